@@ -0,0 +1,251 @@
+#!/bin/sh
+# Reproducible preprocessor and parser benchmarks on synthetic stress inputs.
+#
+# usage: ./bench.sh [--quick] [--runs N] [--save-baseline FILE] [--baseline FILE]
+#
+# Builds an optimized feipiaocc, generates the inputs below (deterministic, no
+# randomness) and runs `feipiaocc -E` on each, plus feipiaocc.c itself, or
+# `feipiaocc --no-codegen` on those marked as parser benchmarks. Prints
+# one JSON object per benchmark: MB/s, tokens/s, peak RSS and allocation
+# counts, taken from --time-report/--stats/--mem-report of the fastest run.
+# --baseline compares against a file written earlier by --save-baseline.
+#
+#   flat       huge flat file of simple statements
+#   longline   a few megabyte-long lines
+#   comments   comment-heavy header
+#   defines    100k #define table
+#   chains     deeply chained object-like macros and their uses
+#   ifnest     heavy #if/#ifdef nesting
+#   fanout     wide #include fan-out
+#   exprs      expression-dense function bodies (parser)
+#   inlines    a header of static inline functions, two of them used (parser)
+#   consts     constant expressions in enums, array sizes and initializers
+#              (parser)
+#   tables     a large lookup table and a huge, mostly zero array (parser)
+
+set -e
+
+scale=4
+runs=3
+save=
+baseline=
+while [ $# -gt 0 ]; do
+  case "$1" in
+  --quick) scale=1 ;;
+  --runs) runs="$2"; shift ;;
+  --save-baseline) save="$2"; shift ;;
+  --baseline) baseline="$2"; shift ;;
+  *) echo "unknown option: $1" >&2; exit 1 ;;
+  esac
+  shift
+done
+
+root=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+cc=$work/feipiaocc
+gcc -std=c11 -O2 -fno-common -Wall -Wno-switch -pthread -o "$cc" \
+  "$root/feipiaocc.c"
+
+gen() {
+  awk -v scale="$scale" -v dir="$work" "$2" > "$work/$1.c"
+}
+
+gen flat '
+BEGIN {
+  n = 50000 * scale
+  for (i = 0; i < n; i++)
+    printf "int v%d = %d + x * (y - 0x%x) / z[%d];\n", i, i, i, i % 64
+}'
+
+gen longline '
+BEGIN {
+  for (l = 0; l < 4; l++) {
+    n = 60000 * scale
+    printf "static const unsigned char blob%d[] = {", l
+    for (i = 0; i < n; i++)
+      printf "0x%02x, ", i % 256
+    printf "};\n"
+  }
+}'
+
+gen comments '
+BEGIN {
+  n = 20000 * scale
+  for (i = 0; i < n; i++) {
+    printf "/*\n * Function %d: lorem ipsum dolor sit amet, consectetur\n", i
+    printf " * adipiscing elit, sed do eiusmod tempor incididunt.\n */\n"
+    printf "int f%d(void); // trailing remark about f%d\n", i, i
+  }
+}'
+
+gen defines '
+BEGIN {
+  n = 25000 * scale
+  for (i = 0; i < n; i++)
+    printf "#define REG_%d (0x40000000UL + 0x%x)\n", i, i * 4
+  for (i = 0; i < n; i += 97)
+    printf "x = REG_%d;\n", i
+}'
+
+gen chains '
+BEGIN {
+  depth = 24
+  for (c = 0; c < 8; c++) {
+    printf "#define C%d_0 0x%x\n", c, c
+    for (i = 1; i < depth; i++)
+      printf "#define C%d_%d (C%d_%d | 0x%x)\n", c, i, c, i - 1, i
+  }
+  n = 300 * scale
+  for (i = 0; i < n; i++)
+    printf "y = C%d_%d + C%d_%d;\n", i % 8, depth - 1, (i + 3) % 8, i % depth
+}'
+
+gen ifnest '
+BEGIN {
+  n = 400 * scale
+  depth = 32
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < depth; i++)
+      printf "#if defined(A%d) || B%d > %d\n", i, i, k
+    printf "int hidden%d;\n", k
+    for (i = 0; i < depth; i++)
+      printf "#elif %d\nint e%d_%d;\n#else\nint x%d_%d;\n#endif\n", i, k, i, k, i
+    printf "int shown%d;\n", k
+  }
+}'
+
+mkdir -p "$work/inc"
+gen fanout '
+BEGIN {
+  n = 500 * scale
+  for (i = 0; i < n; i++) {
+    h = sprintf("%s/inc/h%d.h", dir, i)
+    printf "#ifndef H%d_H\n#define H%d_H\nint h%d(int);\n#endif\n", i, i, i > h
+    close(h)
+    printf "#include \"inc/h%d.h\"\n", i
+  }
+}'
+
+gen exprs '
+BEGIN {
+  n = 2000 * scale
+  printf "int a, b, c, d, t[64], *q = t;\n"
+  printf "int g(int, int, int, int);\n"
+  for (i = 0; i < n; i++) {
+    printf "int e%d(int x, int y) {\n", i
+    printf "  int v[] = {%d, x, y, a, b, c, d, %d, 1, 2, 3, 4, 5, 6, 7, 8};\n", i, i % 97
+    for (j = 0; j < 6; j++) {
+      printf "  x = (x + %d) * y - (a << %d) / (b | 1) ^ (c & d) | t[(x + %d) & 63];\n", i, j, j
+      printf "  y += x < y && !q[%d] || a == b ? x %% 7 : -y + ~c;\n", j
+      printf "  x = g(x, y, a + b * c - d, v[%d] >> 1) + g(1, 2, 3, 4) * x;\n", j
+    }
+    printf "  return x + y;\n}\n"
+  }
+}'
+
+gen inlines '
+BEGIN {
+  n = 5000 * scale
+  for (i = 0; i < n; i++) {
+    printf "static inline int inl%d(int a, int b) {\n", i
+    printf "  int r = a * %d + b;\n", i
+    printf "  for (int k = 0; k < b; k++) {\n    r ^= (r << 3) + k;\n  }\n"
+    printf "  return r;\n}\n"
+  }
+  printf "int main(void) { return inl0(1, 2) + inl%d(3, 4); }\n", n - 1
+}'
+
+gen consts '
+BEGIN {
+  n = 4000 * scale
+  for (i = 0; i < n; i++) {
+    printf "enum { K%d = ((%d << 4) | 0x%x) %% 251 + sizeof(long) * 3 };\n", i, i, i
+    printf "static const unsigned long m%d[(K%d & 7) + 1] = {\n", i, i
+    printf "  (1ul << %d) - 1, ~0u >> %d, (unsigned char)-%d,\n", i % 64, i % 32, i
+    printf "  %d * 1.5 > 2 ? 3 : 4, (K%d + 1) * sizeof(int[4]) / 2};\n", i, i
+    printf "int c%d(int x) {\n", i
+    printf "  return x * (60 * 60 * 24) + (int)(%d / 3.0) - (K%d ^ 0xff);\n}\n", i, i
+  }
+}'
+
+gen tables '
+BEGIN {
+  n = 262144 * scale
+  printf "static const unsigned char table[%d] = {\n", n
+  for (i = 0; i < n; i++)
+    printf "0x%02x,%s", (i * 37) % 256, i % 16 == 15 ? "\n" : " "
+  printf "};\n"
+  printf "static int sparse[%d] = {[0] = 1, [%d] = 2, [%d] = 3};\n", n * 64,
+         n * 32, n * 64 - 1
+}'
+
+cp "$root/feipiaocc.c" "$work/self.c"
+
+# Run one benchmark `runs` times and print its JSON line (fastest run wins).
+# The mode defaults to preprocessing only.
+bench() {
+  name=$1
+  mode=${2:--E}
+  best=
+  for r in $(seq "$runs"); do
+    "$cc" "$work/$name.c" "$mode" --time-report --stats --mem-report \
+      > /dev/null 2> "$work/report.txt"
+    line=$(awk -v name="$name" '
+      /^time report/ { sec = "time" }
+      /^stats for/ { sec = "stats" }
+      /^memory report/ { sec = "mem" }
+      sec == "time" && $1 == "total" { wall = $2 / 1000 }
+      sec == "stats" && /bytes scanned/ { bytes = $3 }
+      sec == "stats" && /tokens produced/ { tokens = $3 }
+      sec == "mem" && $1 == "total" { peak = $3; allocs = $4 }
+      sec == "mem" && /peak RSS/ { rss = $4 }
+      END {
+        if (wall <= 0) wall = 1e-9
+        printf "{\"name\":\"%s\",\"bytes\":%d,\"tokens\":%d,\"seconds\":%.6f," \
+               "\"mb_per_s\":%.2f,\"tokens_per_s\":%.0f," \
+               "\"peak_rss_kib\":%d,\"peak_tracked_bytes\":%d," \
+               "\"allocations\":%d}\n",
+               name, bytes, tokens, wall, bytes / wall / 1e6, tokens / wall,
+               rss, peak, allocs
+      }' "$work/report.txt")
+    sec=$(echo "$line" | sed 's/.*"seconds":\([0-9.]*\).*/\1/')
+    if [ -z "$best" ] || awk -v a="$sec" -v b="$best" 'BEGIN { exit !(a < b) }'; then
+      best=$sec
+      bestline=$line
+    fi
+  done
+  echo "$bestline"
+}
+
+: > "$work/results.json"
+for name in flat longline comments defines chains ifnest fanout self; do
+  bench "$name" | tee -a "$work/results.json"
+done
+for name in exprs inlines consts tables; do
+  bench "$name" --no-codegen | tee -a "$work/results.json"
+done
+
+if [ -n "$save" ]; then
+  cp "$work/results.json" "$save"
+  echo "baseline saved to $save" >&2
+fi
+
+if [ -n "$baseline" ]; then
+  echo "comparison against $baseline (seconds, >1.00x is faster):" >&2
+  awk '
+    function field(line, key,   v) {
+      if (!match(line, "\"" key "\":[^,}]*")) return ""
+      v = substr(line, RSTART + length(key) + 3, RLENGTH - length(key) - 3)
+      gsub(/"/, "", v)
+      return v
+    }
+    FNR == NR { base[field($0, "name")] = field($0, "seconds"); next }
+    {
+      name = field($0, "name"); now = field($0, "seconds")
+      if ((name in base) && now > 0)
+        printf "  %-10s %10.4fs -> %10.4fs  %6.2fx\n", name, base[name], now,
+               base[name] / now
+    }' "$baseline" "$work/results.json" >&2
+fi
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Regenerate feipiaocc_headers.inc, the headers under include/ as C string
+# literals that feipiaocc.c compiles in, after editing any of them.
+#
+# usage: ./embed_headers.sh [OUTPUT]   (default: feipiaocc_headers.inc)
+
+set -e
+
+root=$(cd "$(dirname "$0")" && pwd)
+out=${1:-$root/feipiaocc_headers.inc}
+
+{
+  echo "// Generated by embed_headers.sh from include/; do not edit. The bundled"
+  echo "// headers that PP_BUNDLED_HEADERS lists, as compiled into feipiaocc."
+  for h in "$root"/include/*.h; do
+    name=$(basename "$h")
+    sym=$(printf '%s' "$name" | sed 's/[^A-Za-z0-9]/_/g')
+    echo
+    echo "static const char pp_embedded_$sym[] ="
+    # Escape what a string literal cannot hold as is; `?` for trigraphs.
+    sed -e 's/\\/\\\\/g' -e 's/"/\\"/g' -e 's/?/\\?/g' -e 's/\t/\\t/g' \
+      -e 's/.*/    "&\\n"/' -e '$s/$/;/' "$h"
+  done
+} > "$out"
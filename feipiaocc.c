@@ -1,15 +1,50 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
 
 /* section: general tools*/
+
+// Diagnostics go to stderr, except while a -j worker compiles a translation
+// unit: it points diag_out at the unit's private buffer and catches fatal
+// errors through fatal_jmp, so the main thread can report them in order.
+static _Thread_local FILE *diag_out;
+static _Thread_local jmp_buf *fatal_jmp;
+
+static FILE *diag_stream(void) { return diag_out ? diag_out : stderr; }
+
+static _Noreturn void fatal_exit(void) {
+  if (fatal_jmp)
+    longjmp(*fatal_jmp, 1);
+  exit(1);
+}
+
 static void die_oom(const char *what) {
-  fprintf(stderr, "error: out of memory while %s\n",
+  fprintf(diag_stream(), "error: out of memory while %s\n",
           what ? what : "allocating");
-  exit(1);
+  fatal_exit();
 }
 
 static bool starts_with(const char *s, const char *prefix) {
@@ -23,6 +58,15 @@ static bool ends_with(const char *s, const char *suffix) {
   return n1 >= n2 && !strcmp(s + n1 - n2, suffix);
 }
 
+static char *xstrdup(const char *s) {
+  size_t n = strlen(s) + 1;
+  char *copy = malloc(n);
+  if (!copy)
+    die_oom("copying string");
+  memcpy(copy, s, n);
+  return copy;
+}
+
 typedef struct {
   char **data;
   int len;
@@ -44,16 +88,513 @@ static void strvec_push(StrVec *v, const char *s) {
   v->data[v->len++] = copy;
 }
 
+/* section: tracing */
+
+// Chrome trace-event timeline (--trace-json), loadable in Perfetto or
+// chrome://tracing. Every thread appends complete ("X") events to its own
+// buffer without locking; a buffer is published once, on first use, by a
+// lock-free push onto `trace_bufs`, and main() serializes all buffers after
+// the compile, failed or not, once every other thread has been joined.
+// Events nest by time within a thread: translation unit, phases, #includes,
+// then macro expansions slower than --trace-granularity. Helper threads add
+// tokenizer chunks and include prefetches.
+
+typedef struct {
+  const char *cat; // static string
+  char *name;
+  const char *arg_key[2]; // static strings, NULL if unused
+  char *arg_val[2];
+  double ts;  // microseconds since trace_t0
+  double dur; // microseconds
+} TraceEvent;
+
+typedef struct TraceBuf TraceBuf;
+struct TraceBuf {
+  TraceEvent *events;
+  int len;
+  int cap;
+  int tid;
+  TraceBuf *next;
+};
+
+static const char *trace_path;            // NULL disables tracing
+static double trace_granularity_us = 500; // threshold for macro events
+static double trace_t0;                   // CLOCK_MONOTONIC seconds
+static _Atomic(TraceBuf *) trace_bufs;
+static atomic_int trace_next_tid = 1;
+static _Thread_local TraceBuf *trace_buf;
+
+static bool trace_enabled(void) { return trace_path != NULL; }
+
+static double trace_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static TraceBuf *trace_thread_buf(void) {
+  if (trace_buf)
+    return trace_buf;
+  TraceBuf *b = calloc(1, sizeof(*b));
+  if (!b)
+    die_oom("allocating trace buffer");
+  b->tid = atomic_fetch_add(&trace_next_tid, 1);
+  b->next = atomic_load(&trace_bufs);
+  while (!atomic_compare_exchange_weak(&trace_bufs, &b->next, b))
+    ;
+  trace_buf = b;
+  return b;
+}
+
+// Record one complete event spanning [start, end] (CLOCK_MONOTONIC seconds).
+static void trace_complete(const char *cat, const char *name, double start,
+                           double end, const char *key1, const char *val1,
+                           const char *key2, const char *val2) {
+  TraceBuf *b = trace_thread_buf();
+  if (b->len == b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 256;
+    b->events = realloc(b->events, (size_t)b->cap * sizeof(*b->events));
+    if (!b->events)
+      die_oom("growing trace buffer");
+  }
+  b->events[b->len++] = (TraceEvent){
+      .cat = cat,
+      .name = xstrdup(name),
+      .arg_key = {val1 ? key1 : NULL, val2 ? key2 : NULL},
+      .arg_val = {val1 ? xstrdup(val1) : NULL, val2 ? xstrdup(val2) : NULL},
+      .ts = (start - trace_t0) * 1e6,
+      .dur = (end - start) * 1e6,
+  };
+}
+
+static void trace_write_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+static void trace_flush(void) {
+  FILE *out = fopen(trace_path, "w");
+  if (!out) {
+    fprintf(stderr, "error: cannot write trace: %s\n", trace_path);
+    return;
+  }
+
+  long pid = (long)getpid();
+  bool first = true;
+  fprintf(out, "{\"traceEvents\":[\n");
+  for (TraceBuf *b = atomic_load(&trace_bufs); b; b = b->next) {
+    for (int i = 0; i < b->len; i++) {
+      TraceEvent *e = &b->events[i];
+      fprintf(out, "%s{\"ph\":\"X\",\"pid\":%ld,\"tid\":%d,\"cat\":",
+              first ? "" : ",\n", pid, b->tid);
+      trace_write_json_string(out, e->cat);
+      fprintf(out, ",\"name\":");
+      trace_write_json_string(out, e->name);
+      fprintf(out, ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{", e->ts, e->dur);
+      for (int k = 0; k < 2 && e->arg_key[k]; k++) {
+        if (k)
+          fputc(',', out);
+        trace_write_json_string(out, e->arg_key[k]);
+        fputc(':', out);
+        trace_write_json_string(out, e->arg_val[k]);
+      }
+      fprintf(out, "}}");
+      first = false;
+    }
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(out);
+}
+
+static void trace_init(const char *path, double granularity_us) {
+  trace_path = path;
+  trace_granularity_us = granularity_us;
+  trace_t0 = trace_clock();
+}
+
+/* section: statistics */
+
+// Per-translation-unit phase timers and event counters (--time-report,
+// --stats). Both live in thread-local storage so -j workers never share them;
+// compile_tu() resets them at the start of each unit and prints them at the
+// end. Build with -DFEIPIAOCC_STATS=0 to compile every STAT_* site away.
+
+#ifndef FEIPIAOCC_STATS
+#define FEIPIAOCC_STATS 1
+#endif
+
+typedef enum {
+  PHASE_READ,
+  PHASE_TOKENIZE,
+  PHASE_PREPROCESS,
+  PHASE_PARSE,
+  PHASE_OUTPUT,
+  PHASE_COUNT,
+} Phase;
+
+typedef enum {
+  STAT_BYTES_SCANNED,
+  STAT_TOKENS,
+  STAT_TOKENS_CLONED,
+  STAT_ORIGIN_FRAMES,
+  STAT_HIDESET_NODES,
+  STAT_MACRO_EXPANSIONS,
+  STAT_MACRO_MEMO_HITS,
+  STAT_RESCAN_ITERATIONS,
+  STAT_HASH_LOOKUPS,
+  STAT_HASH_PROBES,
+  STAT_TOKENIZE_CHUNKS,
+  STAT_TOKENIZE_RERUNS,
+  STAT_INCLUDES,
+  STAT_INCLUDE_PREFETCHED,
+  STAT_INCLUDE_GUARD_SKIPS,
+  STAT_WARM_HITS,
+  STAT_SESSION_EDITS,
+  STAT_SESSION_LINES,
+  STAT_SESSION_PARTS_RERUN,
+  STAT_SESSION_PARTS_REUSED,
+  STAT_LEX_TOKENS,
+  STAT_STRING_BYTES,
+  STAT_AST_NODES,
+  STAT_COUNT,
+} StatCounter;
+
+typedef struct {
+  uint64_t counters[STAT_COUNT];
+  double wall[PHASE_COUNT]; // seconds
+  double cpu[PHASE_COUNT];  // CPU seconds, including helper threads
+} Stats;
+
+static _Thread_local Stats tu_stats;
+
+#if FEIPIAOCC_STATS
+#define STAT_ADD(c, n) (tu_stats.counters[(c)] += (uint64_t)(n))
+#else
+#define STAT_ADD(c, n) ((void)0)
+#endif
+#define STAT_INC(c) STAT_ADD(c, 1)
+
+static const char *phase_name(Phase ph) {
+  switch (ph) {
+  case PHASE_READ:
+    return "read";
+  case PHASE_TOKENIZE:
+    return "tokenize";
+  case PHASE_PREPROCESS:
+    return "preprocess";
+  case PHASE_PARSE:
+    return "parse";
+  case PHASE_OUTPUT:
+    return "output";
+  case PHASE_COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+static const char *stat_name(StatCounter c) {
+  switch (c) {
+  case STAT_BYTES_SCANNED:
+    return "bytes scanned";
+  case STAT_TOKENS:
+    return "tokens produced";
+  case STAT_TOKENS_CLONED:
+    return "tokens cloned";
+  case STAT_ORIGIN_FRAMES:
+    return "origin frames";
+  case STAT_HIDESET_NODES:
+    return "hideset nodes";
+  case STAT_MACRO_EXPANSIONS:
+    return "macro expansions";
+  case STAT_MACRO_MEMO_HITS:
+    return "macro memo hits";
+  case STAT_RESCAN_ITERATIONS:
+    return "rescan iterations";
+  case STAT_HASH_LOOKUPS:
+    return "hash lookups";
+  case STAT_HASH_PROBES:
+    return "hash probes";
+  case STAT_TOKENIZE_CHUNKS:
+    return "tokenize chunks";
+  case STAT_TOKENIZE_RERUNS:
+    return "chunk re-runs";
+  case STAT_INCLUDES:
+    return "includes";
+  case STAT_INCLUDE_PREFETCHED:
+    return "includes prefetched";
+  case STAT_INCLUDE_GUARD_SKIPS:
+    return "include guard skips";
+  case STAT_WARM_HITS:
+    return "warm header hits";
+  case STAT_SESSION_EDITS:
+    return "session edits";
+  case STAT_SESSION_LINES:
+    return "session lines lexed";
+  case STAT_SESSION_PARTS_RERUN:
+    return "session parts re-run";
+  case STAT_SESSION_PARTS_REUSED:
+    return "session parts reused";
+  case STAT_LEX_TOKENS:
+    return "lexer tokens";
+  case STAT_STRING_BYTES:
+    return "string bytes decoded";
+  case STAT_AST_NODES:
+    return "ast nodes";
+  case STAT_COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+// Fold a helper thread's counters into this thread's (phase times are the
+// caller's to measure).
+static void stats_merge(const Stats *s) {
+  for (int i = 0; i < STAT_COUNT; i++)
+    tu_stats.counters[i] += s->counters[i];
+}
+
+static double clock_seconds(clockid_t id) {
+  struct timespec ts;
+  clock_gettime(id, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  Phase phase;
+  double wall;
+  double cpu;
+} PhaseTimer;
+
+static PhaseTimer phase_begin(Phase ph) {
+  return (PhaseTimer){
+      .phase = ph,
+      .wall = clock_seconds(CLOCK_MONOTONIC),
+      .cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID),
+  };
+}
+
+static void phase_end(PhaseTimer t) {
+  double wall = clock_seconds(CLOCK_MONOTONIC);
+  tu_stats.wall[t.phase] += wall - t.wall;
+  tu_stats.cpu[t.phase] += clock_seconds(CLOCK_THREAD_CPUTIME_ID) - t.cpu;
+  if (trace_enabled())
+    trace_complete("phase", phase_name(t.phase), t.wall, wall, NULL, NULL,
+                   NULL, NULL);
+}
+
+static void print_time_report(FILE *out, const char *path) {
+  double wall = 0, cpu = 0;
+  fprintf(out, "time report for %s:\n", path);
+  fprintf(out, "  %-12s %12s %12s\n", "phase", "wall(ms)", "cpu(ms)");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    fprintf(out, "  %-12s %12.3f %12.3f\n", phase_name(i),
+            tu_stats.wall[i] * 1e3, tu_stats.cpu[i] * 1e3);
+    wall += tu_stats.wall[i];
+    cpu += tu_stats.cpu[i];
+  }
+  fprintf(out, "  %-12s %12.3f %12.3f\n", "total", wall * 1e3, cpu * 1e3);
+}
+
+static void print_stats(FILE *out, const char *path) {
+  fprintf(out, "stats for %s:\n", path);
+  if (!FEIPIAOCC_STATS) {
+    fprintf(out, "  (counters disabled at build time)\n");
+    return;
+  }
+  for (int i = 0; i < STAT_COUNT; i++)
+    fprintf(out, "  %-20s %14llu\n", stat_name(i),
+            (unsigned long long)tu_stats.counters[i]);
+
+  uint64_t lookups = tu_stats.counters[STAT_HASH_LOOKUPS];
+  if (lookups)
+    fprintf(out, "  %-20s %14.2f\n", "probes per lookup",
+            (double)tu_stats.counters[STAT_HASH_PROBES] / (double)lookups);
+}
+
+/* section: memory accounting */
+
+// Allocation accounting by subsystem (--mem-report). Per-TU data structures
+// allocate through mem_malloc/mem_calloc and release through mem_free with
+// the same tag and size, so each tag tracks live and peak bytes and objects.
+// Like the counters above, the accounting is thread-local and compiled away
+// with -DFEIPIAOCC_STATS=0.
+
+typedef enum {
+  MEM_FILE,        // pp_read_file buffers and paths
+  MEM_TOKEN,       // tokenlize output
+  MEM_TOKEN_CLONE, // pp_clone_* copies made while preprocessing
+  MEM_ORIGIN,      // PPOrigin frames
+  MEM_HIDESET,     // PPHideSet nodes
+  MEM_MACRO,       // PPMacro objects, names, bodies and memoized expansions
+  MEM_HASHMAP,     // PPHashMap bucket arrays
+  MEM_LEX_TOKEN,   // lexer output
+  MEM_STRING,      // decoded string literals
+  MEM_AST,         // syntax tree arena and pool indexes
+  MEM_TAG_COUNT,
+} MemTag;
+
+typedef struct {
+  int64_t bytes[MEM_TAG_COUNT];
+  int64_t peak_bytes[MEM_TAG_COUNT];
+  int64_t objects[MEM_TAG_COUNT];
+  int64_t peak_objects[MEM_TAG_COUNT];
+  int64_t total_bytes;
+  int64_t peak_total_bytes;
+  uint64_t allocs;
+} MemStats;
+
+static _Thread_local MemStats tu_mem;
+// Set while building what outlives the unit (bundled and warm headers), which
+// is then kept out of tu_mem. compile_tu() clears it after a fatal error.
+static _Thread_local bool mem_untracked;
+
+static const char *mem_tag_name(MemTag tag) {
+  switch (tag) {
+  case MEM_FILE:
+    return "file buffers";
+  case MEM_TOKEN:
+    return "tokens";
+  case MEM_TOKEN_CLONE:
+    return "cloned tokens";
+  case MEM_ORIGIN:
+    return "origin frames";
+  case MEM_HIDESET:
+    return "hidesets";
+  case MEM_MACRO:
+    return "macros";
+  case MEM_HASHMAP:
+    return "hash buckets";
+  case MEM_LEX_TOKEN:
+    return "lexer tokens";
+  case MEM_STRING:
+    return "string literals";
+  case MEM_AST:
+    return "ast";
+  case MEM_TAG_COUNT:
+    break;
+  }
+  return "unknown";
+}
+
+static void mem_account(MemTag tag, int64_t bytes, int64_t objects) {
+#if FEIPIAOCC_STATS
+  if (mem_untracked)
+    return;
+  MemStats *m = &tu_mem;
+  m->bytes[tag] += bytes;
+  m->objects[tag] += objects;
+  m->total_bytes += bytes;
+  if (m->bytes[tag] > m->peak_bytes[tag])
+    m->peak_bytes[tag] = m->bytes[tag];
+  if (m->objects[tag] > m->peak_objects[tag])
+    m->peak_objects[tag] = m->objects[tag];
+  if (m->total_bytes > m->peak_total_bytes)
+    m->peak_total_bytes = m->total_bytes;
+  if (objects > 0)
+    m->allocs += (uint64_t)objects;
+#else
+  (void)tag;
+  (void)bytes;
+  (void)objects;
+#endif
+}
+
+static void *mem_malloc(MemTag tag, size_t size) {
+  void *p = malloc(size);
+  if (p)
+    mem_account(tag, (int64_t)size, 1);
+  return p;
+}
+
+static void *mem_calloc(MemTag tag, size_t n, size_t size) {
+  void *p = calloc(n, size);
+  if (p)
+    mem_account(tag, (int64_t)(n * size), 1);
+  return p;
+}
+
+static void mem_free(MemTag tag, void *p, size_t size) {
+  if (!p)
+    return;
+  mem_account(tag, -(int64_t)size, -1);
+  free(p);
+}
+
+// Move a live object from one tag to another (e.g. a cloned token that
+// becomes part of a macro body).
+static void mem_retag(MemTag from, MemTag to, size_t size) {
+  mem_account(from, -(int64_t)size, -1);
+  mem_account(to, (int64_t)size, 1);
+}
+
+// Fold a helper thread's accounting into this thread's. Objects it allocated
+// are freed here later, so live counts must move over; its peaks are only
+// known separately and are added on top of ours as an upper bound.
+static void mem_merge(const MemStats *w) {
+#if FEIPIAOCC_STATS
+  MemStats *m = &tu_mem;
+  for (int i = 0; i < MEM_TAG_COUNT; i++) {
+    if (m->bytes[i] + w->peak_bytes[i] > m->peak_bytes[i])
+      m->peak_bytes[i] = m->bytes[i] + w->peak_bytes[i];
+    if (m->objects[i] + w->peak_objects[i] > m->peak_objects[i])
+      m->peak_objects[i] = m->objects[i] + w->peak_objects[i];
+    m->bytes[i] += w->bytes[i];
+    m->objects[i] += w->objects[i];
+  }
+  if (m->total_bytes + w->peak_total_bytes > m->peak_total_bytes)
+    m->peak_total_bytes = m->total_bytes + w->peak_total_bytes;
+  m->total_bytes += w->total_bytes;
+  m->allocs += w->allocs;
+#else
+  (void)w;
+#endif
+}
+
+static void print_mem_report(FILE *out, const char *path) {
+  fprintf(out, "memory report for %s:\n", path);
+  if (FEIPIAOCC_STATS) {
+    fprintf(out, "  %-14s %14s %14s %11s %11s\n", "subsystem", "bytes",
+            "peak bytes", "objects", "peak objs");
+    for (int i = 0; i < MEM_TAG_COUNT; i++)
+      fprintf(out, "  %-14s %14lld %14lld %11lld %11lld\n", mem_tag_name(i),
+              (long long)tu_mem.bytes[i], (long long)tu_mem.peak_bytes[i],
+              (long long)tu_mem.objects[i],
+              (long long)tu_mem.peak_objects[i]);
+    fprintf(out, "  %-14s %14lld %14lld %11llu allocations\n", "total",
+            (long long)tu_mem.total_bytes, (long long)tu_mem.peak_total_bytes,
+            (unsigned long long)tu_mem.allocs);
+  } else {
+    fprintf(out, "  (accounting disabled at build time)\n");
+  }
+
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    fprintf(out, "  process peak RSS: %ld KiB\n", ru.ru_maxrss);
+}
+
 /* section: parse arguments */
 
 typedef struct {
   bool dump_tokens;
+  bool dump_lex_tokens; // --lex-tokens
+  bool dump_ast;        // --dump-ast
+  bool eager_inline;    // --eager-inline: parse unused static inline bodies
   bool dump_codegen;
   bool verbose;
   StrVec include_paths;
+  StrVec header_bundles; // --header-bundle <tar>, searched after -I
   StrVec defines;
   StrVec inputs;     // all non-option inputs, in argv order
-  StrVec c_inputs;   // *.c
+  StrVec c_inputs;   // *.c and *.pptok (translation units)
   StrVec asm_inputs; // *.s
   StrVec obj_inputs; // *.o
   StrVec ar_inputs;  // *.a
@@ -64,13 +605,32 @@ typedef struct {
   bool opt_c;
   bool opt_S;
   bool opt_E;
+  const char *cache_dir;    // --cache-dir <dir>, NULL disables the cache
+  long long cache_max_size; // --cache-size <bytes>, LRU cap of cache_dir
+  int jobs;                 // -j <n>, threads for inputs and large files
+  long long tokenize_chunk; // --tokenize-chunk <bytes>, parallel split size
+  bool time_report;         // --time-report
+  bool stats;               // --stats
+  const char *trace_json;   // --trace-json <path>
+  double trace_granularity; // --trace-granularity <us>
+  bool mem_report;          // --mem-report
+  int cost_report;          // --cost-report[=N], rows per table (0: off)
+  bool emit_pptok;          // --emit-pptok: -E writes a binary token stream
+  bool pptok_origins;       // --emit-pptok=origins: ... with macro origins
+  const char *edit_script;  // --edit-script <path>: replay editor edits
+  const char *server;       // --server <socket>: serve compile requests
+  const char *connect;      // --connect <socket>: compile through a server
 } Options;
 
 static Options opt = {
     .dump_tokens = false,
+    .dump_lex_tokens = false,
+    .dump_ast = false,
+    .eager_inline = false,
     .dump_codegen = true,
     .verbose = false,
     .include_paths = {},
+    .header_bundles = {},
     .defines = {},
     .inputs = {},
     .c_inputs = {},
@@ -84,6 +644,21 @@ static Options opt = {
     .opt_c = false,
     .opt_S = false,
     .opt_E = false,
+    .cache_dir = NULL,
+    .cache_max_size = 1LL << 30,
+    .jobs = 1,
+    .tokenize_chunk = 4LL << 20,
+    .time_report = false,
+    .stats = false,
+    .trace_json = NULL,
+    .trace_granularity = 500,
+    .mem_report = false,
+    .cost_report = 0,
+    .emit_pptok = false,
+    .pptok_origins = false,
+    .edit_script = NULL,
+    .server = NULL,
+    .connect = NULL,
 };
 
 typedef enum {
@@ -130,6 +705,69 @@ static bool opt_set_E(Options *opt, int nargs, const char **values) {
   return true;
 }
 
+static bool opt_set_cache_dir(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  opt->cache_dir = values[0];
+  return true;
+}
+
+// Parse a byte count with an optional K/M/G suffix, e.g. "512M".
+static bool parse_size(const char *s, long long *out) {
+  char *end = NULL;
+  errno = 0;
+  long long n = strtoll(s, &end, 10);
+  if (errno || end == s || n < 0)
+    return false;
+  switch (*end) {
+  case 'k':
+  case 'K':
+    n <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    n <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    n <<= 30;
+    end++;
+    break;
+  }
+  if (*end != '\0')
+    return false;
+  *out = n;
+  return true;
+}
+
+static bool opt_set_cache_size(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  return parse_size(values[0], &opt->cache_max_size);
+}
+
+static bool opt_set_tokenize_chunk(Options *opt, int nargs,
+                                   const char **values) {
+  long long n;
+  if (nargs != 1 || !parse_size(values[0], &n) || n < 1)
+    return false;
+  opt->tokenize_chunk = n;
+  return true;
+}
+
+static bool opt_set_jobs(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  char *end = NULL;
+  long n = strtol(values[0], &end, 10);
+  if (end == values[0] || *end != '\0' || n < 1 || n > 1024)
+    return false;
+  opt->jobs = (int)n;
+  return true;
+}
+
 static bool opt_add_include_path(Options *opt, int nargs, const char **values) {
   if (nargs != 1)
     return false;
@@ -137,6 +775,14 @@ static bool opt_add_include_path(Options *opt, int nargs, const char **values) {
   return true;
 }
 
+static bool opt_add_header_bundle(Options *opt, int nargs,
+                                  const char **values) {
+  if (nargs != 1)
+    return false;
+  strvec_push(&opt->header_bundles, values[0]);
+  return true;
+}
+
 static bool opt_add_define(Options *opt, int nargs, const char **values) {
   if (nargs != 1)
     return false;
@@ -186,6 +832,29 @@ static bool opt_set_dump_tokens(Options *opt, int nargs, const char **values) {
   return true;
 }
 
+static bool opt_set_dump_lex_tokens(Options *opt, int nargs,
+                                    const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->dump_lex_tokens = true;
+  return true;
+}
+
+static bool opt_set_dump_ast(Options *opt, int nargs, const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->dump_ast = true;
+  return true;
+}
+
+static bool opt_set_eager_inline(Options *opt, int nargs,
+                                 const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->eager_inline = true;
+  return true;
+}
+
 static bool opt_set_no_codegen(Options *opt, int nargs, const char **values) {
   (void)nargs;
   (void)values;
@@ -200,13 +869,96 @@ static bool opt_set_verbose(Options *opt, int nargs, const char **values) {
   return true;
 }
 
+static bool opt_set_time_report(Options *opt, int nargs,
+                                const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->time_report = true;
+  return true;
+}
+
+static bool opt_set_stats(Options *opt, int nargs, const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->stats = true;
+  return true;
+}
+
+static bool opt_set_mem_report(Options *opt, int nargs, const char **values) {
+  (void)nargs;
+  (void)values;
+  opt->mem_report = true;
+  return true;
+}
+
+static bool opt_set_cost_report(Options *opt, int nargs, const char **values) {
+  if (nargs == 0) {
+    opt->cost_report = 10;
+    return true;
+  }
+  char *end = NULL;
+  long n = strtol(values[0], &end, 10);
+  if (end == values[0] || *end != '\0' || n < 1 || n > 1000000)
+    return false;
+  opt->cost_report = (int)n;
+  return true;
+}
+
+static bool opt_set_emit_pptok(Options *opt, int nargs, const char **values) {
+  if (nargs == 1 && strcmp(values[0], "origins"))
+    return false;
+  opt->emit_pptok = true;
+  opt->pptok_origins = nargs == 1;
+  return true;
+}
+
+static bool opt_set_edit_script(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  opt->edit_script = values[0];
+  return true;
+}
+
+static bool opt_set_server(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  opt->server = values[0];
+  return true;
+}
+
+static bool opt_set_connect(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  opt->connect = values[0];
+  return true;
+}
+
+static bool opt_set_trace_json(Options *opt, int nargs, const char **values) {
+  if (nargs != 1)
+    return false;
+  opt->trace_json = values[0];
+  return true;
+}
+
+static bool opt_set_trace_granularity(Options *opt, int nargs,
+                                      const char **values) {
+  if (nargs != 1)
+    return false;
+  char *end = NULL;
+  double us = strtod(values[0], &end);
+  if (end == values[0] || *end != '\0' || us < 0)
+    return false;
+  opt->trace_granularity = us;
+  return true;
+}
+
 static bool opt_set_input(Options *opt, int nargs, const char **values) {
   if (nargs != 1)
     return false;
   const char *path = values[0];
   strvec_push(&opt->inputs, path);
 
-  if (ends_with(path, ".c")) {
+  if (ends_with(path, ".c") || ends_with(path, ".pptok")) {
     strvec_push(&opt->c_inputs, path);
   } else if (ends_with(path, ".s")) {
     strvec_push(&opt->asm_inputs, path);
@@ -248,7 +1000,22 @@ static const OptionSpec specs[] = {
     OPT1("-c", "compile and assemble, but do not link", 0, opt_set_c),
     OPT1("-S", "compile only; do not assemble or link", 0, opt_set_S),
     OPT1("-E", "preprocess only", 0, opt_set_E),
+    OPT1("--emit-pptok", "with -E, write a binary token stream (.pptok)", 0,
+         opt_set_emit_pptok),
+    OPTP1("--emit-pptok=", "origins: same, keeping macro backtraces", 1,
+          opt_set_emit_pptok),
+    OPT1("--edit-script",
+         "preprocess incrementally while replaying edits from <file>", 1,
+         opt_set_edit_script),
+    OPT1("--server", "serve compile requests on this Unix socket", 1,
+         opt_set_server),
+    OPT1("--connect", "compile through the --server on this socket", 1,
+         opt_set_connect),
+    OPTP1("-j", "use up to N threads (parallel inputs, large files)", 1,
+          opt_set_jobs),
     OPTP1("-I", "add include search path", 1, opt_add_include_path),
+    OPT1("--header-bundle", "search headers in this tar archive (after -I)",
+         1, opt_add_header_bundle),
     OPTP1("-D", "define macro (NAME or NAME=VALUE)", 1, opt_add_define),
     OPTP1("-Wl", "pass comma-separated args to linker", 1, opt_add_Wl),
     OPTP1("-l", "link with library (pass through to linker)", 1,
@@ -257,8 +1024,35 @@ static const OptionSpec specs[] = {
     OPT1("-Xlinker", "pass one argument to linker", 1, opt_add_ld_arg),
     OPT2("-h", "--help", "show this help", 0, opt_help),
     OPT1("--tokens", "dump tokens then continue", 0, opt_set_dump_tokens),
+    OPT1("--lex-tokens", "dump lexer tokens then continue", 0,
+         opt_set_dump_lex_tokens),
+    OPT1("--dump-ast", "dump the syntax tree then continue", 0,
+         opt_set_dump_ast),
+    OPT1("--eager-inline", "parse static inline bodies even if unused", 0,
+         opt_set_eager_inline),
     OPT1("--no-codegen", "parse only; do not emit code", 0, opt_set_no_codegen),
     OPT1("--verbose", "print parsed options", 0, opt_set_verbose),
+    OPT1("--cache-dir", "cache -E/-S/-c results in this directory", 1,
+         opt_set_cache_dir),
+    OPT1("--cache-size", "size cap for --cache-dir (e.g. 512M)", 1,
+         opt_set_cache_size),
+    OPT1("--tokenize-chunk", "with -j, tokenize files of 2*SIZE+ in chunks",
+         1, opt_set_tokenize_chunk),
+    OPT1("--time-report", "print per-phase wall/cpu time per input", 0,
+         opt_set_time_report),
+    OPT1("--stats", "print tokenizer/preprocessor counters per input", 0,
+         opt_set_stats),
+    OPT1("--mem-report", "print memory use by subsystem per input", 0,
+         opt_set_mem_report),
+    OPT1("--cost-report", "print top-10 file and macro costs per input", 0,
+         opt_set_cost_report),
+    OPTP1("--cost-report=", "same, with N rows per table", 1,
+          opt_set_cost_report),
+    OPT1("--trace-json", "write a Chrome trace-event timeline to <path>", 1,
+         opt_set_trace_json),
+    OPT1("--trace-granularity",
+         "min macro expansion time (us) recorded by --trace-json", 1,
+         opt_set_trace_granularity),
 };
 
 static const size_t specs_len = sizeof(specs) / sizeof(*specs);
@@ -315,35 +1109,35 @@ static bool match_option(const OptionSpec *spec, const char *arg,
 
 #define ERRORF(...)                                                            \
   do {                                                                         \
-    fprintf(stderr, "error: ");                                                \
-    fprintf(stderr, __VA_ARGS__);                                              \
-    fprintf(stderr, "\n");                                                     \
+    fprintf(diag_stream(), "error: ");                                         \
+    fprintf(diag_stream(), __VA_ARGS__);                                       \
+    fprintf(diag_stream(), "\n");                                              \
   } while (0)
 
 #define INNER_ERRORF(...)                                                      \
   do {                                                                         \
-    fprintf(stderr, "inner error: ");                                          \
-    fprintf(stderr, __VA_ARGS__);                                              \
-    fprintf(stderr, "\n");                                                     \
+    fprintf(diag_stream(), "inner error: ");                                   \
+    fprintf(diag_stream(), __VA_ARGS__);                                       \
+    fprintf(diag_stream(), "\n");                                              \
   } while (0)
 
 #define DIE(...)                                                               \
   do {                                                                         \
     ERRORF(__VA_ARGS__);                                                       \
-    exit(1);                                                                   \
+    fatal_exit();                                                              \
   } while (0)
 
 #define INNER_DIE(...)                                                         \
   do {                                                                         \
     INNER_ERRORF(__VA_ARGS__);                                                 \
-    exit(1);                                                                   \
+    fatal_exit();                                                              \
   } while (0)
 
 #define DIE_HINT(...)                                                          \
   do {                                                                         \
     ERRORF(__VA_ARGS__);                                                       \
     print_errhint();                                                           \
-    exit(1);                                                                   \
+    fatal_exit();                                                              \
   } while (0)
 
 void parse_argv(int argc, char **argv) {
@@ -424,15 +1218,39 @@ void parse_argv(int argc, char **argv) {
 static void dump_options(FILE *out, const Options *opt) {
   fprintf(out, "verbose: %s\n", opt->verbose ? "true" : "false");
   fprintf(out, "dump_tokens: %s\n", opt->dump_tokens ? "true" : "false");
+  fprintf(out, "dump_lex_tokens: %s\n",
+          opt->dump_lex_tokens ? "true" : "false");
+  fprintf(out, "dump_ast: %s\n", opt->dump_ast ? "true" : "false");
+  fprintf(out, "eager_inline: %s\n", opt->eager_inline ? "true" : "false");
   fprintf(out, "dump_codegen: %s\n", opt->dump_codegen ? "true" : "false");
   fprintf(out, "opt_c: %s\n", opt->opt_c ? "true" : "false");
   fprintf(out, "opt_S: %s\n", opt->opt_S ? "true" : "false");
   fprintf(out, "opt_E: %s\n", opt->opt_E ? "true" : "false");
   fprintf(out, "output: %s\n", opt->output ? opt->output : "(null)");
+  fprintf(out, "cache_dir: %s\n", opt->cache_dir ? opt->cache_dir : "(null)");
+  fprintf(out, "cache_max_size: %lld\n", opt->cache_max_size);
+  fprintf(out, "jobs: %d\n", opt->jobs);
+  fprintf(out, "tokenize_chunk: %lld\n", opt->tokenize_chunk);
+  fprintf(out, "time_report: %s\n", opt->time_report ? "true" : "false");
+  fprintf(out, "stats: %s\n", opt->stats ? "true" : "false");
+  fprintf(out, "mem_report: %s\n", opt->mem_report ? "true" : "false");
+  fprintf(out, "cost_report: %d\n", opt->cost_report);
+  fprintf(out, "edit_script: %s\n",
+          opt->edit_script ? opt->edit_script : "(null)");
+  fprintf(out, "server: %s\n", opt->server ? opt->server : "(null)");
+  fprintf(out, "connect: %s\n", opt->connect ? opt->connect : "(null)");
+  fprintf(out, "emit_pptok: %s\n",
+          opt->emit_pptok ? opt->pptok_origins ? "origins" : "true" : "false");
+  fprintf(out, "trace_json: %s\n",
+          opt->trace_json ? opt->trace_json : "(null)");
+  fprintf(out, "trace_granularity: %g\n", opt->trace_granularity);
 
   fprintf(out, "include_paths(%d):\n", opt->include_paths.len);
   for (int i = 0; i < opt->include_paths.len; i++)
     fprintf(out, "  %s\n", opt->include_paths.data[i]);
+  fprintf(out, "header_bundles(%d):\n", opt->header_bundles.len);
+  for (int i = 0; i < opt->header_bundles.len; i++)
+    fprintf(out, "  %s\n", opt->header_bundles.data[i]);
 
   fprintf(out, "defines(%d):\n", opt->defines.len);
   for (int i = 0; i < opt->defines.len; i++)
@@ -478,6 +1296,12 @@ static void validate_options(const Options *opt) {
   if (opt->opt_c && opt->opt_S)
     DIE_HINT("conflicting options: -c cannot be used with -S");
 
+  if (opt->emit_pptok && !opt->opt_E)
+    DIE_HINT("--emit-pptok requires -E");
+
+  if (opt->server && opt->connect)
+    DIE_HINT("conflicting options: --server cannot be used with --connect");
+
   // For per-input outputs (-E/-S/-c), using a single -o with multiple inputs
   // is ambiguous. GCC/clang reject it, and so does chibicc.
   if (opt->output && opt->inputs.len > 1 &&
@@ -522,6 +1346,7 @@ typedef struct {
   const char *path;
   char *path_buf; // owned copy of path (or NULL if not owned)
   char *contents; // NUL-terminated, normalized to '\n'
+  size_t contents_cap; // allocated bytes of contents
 } PPFile;
 
 typedef struct PPToken PPToken;
@@ -556,7 +1381,9 @@ struct PPToken {
   int len;
   bool at_bol;
   bool has_space;
-  PPSrcLoc spelling; // where the token's text is spelled
+  bool in_comment;       // NEWLINE inside a block comment
+  unsigned char mem_tag; // MemTag this token is accounted under
+  PPSrcLoc spelling;     // where the token's text is spelled
   PPOrigin *origin;  // macro expansion backtrace (owned by this token)
   PPHideSet *hideset;
   PPToken *next;
@@ -578,30 +1405,15 @@ typedef struct {
   unsigned next_tok_id;
 } PPTokenizer;
 
-static PPFile pp_read_file(const char *path) {
-  FILE *fp = fopen(path, "rb");
-  if (!fp)
-    DIE("cannot open file: %s", path);
-
-  if (fseek(fp, 0, SEEK_END) != 0)
-    DIE("fseek failed: %s", path);
-  long size = ftell(fp);
-  if (size < 0)
-    DIE("ftell failed: %s", path);
-  if (fseek(fp, 0, SEEK_SET) != 0)
-    DIE("fseek failed: %s", path);
-
-  // We add a small NUL padding so tokenizer helpers can safely look ahead
-  // (e.g. universal-character-name needs up to 10 bytes: "\\UXXXXXXXX")
-  // without risking out-of-bounds reads near end-of-file.
-  enum { PP_FILE_PADDING = 16 };
-  char *buf = malloc((size_t)size + 2 + PP_FILE_PADDING);
-  if (!buf)
-    die_oom("reading file");
-
-  size_t nread = fread(buf, 1, (size_t)size, fp);
-  fclose(fp);
+// We add a small NUL padding so tokenizer helpers can safely look ahead
+// (e.g. universal-character-name needs up to 10 bytes: "\\UXXXXXXXX")
+// without risking out-of-bounds reads near end-of-file.
+enum { PP_FILE_PADDING = 16 };
 
+// Normalize `nread` raw bytes in `buf` (allocated under MEM_FILE with room
+// for `nread + 2 + PP_FILE_PADDING` bytes) into a PPFile named `path`.
+static PPFile pp_file_from_buffer(const char *path, char *buf, size_t nread,
+                                  size_t cap) {
   // Ensure file ends with '\n' (helps diagnostics and NEWLINE tokenization).
   if (nread == 0 || buf[nread - 1] != '\n')
     buf[nread++] = '\n';
@@ -640,18 +1452,56 @@ static PPFile pp_read_file(const char *path) {
   memset(buf + nread + 1, 0, PP_FILE_PADDING);
 
   size_t pn = strlen(path) + 1;
-  char *path_buf = malloc(pn);
+  char *path_buf = mem_malloc(MEM_FILE, pn);
   if (!path_buf)
     die_oom("copying file path");
   memcpy(path_buf, path, pn);
 
-  PPFile f = {.path = path_buf, .path_buf = path_buf, .contents = buf};
+  PPFile f = {.path = path_buf,
+              .path_buf = path_buf,
+              .contents = buf,
+              .contents_cap = cap};
   return f;
 }
 
+static PPFile pp_read_file(const char *path) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    DIE("cannot open file: %s", path);
+
+  if (fseek(fp, 0, SEEK_END) != 0)
+    DIE("fseek failed: %s", path);
+  long size = ftell(fp);
+  if (size < 0)
+    DIE("ftell failed: %s", path);
+  if (fseek(fp, 0, SEEK_SET) != 0)
+    DIE("fseek failed: %s", path);
+
+  size_t cap = (size_t)size + 2 + PP_FILE_PADDING;
+  char *buf = mem_malloc(MEM_FILE, cap);
+  if (!buf)
+    die_oom("reading file");
+
+  size_t nread = fread(buf, 1, (size_t)size, fp);
+  fclose(fp);
+  return pp_file_from_buffer(path, buf, nread, cap);
+}
+
+// Same as pp_read_file(), for contents that are already in memory.
+static PPFile pp_file_from_bytes(const char *path, const char *data,
+                                 size_t size) {
+  size_t cap = size + 2 + PP_FILE_PADDING;
+  char *buf = mem_malloc(MEM_FILE, cap);
+  if (!buf)
+    die_oom("copying file contents");
+  memcpy(buf, data, size);
+  return pp_file_from_buffer(path, buf, size, cap);
+}
+
 static void pp_free_file(PPFile *file) {
-  free(file->path_buf);
-  free(file->contents);
+  if (file->path_buf)
+    mem_free(MEM_FILE, file->path_buf, strlen(file->path_buf) + 1);
+  mem_free(MEM_FILE, file->contents, file->contents_cap);
 }
 
 static void pp_tokenizer_init(PPTokenizer *tz, PPFile *file) {
@@ -691,7 +1541,7 @@ static void pp_fprint_srcloc(FILE *out, PPSrcLoc loc) {
 static void pp_origin_free(PPOrigin *o) {
   while (o) {
     PPOrigin *next = o->parent;
-    free(o);
+    mem_free(MEM_ORIGIN, o, sizeof(*o));
     o = next;
   }
 }
@@ -699,7 +1549,7 @@ static void pp_origin_free(PPOrigin *o) {
 static void pp_hideset_free(PPHideSet *hs) {
   while (hs) {
     PPHideSet *next = hs->next;
-    free(hs);
+    mem_free(MEM_HIDESET, hs, sizeof(*hs));
     hs = next;
   }
 }
@@ -735,8 +1585,129 @@ static int pp_scan_ucn_len(const char *p) {
   return 0;
 }
 
-static bool pp_is_ident1(const char *p) {
-  return pp_is_nondigit((unsigned char)p[0]) || pp_scan_ucn_len(p) != 0;
+// The code point a UCN of length `n` (see above) names.
+static uint32_t pp_ucn_value(const char *p, int n) {
+  uint32_t c = 0;
+  for (int i = 2; i < n; i++) {
+    int d = (unsigned char)p[i];
+    c = c << 4 | (uint32_t)(d <= '9' ? d - '0' : (d | 0x20) - 'a' + 10);
+  }
+  return c;
+}
+
+// [A-Za-z0-9_]: the bytes that make up almost every identifier, tested
+// without a locale-aware ctype call.
+static bool pp_is_ident_ascii(unsigned char c) {
+  return (unsigned)((c | 0x20) - 'a') < 26 || (unsigned)(c - '0') < 10 ||
+         c == '_';
+}
+
+// C11 Annex D: characters allowed in identifiers (D.1), and those of them not
+// allowed to start one (D.2). Sorted, inclusive ranges.
+static const uint32_t pp_annex_d1[][2] = {
+    {0x00A8, 0x00A8},   {0x00AA, 0x00AA},   {0x00AD, 0x00AD},
+    {0x00AF, 0x00AF},   {0x00B2, 0x00B5},   {0x00B7, 0x00BA},
+    {0x00BC, 0x00BE},   {0x00C0, 0x00D6},   {0x00D8, 0x00F6},
+    {0x00F8, 0x00FF},   {0x0100, 0x167F},   {0x1681, 0x180D},
+    {0x180F, 0x1FFF},   {0x200B, 0x200D},   {0x202A, 0x202E},
+    {0x203F, 0x2040},   {0x2054, 0x2054},   {0x2060, 0x206F},
+    {0x2070, 0x218F},   {0x2460, 0x24FF},   {0x2776, 0x2793},
+    {0x2C00, 0x2DFF},   {0x2E80, 0x2FFF},   {0x3004, 0x3007},
+    {0x3021, 0x302F},   {0x3031, 0x303F},   {0x3040, 0xD7FF},
+    {0xF900, 0xFD3D},   {0xFD40, 0xFDCF},   {0xFDF0, 0xFE44},
+    {0xFE47, 0xFFFD},   {0x10000, 0x1FFFD}, {0x20000, 0x2FFFD},
+    {0x30000, 0x3FFFD}, {0x40000, 0x4FFFD}, {0x50000, 0x5FFFD},
+    {0x60000, 0x6FFFD}, {0x70000, 0x7FFFD}, {0x80000, 0x8FFFD},
+    {0x90000, 0x9FFFD}, {0xA0000, 0xAFFFD}, {0xB0000, 0xBFFFD},
+    {0xC0000, 0xCFFFD}, {0xD0000, 0xDFFFD}, {0xE0000, 0xEFFFD},
+};
+
+static const uint32_t pp_annex_d2[][2] = {
+    {0x0300, 0x036F},
+    {0x1DC0, 0x1DFF},
+    {0x20D0, 0x20FF},
+    {0xFE20, 0xFE2F},
+};
+
+static bool pp_in_ranges(const uint32_t (*r)[2], int n, uint32_t c) {
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (c > r[mid][1])
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < n && c >= r[lo][0];
+}
+
+// Length of the well-formed UTF-8 sequence at `p`, storing its code point in
+// `*cp`, or 0.
+static int pp_decode_utf8(const char *p, uint32_t *cp) {
+  const unsigned char *s = (const unsigned char *)p;
+  int n;
+  uint32_t c, min;
+  if (s[0] < 0x80) {
+    *cp = s[0];
+    return 1;
+  } else if ((s[0] & 0xE0) == 0xC0) {
+    n = 2, c = s[0] & 0x1F, min = 0x80;
+  } else if ((s[0] & 0xF0) == 0xE0) {
+    n = 3, c = s[0] & 0x0F, min = 0x800;
+  } else if ((s[0] & 0xF8) == 0xF0) {
+    n = 4, c = s[0] & 0x07, min = 0x10000;
+  } else {
+    return 0;
+  }
+  for (int i = 1; i < n; i++) {
+    if ((s[i] & 0xC0) != 0x80)
+      return 0; // also stops at the terminating NUL
+    c = c << 6 | (s[i] & 0x3F);
+  }
+  if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return 0;
+  *cp = c;
+  return n;
+}
+
+// Length of the UTF-8 character at `p` if C11 Annex D allows it in an
+// identifier (`first`: at its start), or 0.
+static int pp_scan_utf8_ident_len(const char *p, bool first) {
+  uint32_t c;
+  int n = pp_decode_utf8(p, &c);
+  if (n < 2 || !pp_in_ranges(pp_annex_d1, (int)(sizeof(pp_annex_d1) /
+                                                sizeof(pp_annex_d1[0])),
+                             c))
+    return 0;
+  if (first && pp_in_ranges(pp_annex_d2, (int)(sizeof(pp_annex_d2) /
+                                              sizeof(pp_annex_d2[0])),
+                            c))
+    return 0;
+  return n;
+}
+
+// Why the character `c`, spelled as a UCN, may not be in an identifier (at
+// its start if `first`), or NULL.
+static const char *pp_ucn_ident_error(uint32_t c, bool first) {
+  if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+    return "is not a valid universal character";
+  if (c < 0xA0 && c != 0x24 && c != 0x40 && c != 0x60)
+    return "names a basic or control character"; // C11 6.4.3p2
+  if (!pp_in_ranges(pp_annex_d1,
+                    (int)(sizeof(pp_annex_d1) / sizeof(pp_annex_d1[0])), c))
+    return "is not allowed in an identifier";
+  if (first && pp_in_ranges(pp_annex_d2, (int)(sizeof(pp_annex_d2) /
+                                              sizeof(pp_annex_d2[0])),
+                            c))
+    return "is not allowed at the start of an identifier";
+  return NULL;
+}
+
+static bool pp_is_ident1(const char *p) {
+  unsigned char c = (unsigned char)p[0];
+  if (c < 0x80)
+    return pp_is_nondigit(c) || pp_scan_ucn_len(p) != 0;
+  return pp_scan_utf8_ident_len(p, true) != 0;
 }
 
 static bool pp_is_punctuator_first(int c) {
@@ -905,6 +1876,14 @@ static bool pp_try_pp_number_end(const char *p, const char **end_out) {
       continue;
     }
 
+    // pp-number identifier-nondigit, which includes extended characters.
+    int utf8_len = (unsigned char)*q >= 0x80 ? pp_scan_utf8_ident_len(q, false)
+                                             : 0;
+    if (utf8_len) {
+      q += utf8_len;
+      continue;
+    }
+
     break;
   }
 
@@ -912,28 +1891,35 @@ static bool pp_try_pp_number_end(const char *p, const char **end_out) {
   return true;
 }
 
-static bool pp_try_identifier_end(const char *p, const char **end_out) {
+static const char *pp_intern_ucn_spelling(const char *p, int *len);
+
+// Identifiers are scanned a run of [A-Za-z0-9_] at a time; only a backslash
+// (a UCN) or a byte >= 0x80 (UTF-8) leaves that loop. `*has_ucn` tells
+// whether the spelling needs canonicalizing.
+static bool pp_try_identifier_end(const char *p, const char **end_out,
+                                  bool *has_ucn) {
   if (!pp_is_ident1(p))
     return false;
 
   const char *q = p;
-
-  int ucn_len = pp_scan_ucn_len(q);
-  if (ucn_len)
-    q += ucn_len;
-  else
-    q++;
-
-  while (*q) {
-    ucn_len = pp_scan_ucn_len(q);
-    if (ucn_len) {
+  *has_ucn = false;
+  for (;;) {
+    while (pp_is_ident_ascii((unsigned char)*q))
+      q++;
+    if (*q == '\\') {
+      int ucn_len = pp_scan_ucn_len(q);
+      if (!ucn_len)
+        break;
       q += ucn_len;
-      continue;
-    }
-
-    if (!isalnum((unsigned char)*q) && *q != '_')
+      *has_ucn = true;
+    } else if ((unsigned char)*q >= 0x80) {
+      int utf8_len = pp_scan_utf8_ident_len(q, q == p);
+      if (!utf8_len)
+        break;
+      q += utf8_len;
+    } else {
       break;
-    q++;
+    }
   }
 
   *end_out = q;
@@ -987,10 +1973,23 @@ static bool pp_try_identifier(PPTokenizer *tz, const char *p, bool tok_at_bol,
 
   const char *start = p;
   const char *end = NULL;
-  if (!pp_try_identifier_end(p, &end))
+  bool has_ucn = false;
+  if (!pp_try_identifier_end(p, &end, &has_ucn))
     return false;
   *out =
       pp_make_tok(tz, PPTOK_IDENTIFIER, start, end, tok_at_bol, tok_has_space);
+  // The UCNs must name characters Annex D allows there (C11 6.4.2.1p3).
+  for (const char *q = start; has_ucn && q < end;) {
+    int n = *q == '\\' ? pp_scan_ucn_len(q) : 0;
+    const char *why = n ? pp_ucn_ident_error(pp_ucn_value(q, n), q == start)
+                        : NULL;
+    if (why)
+      DIE("%s:%d:%d: \\%.*s %s", out->spelling.path, out->spelling.line_no,
+          out->spelling.col_no, n - 1, q + 1, why);
+    q += n ? n : 1;
+  }
+  if (has_ucn)
+    out->loc = pp_intern_ucn_spelling(out->loc, &out->len);
   tz->cur = end;
   tz->at_bol = false;
   tz->has_space = false;
@@ -1104,6 +2103,7 @@ static bool pp_try_in_block_comment(PPTokenizer *tz, PPToken *out) {
     if (*p == '\n') {
       *out =
           pp_make_tok(tz, PPTOK_NEWLINE, p, p + 1, tz->at_bol, tz->has_space);
+      out->in_comment = true;
       tz->cur = p + 1;
       tz->line_no++;
       tz->line_start = tz->cur;
@@ -1190,31 +2190,45 @@ static PPToken next_preprocessing_token(PPTokenizer *tz) {
   return tok;
 }
 
-// Tokenize a whole source file into a PPToken linked list.
-//
-// Note: returned tokens' `loc/len` slices point into `file->contents`, so the
-// caller must keep `file->contents` alive for as long as the list is used.
-static PPToken *tokenlize(PPFile *file) {
-  PPTokenizer tz;
-  pp_tokenizer_init(&tz, file);
-
-  PPToken head = {};
-  PPToken *cur = &head;
-
-  for (;;) {
-    PPToken tok = next_preprocessing_token(&tz);
-    PPToken *node = calloc(1, sizeof(*node));
+// Append tokens after `*tail` until the tokenizer reaches `limit` (which must
+// be the start of a line) or produces EOF; a NULL limit runs to EOF. Every
+// call stops at the next '\n' at the latest, so a line-aligned limit is never
+// overshot. Returns the number of tokens appended.
+static unsigned pp_tokenize_until(PPTokenizer *tz, const char *limit,
+                                  PPToken **tail) {
+  const char *start = tz->cur;
+  unsigned n = 0;
+
+  while (!limit || tz->cur < limit) {
+    PPToken tok = next_preprocessing_token(tz);
+    PPToken *node = mem_malloc(MEM_TOKEN, sizeof(*node));
     if (!node)
       die_oom("allocating preprocessing token");
     *node = tok;
+    node->mem_tag = MEM_TOKEN;
     node->next = NULL;
-    cur = cur->next = node;
+    *tail = (*tail)->next = node;
+    n++;
 
     if (tok.kind == PPTOK_EOF)
       break;
   }
 
-  return head.next;
+  STAT_ADD(STAT_TOKENS, n);
+  STAT_ADD(STAT_BYTES_SCANNED, tz->cur - start);
+  return n;
+}
+
+// Threads available to tokenize one large file: all of -j for a single input,
+// otherwise what is left over per translation unit. Set before any compile.
+static int tokenize_jobs = 1;
+
+static PPToken *pp_tokenize_chunked(PPFile *file, size_t size);
+
+// Whether tokenlize() splits `file` between threads.
+static bool pp_tokenize_in_chunks(const PPFile *file) {
+  return tokenize_jobs > 1 &&
+         strlen(file->contents) >= 2 * (size_t)opt.tokenize_chunk;
 }
 
 static void free_pptokens(PPToken *tok) {
@@ -1222,17 +2236,261 @@ static void free_pptokens(PPToken *tok) {
     PPToken *next = tok->next;
     pp_origin_free(tok->origin);
     pp_hideset_free(tok->hideset);
-    free(tok);
+    mem_free(tok->mem_tag, tok, sizeof(*tok));
     tok = next;
   }
 }
 
+// Tokenize a whole source file into a PPToken linked list.
+//
+// Note: returned tokens' `loc/len` slices point into `file->contents`, so the
+// caller must keep `file->contents` alive for as long as the list is used.
+static PPToken *tokenlize(PPFile *file) {
+  if (pp_tokenize_in_chunks(file))
+    return pp_tokenize_chunked(file, strlen(file->contents));
+
+  PPTokenizer tz;
+  pp_tokenizer_init(&tz, file);
+
+  PPToken head = {};
+  PPToken *cur = &head;
+  // An error (an unclosed comment) frees what was tokenized before it is
+  // passed on: the include prefetcher outlives a failed load.
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    free_pptokens(head.next);
+    fatal_exit();
+  }
+  pp_tokenize_until(&tz, NULL, &cur);
+  fatal_jmp = saved;
+  return head.next;
+}
+
 static void pp_free_tok(PPToken *tok) {
   if (!tok)
     return;
   pp_origin_free(tok->origin);
   pp_hideset_free(tok->hideset);
-  free(tok);
+  mem_free(tok->mem_tag, tok, sizeof(*tok));
+}
+
+// Parallel tokenization of large files.
+//
+// The buffer is cut into line-aligned chunks that workers claim from an atomic
+// cursor. After translation phases 1-2 (pp_read_file) the only state that
+// survives a newline is "inside a block comment": literals cannot span lines,
+// line comments end at '\n', and at_bol/has_space are reset by every NEWLINE.
+// So each chunk after the first is tokenized speculatively as starting outside
+// a comment, with chunk-local line numbers and ids. The main thread then walks
+// the chunks in order and re-tokenizes, serially and with real line numbers,
+// any chunk whose speculation was wrong or hit an error, since a comment or
+// literal error there may not be real. Finally workers shift line numbers and
+// ids into place and the lists are linked.
+
+typedef struct {
+  const char *begin; // first byte, at the start of a line
+  const char *end;   // one past the chunk's last '\n'; the NUL for the last
+  bool last;
+  PPToken head;            // list of the chunk's tokens is head.next
+  PPToken *tail;           // last token (or &head)
+  unsigned ntokens;
+  int nlines;              // NEWLINE tokens produced
+  PPCommentMode end_mode;  // comment state after the last line
+  bool failed;             // speculative tokenization raised an error
+  int line_delta;          // added to spelling.line_no by the fixup pass
+  unsigned id_delta;       // added to id by the fixup pass
+} PPChunk;
+
+typedef struct {
+  PPFile *file;
+  PPChunk *chunks;
+  int n;
+  atomic_int next;
+  bool fixup; // second pass: shift line numbers and ids
+} PPChunkJob;
+
+typedef struct {
+  PPChunkJob *job;
+  Stats stats;
+  MemStats mem;
+  double cpu; // thread CPU seconds
+} PPChunkWorker;
+
+static void pp_tokenize_chunk(PPFile *file, PPChunk *c, PPCommentMode mode,
+                              int line_no, unsigned first_id) {
+  PPTokenizer tz;
+  pp_tokenizer_init(&tz, file);
+  tz.cur = tz.line_start = c->begin;
+  tz.line_no = line_no;
+  tz.comment_mode = mode;
+  tz.next_tok_id = first_id;
+
+  c->head.next = NULL;
+  c->tail = &c->head;
+  c->ntokens = pp_tokenize_until(&tz, c->last ? NULL : c->end, &c->tail);
+  c->nlines = tz.line_no - line_no;
+  c->end_mode = tz.comment_mode;
+}
+
+static int pp_chunk_worker(void *arg) {
+  PPChunkWorker *w = arg;
+  PPChunkJob *job = w->job;
+
+  // Errors in a speculative chunk are only reported if the serial re-run
+  // confirms them, so they go to a scratch buffer and unwind to here.
+  char *diag_buf = NULL;
+  size_t diag_len = 0;
+  FILE *sink = job->fixup ? NULL : open_memstream(&diag_buf, &diag_len);
+  jmp_buf jb;
+  diag_out = sink;
+
+  for (;;) {
+    int i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->n)
+      break;
+    PPChunk *c = &job->chunks[i];
+
+    if (job->fixup) {
+      for (PPToken *t = c->head.next; t; t = t->next) {
+        t->spelling.line_no += c->line_delta;
+        t->id += c->id_delta;
+      }
+      continue;
+    }
+
+    double start = trace_enabled() ? trace_clock() : 0;
+    fatal_jmp = &jb;
+    if (setjmp(jb) == 0) {
+      pp_tokenize_chunk(job->file, c, PP_COMMENT_NONE, 1, 1);
+    } else {
+      c->failed = true;
+      free_pptokens(c->head.next);
+      c->head.next = NULL;
+    }
+    fatal_jmp = NULL;
+    if (trace_enabled())
+      trace_complete("tokenize", "chunk", start, trace_clock(), "file",
+                     job->file->path, NULL, NULL);
+  }
+
+  diag_out = NULL;
+  if (sink)
+    fclose(sink);
+  free(diag_buf);
+  w->stats = tu_stats;
+  w->mem = tu_mem;
+  w->cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+  return 0;
+}
+
+static void pp_run_chunk_workers(PPChunkJob *job, int nthreads) {
+  atomic_init(&job->next, 0);
+  thrd_t *threads = calloc((size_t)nthreads, sizeof(*threads));
+  PPChunkWorker *workers = calloc((size_t)nthreads, sizeof(*workers));
+  if (!threads || !workers)
+    die_oom("allocating tokenizer threads");
+  // Make do with the threads that started: none may outlive this call.
+  for (int t = 0; t < nthreads; t++) {
+    workers[t].job = job;
+    if (thrd_create(&threads[t], pp_chunk_worker, &workers[t]) !=
+        thrd_success) {
+      nthreads = t;
+      break;
+    }
+  }
+  if (nthreads == 0)
+    DIE("cannot start tokenizer thread");
+  for (int t = 0; t < nthreads; t++) {
+    thrd_join(threads[t], NULL);
+    stats_merge(&workers[t].stats);
+    mem_merge(&workers[t].mem);
+    tu_stats.cpu[PHASE_TOKENIZE] += workers[t].cpu;
+  }
+  free(workers);
+  free(threads);
+}
+
+static PPToken *pp_tokenize_chunked(PPFile *file, size_t size) {
+  // A few chunks per thread so one slow chunk does not serialize the tail.
+  size_t chunk_size = size / ((size_t)tokenize_jobs * 4);
+  if (chunk_size < (size_t)opt.tokenize_chunk)
+    chunk_size = (size_t)opt.tokenize_chunk;
+
+  PPChunkJob job = {.file = file};
+  int cap = (int)(size / chunk_size) + 1;
+  job.chunks = calloc((size_t)cap, sizeof(*job.chunks));
+  if (!job.chunks)
+    die_oom("allocating tokenizer chunks");
+  const char *p = file->contents;
+  const char *eof = file->contents + size;
+  while (p < eof) {
+    PPChunk *c = &job.chunks[job.n++];
+    c->begin = p;
+    const char *nl = NULL;
+    if ((size_t)(eof - p) > chunk_size && job.n < cap)
+      nl = memchr(p + chunk_size, '\n', (size_t)(eof - p - chunk_size));
+    c->end = nl ? nl + 1 : eof;
+    c->last = !nl;
+    p = c->end;
+  }
+
+  // As in tokenlize(), an error frees the chunks' tokens before going on.
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    for (int i = 0; i < job.n; i++)
+      free_pptokens(job.chunks[i].head.next);
+    free(job.chunks);
+    fatal_exit();
+  }
+  int nthreads = tokenize_jobs < job.n ? tokenize_jobs : job.n;
+  pp_run_chunk_workers(&job, nthreads);
+
+  // Validate speculation in order. A re-run chunk gets its real line numbers
+  // and ids directly; errors from it are genuine and die as usual.
+  PPCommentMode mode = PP_COMMENT_NONE;
+  int line_no = 1;
+  unsigned id = 1;
+  int reruns = 0;
+  for (int i = 0; i < job.n; i++) {
+    PPChunk *c = &job.chunks[i];
+    if (c->failed || mode != PP_COMMENT_NONE) {
+      free_pptokens(c->head.next);
+      pp_tokenize_chunk(file, c, mode, line_no, id);
+      c->failed = false;
+      c->line_delta = 0;
+      c->id_delta = 0;
+      reruns++;
+    } else {
+      c->line_delta = line_no - 1;
+      c->id_delta = id - 1;
+    }
+    mode = c->end_mode;
+    line_no += c->nlines;
+    id += c->ntokens;
+  }
+
+  job.fixup = true;
+  pp_run_chunk_workers(&job, nthreads);
+  fatal_jmp = saved;
+
+  PPToken head = {};
+  PPToken *cur = &head;
+  for (int i = 0; i < job.n; i++) {
+    if (!job.chunks[i].head.next)
+      continue;
+    cur->next = job.chunks[i].head.next;
+    cur = job.chunks[i].tail;
+  }
+  STAT_ADD(STAT_TOKENIZE_CHUNKS, job.n);
+  STAT_ADD(STAT_TOKENIZE_RERUNS, reruns);
+  free(job.chunks);
+  return head.next;
 }
 
 static bool pp_tok_text_is(PPToken *tok, const char *s) {
@@ -1265,9 +2523,10 @@ static PPOrigin *pp_origin_clone(const PPOrigin *o) {
   PPOrigin *head = NULL;
   PPOrigin **tail = &head;
   for (const PPOrigin *p = o; p; p = p->parent) {
-    PPOrigin *node = calloc(1, sizeof(*node));
+    PPOrigin *node = mem_malloc(MEM_ORIGIN, sizeof(*node));
     if (!node)
       die_oom("allocating macro origin");
+    STAT_INC(STAT_ORIGIN_FRAMES);
     *node = *p;
     node->parent = NULL;
     *tail = node;
@@ -1282,9 +2541,10 @@ static PPHideSet *pp_hideset_clone(const PPHideSet *hs) {
   PPHideSet *head = NULL;
   PPHideSet **tail = &head;
   for (const PPHideSet *p = hs; p; p = p->next) {
-    PPHideSet *node = calloc(1, sizeof(*node));
+    PPHideSet *node = mem_malloc(MEM_HIDESET, sizeof(*node));
     if (!node)
       die_oom("allocating hideset");
+    STAT_INC(STAT_HIDESET_NODES);
     *node = *p;
     node->next = NULL;
     *tail = node;
@@ -1294,10 +2554,12 @@ static PPHideSet *pp_hideset_clone(const PPHideSet *hs) {
 }
 
 static PPToken *pp_clone_tok(const PPToken *tok) {
-  PPToken *node = calloc(1, sizeof(*node));
+  PPToken *node = mem_malloc(MEM_TOKEN_CLONE, sizeof(*node));
   if (!node)
     die_oom("allocating preprocessing token");
+  STAT_INC(STAT_TOKENS_CLONED);
   *node = *tok;
+  node->mem_tag = MEM_TOKEN_CLONE;
   node->next = NULL;
   node->origin = pp_origin_clone(tok->origin);
   node->hideset = pp_hideset_clone(tok->hideset);
@@ -1339,15 +2601,6 @@ static bool pp_is_endif_like(PPToken *hash_tok) {
          pp_directive_is(hash_tok, "endif");
 }
 
-static char *pp_strndup(const char *p, int len) {
-  char *s = malloc((size_t)len + 1);
-  if (!s)
-    die_oom("copying string");
-  memcpy(s, p, (size_t)len);
-  s[len] = '\0';
-  return s;
-}
-
 static bool pp_hideset_contains(const PPHideSet *hs, const char *s, int len) {
   for (const PPHideSet *p = hs; p; p = p->next) {
     if ((int)strlen(p->name) == len && !strncmp(p->name, s, (size_t)len))
@@ -1360,9 +2613,10 @@ static PPHideSet *pp_hideset_add_name(PPHideSet *hs, const char *name) {
   int len = (int)strlen(name);
   if (pp_hideset_contains(hs, name, len))
     return hs;
-  PPHideSet *node = calloc(1, sizeof(*node));
+  PPHideSet *node = mem_malloc(MEM_HIDESET, sizeof(*node));
   if (!node)
     die_oom("allocating hideset");
+  STAT_INC(STAT_HIDESET_NODES);
   node->name = name;
   node->next = hs;
   return node;
@@ -1387,6 +2641,7 @@ typedef struct {
   PPHashEntry *buckets;
   int capacity;
   int used;
+  bool untracked; // kept out of --stats and --mem-report (--cost-report's own)
 } PPHashMap;
 
 #define PP_TOMBSTONE ((void *)-1)
@@ -1405,6 +2660,24 @@ static bool pp_hash_match(PPHashEntry *ent, char *key, int keylen) {
          !memcmp(ent->key, key, (size_t)keylen);
 }
 
+static PPHashEntry *pp_hash_alloc_buckets(const PPHashMap *map, int cap) {
+  size_t n = (size_t)cap;
+  PPHashEntry *buckets = map->untracked
+                             ? calloc(n, sizeof(PPHashEntry))
+                             : mem_calloc(MEM_HASHMAP, n, sizeof(PPHashEntry));
+  if (!buckets)
+    die_oom("allocating hashmap");
+  return buckets;
+}
+
+static void pp_hash_free_buckets(PPHashMap *map) {
+  if (map->untracked)
+    free(map->buckets);
+  else
+    mem_free(MEM_HASHMAP, map->buckets,
+             (size_t)map->capacity * sizeof(PPHashEntry));
+}
+
 static void pp_hash_rehash(PPHashMap *map) {
   int nkeys = 0;
   for (int i = 0; i < map->capacity; i++)
@@ -1415,11 +2688,9 @@ static void pp_hash_rehash(PPHashMap *map) {
   while ((nkeys * 100) / cap >= 50)
     cap *= 2;
 
-  PPHashMap map2 = {};
+  PPHashMap map2 = {.untracked = map->untracked};
   map2.capacity = cap;
-  map2.buckets = calloc((size_t)cap, sizeof(PPHashEntry));
-  if (!map2.buckets)
-    die_oom("allocating hashmap");
+  map2.buckets = pp_hash_alloc_buckets(map, cap);
 
   for (int i = 0; i < map->capacity; i++) {
     PPHashEntry *ent = &map->buckets[i];
@@ -1437,17 +2708,19 @@ static void pp_hash_rehash(PPHashMap *map) {
     }
   }
 
-  free(map->buckets);
+  pp_hash_free_buckets(map);
   *map = map2;
 }
 
 static PPHashEntry *pp_hash_get_entry(PPHashMap *map, char *key, int keylen) {
+  STAT_ADD(STAT_HASH_LOOKUPS, !map->untracked);
   if (!map->buckets)
     return NULL;
   uint64_t hash = pp_fnv_hash(key, keylen);
   for (int i = 0; i < map->capacity; i++) {
     PPHashEntry *ent =
         &map->buckets[(hash + (uint64_t)i) % (uint64_t)map->capacity];
+    STAT_ADD(STAT_HASH_PROBES, !map->untracked);
     if (pp_hash_match(ent, key, keylen))
       return ent;
     if (ent->key == NULL)
@@ -1459,17 +2732,17 @@ static PPHashEntry *pp_hash_get_entry(PPHashMap *map, char *key, int keylen) {
 static PPHashEntry *pp_hash_get_or_insert(PPHashMap *map, char *key, int keylen) {
   if (!map->buckets) {
     map->capacity = 16;
-    map->buckets = calloc((size_t)map->capacity, sizeof(PPHashEntry));
-    if (!map->buckets)
-      die_oom("allocating hashmap");
+    map->buckets = pp_hash_alloc_buckets(map, map->capacity);
   } else if ((map->used * 100) / map->capacity >= 70) {
     pp_hash_rehash(map);
   }
 
+  STAT_ADD(STAT_HASH_LOOKUPS, !map->untracked);
   uint64_t hash = pp_fnv_hash(key, keylen);
   for (int i = 0; i < map->capacity; i++) {
     PPHashEntry *ent =
         &map->buckets[(hash + (uint64_t)i) % (uint64_t)map->capacity];
+    STAT_ADD(STAT_HASH_PROBES, !map->untracked);
 
     if (pp_hash_match(ent, key, keylen))
       return ent;
@@ -1506,444 +2779,10131 @@ static void pp_hash_delete2(PPHashMap *map, char *key, int keylen) {
     ent->key = (char *)PP_TOMBSTONE;
 }
 
-typedef struct PPMacro PPMacro;
-struct PPMacro {
-  char *name;
-  PPSrcLoc defined_at;
-  PPToken *body; // replacement list tokens (no NEWLINE)
+// Identifiers spelled with UCNs take their canonical spelling, with each UCN
+// decoded to UTF-8 as if the character had been written directly, from a pool
+// shared by all threads and units. \u00e9, \u00E9 and a raw é are then one
+// name to the macro table and everything after it, and nothing downstream
+// decodes UCNs again. pp_try_identifier() has already checked every UCN.
+static PPHashMap pp_ucn_names = {.untracked = true}; // outlives every unit
+static mtx_t pp_ucn_mu;
+static once_flag pp_ucn_once = ONCE_FLAG_INIT;
+
+static void pp_ucn_init(void) {
+  if (mtx_init(&pp_ucn_mu, mtx_plain) != thrd_success)
+    DIE("cannot initialize identifier pool");
+}
+
+static const char *pp_intern_ucn_spelling(const char *p, int *len) {
+  // Each UCN is at least as long as its UTF-8 encoding.
+  char *buf = malloc((size_t)*len + 1);
+  if (!buf)
+    die_oom("canonicalizing identifier");
+  char *w = buf;
+  for (int i = 0; i < *len;) {
+    int n = pp_scan_ucn_len(p + i);
+    if (!n) {
+      *w++ = p[i++];
+      continue;
+    }
+    uint32_t c = pp_ucn_value(p + i, n);
+    if (c < 0x80) {
+      *w++ = (char)c;
+    } else if (c < 0x800) {
+      *w++ = (char)(0xC0 | c >> 6);
+      *w++ = (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+      *w++ = (char)(0xE0 | c >> 12);
+      *w++ = (char)(0x80 | (c >> 6 & 0x3F));
+      *w++ = (char)(0x80 | (c & 0x3F));
+    } else {
+      *w++ = (char)(0xF0 | c >> 18);
+      *w++ = (char)(0x80 | (c >> 12 & 0x3F));
+      *w++ = (char)(0x80 | (c >> 6 & 0x3F));
+      *w++ = (char)(0x80 | (c & 0x3F));
+    }
+    i += n;
+  }
+  *w = '\0';
+  int n = (int)(w - buf);
+
+  call_once(&pp_ucn_once, pp_ucn_init);
+  mtx_lock(&pp_ucn_mu);
+  char *name = pp_hash_get2(&pp_ucn_names, buf, n);
+  if (name) {
+    free(buf);
+  } else {
+    name = buf;
+    pp_hash_put2(&pp_ucn_names, name, n, name);
+  }
+  mtx_unlock(&pp_ucn_mu);
+  *len = n;
+  return name;
+}
+
+// Virtual header files.
+//
+// Headers can come from memory instead of the filesystem: the bundled
+// include/ directory is compiled into the binary, and --header-bundle maps a
+// tar archive whose members then appear under "<archive path>/". Each virtual
+// file is normalized, tokenized and checked for an include guard once per
+// process, on first use, and then shared read-only by every translation unit
+// (including -j workers), so resolving and reading one costs no syscalls.
+
+// The embedded copies are string literals in feipiaocc_headers.inc, which
+// embed_headers.sh generates from include/; #include finds it next to this
+// file whatever directory the compiler runs in. -DFEIPIAOCC_EMBED_HEADERS=0
+// reads include/ from disk next to the binary instead.
+#ifndef FEIPIAOCC_EMBED_HEADERS
+#define FEIPIAOCC_EMBED_HEADERS 1
+#endif
+
+#define PP_BUNDLED_HEADERS(X)                                                  \
+  X(float_h, "float.h")                                                        \
+  X(stdalign_h, "stdalign.h")                                                  \
+  X(stdarg_h, "stdarg.h")                                                      \
+  X(stdatomic_h, "stdatomic.h")                                                \
+  X(stdbool_h, "stdbool.h")                                                    \
+  X(stddef_h, "stddef.h")                                                      \
+  X(stdnoreturn_h, "stdnoreturn.h")
+
+#if FEIPIAOCC_EMBED_HEADERS
+#include "feipiaocc_headers.inc"
+#endif
+
+// <compiler dir>/include, searched after -I; set by main().
+static char *pp_bundled_include_dir;
+
+
+static const char *pp_system_include_dirs[] = {
+    "/usr/local/include",
+    "/usr/include/x86_64-linux-gnu",
+    "/usr/include",
 };
 
-typedef struct {
-  PPHashMap macros;
-} PPContext;
+static char *pp_path_join(const char *dir, int dirlen, const char *name) {
+  size_t n = (size_t)dirlen + 1 + strlen(name) + 1;
+  char *path = malloc(n);
+  if (!path)
+    die_oom("building include path");
+  snprintf(path, n, "%.*s/%s", dirlen, dir, name);
+  return path;
+}
 
-static PPToken *pp_clone_range(PPToken *tok, PPToken *end) {
-  PPToken head = {};
-  PPToken *cur = &head;
-  while (tok && tok != end) {
-    PPToken *c = pp_clone_tok(tok);
-    c->next = NULL;
-    cur = cur->next = c;
-    tok = tok->next;
+static void pp_init_bundled_include_dir(const char *argv0) {
+  char exe[4096];
+  ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  const char *self = argv0;
+  if (n > 0) {
+    exe[n] = '\0';
+    self = exe;
   }
-  return head.next;
+  const char *slash = strrchr(self, '/');
+  pp_bundled_include_dir = slash ? pp_path_join(self, (int)(slash - self),
+                                                "include")
+                                 : xstrdup("include");
 }
 
-static bool pp_is_identifier(PPToken *tok) {
-  return tok && tok->kind == PPTOK_IDENTIFIER;
+typedef struct {
+  char *path;       // virtual path
+  const char *data; // raw contents (embedded or mapped), not NUL-terminated
+  size_t size;
+  atomic_bool ready; // the fields below are built (under pp_vfs_mu)
+  PPFile file;
+  PPToken *tokens;
+  PPToken *guard;
+} PPVFile;
+
+static PPHashMap pp_vfs; // virtual path -> PPVFile*, filled before any unit
+static mtx_t pp_vfs_mu;
+
+static PPToken *pp_detect_include_guard(PPToken *tok);
+
+static void pp_vfs_add(char *path, const char *data, size_t size) {
+  PPVFile *vf = calloc(1, sizeof(*vf));
+  if (!vf)
+    die_oom("allocating virtual file");
+  vf->path = path;
+  vf->data = data;
+  vf->size = size;
+  atomic_init(&vf->ready, false);
+  pp_hash_put2(&pp_vfs, path, (int)strlen(path), vf);
 }
 
-static void pp_list_append(PPToken **out_cur, PPToken *node) {
-  (*out_cur)->next = node;
-  *out_cur = node;
+static unsigned long long pp_tar_octal(const unsigned char *p, int n) {
+  unsigned long long v = 0;
+  for (int i = 0; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+    v = v * 8 + (unsigned long long)(p[i] - '0');
+  return v;
 }
 
-static void pp_list_append_list(PPToken **out_cur, PPToken *list) {
-  while (list) {
-    PPToken *next = list->next;
-    list->next = NULL;
-    pp_list_append(out_cur, list);
-    list = next;
+// Map a ustar/GNU tar archive and register its regular files.
+static void pp_vfs_add_tar(const char *archive) {
+  int fd = open(archive, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    DIE("cannot open header bundle: %s", archive);
+  size_t size = (size_t)st.st_size;
+  const unsigned char *base = NULL;
+  if (size) {
+    void *m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED)
+      DIE("cannot map header bundle: %s", archive);
+    base = m;
+  }
+  close(fd);
+
+  char longname[4096] = "";
+  for (size_t off = 0; off + 512 <= size;) {
+    const unsigned char *h = base + off;
+    if (h[0] == '\0')
+      break; // end-of-archive blocks
+    unsigned long long len = pp_tar_octal(h + 124, 12);
+    char type = (char)h[156];
+    off += 512;
+    if (len > size - off)
+      DIE("truncated header bundle: %s", archive);
+    const char *data = (const char *)base + off;
+    off += (size_t)((len + 511) & ~511ULL);
+
+    if (type == 'L') { // GNU long name for the next member
+      snprintf(longname, sizeof(longname), "%.*s", (int)len, data);
+      continue;
+    }
+    if (type != '0' && type != '\0') {
+      longname[0] = '\0';
+      continue;
+    }
+
+    char name[4096];
+    if (longname[0])
+      snprintf(name, sizeof(name), "%s", longname);
+    else if (h[345])
+      snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345,
+               (const char *)h);
+    else
+      snprintf(name, sizeof(name), "%.100s", (const char *)h);
+    longname[0] = '\0';
+
+    const char *member = name;
+    while (starts_with(member, "./"))
+      member += 2;
+    pp_vfs_add(pp_path_join(archive, (int)strlen(archive), member), data,
+               (size_t)len);
   }
 }
 
-static PPMacro *pp_macro_find(PPContext *ctx, PPToken *tok) {
-  if (!ctx || !tok || tok->kind != PPTOK_IDENTIFIER)
-    return NULL;
-  return (PPMacro *)pp_hash_get2(&ctx->macros, (char *)tok->loc, tok->len);
+// Called once from main(), before any unit is compiled.
+static void pp_vfs_init(const StrVec *bundles) {
+  if (mtx_init(&pp_vfs_mu, mtx_plain) != thrd_success)
+    DIE("cannot initialize header VFS");
+  for (int i = 0; i < bundles->len; i++)
+    pp_vfs_add_tar(bundles->data[i]);
+#if FEIPIAOCC_EMBED_HEADERS
+  const char *dir = pp_bundled_include_dir;
+#define PP_ADD_EMBEDDED(sym, name)                                             \
+  pp_vfs_add(pp_path_join(dir, (int)strlen(dir), name), pp_embedded_##sym,     \
+             sizeof(pp_embedded_##sym) - 1);
+  PP_BUNDLED_HEADERS(PP_ADD_EMBEDDED)
+#undef PP_ADD_EMBEDDED
+#endif
 }
 
-static void pp_macro_undef(PPContext *ctx, char *name, int len) {
-  if (!ctx)
-    return;
-  PPMacro *m = (PPMacro *)pp_hash_get2(&ctx->macros, name, len);
-  if (!m)
-    return;
-  pp_hash_delete2(&ctx->macros, name, len);
-  free_pptokens(m->body);
-  free(m->name);
-  free(m);
+static PPVFile *pp_vfs_find(const char *path) {
+  if (!pp_vfs.used)
+    return NULL;
+  return pp_hash_get2(&pp_vfs, (char *)path, (int)strlen(path));
 }
 
-static void pp_macro_define_obj(PPContext *ctx, PPSrcLoc defined_at, char *name,
-                               PPToken *body) {
-  int len = (int)strlen(name);
-  pp_macro_undef(ctx, name, len);
+// Return `vf` with its shared file, tokens and guard built.
+static PPVFile *pp_vfs_open(PPVFile *vf) {
+  if (atomic_load_explicit(&vf->ready, memory_order_acquire))
+    return vf;
+  mtx_lock(&pp_vfs_mu);
+  if (!atomic_load_explicit(&vf->ready, memory_order_relaxed)) {
+    // Lives for the rest of the process, so it is not charged to the unit
+    // that happens to build it.
+    mem_untracked = true;
+    vf->file = pp_file_from_bytes(vf->path, vf->data, vf->size);
+    vf->tokens = tokenlize(&vf->file);
+    vf->guard = pp_detect_include_guard(vf->tokens);
+    mem_untracked = false;
+    atomic_store_explicit(&vf->ready, true, memory_order_release);
+  }
+  mtx_unlock(&pp_vfs_mu);
+  return vf;
+}
 
-  PPMacro *m = calloc(1, sizeof(*m));
-  if (!m)
-    die_oom("allocating macro");
-  m->name = name;
-  m->defined_at = defined_at;
-  m->body = body;
-  pp_hash_put2(&ctx->macros, m->name, len, m);
+// Build every file of the VFS now, as a server does before its first request.
+static void pp_vfs_open_all(void) {
+  for (int i = 0; i < pp_vfs.capacity; i++) {
+    PPHashEntry *ent = &pp_vfs.buckets[i];
+    if (ent->key && ent->key != (char *)PP_TOMBSTONE)
+      pp_vfs_open(ent->val);
+  }
 }
 
-static PPToken *pp_expand_list(PPContext *ctx, PPToken *tok);
+// Warm header cache (--server).
+//
+// A server compiles one request after another in the same process, so the
+// headers its units include can outlive them: each is kept read, tokenized
+// and guard-checked under its resolved path, and later units share it like a
+// bundled header for as long as the file keeps the device, inode, size and
+// mtime it was read with. A changed file is read again; the stale entry may
+// still be in use by another unit of the same request (-j), so it is only
+// freed between requests. Each request runs in a process of its own, so what
+// it reads is learned: the server reads the same headers into its own cache
+// once the request is done (see server_handle).
+
+typedef struct PPWarmFile PPWarmFile;
+struct PPWarmFile {
+  char *path;
+  struct stat st; // identity of the file that was read
+  PPFile file;
+  PPToken *tokens;
+  PPToken *guard;
+  PPWarmFile *next_retired;
+  bool learned; // read by a request, not by the server
+};
 
-static PPOrigin *pp_origin_new(const char *macro_name, PPSrcLoc expanded_at,
-                               PPSrcLoc defined_at, PPOrigin *parent) {
-  PPOrigin *o = calloc(1, sizeof(*o));
-  if (!o)
-    die_oom("allocating macro origin");
-  o->macro_name = macro_name;
-  o->expanded_at = expanded_at;
-  o->defined_at = defined_at;
-  o->parent = parent;
-  return o;
+static bool pp_warm_enabled; // set by the server before any unit
+static bool pp_warm_in_request; // set in a request's process
+static PPHashMap pp_warm;    // resolved path -> PPWarmFile*
+static PPWarmFile *pp_warm_retired;
+static mtx_t pp_warm_mu; // guards the two above
+
+static bool pp_warm_is_current(const PPWarmFile *wf, const struct stat *st) {
+  return wf->st.st_dev == st->st_dev && wf->st.st_ino == st->st_ino &&
+         wf->st.st_size == st->st_size &&
+         wf->st.st_mtim.tv_sec == st->st_mtim.tv_sec &&
+         wf->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
 }
 
-static PPToken *pp_clone_tok_for_macro(const PPToken *body_tok,
-                                       const PPToken *call_tok,
-                                       const PPMacro *m) {
-  PPToken *t = pp_clone_tok(body_tok);
-
-  // origin: one new frame for this macro expansion, parented by caller origin.
-  PPOrigin *parent = pp_origin_clone(call_tok->origin);
-  t->origin = pp_origin_new(m->name, call_tok->spelling, m->defined_at, parent);
+// Return the warm entry for `path`, reading the file into it if it is new or
+// has changed.
+static PPWarmFile *pp_warm_open(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    DIE("cannot open file: %s", path);
+  int len = (int)strlen(path);
+  mtx_lock(&pp_warm_mu);
+  PPWarmFile *wf = pp_hash_get2(&pp_warm, (char *)path, len);
+  mtx_unlock(&pp_warm_mu);
+  if (wf && pp_warm_is_current(wf, &st)) {
+    STAT_INC(STAT_WARM_HITS);
+    return wf;
+  }
 
-  // hideset: union(body, call) + macro name
-  PPHideSet *hs = pp_hideset_union(body_tok->hideset, call_tok->hideset);
-  hs = pp_hideset_add_name(hs, m->name);
-  pp_hideset_free(t->hideset);
-  t->hideset = hs;
+  // Like a bundled header, it outlives the unit that reads it.
+  mem_untracked = true;
+  wf = calloc(1, sizeof(*wf));
+  if (!wf)
+    die_oom("allocating warm header");
+  wf->path = xstrdup(path);
+  wf->st = st; // taken before reading: a later change is always noticed
+  wf->learned = pp_warm_in_request;
+  wf->file = pp_read_file(path);
+  wf->tokens = tokenlize(&wf->file);
+  wf->guard = pp_detect_include_guard(wf->tokens);
+  mtx_lock(&pp_warm_mu);
+  PPWarmFile *old = pp_hash_get2(&pp_warm, wf->path, len);
+  if (old) {
+    pp_hash_delete2(&pp_warm, old->path, len);
+    old->next_retired = pp_warm_retired;
+    pp_warm_retired = old;
+  }
+  pp_hash_put2(&pp_warm, wf->path, len, wf);
+  mtx_unlock(&pp_warm_mu);
+  mem_untracked = false;
+  return wf;
+}
 
-  return t;
+// Free the entries replaced during the last request. Called between
+// requests, when no unit can be using them.
+static void pp_warm_sweep(void) {
+  mem_untracked = true;
+  while (pp_warm_retired) {
+    PPWarmFile *wf = pp_warm_retired;
+    pp_warm_retired = wf->next_retired;
+    free_pptokens(wf->tokens);
+    pp_free_file(&wf->file);
+    free(wf->path);
+    free(wf);
+  }
+  mem_untracked = false;
 }
 
-static PPToken *pp_expand_list(PPContext *ctx, PPToken *tok) {
-  if (!ctx)
-    return tok;
+// Included files (#include) and their background prefetch.
+//
+// Every file a translation unit includes is read and tokenized once into a
+// PPSource that lives until the output has been printed, since preprocessed
+// tokens point into its contents. Sources are found by resolved path, so a
+// header included twice is tokenized once.
+//
+// Reading headers is blocking I/O, so it is moved off the critical path. As
+// soon as a file is tokenized, its #include lines that are outside every
+// conditional (those are always processed, as #if is not evaluated yet) are
+// resolved and queued. A per-TU I/O thread reads and tokenizes queued files in
+// order, queueing their own includes the same way, while the main thread keeps
+// preprocessing. When the main thread reaches an #include it takes the ready
+// source, waits for one in flight, or loads it itself. A failed prefetch is
+// simply loaded again, so errors are reported by the main thread as usual.
 
-  PPToken head = {};
-  PPToken *out_cur = &head;
+#define PP_MAX_INCLUDE_DEPTH 200
 
-  while (tok) {
-    PPToken *next = tok->next;
-    tok->next = NULL;
+typedef enum {
+  PP_SOURCE_QUEUED,
+  PP_SOURCE_LOADING,
+  PP_SOURCE_READY,
+  PP_SOURCE_FAILED,
+} PPSourceState;
+
+typedef struct PPSource PPSource;
+typedef struct PPIncludeUse PPIncludeUse;
+
+// One way an #include resolved to a source: re-resolving it tells whether a
+// cached result still holds (a new header may now shadow the source).
+struct PPIncludeUse {
+  PPSource *includer; // NULL for the main file
+  char *name;         // header name after macro expansion
+  bool angled;
+  PPIncludeUse *next;
+};
 
-    if (tok->kind == PPTOK_IDENTIFIER) {
-      PPMacro *m = pp_macro_find(ctx, tok);
-      if (m && !pp_hideset_contains(tok->hideset, tok->loc, tok->len)) {
-        // Replace identifier token with expanded macro body.
-        for (PPToken *bp = m->body; bp; bp = bp->next) {
-          PPToken *expanded = pp_clone_tok_for_macro(bp, tok, m);
-          expanded->next = NULL;
-          pp_list_append(&out_cur, expanded);
-        }
-        pp_free_tok(tok);
-        tok = next;
+struct PPSource {
+  char *path; // resolved path
+  uint64_t path_hash;
+  PPFile file;
+  PPToken *tokens;
+  PPToken *guard;      // include-guard macro name, if the file has one
+  bool shared;         // file and tokens belong to a PPVFile or PPWarmFile
+  bool bundled;        // from a PPVFile, whose contents the cache key covers
+  PPSourceState state; // guarded by PPFileSet.mu
+  bool prefetched;     // loaded by the I/O thread
+  bool included;       // entered by the preprocessor (a cache dependency)
+  int entered_at;      // session: 1 + first top-level part reaching it, or 0
+  int dep_id;          // its line in a cache entry's deps, from 1
+  PPIncludeUse *uses;  // distinct #includes reaching it, if recorded
+  PPSource *next;      // all sources, in first-seen order
+  PPSource *next_queued;
+};
+
+typedef struct {
+  PPSource *head;
+  PPSource **tail;
+  PPSource *queue; // QUEUED sources for the I/O thread, FIFO
+  PPSource **queue_tail;
+  mtx_t mu;
+  cnd_t cv; // queue grew, a load finished, or stop was requested
+  bool started;
+  bool stop;
+  thrd_t thread;
+  bool warm;   // sources may come from the server's warm header cache
+  bool record_includes; // keep PPSource.uses (for the result cache)
+  Stats stats; // the I/O thread's accounting, merged by pp_fileset_stop()
+  MemStats mem;
+  double cpu;
+} PPFileSet;
+
+static bool pp_is_regular_file(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static char *pp_try_include_dir(const char *dir, int dirlen, const char *name) {
+  char *path = pp_path_join(dir, dirlen, name);
+  if (pp_vfs_find(path) || pp_is_regular_file(path))
+    return path;
+  free(path);
+  return NULL;
+}
+
+// Resolve an #include name to an existing file (C11 6.10.2), or return NULL.
+// Quoted names are looked up next to the including file first; then -I
+// directories, --header-bundle archives, the bundled include/ directory and
+// the system directories are tried in order. Only reads immutable state, so
+// the I/O thread may call it.
+static char *pp_search_include(const char *name, bool angled,
+                               const char *includer) {
+  if (name[0] == '/')
+    return pp_vfs_find(name) || pp_is_regular_file(name) ? xstrdup(name)
+                                                          : NULL;
+
+  char *path = NULL;
+  if (!angled) {
+    const char *slash = strrchr(includer, '/');
+    if (slash)
+      path = pp_try_include_dir(includer, (int)(slash - includer), name);
+    else if (pp_vfs_find(name) || pp_is_regular_file(name))
+      path = xstrdup(name);
+  }
+  for (int i = 0; !path && i < opt.include_paths.len; i++) {
+    const char *dir = opt.include_paths.data[i];
+    path = pp_try_include_dir(dir, (int)strlen(dir), name);
+  }
+  for (int i = 0; !path && i < opt.header_bundles.len; i++) {
+    const char *dir = opt.header_bundles.data[i];
+    path = pp_try_include_dir(dir, (int)strlen(dir), name);
+  }
+  if (!path && pp_bundled_include_dir)
+    path = pp_try_include_dir(pp_bundled_include_dir,
+                              (int)strlen(pp_bundled_include_dir), name);
+  int nsys = (int)(sizeof(pp_system_include_dirs) /
+                   sizeof(pp_system_include_dirs[0]));
+  for (int i = 0; !path && i < nsys; i++) {
+    const char *dir = pp_system_include_dirs[i];
+    path = pp_try_include_dir(dir, (int)strlen(dir), name);
+  }
+  return path;
+}
+
+// Spell the header-name starting at `tok` ("file" or <file>) into a new
+// string, or return NULL if the line has some other form.
+static char *pp_include_literal_name(PPToken *tok, bool *angled) {
+  if (!tok)
+    return NULL;
+  if (tok->kind == PPTOK_STRING_LITERAL && tok->loc[0] == '"') {
+    *angled = false;
+    char *name = malloc((size_t)tok->len - 1);
+    if (!name)
+      die_oom("copying header name");
+    memcpy(name, tok->loc + 1, (size_t)tok->len - 2);
+    name[tok->len - 2] = '\0';
+    return name;
+  }
+  if (!pp_tok_text_is(tok, "<"))
+    return NULL;
+
+  // <...> arrives as separate tokens; rejoin their spellings, keeping spaces.
+  size_t len = 0;
+  PPToken *end = tok->next;
+  for (; end && end->kind != PPTOK_NEWLINE && end->kind != PPTOK_EOF;
+       end = end->next) {
+    if (pp_tok_text_is(end, ">"))
+      break;
+    len += (size_t)end->len + 1;
+  }
+  if (!end || !pp_tok_text_is(end, ">"))
+    return NULL;
+
+  char *name = malloc(len + 1);
+  if (!name)
+    die_oom("copying header name");
+  char *w = name;
+  for (PPToken *t = tok->next; t != end; t = t->next) {
+    if (t->has_space && t != tok->next)
+      *w++ = ' ';
+    memcpy(w, t->loc, (size_t)t->len);
+    w += t->len;
+  }
+  *w = '\0';
+  *angled = true;
+  return name;
+}
+
+static void pp_fileset_init(PPFileSet *set) {
+  *set = (PPFileSet){.warm = pp_warm_enabled};
+  set->tail = &set->head;
+  set->queue_tail = &set->queue;
+  if (mtx_init(&set->mu, mtx_plain) != thrd_success ||
+      cnd_init(&set->cv) != thrd_success)
+    DIE("cannot initialize include prefetcher");
+}
+
+// Caller holds set->mu.
+static PPSource *pp_fileset_find(PPFileSet *set, const char *path,
+                                 uint64_t hash) {
+  for (PPSource *src = set->head; src; src = src->next)
+    if (src->path_hash == hash && !strcmp(src->path, path))
+      return src;
+  return NULL;
+}
+
+// Allocated before taking set->mu, so that running out of memory does not
+// leave the lock held for the cleanup that follows a fatal error.
+static PPSource *pp_source_new(uint64_t hash, PPSourceState state) {
+  PPSource *src = calloc(1, sizeof(*src));
+  if (!src)
+    die_oom("allocating include source");
+  src->path_hash = hash;
+  src->state = state;
+  return src;
+}
+
+// Caller holds set->mu. Takes ownership of `path`.
+static PPSource *pp_fileset_add(PPFileSet *set, PPSource *src, char *path) {
+  src->path = path;
+  *set->tail = src;
+  set->tail = &src->next;
+  return src;
+}
+
+// If `tok` (a whole file) is wrapped in "#ifndef X / #define X ... #endif"
+// with only blank lines outside, return the X token of the #ifndef line.
+static PPToken *pp_detect_include_guard(PPToken *tok) {
+  while (tok && tok->kind == PPTOK_NEWLINE)
+    tok = tok->next;
+  if (!pp_directive_is(tok, "ifndef"))
+    return NULL;
+  PPToken *guard = pp_directive_name(tok)->next;
+  if (!guard || guard->kind != PPTOK_IDENTIFIER || !guard->next ||
+      guard->next->kind != PPTOK_NEWLINE)
+    return NULL;
+
+  tok = guard->next->next;
+  while (tok && tok->kind == PPTOK_NEWLINE)
+    tok = tok->next;
+  if (!pp_directive_is(tok, "define"))
+    return NULL;
+  PPToken *name = pp_directive_name(tok)->next;
+  if (!name || name->len != guard->len ||
+      memcmp(name->loc, guard->loc, (size_t)guard->len))
+    return NULL;
+
+  int depth = 1;
+  for (; tok && tok->kind != PPTOK_EOF; tok = pp_skip_to_line_end(tok)) {
+    if (!pp_is_directive_start(tok))
+      continue;
+    if (pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
+        pp_directive_is(tok, "ifndef")) {
+      depth++;
+    } else if (depth == 1 && (pp_directive_is(tok, "elif") ||
+                              pp_directive_is(tok, "else"))) {
+      return NULL;
+    } else if (pp_directive_is(tok, "endif") && --depth == 0) {
+      break;
+    }
+  }
+  if (!tok || tok->kind == PPTOK_EOF)
+    return NULL;
+  for (tok = pp_skip_to_line_end(tok); tok && tok->kind == PPTOK_NEWLINE;
+       tok = tok->next)
+    ;
+  return tok && tok->kind == PPTOK_EOF ? guard : NULL;
+}
+
+static void pp_source_load(PPFileSet *set, PPSource *src) {
+  PPVFile *vf = pp_vfs_find(src->path);
+  if (vf) {
+    pp_vfs_open(vf);
+    src->file = vf->file;
+    src->tokens = vf->tokens;
+    src->guard = vf->guard;
+    src->shared = true;
+    src->bundled = true;
+    return;
+  }
+  if (set->warm) {
+    PPWarmFile *wf = pp_warm_open(src->path);
+    src->file = wf->file;
+    src->tokens = wf->tokens;
+    src->guard = wf->guard;
+    src->shared = true;
+    return;
+  }
+  src->file = pp_read_file(src->path);
+  src->tokens = tokenlize(&src->file);
+  src->guard = pp_detect_include_guard(src->tokens);
+}
+
+static int pp_prefetch_worker(void *arg);
+
+// Queue `path` for the I/O thread unless it is already known. Takes ownership
+// of `path`.
+static void pp_fileset_enqueue(PPFileSet *set, char *path) {
+  uint64_t hash = pp_fnv_hash(path, (int)strlen(path));
+  PPSource *src = pp_source_new(hash, PP_SOURCE_QUEUED);
+  mtx_lock(&set->mu);
+  if (pp_fileset_find(set, path, hash)) {
+    mtx_unlock(&set->mu);
+    free(src);
+    free(path);
+    return;
+  }
+  pp_fileset_add(set, src, path);
+  *set->queue_tail = src;
+  set->queue_tail = &src->next_queued;
+  // If the thread cannot start, queued sources are just loaded on demand.
+  if (!set->started &&
+      thrd_create(&set->thread, pp_prefetch_worker, set) == thrd_success)
+    set->started = true;
+  cnd_broadcast(&set->cv);
+  mtx_unlock(&set->mu);
+}
+
+// Queue the includes of `tok` (a file's token list, `path` being the file)
+// that are outside every conditional and spelled literally.
+static void pp_prefetch_includes(PPFileSet *set, PPToken *tok,
+                                 const char *path) {
+  int depth = 0;
+  for (; tok && tok->kind != PPTOK_EOF; tok = pp_skip_to_line_end(tok)) {
+    if (!pp_is_directive_start(tok))
+      continue;
+    if (pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
+        pp_directive_is(tok, "ifndef")) {
+      depth++;
+    } else if (pp_directive_is(tok, "endif")) {
+      depth--;
+    } else if (depth == 0 && pp_directive_is(tok, "include")) {
+      bool angled = false;
+      char *name = pp_include_literal_name(tok->next->next, &angled);
+      if (!name)
         continue;
+      char *resolved = pp_search_include(name, angled, path);
+      free(name);
+      if (resolved)
+        pp_fileset_enqueue(set, resolved);
+    }
+  }
+}
+
+static int pp_prefetch_worker(void *arg) {
+  PPFileSet *set = arg;
+
+  // A prefetch that fails is retried by the main thread, which reports the
+  // error; here it goes to a scratch buffer and unwinds to the loop.
+  char *diag_buf = NULL;
+  size_t diag_len = 0;
+  FILE *sink = open_memstream(&diag_buf, &diag_len);
+  jmp_buf jb;
+  diag_out = sink;
+
+  mtx_lock(&set->mu);
+  for (;;) {
+    while (!set->queue && !set->stop)
+      cnd_wait(&set->cv, &set->mu);
+    if (set->stop)
+      break;
+    PPSource *src = set->queue;
+    set->queue = src->next_queued;
+    if (!set->queue)
+      set->queue_tail = &set->queue;
+    if (src->state != PP_SOURCE_QUEUED)
+      continue; // the main thread got to it first
+    src->state = PP_SOURCE_LOADING;
+    src->prefetched = true;
+    mtx_unlock(&set->mu);
+
+    double start = trace_enabled() ? trace_clock() : 0;
+    PPSourceState state = PP_SOURCE_FAILED;
+    fatal_jmp = &jb;
+    if (setjmp(jb) == 0) {
+      pp_source_load(set, src);
+      state = PP_SOURCE_READY;
+    }
+    fatal_jmp = NULL;
+    if (state == PP_SOURCE_READY) {
+      pp_prefetch_includes(set, src->tokens, src->path);
+    } else if (src->file.contents && !src->shared) {
+      // tokenlize() freed the partial list; the main thread's retry will
+      // fail the same way and end the unit.
+      pp_free_file(&src->file);
+      src->file = (PPFile){};
+    }
+    if (trace_enabled())
+      trace_complete("io", "prefetch", start, trace_clock(), "file",
+                     src->path, NULL, NULL);
+
+    mtx_lock(&set->mu);
+    src->state = state;
+    cnd_broadcast(&set->cv);
+  }
+  mtx_unlock(&set->mu);
+
+  diag_out = NULL;
+  if (sink)
+    fclose(sink);
+  free(diag_buf);
+  set->stats = tu_stats;
+  set->mem = tu_mem;
+  set->cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+  return 0;
+}
+
+// Return the tokenized source for `path`, loading it here unless the I/O
+// thread has it or is on it. Takes ownership of `path`.
+static PPSource *pp_fileset_get(PPFileSet *set, char *path) {
+  uint64_t hash = pp_fnv_hash(path, (int)strlen(path));
+  bool load_here = false;
+  PPSource *fresh = pp_source_new(hash, PP_SOURCE_LOADING);
+
+  mtx_lock(&set->mu);
+  PPSource *src = pp_fileset_find(set, path, hash);
+  if (!src) {
+    src = pp_fileset_add(set, fresh, path);
+    fresh = NULL;
+    path = NULL;
+    load_here = true;
+  } else {
+    while (src->state == PP_SOURCE_LOADING)
+      cnd_wait(&set->cv, &set->mu);
+    if (src->state == PP_SOURCE_READY) {
+      if (src->prefetched && !src->included)
+        STAT_INC(STAT_INCLUDE_PREFETCHED);
+    } else {
+      src->state = PP_SOURCE_LOADING;
+      load_here = true;
+    }
+  }
+  mtx_unlock(&set->mu);
+  free(fresh);
+  free(path);
+
+  if (load_here) {
+    pp_source_load(set, src);
+    pp_prefetch_includes(set, src->tokens, src->path);
+    mtx_lock(&set->mu);
+    src->state = PP_SOURCE_READY;
+    mtx_unlock(&set->mu);
+  }
+  return src;
+}
+
+// Note that #include `name` in `includer` (a file path) reached `src`, unless
+// the same include did before. Takes ownership of `name`.
+static void pp_fileset_record_use(PPFileSet *set, PPSource *src, char *name,
+                                  bool angled, const char *includer) {
+  PPIncludeUse *use = malloc(sizeof(*use));
+  if (!use)
+    die_oom("recording include");
+  mtx_lock(&set->mu);
+  PPSource *from =
+      pp_fileset_find(set, includer, pp_fnv_hash((char *)includer,
+                                                 (int)strlen(includer)));
+  for (PPIncludeUse *u = src->uses; u; u = u->next) {
+    if (u->includer == from && u->angled == angled && !strcmp(u->name, name)) {
+      mtx_unlock(&set->mu);
+      free(use);
+      free(name);
+      return;
+    }
+  }
+  *use = (PPIncludeUse){
+      .includer = from, .name = name, .angled = angled, .next = src->uses};
+  src->uses = use;
+  mtx_unlock(&set->mu);
+}
+
+// Stop the I/O thread and fold its accounting into the unit's.
+static void pp_fileset_stop(PPFileSet *set) {
+  mtx_lock(&set->mu);
+  set->stop = true;
+  cnd_broadcast(&set->cv);
+  mtx_unlock(&set->mu);
+  if (!set->started)
+    return;
+  thrd_join(set->thread, NULL);
+  set->started = false;
+  stats_merge(&set->stats);
+  mem_merge(&set->mem);
+  tu_stats.cpu[PHASE_PREPROCESS] += set->cpu;
+}
+
+static void pp_fileset_free(PPFileSet *set) {
+  pp_fileset_stop(set);
+  for (PPSource *src = set->head, *next; src; src = next) {
+    next = src->next;
+    if (!src->shared) {
+      free_pptokens(src->tokens);
+      if (src->file.contents)
+        pp_free_file(&src->file);
+    }
+    for (PPIncludeUse *u = src->uses, *next_use; u; u = next_use) {
+      next_use = u->next;
+      free(u->name);
+      free(u);
+    }
+    free(src->path);
+    free(src);
+  }
+  cnd_destroy(&set->cv);
+  mtx_destroy(&set->mu);
+}
+
+// An interned macro name (see pp_intern_name): the rest of the preprocessor
+// only sees `name`.
+typedef struct {
+  unsigned changed_gen; // PPContext.generation when its binding last changed
+  unsigned dep_mark;    // PPContext.memo_builds when last made a dependency
+  char name[];
+} PPName;
+
+typedef struct PPMacro PPMacro;
+struct PPMacro {
+  char *name; // interned in PPContext.names
+  PPSrcLoc defined_at;
+  PPToken *body; // replacement list tokens (no NEWLINE)
+
+  // Memoized, fully rescanned replacement as seen from a call token with an
+  // empty hideset (see pp_macro_expansion), as of PPContext.generation
+  // expansion_gen (0: never built). It stays valid until the binding of one
+  // of `deps`, the names rescanning looked up, changes; `nested` are the
+  // expansions rescanning did, which a memo hit counts again.
+  PPToken *expansion;
+  unsigned expansion_gen;
+  char **deps;
+  int ndeps, deps_cap;
+  PPMacro **nested;
+  int nnested, nested_cap;
+};
+
+// Incremental sessions (see PPSession) record where each top-level group part
+// of the main file started and undo information for the macro table.
+typedef struct {
+  PPToken *in;  // first main-file token of the part
+  long offset;  // its byte offset, as of when it was recorded
+  PPToken *out; // last output token before the part
+  size_t nundo; // macro undo log length before the part
+} PPCheckpoint;
+
+typedef struct {
+  char *name; // key of the changed binding
+  int len;
+  PPMacro *old; // macro it had before, NULL if unbound
+} PPMacroUndo;
+
+typedef struct {
+  PPCheckpoint *cps; // one per top-level group part, in order
+  int ncps, cps_cap;
+  PPMacroUndo *undo;
+  size_t nundo, undo_cap;
+} PPSessionLog;
+
+typedef struct {
+  PPHashMap macros;
+  PPHashMap names;     // interned macro names; they outlive their macros,
+                       // as expanded tokens' origins and hidesets use them
+  unsigned generation; // bumped by every change to `macros`
+  unsigned memo_builds;
+  PPMacro *building;   // whose memo pp_macro_expansion() is building
+  PPFileSet *files;    // everything #included so far
+  int include_depth;
+  PPSessionLog *log; // non-NULL in a session: replaced macros are kept
+} PPContext;
+
+// Cost attribution (--cost-report).
+//
+// Files are charged for the output tokens emitted while they are on top of
+// the file stack and for the time they spend there; inclusive figures also
+// count everything they #include. Macros are identified by their
+// definition site (PPMacro.defined_at) and charged for expansions, inclusive
+// expansion time, and every output token whose origin chain passes through
+// them ("direct" when theirs is the innermost frame). Origin chains are walked
+// as soon as a line is expanded, while the macros they name are still live.
+
+typedef struct {
+  char *path;
+  uint64_t entries;
+  uint64_t tokens_excl;
+  uint64_t tokens_incl;
+  double seconds_excl;
+  double seconds_incl;
+} FileCost;
+
+typedef struct {
+  char key[sizeof(const char *) + sizeof(long)]; // defined_at path + offset
+  char *name;
+  PPSrcLoc defined_at; // .path points at `path`
+  char *path;
+  uint64_t expansions;
+  uint64_t tokens_direct;
+  uint64_t tokens_incl;
+  double seconds;
+} MacroCost;
+
+typedef struct {
+  FileCost *file;
+  double start;
+  double child_seconds;
+  uint64_t tokens; // emitted while active, including nested files
+} CostFrame;
+
+typedef struct {
+  PPHashMap files;  // path -> FileCost
+  PPHashMap macros; // MacroCost.key -> MacroCost
+  CostFrame *stack;
+  int depth;
+  int cap;
+} CostReport;
+
+static _Thread_local CostReport *tu_cost; // NULL unless --cost-report
+
+static void cost_file_push(const char *path) {
+  CostReport *c = tu_cost;
+  int len = (int)strlen(path);
+  FileCost *fc = pp_hash_get2(&c->files, (char *)path, len);
+  if (!fc) {
+    fc = calloc(1, sizeof(*fc));
+    if (!fc)
+      die_oom("allocating file cost");
+    fc->path = xstrdup(path);
+    pp_hash_put2(&c->files, fc->path, len, fc);
+  }
+  fc->entries++;
+
+  if (c->depth == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->stack = realloc(c->stack, (size_t)c->cap * sizeof(*c->stack));
+    if (!c->stack)
+      die_oom("growing cost stack");
+  }
+  c->stack[c->depth++] =
+      (CostFrame){.file = fc, .start = clock_seconds(CLOCK_MONOTONIC)};
+}
+
+static void cost_file_pop(void) {
+  CostReport *c = tu_cost;
+  CostFrame *f = &c->stack[--c->depth];
+  double incl = clock_seconds(CLOCK_MONOTONIC) - f->start;
+  f->file->seconds_incl += incl;
+  f->file->seconds_excl += incl - f->child_seconds;
+  f->file->tokens_incl += f->tokens;
+  if (c->depth) {
+    CostFrame *parent = &c->stack[c->depth - 1];
+    parent->child_seconds += incl;
+    parent->tokens += f->tokens;
+  }
+}
+
+static MacroCost *cost_macro(const char *name, PPSrcLoc defined_at) {
+  char key[sizeof(((MacroCost *)0)->key)];
+  memcpy(key, &defined_at.path, sizeof(const char *));
+  memcpy(key + sizeof(const char *), &defined_at.byte_offset, sizeof(long));
+
+  MacroCost *mc = pp_hash_get2(&tu_cost->macros, key, (int)sizeof(key));
+  if (mc)
+    return mc;
+  mc = calloc(1, sizeof(*mc));
+  if (!mc)
+    die_oom("allocating macro cost");
+  memcpy(mc->key, key, sizeof(key));
+  mc->name = xstrdup(name);
+  mc->path = defined_at.path ? xstrdup(defined_at.path) : NULL;
+  mc->defined_at = defined_at;
+  mc->defined_at.path = mc->path;
+  pp_hash_put2(&tu_cost->macros, mc->key, (int)sizeof(mc->key), mc);
+  return mc;
+}
+
+// Charge the tokens of one expanded output line to the current file and to
+// every macro in their origin chains.
+static void cost_charge_line(PPToken *line) {
+  CostReport *c = tu_cost;
+  uint64_t n = 0;
+  for (PPToken *t = line; t; t = t->next) {
+    n++;
+    for (PPOrigin *o = t->origin; o; o = o->parent) {
+      MacroCost *mc = cost_macro(o->macro_name, o->defined_at);
+      mc->tokens_incl++;
+      if (o == t->origin)
+        mc->tokens_direct++;
+    }
+  }
+  if (c->depth) {
+    CostFrame *f = &c->stack[c->depth - 1];
+    f->file->tokens_excl += n;
+    f->tokens += n;
+  }
+}
+
+static int cost_cmp_file(const void *a, const void *b) {
+  const FileCost *x = *(FileCost *const *)a;
+  const FileCost *y = *(FileCost *const *)b;
+  if (x->tokens_incl != y->tokens_incl)
+    return x->tokens_incl > y->tokens_incl ? -1 : 1;
+  return strcmp(x->path, y->path);
+}
+
+static int cost_cmp_macro_tokens(const void *a, const void *b) {
+  const MacroCost *x = *(MacroCost *const *)a;
+  const MacroCost *y = *(MacroCost *const *)b;
+  if (x->tokens_incl != y->tokens_incl)
+    return x->tokens_incl > y->tokens_incl ? -1 : 1;
+  if (x->expansions != y->expansions)
+    return x->expansions > y->expansions ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+static int cost_cmp_macro_seconds(const void *a, const void *b) {
+  const MacroCost *x = *(MacroCost *const *)a;
+  const MacroCost *y = *(MacroCost *const *)b;
+  if (x->seconds != y->seconds)
+    return x->seconds > y->seconds ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+static void **cost_collect(PPHashMap *map, int *len_out) {
+  void **items = calloc((size_t)map->used + 1, sizeof(*items));
+  if (!items)
+    die_oom("collecting cost entries");
+  int len = 0;
+  for (int i = 0; i < map->capacity; i++) {
+    PPHashEntry *ent = &map->buckets[i];
+    if (ent->key && ent->key != (char *)PP_TOMBSTONE)
+      items[len++] = ent->val;
+  }
+  *len_out = len;
+  return items;
+}
+
+static void cost_print_macros(FILE *out, MacroCost **ms, int len, int top,
+                              const char *title) {
+  fprintf(out, "  top macros by %s:\n", title);
+  fprintf(out, "    %10s %12s %12s %10s  %s\n", "expansions", "tokens(incl)",
+          "tokens(dir)", "ms(incl)", "macro");
+  for (int i = 0; i < len && i < top; i++) {
+    MacroCost *mc = ms[i];
+    fprintf(out, "    %10llu %12llu %12llu %10.3f  %s (",
+            (unsigned long long)mc->expansions,
+            (unsigned long long)mc->tokens_incl,
+            (unsigned long long)mc->tokens_direct, mc->seconds * 1e3, mc->name);
+    pp_fprint_srcloc(out, mc->defined_at);
+    fprintf(out, ")\n");
+  }
+}
+
+static void print_cost_report(FILE *out, const char *path, int top) {
+  CostReport *c = tu_cost;
+  fprintf(out, "cost report for %s:\n", path);
+
+  int nfiles = 0;
+  FileCost **fs = (FileCost **)cost_collect(&c->files, &nfiles);
+  qsort(fs, (size_t)nfiles, sizeof(*fs), cost_cmp_file);
+  fprintf(out, "  top files by tokens:\n");
+  fprintf(out, "    %12s %12s %10s %10s %7s  %s\n", "tokens(incl)",
+          "tokens(excl)", "ms(incl)", "ms(excl)", "entries", "file");
+  for (int i = 0; i < nfiles && i < top; i++)
+    fprintf(out, "    %12llu %12llu %10.3f %10.3f %7llu  %s\n",
+            (unsigned long long)fs[i]->tokens_incl,
+            (unsigned long long)fs[i]->tokens_excl, fs[i]->seconds_incl * 1e3,
+            fs[i]->seconds_excl * 1e3, (unsigned long long)fs[i]->entries,
+            fs[i]->path);
+
+  int nmacros = 0;
+  MacroCost **ms = (MacroCost **)cost_collect(&c->macros, &nmacros);
+  qsort(ms, (size_t)nmacros, sizeof(*ms), cost_cmp_macro_tokens);
+  cost_print_macros(out, ms, nmacros, top, "output tokens");
+  qsort(ms, (size_t)nmacros, sizeof(*ms), cost_cmp_macro_seconds);
+  cost_print_macros(out, ms, nmacros, top, "expansion time");
+
+  free(fs);
+  free(ms);
+}
+
+static void cost_report_free(CostReport *c) {
+  for (int i = 0; i < c->files.capacity; i++) {
+    PPHashEntry *ent = &c->files.buckets[i];
+    if (ent->key && ent->key != (char *)PP_TOMBSTONE) {
+      FileCost *fc = ent->val;
+      free(fc->path);
+      free(fc);
+    }
+  }
+  for (int i = 0; i < c->macros.capacity; i++) {
+    PPHashEntry *ent = &c->macros.buckets[i];
+    if (ent->key && ent->key != (char *)PP_TOMBSTONE) {
+      MacroCost *mc = ent->val;
+      free(mc->name);
+      free(mc->path);
+      free(mc);
+    }
+  }
+  pp_hash_free_buckets(&c->files);
+  pp_hash_free_buckets(&c->macros);
+  free(c->stack);
+}
+
+static PPToken *pp_clone_range(PPToken *tok, PPToken *end) {
+  PPToken head = {};
+  PPToken *cur = &head;
+  while (tok && tok != end) {
+    PPToken *c = pp_clone_tok(tok);
+    c->next = NULL;
+    cur = cur->next = c;
+    tok = tok->next;
+  }
+  return head.next;
+}
+
+// Account a token list under `tag` from now on (it changed owner).
+static void pp_retag_tokens(PPToken *tok, MemTag tag) {
+  for (; tok; tok = tok->next) {
+    mem_retag(tok->mem_tag, tag, sizeof(*tok));
+    tok->mem_tag = tag;
+  }
+}
+
+static bool pp_is_identifier(PPToken *tok) {
+  return tok && tok->kind == PPTOK_IDENTIFIER;
+}
+
+static void pp_list_append(PPToken **out_cur, PPToken *node) {
+  (*out_cur)->next = node;
+  *out_cur = node;
+}
+
+static void pp_list_append_list(PPToken **out_cur, PPToken *list) {
+  while (list) {
+    PPToken *next = list->next;
+    list->next = NULL;
+    pp_list_append(out_cur, list);
+    list = next;
+  }
+}
+
+static PPName *pp_name_of(const char *name) {
+  return (PPName *)(name - offsetof(PPName, name));
+}
+
+static char *pp_intern_name(PPContext *ctx, const char *p, int len) {
+  char *name = pp_hash_get2(&ctx->names, (char *)p, len);
+  if (!name) {
+    PPName *n = mem_calloc(MEM_MACRO, 1, sizeof(PPName) + (size_t)len + 1);
+    if (!n)
+      die_oom("interning macro name");
+    memcpy(n->name, p, (size_t)len);
+    name = n->name;
+    pp_hash_put2(&ctx->names, name, len, name);
+  }
+  return name;
+}
+
+// Grow the array *data, of *cap items of `size` bytes, the first n in use.
+static void pp_memo_grow(void **data, int n, int *cap, size_t size) {
+  int new_cap = *cap ? *cap * 2 : 8;
+  void *grown = mem_malloc(MEM_MACRO, (size_t)new_cap * size);
+  if (!grown)
+    die_oom("growing macro memo");
+  if (n)
+    memcpy(grown, *data, (size_t)n * size);
+  mem_free(MEM_MACRO, *data, (size_t)*cap * size);
+  *data = grown;
+  *cap = new_cap;
+}
+
+static PPMacro *pp_macro_find(PPContext *ctx, PPToken *tok) {
+  if (!ctx || !tok || tok->kind != PPTOK_IDENTIFIER)
+    return NULL;
+  PPMacro *b = ctx->building;
+  if (b) { // the memo of `b` depends on what this name is bound to
+    PPName *n = pp_name_of(pp_intern_name(ctx, tok->loc, tok->len));
+    if (n->dep_mark != ctx->memo_builds) {
+      n->dep_mark = ctx->memo_builds;
+      if (b->ndeps == b->deps_cap) {
+        void *deps = b->deps;
+        pp_memo_grow(&deps, b->ndeps, &b->deps_cap, sizeof(*b->deps));
+        b->deps = deps;
+      }
+      b->deps[b->ndeps++] = n->name;
+    }
+  }
+  return (PPMacro *)pp_hash_get2(&ctx->macros, (char *)tok->loc, tok->len);
+}
+
+// m->name is interned, not owned: origins of tokens expanded from `m` name it
+// after an #undef.
+static void pp_macro_free(PPMacro *m) {
+  free_pptokens(m->body);
+  free_pptokens(m->expansion);
+  mem_free(MEM_MACRO, m->deps, (size_t)m->deps_cap * sizeof(*m->deps));
+  mem_free(MEM_MACRO, m->nested, (size_t)m->nested_cap * sizeof(*m->nested));
+  mem_free(MEM_MACRO, m, sizeof(*m));
+}
+
+// The binding of the interned `name` is changing: memos that looked it up
+// are stale.
+static void pp_macro_changed(PPContext *ctx, char *name) {
+  pp_name_of(name)->changed_gen = ++ctx->generation;
+}
+
+// Record that the binding of `name` is about to change from `old`.
+static void pp_macro_log_undo(PPSessionLog *log, char *name, int len,
+                              PPMacro *old) {
+  if (log->nundo == log->undo_cap) {
+    log->undo_cap = log->undo_cap ? log->undo_cap * 2 : 64;
+    log->undo = realloc(log->undo, log->undo_cap * sizeof(*log->undo));
+    if (!log->undo)
+      die_oom("growing macro undo log");
+  }
+  log->undo[log->nundo++] = (PPMacroUndo){name, len, old};
+}
+
+static void pp_macro_undef(PPContext *ctx, char *name, int len) {
+  if (!ctx)
+    return;
+  PPMacro *m = (PPMacro *)pp_hash_get2(&ctx->macros, name, len);
+  if (!m)
+    return;
+  pp_hash_delete2(&ctx->macros, name, len);
+  pp_macro_changed(ctx, m->name);
+  if (ctx->log)
+    pp_macro_log_undo(ctx->log, m->name, len, m); // freed by a rollback
+  else
+    pp_macro_free(m);
+}
+
+static void pp_macro_define_obj(PPContext *ctx, PPSrcLoc defined_at, char *name,
+                               PPToken *body) {
+  int len = (int)strlen(name);
+  pp_macro_undef(ctx, name, len);
+
+  PPMacro *m = mem_calloc(MEM_MACRO, 1, sizeof(*m));
+  if (!m)
+    die_oom("allocating macro");
+  m->name = name;
+  m->defined_at = defined_at;
+  m->body = body;
+  pp_hash_put2(&ctx->macros, m->name, len, m);
+  pp_macro_changed(ctx, m->name);
+  if (ctx->log)
+    pp_macro_log_undo(ctx->log, m->name, len, NULL);
+}
+
+static PPToken *pp_expand_list(PPContext *ctx, PPToken *tok);
+
+static PPOrigin *pp_origin_new(const char *macro_name, PPSrcLoc expanded_at,
+                               PPSrcLoc defined_at, PPOrigin *parent) {
+  PPOrigin *o = mem_malloc(MEM_ORIGIN, sizeof(*o));
+  if (!o)
+    die_oom("allocating macro origin");
+  STAT_INC(STAT_ORIGIN_FRAMES);
+  o->macro_name = macro_name;
+  o->expanded_at = expanded_at;
+  o->defined_at = defined_at;
+  o->parent = parent;
+  return o;
+}
+
+static PPToken *pp_clone_tok_for_macro(const PPToken *body_tok,
+                                       const PPToken *call_tok,
+                                       const PPMacro *m) {
+  PPToken *t = pp_clone_tok(body_tok);
+
+  // origin: one new frame for this macro expansion, parented by caller origin.
+  PPOrigin *parent = pp_origin_clone(call_tok->origin);
+  t->origin = pp_origin_new(m->name, call_tok->spelling, m->defined_at, parent);
+
+  // hideset: union(body, call) + macro name
+  PPHideSet *hs = pp_hideset_union(body_tok->hideset, call_tok->hideset);
+  hs = pp_hideset_add_name(hs, m->name);
+  pp_hideset_free(t->hideset);
+  t->hideset = hs;
+
+  return t;
+}
+
+// Whether the memo of `m` still holds: no name it looked up has been
+// (re)defined or undefined since it was built.
+static bool pp_memo_valid(PPContext *ctx, PPMacro *m) {
+  if (m->expansion_gen == ctx->generation)
+    return true;
+  if (!m->expansion_gen)
+    return false;
+  for (int i = 0; i < m->ndeps; i++)
+    if (pp_name_of(m->deps[i])->changed_gen > m->expansion_gen)
+      return false;
+  m->expansion_gen = ctx->generation; // checked up to here
+  return true;
+}
+
+// Returns the memoized expansion of `m`, rebuilding it if a macro it depends
+// on changed since it was built. An object-like macro invoked from a token
+// with an empty hideset always expands to the same tokens: every body token
+// gets hideset {m} and one origin frame for `m`, and rescanning depends only
+// on the bindings of the names it looks up. The memo is built with a
+// placeholder call site; callers patch the outermost origin frame's
+// expanded_at per use. A hit counts the expansions the rescan did as if it
+// had run again, for --stats and --cost-report.
+static PPToken *pp_macro_expansion(PPContext *ctx, PPMacro *m) {
+  if (pp_memo_valid(ctx, m)) {
+    STAT_INC(STAT_MACRO_MEMO_HITS);
+    STAT_ADD(STAT_MACRO_EXPANSIONS, m->nnested);
+    for (int i = 0; tu_cost && i < m->nnested; i++)
+      cost_macro(m->nested[i]->name, m->nested[i]->defined_at)->expansions++;
+    return m->expansion;
+  }
+
+  free_pptokens(m->expansion);
+  m->expansion = NULL;
+  m->expansion_gen = 0; // until built: an error may cut the rescan short
+  m->ndeps = m->nnested = 0;
+
+  PPToken call = {.kind = PPTOK_IDENTIFIER};
+  PPToken head = {};
+  PPToken *cur = &head;
+  for (PPToken *bp = m->body; bp; bp = bp->next)
+    pp_list_append(&cur, pp_clone_tok_for_macro(bp, &call, m));
+
+  // Body tokens all carry {m}, so this cannot re-enter the memo of `m`, nor
+  // build another: every call it rescans has a hideset.
+  ctx->memo_builds++;
+  ctx->building = m;
+  m->expansion = pp_expand_list(ctx, head.next);
+  ctx->building = NULL;
+  m->expansion_gen = ctx->generation;
+  pp_retag_tokens(m->expansion, MEM_MACRO);
+  return m->expansion;
+}
+
+// Append the replacement of one use of `m` (at `call`) to *out_cur.
+static void pp_expand_macro_use_body(PPContext *ctx, PPMacro *m,
+                                     PPToken *call, PPToken **out_cur) {
+  if (!call->hideset && !call->origin) {
+    // Bulk copy of the memo; only the outermost frame differs between uses.
+    for (PPToken *t = pp_macro_expansion(ctx, m); t; t = t->next) {
+      PPToken *c = pp_clone_tok(t);
+      PPOrigin *o = c->origin;
+      while (o->parent)
+        o = o->parent;
+      o->expanded_at = call->spelling;
+      pp_list_append(out_cur, c);
+    }
+    return;
+  }
+
+  for (PPToken *bp = m->body; bp; bp = bp->next) {
+    PPToken *expanded = pp_clone_tok_for_macro(bp, call, m);
+    expanded->next = NULL;
+    pp_list_append(out_cur, expanded);
+  }
+}
+
+static void pp_expand_macro_use(PPContext *ctx, PPMacro *m, PPToken *call,
+                                PPToken **out_cur) {
+  STAT_INC(STAT_MACRO_EXPANSIONS);
+  PPMacro *b = ctx->building;
+  if (b) {
+    if (b->nnested == b->nested_cap) {
+      void *nested = b->nested;
+      pp_memo_grow(&nested, b->nnested, &b->nested_cap, sizeof(*b->nested));
+      b->nested = nested;
+    }
+    b->nested[b->nnested++] = m;
+  }
+  MacroCost *mc = tu_cost ? cost_macro(m->name, m->defined_at) : NULL;
+  if (!trace_enabled() && !mc) {
+    pp_expand_macro_use_body(ctx, m, call, out_cur);
+    return;
+  }
+
+  double start = trace_clock();
+  pp_expand_macro_use_body(ctx, m, call, out_cur);
+  double end = trace_clock();
+  if (mc) {
+    mc->expansions++;
+    mc->seconds += end - start;
+  }
+  if (trace_enabled() && (end - start) * 1e6 >= trace_granularity_us)
+    trace_complete("macro", m->name, start, end, "macro", m->name, "file",
+                   m->defined_at.path);
+}
+
+static PPToken *pp_expand_list(PPContext *ctx, PPToken *tok) {
+  if (!ctx)
+    return tok;
+
+  PPToken head = {};
+  PPToken *out_cur = &head;
+
+  while (tok) {
+    PPToken *next = tok->next;
+    tok->next = NULL;
+
+    if (tok->kind == PPTOK_IDENTIFIER) {
+      PPMacro *m = pp_macro_find(ctx, tok);
+      if (m && !pp_hideset_contains(tok->hideset, tok->loc, tok->len)) {
+        // Replace identifier token with expanded macro body.
+        pp_expand_macro_use(ctx, m, tok, &out_cur);
+        pp_free_tok(tok);
+        tok = next;
+        continue;
+      }
+    }
+
+    pp_list_append(&out_cur, tok);
+    tok = next;
+  }
+
+  // Expand recursively until no changes. Since we don't have function-like
+  // macros yet, a few fixed iterations is enough; hideset prevents loops.
+  bool changed;
+  do {
+    STAT_INC(STAT_RESCAN_ITERATIONS);
+    changed = false;
+    PPToken out2 = {};
+    PPToken *cur2 = &out2;
+
+    PPToken *p = head.next;
+    head.next = NULL;
+    while (p) {
+      PPToken *pn = p->next;
+      p->next = NULL;
+      if (p->kind == PPTOK_IDENTIFIER) {
+        PPMacro *m = pp_macro_find(ctx, p);
+        if (m && !pp_hideset_contains(p->hideset, p->loc, p->len)) {
+          changed = true;
+          pp_expand_macro_use(ctx, m, p, &cur2);
+          pp_free_tok(p);
+          p = pn;
+          continue;
+        }
+      }
+      pp_list_append(&cur2, p);
+      p = pn;
+    }
+    head.next = out2.next;
+  } while (changed);
+
+  return head.next;
+}
+
+typedef struct {
+  PPContext *ctx;
+  PPToken **out_cur;
+  bool emit_text;
+  bool stop_on_endif_like;
+  bool checkpoint; // session's top-level parser: record each group part
+} PPGroupParser;
+
+static PPToken *pp_parse_group(PPGroupParser *p, PPToken *tok);
+
+static void pp_session_checkpoint(PPSessionLog *log, PPToken *in,
+                                  PPToken *out) {
+  if (log->ncps == log->cps_cap) {
+    log->cps_cap = log->cps_cap ? log->cps_cap * 2 : 256;
+    log->cps = realloc(log->cps, (size_t)log->cps_cap * sizeof(*log->cps));
+    if (!log->cps)
+      die_oom("growing session checkpoints");
+  }
+  log->cps[log->ncps++] = (PPCheckpoint){
+      .in = in,
+      .offset = in->spelling.byte_offset,
+      .out = out,
+      .nundo = log->nundo,
+  };
+}
+
+static PPToken *pp_handle_text_line(PPGroupParser *p, PPToken *tok) {
+  PPToken *line_end = tok;
+  while (line_end && line_end->kind != PPTOK_EOF &&
+         line_end->kind != PPTOK_NEWLINE)
+    line_end = line_end->next;
+
+  if (!p->emit_text)
+    return pp_skip_to_line_end(tok);
+
+  // Clone the line into an owned list, expand macros in it, and append to output.
+  PPToken *line = pp_clone_range(tok, line_end);
+  line = pp_expand_list(p->ctx, line);
+  if (tu_cost)
+    cost_charge_line(line);
+  pp_list_append_list(p->out_cur, line);
+
+  if (line_end && line_end->kind == PPTOK_NEWLINE) {
+    pp_list_append(p->out_cur, pp_clone_tok(line_end));
+    return line_end->next;
+  }
+  return line_end;
+}
+
+static PPToken *pp_handle_empty_directive(PPToken *tok) {
+  // control-line: "#" new-line
+  PPToken *trail = tok->next;
+  if (trail && trail->kind != PPTOK_NEWLINE && trail->kind != PPTOK_EOF)
+    pp_die_tok(trail, "extra token after #");
+  return pp_skip_to_line_end(tok);
+}
+
+// Resolve the #include line at `tok` to the source it enters, or NULL when
+// the multiple-include optimization skips it.
+static PPSource *pp_include_source(PPGroupParser *p, PPToken *tok) {
+  PPToken *arg = tok->next->next;
+  bool angled = false;
+  char *name = pp_include_literal_name(arg, &angled);
+  if (!name) {
+    // Any other form is macro-expanded first (C11 6.10.2p4).
+    PPToken *line_end = arg;
+    while (line_end && line_end->kind != PPTOK_EOF &&
+           line_end->kind != PPTOK_NEWLINE)
+      line_end = line_end->next;
+    PPToken *line = pp_expand_list(p->ctx, pp_clone_range(arg, line_end));
+    name = pp_include_literal_name(line, &angled);
+    free_pptokens(line);
+  }
+  if (!name)
+    pp_die_tok(tok, "#include expects \"FILENAME\" or <FILENAME>");
+
+  PPContext *ctx = p->ctx;
+  if (ctx->include_depth >= PP_MAX_INCLUDE_DEPTH)
+    pp_die_tok(tok, "#include nested too deeply");
+  char *path = pp_search_include(name, angled, tok->spelling.path);
+  if (!path)
+    DIE("%s:%d:%d: %s: file not found", tok->spelling.path,
+        tok->spelling.line_no, tok->spelling.col_no, name);
+
+  PPSource *src = pp_fileset_get(ctx->files, path);
+  if (ctx->files->record_includes)
+    pp_fileset_record_use(ctx->files, src, name, angled, tok->spelling.path);
+  else
+    free(name);
+  src->included = true;
+  if (ctx->log && !src->entered_at)
+    src->entered_at = ctx->log->ncps;
+  STAT_INC(STAT_INCLUDES);
+  // Multiple-include optimization: a guarded file whose guard is defined
+  // would expand to nothing.
+  if (src->guard && pp_macro_find(ctx, src->guard)) {
+    STAT_INC(STAT_INCLUDE_GUARD_SKIPS);
+    return NULL;
+  }
+  return src;
+}
+
+static PPToken *pp_handle_include(PPGroupParser *p, PPToken *tok) {
+  // control-line:
+  //   # include pp-tokens new-line
+  if (!p->emit_text)
+    return pp_skip_to_line_end(tok);
+  PPSource *src = pp_include_source(p, tok);
+  if (!src)
+    return pp_skip_to_line_end(tok);
+
+  PPContext *ctx = p->ctx;
+  double start = trace_enabled() ? trace_clock() : 0;
+  if (tu_cost)
+    cost_file_push(src->path);
+  ctx->include_depth++;
+  PPGroupParser sub = *p;
+  sub.stop_on_endif_like = false;
+  sub.checkpoint = false;
+  PPToken *end = pp_parse_group(&sub, src->tokens);
+  if (!end || end->kind != PPTOK_EOF)
+    pp_die_tok(end, "internal error: expected EOF after included file");
+  ctx->include_depth--;
+  if (tu_cost)
+    cost_file_pop();
+  if (trace_enabled())
+    trace_complete("include", src->path, start, trace_clock(), NULL, NULL,
+                   NULL, NULL);
+
+  return pp_skip_to_line_end(tok);
+}
+
+static PPToken *pp_handle_include_next(PPToken *tok) {
+  return pp_skip_to_line_end(tok);
+}
+
+static PPToken *pp_handle_define(PPContext *ctx, PPToken *tok) {
+  // control-line:
+  //   # define identifier replacement-list new-line
+  // For now we only support object-like macros.
+  PPToken *define_tok = tok->next;
+  PPToken *name_tok = define_tok ? define_tok->next : NULL;
+  if (!pp_directive_is(tok, "define") || !pp_is_identifier(name_tok))
+    pp_die_tok(tok, "malformed #define");
+
+  char *name = pp_intern_name(ctx, name_tok->loc, name_tok->len);
+
+  // Replacement-list: tokens up to NEWLINE.
+  PPToken *line_end = name_tok->next;
+  while (line_end && line_end->kind != PPTOK_EOF &&
+         line_end->kind != PPTOK_NEWLINE)
+    line_end = line_end->next;
+  PPToken *body = pp_clone_range(name_tok->next, line_end);
+  pp_retag_tokens(body, MEM_MACRO);
+
+  pp_macro_define_obj(ctx, name_tok->spelling, name, body);
+  return pp_skip_to_line_end(tok);
+}
+
+static PPToken *pp_handle_undef(PPContext *ctx, PPToken *tok) {
+  // control-line:
+  //   # undef identifier new-line
+  PPToken *undef_tok = tok->next;
+  PPToken *name_tok = undef_tok ? undef_tok->next : NULL;
+  if (!pp_directive_is(tok, "undef") || !pp_is_identifier(name_tok))
+    pp_die_tok(tok, "malformed #undef");
+  pp_macro_undef(ctx, (char *)name_tok->loc, name_tok->len);
+  PPToken *trail = name_tok->next;
+  if (trail && trail->kind != PPTOK_NEWLINE && trail->kind != PPTOK_EOF)
+    pp_die_tok(trail, "extra token after #undef");
+  return pp_skip_to_line_end(tok);
+}
+
+static PPToken *pp_handle_line(PPToken *tok) { return pp_skip_to_line_end(tok); }
+
+static PPToken *pp_handle_error(PPToken *tok) { return pp_skip_to_line_end(tok); }
+
+static PPToken *pp_handle_pragma(PPToken *tok) { return pp_skip_to_line_end(tok); }
+
+static PPToken *pp_handle_non_directive(PPToken *tok) { return pp_skip_to_line_end(tok); }
+
+static PPToken *pp_handle_control_line(PPGroupParser *p, PPToken *tok) {
+  if (pp_is_empty_directive(tok))
+    return pp_handle_empty_directive(tok);
+  if (pp_directive_is(tok, "include"))
+    return pp_handle_include(p, tok);
+  if (pp_directive_is(tok, "include_next"))
+    return pp_handle_include_next(tok);
+  if (pp_directive_is(tok, "define"))
+    return pp_handle_define(p->ctx, tok);
+  if (pp_directive_is(tok, "undef"))
+    return pp_handle_undef(p->ctx, tok);
+  if (pp_directive_is(tok, "line"))
+    return pp_handle_line(tok);
+  if (pp_directive_is(tok, "error"))
+    return pp_handle_error(tok);
+  if (pp_directive_is(tok, "pragma"))
+    return pp_handle_pragma(tok);
+
+  // conditionals are handled elsewhere; unknown directives are non-directive.
+  return pp_handle_non_directive(tok);
+}
+
+static PPToken *pp_handle_if_section(PPGroupParser *p, PPToken *tok) {
+  // Parse:
+  //   if-group (elif-group)* (else-group)? endif-line
+  // We do not evaluate expressions, so we also do not emit any controlled text.
+  // Evaluating #if waits for function-like macros, and is then to go through
+  // the parser's constant folding (docs/lexer_and_parser.md, section 3.3).
+  PPSrcLoc started_at = tok->spelling;
+
+  if (!(pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
+        pp_directive_is(tok, "ifndef")))
+    pp_die_tok(tok, "internal error: expected #if/#ifdef/#ifndef");
+
+  // if-line
+  tok = pp_skip_to_line_end(tok);
+  // pp_handle_if_section is syntax-only for now, so we don't expand or emit
+  // anything in controlled regions.
+  PPGroupParser sub = *p;
+  sub.emit_text = false;
+  sub.stop_on_endif_like = true;
+  sub.checkpoint = false;
+  tok = pp_parse_group(&sub, tok);
+
+  // elif-groupsopt
+  for (;;) {
+    if (!tok || tok->kind == PPTOK_EOF)
+      break;
+    if (!pp_directive_is(tok, "elif"))
+      break;
+    tok = pp_skip_to_line_end(tok);
+    tok = pp_parse_group(&sub, tok);
+  }
+
+  // else-groupopt
+  if (tok && pp_directive_is(tok, "else")) {
+    tok = pp_skip_to_line_end(tok);
+    tok = pp_parse_group(&sub, tok);
+  }
+
+  // endif-line
+  if (!tok || tok->kind == PPTOK_EOF) {
+    DIE("%s:%d:%d: unterminated #if (missing #endif)", started_at.path,
+        started_at.line_no, started_at.col_no);
+  }
+
+  if (!pp_directive_is(tok, "endif"))
+    pp_die_tok(tok, "expected #endif");
+  tok = pp_skip_to_line_end(tok);
+
+  return tok;
+}
+
+// Handle the group-part at `tok` and return the token after it.
+static PPToken *pp_parse_group_part(PPGroupParser *p, PPToken *tok) {
+  if (!pp_is_directive_start(tok))
+    return pp_handle_text_line(p, tok);
+
+  if (pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
+      pp_directive_is(tok, "ifndef"))
+    return pp_handle_if_section(p, tok);
+
+  if (pp_is_endif_like(tok)) {
+    // These should have been caught by stop_on_endif_like.
+    pp_die_tok(tok, "stray conditional directive");
+  }
+
+  return pp_handle_control_line(p, tok);
+}
+
+static PPToken *pp_parse_group(PPGroupParser *p, PPToken *tok) {
+  // Parse groupopt/group: a sequence of group-part.
+  // When stop_on_endif_like is true, we stop before a line that begins with
+  // #elif/#else/#endif (so the enclosing if-section parser can consume it).
+  while (tok && tok->kind != PPTOK_EOF) {
+    if (p->checkpoint)
+      pp_session_checkpoint(p->ctx->log, tok, *p->out_cur);
+
+    if (p->stop_on_endif_like && pp_is_directive_start(tok)) {
+      if (pp_is_endif_like(tok))
+        return tok;
+    }
+
+    tok = pp_parse_group_part(p, tok);
+  }
+  return tok;
+}
+
+// Streaming preprocessor: the pull end of the preprocess -> lex -> parse
+// pipeline. Rather than building the unit's whole output, a PPStream runs the
+// group parser one text line at a time, when its consumer has used up the
+// previous one, so an expanded token is created shortly before it is
+// consumed and output memory is bounded by the longest expanded line.
+// Included files are entered by pushing a frame instead of recursing, so the
+// stream can stop anywhere; if-sections and other directives run at once,
+// as they emit nothing.
+//
+// The main file can be streamed as well (pp_stream_init_file): it is then
+// tokenized a group part at a time, a bounded window ahead of the parser so
+// that its #includes are still prefetched early, and parts are freed once
+// run. Headers stay tokenized whole, as sources shared by the unit.
+
+#define PP_STREAM_LOOKAHEAD 4096 // main-file tokens kept tokenized ahead
+
+typedef struct {
+  PPToken *tok;        // next group-part of the file
+  const char *path;    // included file (NULL for the main file)
+  double trace_start;  // for its "include" trace event
+} PPStreamFrame;
+
+typedef struct {
+  PPContext ctx;
+  PPGroupParser p; // appends expanded lines to `head`
+  PPToken head;    // expanded tokens not pulled yet
+  PPToken *tail;
+  PPStreamFrame *frames;
+  int nframes, frames_cap;
+  bool done; // EOF has been queued
+
+  // Streamed main file (pp_stream_init_file): its tokenized parts not run
+  // yet are ahead.next...ahead_last, `nahead` tokens in all.
+  bool lazy;
+  PPTokenizer tz;
+  PPToken ahead;
+  PPToken *ahead_last;
+  unsigned nahead;
+  bool at_eof; // the main file's EOF has been tokenized
+} PPStream;
+
+static void pp_stream_push(PPStream *s, PPToken *tok, const char *path) {
+  if (s->nframes == s->frames_cap) {
+    s->frames_cap = s->frames_cap ? s->frames_cap * 2 : 16;
+    s->frames = realloc(s->frames, (size_t)s->frames_cap * sizeof(*s->frames));
+    if (!s->frames)
+      die_oom("growing include stack");
+  }
+  s->frames[s->nframes++] = (PPStreamFrame){
+      .tok = tok,
+      .path = path,
+      .trace_start = path && trace_enabled() ? trace_clock() : 0,
+  };
+  if (tu_cost)
+    cost_file_push(path ? path : tok->spelling.path);
+}
+
+static void pp_stream_start(PPStream *s, PPFileSet *files) {
+  *s = (PPStream){.ctx = {.files = files}};
+  s->tail = &s->head;
+  s->p = (PPGroupParser){
+      .ctx = &s->ctx,
+      .out_cur = &s->tail,
+      .emit_text = true,
+  };
+}
+
+// Start streaming the tokenized file `in`. Files it #includes are added to
+// `files`, which must outlive every token pulled.
+static void pp_stream_init(PPStream *s, PPToken *in, PPFileSet *files) {
+  pp_stream_start(s, files);
+  pp_prefetch_includes(files, in, in->spelling.path);
+  pp_stream_push(s, in, NULL);
+}
+
+// Tokenize the main file's next group part (a line, or a whole if-section)
+// onto the window and queue its #includes.
+static void pp_stream_read_part(PPStream *s) {
+  PPToken *before = s->ahead_last;
+  int depth = 0;
+  do {
+    PPToken *line = s->ahead_last;
+    const char *nl = strchr(s->tz.cur, '\n');
+    s->nahead += pp_tokenize_until(&s->tz, nl ? nl + 1 : NULL, &s->ahead_last);
+    PPToken *tok = line->next;
+    if (pp_is_directive_start(tok)) {
+      if (pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
+          pp_directive_is(tok, "ifndef"))
+        depth++;
+      else if (pp_directive_is(tok, "endif") && depth > 0)
+        depth--;
+    }
+    s->at_eof = s->ahead_last->kind == PPTOK_EOF;
+  } while (depth > 0 && !s->at_eof);
+  pp_prefetch_includes(s->ctx.files, before->next, s->tz.file->path);
+}
+
+// Free the main file's tokens before `next`, the part it runs next, and
+// top up the window.
+static void pp_stream_advance(PPStream *s, PPToken *next) {
+  while (s->ahead.next != next) {
+    PPToken *tok = s->ahead.next;
+    s->ahead.next = tok->next;
+    pp_free_tok(tok);
+    s->nahead--;
+  }
+  if (!next)
+    s->ahead_last = &s->ahead;
+  while (s->nahead < PP_STREAM_LOOKAHEAD && !s->at_eof)
+    pp_stream_read_part(s);
+}
+
+// Start streaming `file`, tokenizing it as the stream goes (see above).
+static void pp_stream_init_file(PPStream *s, PPFile *file, PPFileSet *files) {
+  pp_stream_start(s, files);
+  s->lazy = true;
+  pp_tokenizer_init(&s->tz, file);
+  s->ahead_last = &s->ahead;
+  pp_stream_advance(s, NULL);
+  pp_stream_push(s, s->ahead.next, NULL);
+}
+
+// Run group-parts until one emits tokens or the unit ends.
+static void pp_stream_fill(PPStream *s) {
+  while (!s->head.next && !s->done) {
+    PPStreamFrame *f = &s->frames[s->nframes - 1];
+    if (s->lazy && s->nframes == 1) {
+      pp_stream_advance(s, f->tok);
+      f->tok = s->ahead.next;
+    }
+    PPToken *tok = f->tok;
+    if (!tok)
+      pp_die_tok(tok, "internal error: expected EOF after preprocessing-file");
+
+    if (tok->kind == PPTOK_EOF) {
+      if (tu_cost)
+        cost_file_pop();
+      if (f->path && trace_enabled())
+        trace_complete("include", f->path, f->trace_start, trace_clock(),
+                       NULL, NULL, NULL, NULL);
+      if (--s->nframes > 0) {
+        s->ctx.include_depth--;
+        continue;
+      }
+      pp_fileset_stop(s->ctx.files);
+      pp_list_append(&s->tail, pp_clone_tok(tok));
+      s->done = true;
+      break;
+    }
+
+    if (pp_is_directive_start(tok) && pp_directive_is(tok, "include")) {
+      f->tok = pp_skip_to_line_end(tok);
+      PPSource *src = pp_include_source(&s->p, tok);
+      if (src) {
+        s->ctx.include_depth++;
+        pp_stream_push(s, src->tokens, src->path);
+      }
+      continue;
+    }
+    f->tok = pp_parse_group_part(&s->p, tok);
+  }
+}
+
+// The next preprocessed token, owned by the caller; EOF comes last.
+static PPToken *pp_stream_next(PPStream *s) {
+  if (!s->head.next) {
+    pp_stream_fill(s);
+    if (!s->head.next)
+      return NULL;
+  }
+  PPToken *tok = s->head.next;
+  s->head.next = tok->next;
+  if (!s->head.next)
+    s->tail = &s->head;
+  tok->next = NULL;
+  return tok;
+}
+
+// Like preprocess() always has, this keeps the macro table: the origins of
+// pulled tokens point at its interned names.
+static void pp_stream_free(PPStream *s) {
+  free_pptokens(s->head.next);
+  free_pptokens(s->ahead.next);
+  free(s->frames);
+}
+
+// Preprocess the tokenized file `in`, or else `file`, tokenizing it on the
+// way, into one list (-E). Files it #includes are added to `files`, which
+// must outlive the returned list.
+static PPToken *preprocess(PPToken *in, PPFile *file, PPFileSet *files) {
+  PPStream s;
+  if (in)
+    pp_stream_init(&s, in, files);
+  else
+    pp_stream_init_file(&s, file, files);
+  PPToken head = {};
+  PPToken *cur = &head;
+  while (!s.done) {
+    pp_stream_fill(&s);
+    cur->next = s.head.next;
+    cur = s.tail;
+    s.head.next = NULL;
+    s.tail = &s.head;
+  }
+  pp_stream_free(&s);
+  return head.next;
+}
+
+// Incremental preprocessing sessions (editor integration).
+//
+// A PPSession keeps one translation unit resident: the tokens of its main file
+// and of every header it reached, the macro table and the preprocessed output.
+// While it runs, the top-level parser checkpoints every group part of the main
+// file (a text line, a control line or a whole if-section): where the part
+// starts, the output so far, and the length of the macro undo log, to which
+// each #define/#undef appends the binding it replaced. Rolling back to a
+// checkpoint restores exactly the PPContext the part first ran with.
+//
+// An edit re-normalizes the edited file and compares it with its previous
+// text. Only the lines from the first to the last changed byte are tokenized
+// again, into a patch buffer; the tokens after them are kept with their
+// positions shifted, unless the edit opened or closed a block comment around
+// them. Preprocessing then resumes from the first affected part: for the main
+// file the last part starting before the change, for a header the first part
+// that reached it. Output and macro state before that point are reused.
+//
+// Tokens, output and macro bodies keep pointing into superseded buffers, so
+// those are retained until a file's patches outgrow its text; then the file is
+// tokenized afresh and preprocessing restarts from its first part.
+
+typedef struct PPPatch PPPatch;
+struct PPPatch {
+  PPPatch *next;
+  char *buf; // MEM_FILE allocation that tokens may point into
+  size_t cap;
+};
+
+typedef struct {
+  PPSource *src; // src->file.contents is the current normalized text
+  char *raw;     // current text as edited, before normalization
+  size_t raw_len;
+  bool text_in_use; // tokens point into src->file.contents
+  bool stale;       // raw holds edits not tokenized yet (they had an error)
+  PPPatch *patches;
+  size_t patch_bytes;
+  unsigned next_id;
+} PPSessionFile;
+
+typedef struct {
+  PPSource main;
+  PPFileSet files;
+  PPContext ctx;
+  PPSessionLog log;
+  PPToken out_head; // the output is out_head.next
+  int rerun_from;   // first part to preprocess again, -1 when up to date
+  PPSessionFile *edited;
+  int nedited, edited_cap;
+  PPPatch *retired; // buffers to free once the next run has rolled back
+} PPSession;
+
+static void pp_patch_push(PPPatch **list, char *buf, size_t cap) {
+  PPPatch *pt = malloc(sizeof(*pt));
+  if (!pt)
+    die_oom("recording session buffer");
+  *pt = (PPPatch){.next = *list, .buf = buf, .cap = cap};
+  *list = pt;
+}
+
+static void pp_patch_free(PPPatch *pt) {
+  while (pt) {
+    PPPatch *next = pt->next;
+    mem_free(MEM_FILE, pt->buf, pt->cap);
+    free(pt);
+    pt = next;
+  }
+}
+
+static unsigned pp_count_tokens(PPToken *tok) {
+  unsigned n = 0;
+  for (; tok; tok = tok->next)
+    n++;
+  return n;
+}
+
+static PPSession *pp_session_open(const char *path) {
+  PPSession *s = calloc(1, sizeof(*s));
+  if (!s)
+    die_oom("allocating session");
+  s->main.path = xstrdup(path);
+  s->main.file = pp_read_file(path);
+  s->main.tokens = tokenlize(&s->main.file);
+  s->main.state = PP_SOURCE_READY;
+  pp_fileset_init(&s->files);
+  s->files.warm = false; // edits patch the sources in place
+  s->ctx = (PPContext){.files = &s->files, .log = &s->log};
+  s->rerun_from = 0;
+  pp_prefetch_includes(&s->files, s->main.tokens, path);
+  return s;
+}
+
+// Undo macro table changes until the undo log is `nundo` entries long.
+static void pp_session_rollback(PPContext *ctx, size_t nundo) {
+  PPSessionLog *log = ctx->log;
+  if (log->nundo == nundo)
+    return;
+  while (log->nundo > nundo) {
+    PPMacroUndo *u = &log->undo[--log->nundo];
+    PPMacro *cur = pp_hash_get2(&ctx->macros, u->name, u->len);
+    if (cur) {
+      pp_hash_delete2(&ctx->macros, u->name, u->len);
+      pp_macro_free(cur);
+    }
+    if (u->old)
+      pp_hash_put2(&ctx->macros, u->old->name, u->len, u->old);
+    pp_macro_changed(ctx, u->name);
+  }
+}
+
+// Preprocess again from part `rerun_from` on.
+static void pp_session_run(PPSession *s) {
+  int k = s->rerun_from;
+  PPSessionLog *log = &s->log;
+  PPToken *start = s->main.tokens;
+  PPToken *out = &s->out_head;
+  size_t nundo = 0;
+  if (k > 0) {
+    start = log->cps[k].in;
+    out = log->cps[k].out;
+    nundo = log->cps[k].nundo;
+  }
+
+  free_pptokens(out->next);
+  out->next = NULL;
+  pp_session_rollback(&s->ctx, nundo);
+  for (PPSource *src = s->files.head; src; src = src->next)
+    if (src->entered_at > k)
+      src->entered_at = 0;
+  pp_patch_free(s->retired); // nothing from before `k` points into these
+  s->retired = NULL;
+  STAT_ADD(STAT_SESSION_PARTS_REUSED, k);
+  log->ncps = k;
+
+  PPGroupParser p = {
+      .ctx = &s->ctx,
+      .out_cur = &out,
+      .emit_text = true,
+      .stop_on_endif_like = false,
+      .checkpoint = true,
+  };
+  PPToken *tok = pp_parse_group(&p, start);
+  if (!tok || tok->kind != PPTOK_EOF)
+    pp_die_tok(tok, "internal error: expected EOF after preprocessing-file");
+  out->next = pp_clone_tok(tok);
+  STAT_ADD(STAT_SESSION_PARTS_RERUN, log->ncps - k);
+  s->rerun_from = -1;
+  pp_fileset_stop(&s->files);
+}
+
+
+static PPSessionFile *pp_session_file(PPSession *s, const char *path) {
+  for (int i = 0; i < s->nedited; i++)
+    if (!strcmp(s->edited[i].src->path, path))
+      return &s->edited[i];
+
+  PPSource *src = NULL;
+  if (!strcmp(path, s->main.path)) {
+    src = &s->main;
+  } else {
+    mtx_lock(&s->files.mu);
+    src = pp_fileset_find(&s->files, path, pp_fnv_hash((char *)path,
+                                                       (int)strlen(path)));
+    mtx_unlock(&s->files.mu);
+    if (!src || src->state != PP_SOURCE_READY)
+      return NULL; // not part of this unit (yet): nothing to update
+    if (src->shared)
+      DIE("%s: bundled headers cannot be edited", path);
+  }
+
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    DIE("cannot open file: %s", path);
+  char *raw = NULL;
+  size_t raw_len = 0;
+  FILE *mem = open_memstream(&raw, &raw_len);
+  if (!mem)
+    die_oom("reading file");
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    fwrite(buf, 1, n, mem);
+  fclose(fp);
+  fclose(mem);
+
+  if (s->nedited == s->edited_cap) {
+    s->edited_cap = s->edited_cap ? s->edited_cap * 2 : 4;
+    s->edited = realloc(s->edited, (size_t)s->edited_cap * sizeof(*s->edited));
+    if (!s->edited)
+      die_oom("tracking edited files");
+  }
+  s->edited[s->nedited] = (PPSessionFile){
+      .src = src,
+      .raw = raw,
+      .raw_len = raw_len,
+      .text_in_use = true,
+      .next_id = pp_count_tokens(src->tokens) + 1,
+  };
+  return &s->edited[s->nedited++];
+}
+
+// The part to resume from after the main file changed at line start `l`:
+// the last one that starts before it, among the parts that are still valid.
+static int pp_session_part_before(PPSession *s, long l) {
+  PPSessionLog *log = &s->log;
+  int lo = 0, hi = s->rerun_from >= 0 ? s->rerun_from : log->ncps;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (log->cps[mid].offset < l)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? lo - 1 : 0;
+}
+
+static void pp_session_rerun_from(PPSession *s, int k) {
+  if (s->rerun_from < 0 || k < s->rerun_from)
+    s->rerun_from = k;
+}
+
+// Make `text` (a MEM_FILE buffer of `cap` bytes) the current text of `sf`.
+// The previous one stays alive if tokens point into it.
+static void pp_session_set_text(PPSessionFile *sf, char *text, size_t cap) {
+  PPFile *f = &sf->src->file;
+  if (sf->text_in_use) {
+    pp_patch_push(&sf->patches, f->contents, f->contents_cap);
+    sf->patch_bytes += f->contents_cap;
+  } else {
+    mem_free(MEM_FILE, f->contents, f->contents_cap);
+  }
+  f->contents = text;
+  f->contents_cap = cap;
+  sf->text_in_use = false;
+}
+
+// Tokenize `sf` afresh from `text`, once its patches have grown too large.
+static void pp_session_reload(PPSession *s, PPSessionFile *sf, char *text,
+                              size_t cap) {
+  PPSource *src = sf->src;
+  PPFile f = {.path = src->file.path, .contents = text};
+  PPToken *tokens = tokenlize(&f);
+  pp_session_set_text(sf, text, cap);
+  free_pptokens(src->tokens);
+  src->tokens = tokens;
+  if (src != &s->main)
+    src->guard = pp_detect_include_guard(tokens);
+
+  // Output and macros from the file's first part on may still point into the
+  // old buffers; they are released by the run that discards those.
+  PPPatch **tail = &sf->patches;
+  while (*tail)
+    tail = &(*tail)->next;
+  *tail = s->retired;
+  s->retired = sf->patches;
+  sf->patches = NULL;
+  sf->patch_bytes = 0;
+  sf->text_in_use = true;
+  sf->next_id = pp_count_tokens(tokens) + 1;
+
+  if (src == &s->main)
+    pp_session_rerun_from(s, 0);
+  else if (src->entered_at)
+    pp_session_rerun_from(s, src->entered_at - 1);
+}
+
+// Re-tokenize the lines of `sf` that differ from its raw text and schedule
+// the affected parts to run again. Nothing changes if this dies.
+static void pp_session_sync(PPSession *s, PPSessionFile *sf) {
+  PPSource *src = sf->src;
+  PPFile nf = pp_file_from_bytes(src->file.path, sf->raw, sf->raw_len);
+  mem_free(MEM_FILE, nf.path_buf, strlen(nf.path_buf) + 1);
+  const char *old = src->file.contents;
+  const char *new = nf.contents;
+  size_t old_len = strlen(old), new_len = strlen(new);
+
+  size_t a = 0, min_len = old_len < new_len ? old_len : new_len;
+  while (a < min_len && old[a] == new[a])
+    a++;
+  if (a == old_len && a == new_len) {
+    mem_free(MEM_FILE, nf.contents, nf.contents_cap);
+    return;
+  }
+  if (sf->patch_bytes > new_len + 65536) {
+    pp_session_reload(s, sf, nf.contents, nf.contents_cap);
+    return;
+  }
+  size_t sfx = 0;
+  while (sfx < min_len - a && old[old_len - 1 - sfx] == new[new_len - 1 - sfx])
+    sfx++;
+
+  // Changed lines: [l, q) in the new text, [l, q_old) in the old one. They
+  // end at a '\n' inside the common suffix, or run to the end of the file.
+  size_t l = a;
+  while (l > 0 && new[l - 1] != '\n')
+    l--;
+  const char *nl = sfx ? memchr(new + new_len - sfx, '\n', sfx) : NULL;
+  size_t q = nl ? (size_t)(nl - new) + 1 : new_len;
+  size_t q_old = q + old_len - new_len;
+
+  bool is_main = src == &s->main;
+  int k = is_main ? pp_session_part_before(s, (long)l) : -1;
+  int nvalid = s->rerun_from >= 0 ? s->rerun_from : s->log.ncps;
+  PPToken *before = NULL;
+  PPToken *t = src->tokens;
+  if (is_main && k < nvalid && s->log.cps[k].offset < (long)l)
+    t = s->log.cps[k].in; // still alive: the part is before every change
+  for (; l > 0 && t->kind != PPTOK_EOF; t = t->next) {
+    if (t->kind == PPTOK_NEWLINE && t->spelling.byte_offset == (long)l - 1) {
+      before = t;
+      break;
+    }
+  }
+  if (l > 0 && !before)
+    INNER_DIE("session: lost line start in %s", src->path);
+  PPToken *after = NULL;
+  if (nl) {
+    for (t = before ? before->next : src->tokens; t->kind != PPTOK_EOF;
+         t = t->next) {
+      if (t->kind == PPTOK_NEWLINE &&
+          t->spelling.byte_offset == (long)q_old - 1) {
+        after = t;
+        break;
+      }
+    }
+    if (!after)
+      INNER_DIE("session: lost line end in %s", src->path);
+  }
+
+  PPCommentMode mode =
+      before && before->in_comment ? PP_COMMENT_BLOCK : PP_COMMENT_NONE;
+  int line_no = before ? before->spelling.line_no + 1 : 1;
+  char *patch;
+  size_t patch_cap;
+  PPToken head = {};
+  PPToken *tail;
+  PPTokenizer tz;
+  for (;;) {
+    size_t n = (after ? q : new_len) - l;
+    patch_cap = n + 1 + PP_FILE_PADDING;
+    patch = mem_calloc(MEM_FILE, 1, patch_cap);
+    if (!patch)
+      die_oom("re-tokenizing edited lines");
+    memcpy(patch, new + l, n);
+    PPFile pf = {.path = src->file.path, .contents = patch};
+    pp_tokenizer_init(&tz, &pf);
+    tz.line_no = line_no;
+    tz.comment_mode = mode;
+    tz.next_tok_id = sf->next_id;
+    head.next = NULL;
+    tail = &head;
+    pp_tokenize_until(&tz, after ? patch + n : NULL, &tail);
+    if (!after || tz.comment_mode == (after->in_comment ? PP_COMMENT_BLOCK
+                                                        : PP_COMMENT_NONE))
+      break;
+    // A comment now starts or ends elsewhere: the rest must be split anew.
+    free_pptokens(head.next);
+    mem_free(MEM_FILE, patch, patch_cap);
+    after = NULL;
+  }
+  sf->next_id = tz.next_tok_id;
+  STAT_ADD(STAT_SESSION_LINES, tz.line_no - line_no);
+  for (t = head.next; t; t = t->next)
+    t->spelling.byte_offset += (long)l;
+
+  // Splice the new tokens in and shift the ones after them.
+  PPToken *first = before ? before->next : src->tokens;
+  PPToken *rest = NULL;
+  if (after) {
+    rest = after->next;
+    after->next = NULL;
+    int dline = tz.line_no - (after->spelling.line_no + 1);
+    long dbyte = (long)q - (long)q_old;
+    for (t = rest; t; t = t->next) {
+      t->spelling.line_no += dline;
+      t->spelling.byte_offset += dbyte;
+    }
+  }
+  free_pptokens(first);
+  tail->next = rest;
+  if (before)
+    before->next = head.next;
+  else
+    src->tokens = head.next;
+  pp_session_set_text(sf, nf.contents, nf.contents_cap);
+  pp_patch_push(&sf->patches, patch, patch_cap);
+  sf->patch_bytes += patch_cap;
+
+  if (is_main) {
+    pp_session_rerun_from(s, k);
+  } else {
+    src->guard = pp_detect_include_guard(src->tokens);
+    if (src->entered_at)
+      pp_session_rerun_from(s, src->entered_at - 1);
+  }
+}
+
+static void pp_session_sync(PPSession *s, PPSessionFile *sf);
+
+// Bring the session's output up to date. Returns NULL after reporting an
+// error; the session stays usable, and a later edit can fix the error.
+static PPToken *pp_session_output(PPSession *s) {
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    s->ctx.building = NULL;
+    return NULL;
+  }
+  for (int i = 0; i < s->nedited; i++) {
+    if (s->edited[i].stale) {
+      pp_session_sync(s, &s->edited[i]);
+      s->edited[i].stale = false;
+    }
+  }
+  if (s->rerun_from >= 0)
+    pp_session_run(s);
+  fatal_jmp = saved;
+  return s->out_head.next;
+}
+
+// Replace `removed` bytes at `offset` in `path` (the main file, or a header
+// by the path #include resolved it to) with `len` bytes of `text`. Offsets
+// are in the file as the editor sees it, before line splicing. Returns false
+// after reporting an error; edits to files the unit does not use are ignored.
+static bool pp_session_edit(PPSession *s, const char *path, size_t offset,
+                            size_t removed, const char *text, size_t len) {
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    return false;
+  }
+
+  PPSessionFile *sf = pp_session_file(s, path);
+  if (sf) {
+    if (offset > sf->raw_len || removed > sf->raw_len - offset)
+      DIE("%s: edit at %zu+%zu is outside the file (%zu bytes)", path, offset,
+          removed, sf->raw_len);
+    size_t n = sf->raw_len - removed + len;
+    char *raw = malloc(n + 1);
+    if (!raw)
+      die_oom("applying edit");
+    memcpy(raw, sf->raw, offset);
+    memcpy(raw + offset, text, len);
+    memcpy(raw + offset + len, sf->raw + offset + removed,
+           sf->raw_len - offset - removed);
+    free(sf->raw);
+    sf->raw = raw;
+    sf->raw_len = n;
+    STAT_INC(STAT_SESSION_EDITS);
+    // If this fails (e.g. an unterminated comment), the tokens keep matching
+    // the previous text; the file is synced again before the next output.
+    sf->stale = true;
+    pp_session_sync(s, sf);
+    sf->stale = false;
+  }
+  fatal_jmp = saved;
+  return true;
+}
+
+static void pp_session_close(PPSession *s) {
+  free_pptokens(s->out_head.next);
+  pp_session_rollback(&s->ctx, 0);
+  mem_free(MEM_HASHMAP, s->ctx.macros.buckets,
+           (size_t)s->ctx.macros.capacity * sizeof(PPHashEntry));
+  for (int i = 0; i < s->ctx.names.capacity; i++) {
+    PPHashEntry *ent = &s->ctx.names.buckets[i];
+    if (ent->key && ent->key != (char *)PP_TOMBSTONE)
+      mem_free(MEM_MACRO, pp_name_of(ent->key),
+               sizeof(PPName) + (size_t)ent->keylen + 1);
+  }
+  mem_free(MEM_HASHMAP, s->ctx.names.buckets,
+           (size_t)s->ctx.names.capacity * sizeof(PPHashEntry));
+  for (int i = 0; i < s->nedited; i++) {
+    free(s->edited[i].raw);
+    pp_patch_free(s->edited[i].patches);
+  }
+  pp_patch_free(s->retired);
+  free(s->edited);
+  free(s->log.cps);
+  free(s->log.undo);
+  pp_fileset_free(&s->files);
+  free_pptokens(s->main.tokens);
+  pp_free_file(&s->main.file);
+  free(s->main.path);
+  free(s);
+}
+
+// Print a preprocessed token stream as -E text.
+static void pp_print_tokens(FILE *out, PPToken *tok) {
+  for (; tok; tok = tok->next) {
+    if (tok->kind == PPTOK_NEWLINE) {
+      fputc('\n', out);
+    } else {
+      if (tok->has_space)
+        fputc(' ', out);
+      fwrite(tok->loc, 1, (size_t)tok->len, out);
+    }
+  }
+}
+
+// Binary preprocessed-token stream (--emit-pptok, *.pptok inputs).
+//
+// With --emit-pptok, -E writes the preprocessed token list in a compact binary
+// form instead of text. A *.pptok input is loaded straight back into a token
+// list, skipping reading, tokenizing and preprocessing the source, so builds
+// can preprocess on one machine and compile on another without re-tokenizing
+// -E text.
+//
+// Layout; u is an unsigned LEB128 varint, s a zigzag-encoded signed one:
+//   "PPTOK" u8 version u8 flags     flags: PPTOK_F_ORIGINS
+//   token*                          up to and including a PPTOK_EOF token
+// token:
+//   u8  kind | at_bol << 3 | has_space << 4 | has_origin << 5
+//   str spelling, loc spelling location
+//   [u nframes, then per frame: str macro name, loc expanded_at,
+//    loc defined_at]                                   if has_origin
+// str: u ref. 0 introduces a new string (u len, bytes, NUL) that takes the
+//   next index; any other ref is 1 + the index of an earlier string. Token
+//   texts, paths and macro names share the table, so each is stored once,
+//   and the NUL lets a loaded stream point into the file buffer directly.
+// loc: u column, 0 for an unknown location (nothing follows); otherwise
+//   str path, s line delta from the previous known loc. Byte offsets are not
+//   kept.
+
+#define PPTOK_MAGIC "PPTOK"
+enum { PPTOK_VERSION = 1, PPTOK_F_ORIGINS = 1 };
+
+typedef struct {
+  FILE *out;
+  PPHashMap strings; // text -> 1 + index
+  uintptr_t nstrings;
+  int line; // line of the previous known loc
+} PPTokWriter;
+
+static void pptok_put_u(PPTokWriter *w, uint64_t v) {
+  while (v >= 0x80) {
+    fputc((int)(v & 0x7f) | 0x80, w->out);
+    v >>= 7;
+  }
+  fputc((int)v, w->out);
+}
+
+static void pptok_put_s(PPTokWriter *w, int64_t v) {
+  pptok_put_u(w, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static void pptok_put_str(PPTokWriter *w, const char *p, int len) {
+  uintptr_t ref = (uintptr_t)pp_hash_get2(&w->strings, (char *)p, len);
+  if (ref) {
+    pptok_put_u(w, ref);
+    return;
+  }
+  pp_hash_put2(&w->strings, (char *)p, len, (void *)++w->nstrings);
+  pptok_put_u(w, 0);
+  pptok_put_u(w, (uint64_t)len);
+  fwrite(p, 1, (size_t)len, w->out);
+  fputc('\0', w->out);
+}
+
+static void pptok_put_loc(PPTokWriter *w, PPSrcLoc loc) {
+  if (!pp_srcloc_is_valid(loc)) {
+    pptok_put_u(w, 0);
+    return;
+  }
+  pptok_put_u(w, (uint64_t)loc.col_no);
+  pptok_put_str(w, loc.path, (int)strlen(loc.path));
+  pptok_put_s(w, (int64_t)loc.line_no - w->line);
+  w->line = loc.line_no;
+}
+
+static void pp_write_pptok(FILE *out, PPToken *tok, bool origins) {
+  PPTokWriter w = {.out = out};
+  fputs(PPTOK_MAGIC, out);
+  fputc(PPTOK_VERSION, out);
+  fputc(origins ? PPTOK_F_ORIGINS : 0, out);
+
+  for (; tok; tok = tok->next) {
+    bool has_origin = origins && tok->origin;
+    fputc((int)tok->kind | tok->at_bol << 3 | tok->has_space << 4 |
+              has_origin << 5,
+          out);
+    pptok_put_str(&w, tok->loc, tok->len);
+    pptok_put_loc(&w, tok->spelling);
+    if (has_origin) {
+      uint64_t n = 0;
+      for (PPOrigin *o = tok->origin; o; o = o->parent)
+        n++;
+      pptok_put_u(&w, n);
+      for (PPOrigin *o = tok->origin; o; o = o->parent) {
+        pptok_put_str(&w, o->macro_name, (int)strlen(o->macro_name));
+        pptok_put_loc(&w, o->expanded_at);
+        pptok_put_loc(&w, o->defined_at);
+      }
+    }
+    if (tok->kind == PPTOK_EOF)
+      break;
+  }
+  mem_free(MEM_HASHMAP, w.strings.buckets,
+           (size_t)w.strings.capacity * sizeof(PPHashEntry));
+}
+
+typedef struct {
+  const char *path; // for diagnostics
+  char *buf;
+  size_t pos, size;
+  const char **strings; // index -> NUL-terminated text inside buf
+  size_t nstrings, cap;
+  int line;
+} PPTokReader;
+
+static _Noreturn void pptok_corrupt(PPTokReader *r) {
+  DIE("%s: corrupt token stream at byte %zu", r->path, r->pos);
+}
+
+static uint64_t pptok_get_u(PPTokReader *r) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->pos >= r->size)
+      pptok_corrupt(r);
+    unsigned char c = (unsigned char)r->buf[r->pos++];
+    v |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return v;
+  }
+  pptok_corrupt(r);
+}
+
+static int64_t pptok_get_s(PPTokReader *r) {
+  uint64_t v = pptok_get_u(r);
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static const char *pptok_get_str(PPTokReader *r, int *len) {
+  uint64_t ref = pptok_get_u(r);
+  if (ref) {
+    if (ref > r->nstrings)
+      pptok_corrupt(r);
+    const char *p = r->strings[ref - 1];
+    if (len)
+      *len = (int)strlen(p);
+    return p;
+  }
+  uint64_t n = pptok_get_u(r);
+  if (n > INT_MAX || n >= r->size - r->pos || r->buf[r->pos + n] != '\0')
+    pptok_corrupt(r);
+  const char *p = r->buf + r->pos;
+  r->pos += n + 1;
+  if (r->nstrings == r->cap) {
+    r->cap = r->cap ? r->cap * 2 : 256;
+    r->strings = realloc(r->strings, r->cap * sizeof(*r->strings));
+    if (!r->strings)
+      die_oom("reading token stream");
+  }
+  r->strings[r->nstrings++] = p;
+  if (len)
+    *len = (int)n;
+  return p;
+}
+
+static PPSrcLoc pptok_get_loc(PPTokReader *r) {
+  PPSrcLoc loc = {.byte_offset = -1};
+  uint64_t col = pptok_get_u(r);
+  if (col == 0)
+    return loc;
+  loc.col_no = (int)col;
+  loc.path = pptok_get_str(r, NULL);
+  loc.line_no = r->line += (int)pptok_get_s(r);
+  return loc;
+}
+
+// Load a stream written by pp_write_pptok(). `file` receives the raw bytes,
+// which the returned tokens' text and paths point into.
+static PPToken *pp_read_pptok(const char *path, PPFile *file) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    DIE("cannot open %s: %s", path, strerror(errno));
+  struct stat st;
+  if (fstat(fileno(fp), &st) != 0)
+    DIE("cannot stat %s: %s", path, strerror(errno));
+  size_t size = (size_t)st.st_size;
+  char *buf = mem_malloc(MEM_FILE, size + 1);
+  if (!buf)
+    die_oom("reading token stream");
+  if (fread(buf, 1, size, fp) != size)
+    DIE("cannot read %s", path);
+  fclose(fp);
+  buf[size] = '\0';
+  *file = (PPFile){.path = path, .contents = buf, .contents_cap = size + 1};
+
+  PPTokReader r = {.path = path, .buf = buf, .size = size};
+  size_t magic = strlen(PPTOK_MAGIC);
+  if (size < magic + 2 || memcmp(buf, PPTOK_MAGIC, magic))
+    DIE("%s: not a token stream", path);
+  if (buf[magic] != PPTOK_VERSION)
+    DIE("%s: unsupported token stream version %d", path, buf[magic]);
+  r.pos = magic + 2;
+
+  PPToken head = {};
+  PPToken *cur = &head;
+  unsigned id = 1;
+  for (;;) {
+    if (r.pos >= r.size)
+      pptok_corrupt(&r);
+    unsigned char bits = (unsigned char)buf[r.pos++];
+    if ((bits & 7) > PPTOK_OTHER)
+      pptok_corrupt(&r);
+    PPToken *tok = mem_malloc(MEM_TOKEN, sizeof(*tok));
+    if (!tok)
+      die_oom("allocating preprocessing token");
+    *tok = (PPToken){
+        .kind = (PPTokenKind)(bits & 7),
+        .id = id++,
+        .at_bol = bits >> 3 & 1,
+        .has_space = bits >> 4 & 1,
+        .mem_tag = MEM_TOKEN,
+    };
+    tok->loc = pptok_get_str(&r, &tok->len);
+    tok->spelling = pptok_get_loc(&r);
+    if (bits >> 5 & 1) {
+      uint64_t n = pptok_get_u(&r);
+      PPOrigin **tail = &tok->origin;
+      for (uint64_t i = 0; i < n; i++) {
+        const char *name = pptok_get_str(&r, NULL);
+        PPSrcLoc expanded_at = pptok_get_loc(&r);
+        PPSrcLoc defined_at = pptok_get_loc(&r);
+        *tail = pp_origin_new(name, expanded_at, defined_at, NULL);
+        tail = &(*tail)->parent;
+      }
+    }
+    cur = cur->next = tok;
+    if (tok->kind == PPTOK_EOF)
+      break;
+  }
+  free(r.strings);
+  STAT_ADD(STAT_TOKENS, id - 1);
+  return head.next;
+}
+
+// Write the -E result in the format selected by --emit-pptok.
+static void pp_emit_tokens(FILE *out, PPToken *tok) {
+  if (opt.emit_pptok)
+    pp_write_pptok(out, tok, opt.pptok_origins);
+  else
+    pp_print_tokens(out, tok);
+}
+
+/* section: compilation cache */
+
+// Content-addressed result cache (--cache-dir).
+//
+// Entries are keyed by a 128-bit hash of everything that can change a result:
+// the normalized translation unit text, the option fields that reach the
+// preprocessor (-D/-I), the output mode and the compiler build. The unit's
+// headers are only known after preprocessing, so each entry starts with the
+// files it included and a hash of their normalized contents; a hit requires
+// them all to be unchanged and every #include to still resolve to the same
+// file, and then skips tokenizing and preprocessing altogether. A miss after
+// a header edit is overwritten by the new result.
+//
+// Insertion writes a private temp file and rename()s it into place, so
+// concurrent compilers sharing a directory never observe partial entries.
+// Hits bump the entry's mtime; stores evict least recently used entries once
+// the directory grows past --cache-size.
+
+typedef struct {
+  uint64_t lo;
+  uint64_t hi;
+} Hash128;
+
+// Streaming two-lane hash (murmur3 x64_128 style mixing over 8-byte words).
+typedef struct {
+  uint64_t a;
+  uint64_t b;
+  uint64_t total;
+  unsigned char tail[8];
+  int tail_len;
+} Hasher128;
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void hash128_init(Hasher128 *h) {
+  *h = (Hasher128){.a = 0x9e3779b97f4a7c15ULL, .b = 0xc2b2ae3d27d4eb4fULL};
+}
+
+static void hash128_word(Hasher128 *h, uint64_t w) {
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+  h->a ^= rotl64(w * c1, 31) * c2;
+  h->a = rotl64(h->a, 27) + h->b;
+  h->a = h->a * 5 + 0x52dce729;
+
+  h->b ^= rotl64(w * c2, 33) * c1;
+  h->b = rotl64(h->b, 31) + h->a;
+  h->b = h->b * 5 + 0x38495ab5;
+}
+
+static void hash128_update(Hasher128 *h, const void *data, size_t n) {
+  const unsigned char *p = data;
+  h->total += n;
+
+  while (n && h->tail_len) {
+    h->tail[h->tail_len++] = *p++;
+    n--;
+    if (h->tail_len == 8) {
+      uint64_t w;
+      memcpy(&w, h->tail, 8);
+      hash128_word(h, w);
+      h->tail_len = 0;
+    }
+  }
+
+  for (; n >= 8; p += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    hash128_word(h, w);
+  }
+
+  memcpy(h->tail, p, n);
+  h->tail_len = (int)n;
+}
+
+// Length-prefixed, so consecutive fields cannot run into each other.
+static void hash128_str(Hasher128 *h, const char *s) {
+  uint64_t n = s ? strlen(s) : 0;
+  hash128_update(h, &n, sizeof(n));
+  hash128_update(h, s, (size_t)n);
+}
+
+static Hash128 hash128_final(Hasher128 *h) {
+  if (h->tail_len) {
+    memset(h->tail + h->tail_len, 0, (size_t)(8 - h->tail_len));
+    uint64_t w;
+    memcpy(&w, h->tail, 8);
+    hash128_word(h, w);
+  }
+  uint64_t a = h->a ^ h->total;
+  uint64_t b = h->b ^ h->total;
+  a += b;
+  b += a;
+  a = fmix64(a);
+  b = fmix64(b);
+  a += b;
+  b += a;
+  return (Hash128){.lo = a, .hi = b};
+}
+
+static Hash128 cache_key(const Options *opt, const PPFile *file) {
+  Hasher128 h;
+  hash128_init(&h);
+  hash128_str(&h, "feipiaocc-cache-v3 " __DATE__ " " __TIME__);
+  hash128_str(&h, opt->opt_E ? "-E" : opt->opt_S ? "-S" : opt->opt_c ? "-c"
+                                                                      : "");
+  hash128_str(&h, !opt->emit_pptok      ? "text"
+                  : opt->pptok_origins ? "pptok+origins"
+                                       : "pptok");
+
+  uint64_t n = (uint64_t)opt->defines.len;
+  hash128_update(&h, &n, sizeof(n));
+  for (int i = 0; i < opt->defines.len; i++)
+    hash128_str(&h, opt->defines.data[i]);
+
+  n = (uint64_t)opt->include_paths.len;
+  hash128_update(&h, &n, sizeof(n));
+  for (int i = 0; i < opt->include_paths.len; i++)
+    hash128_str(&h, opt->include_paths.data[i]);
+
+  // Bundle members are not listed as dependencies; the archive's identity
+  // stands in for them (embedded headers are covered by the build stamp).
+  n = (uint64_t)opt->header_bundles.len;
+  hash128_update(&h, &n, sizeof(n));
+  for (int i = 0; i < opt->header_bundles.len; i++) {
+    struct stat st = {};
+    (void)stat(opt->header_bundles.data[i], &st);
+    hash128_str(&h, opt->header_bundles.data[i]);
+    uint64_t id[4] = {(uint64_t)st.st_dev, (uint64_t)st.st_ino,
+                      (uint64_t)st.st_size,
+                      (uint64_t)st.st_mtim.tv_sec * 1000000000u +
+                          (uint64_t)st.st_mtim.tv_nsec};
+    hash128_update(&h, id, sizeof(id));
+  }
+
+  hash128_str(&h, file->contents);
+  return hash128_final(&h);
+}
+
+static Hash128 cache_content_hash(const char *contents) {
+  Hasher128 h;
+  hash128_init(&h);
+  hash128_str(&h, contents);
+  return hash128_final(&h);
+}
+
+// Entry header:
+//   deps <n>
+//   <32 hex digits of cache_content_hash> <path>    (n lines; "bundled"
+//                                                    instead of the hash for
+//                                                    embedded/bundle headers)
+//   includes <m>
+//   <dep> <includer> <q|a> <name>                   (m lines)
+// An include line says that #include "name" (q) or <name> (a) in dep line
+// <includer> (0: the main file) resolved to dep line <dep>. Checking the
+// resolution again catches headers that appeared earlier on the search path.
+static void cache_write_deps(FILE *fp, PPFileSet *files) {
+  int n = 0, m = 0;
+  for (PPSource *src = files->head; src; src = src->next) {
+    src->dep_id = src->included ? ++n : 0;
+    for (PPIncludeUse *u = src->uses; u; u = u->next)
+      m++;
+  }
+  fprintf(fp, "deps %d\n", n);
+  for (PPSource *src = files->head; src; src = src->next) {
+    if (!src->included)
+      continue;
+    if (src->bundled) {
+      fprintf(fp, "%-32s %s\n", "bundled", src->path);
+      continue;
+    }
+    Hash128 h = cache_content_hash(src->file.contents);
+    fprintf(fp, "%016llx%016llx %s\n", (unsigned long long)h.hi,
+            (unsigned long long)h.lo, src->path);
+  }
+  fprintf(fp, "includes %d\n", m);
+  for (PPSource *src = files->head; src; src = src->next)
+    for (PPIncludeUse *u = src->uses; u; u = u->next)
+      fprintf(fp, "%d %d %c %s\n", src->dep_id,
+              u->includer ? u->includer->dep_id : 0, u->angled ? 'a' : 'q',
+              u->name);
+}
+
+static bool cache_dep_valid(char *line, ssize_t len) {
+  if (len < 35 || line[32] != ' ' || line[len - 1] != '\n')
+    return false;
+  line[len - 1] = '\0';
+  const char *path = line + 33;
+  if (!strncmp(line, "bundled ", 8))
+    return pp_vfs_find(path) != NULL;
+  unsigned long long hi, lo;
+  if (sscanf(line, "%16llx%16llx", &hi, &lo) != 2 ||
+      !pp_is_regular_file(path) || access(path, R_OK) != 0)
+    return false;
+  PPFile f = pp_read_file(path);
+  Hash128 h = cache_content_hash(f.contents);
+  pp_free_file(&f);
+  return h.hi == hi && h.lo == lo;
+}
+
+// Reads the entry header from `fp`, leaving it at the result text. `main` is
+// the path of the unit's main file.
+static bool cache_deps_valid(FILE *fp, const char *main) {
+  char *line = NULL;
+  size_t cap = 0;
+  int n = -1, m = -1;
+  bool ok = getline(&line, &cap, fp) > 0 && sscanf(line, "deps %d", &n) == 1 &&
+            n >= 0;
+  char **paths = ok ? calloc((size_t)n + 1, sizeof(*paths)) : NULL;
+  ok = ok && paths;
+  if (ok)
+    paths[0] = xstrdup(main);
+  for (int i = 1; ok && i <= n; i++) {
+    ssize_t len = getline(&line, &cap, fp);
+    ok = cache_dep_valid(line, len);
+    if (ok)
+      paths[i] = xstrdup(line + 33);
+  }
+  ok = ok && getline(&line, &cap, fp) > 0 &&
+       sscanf(line, "includes %d", &m) == 1;
+  for (int i = 0; ok && i < m; i++) {
+    ssize_t len = getline(&line, &cap, fp);
+    int dep, includer, at = 0;
+    char kind;
+    ok = len > 0 && line[len - 1] == '\n' &&
+         sscanf(line, "%d %d %c %n", &dep, &includer, &kind, &at) == 3 &&
+         at > 0 && dep >= 1 && dep <= n && includer >= 0 && includer <= n &&
+         (kind == 'a' || kind == 'q');
+    if (!ok)
+      break;
+    line[len - 1] = '\0';
+    char *path = pp_search_include(line + at, kind == 'a', paths[includer]);
+    ok = path && !strcmp(path, paths[dep]);
+    free(path);
+  }
+  if (paths)
+    for (int i = 0; i <= n; i++)
+      free(paths[i]);
+  free(paths);
+  free(line);
+  return ok;
+}
+
+static void cache_skip_deps(FILE *fp) {
+  char *line = NULL;
+  size_t cap = 0;
+  int n = 0;
+  for (int k = 0; k < 2; k++) { // the deps lines, then the includes lines
+    if (getline(&line, &cap, fp) <= 0 ||
+        sscanf(line, k ? "includes %d" : "deps %d", &n) != 1)
+      break;
+    for (int i = 0; i < n && getline(&line, &cap, fp) > 0; i++)
+      ;
+  }
+  free(line);
+}
+
+static char *cache_entry_path(const char *dir, Hash128 key) {
+  size_t n = strlen(dir) + 1 + 32 + 1;
+  char *path = malloc(n);
+  if (!path)
+    die_oom("building cache entry path");
+  snprintf(path, n, "%s/%016llx%016llx", dir, (unsigned long long)key.hi,
+           (unsigned long long)key.lo);
+  return path;
+}
+
+static bool cache_is_entry_name(const char *name) {
+  if (strlen(name) != 32)
+    return false;
+  for (const char *p = name; *p; p++)
+    if (!isxdigit((unsigned char)*p))
+      return false;
+  return true;
+}
+
+static void cache_copy_stream(FILE *in, FILE *out) {
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    fwrite(buf, 1, n, out);
+}
+
+// On a hit, copies the cached result to `out` and returns true.
+static bool cache_fetch(const char *dir, Hash128 key, const char *main,
+                        FILE *out) {
+  char *path = cache_entry_path(dir, key);
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    free(path);
+    return false;
+  }
+  if (!cache_deps_valid(fp, main)) {
+    fclose(fp);
+    free(path);
+    return false;
+  }
+
+  // Refresh the LRU position. Failure only makes the entry look older.
+  (void)utimensat(AT_FDCWD, path, NULL, 0);
+  cache_copy_stream(fp, out);
+  fclose(fp);
+  free(path);
+  return true;
+}
+
+typedef struct {
+  char *path;
+  long long size;
+  struct timespec mtime;
+} CacheEntryInfo;
+
+static int cache_entry_cmp_mtime(const void *a, const void *b) {
+  const CacheEntryInfo *x = a;
+  const CacheEntryInfo *y = b;
+  if (x->mtime.tv_sec != y->mtime.tv_sec)
+    return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+  if (x->mtime.tv_nsec != y->mtime.tv_nsec)
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+static void cache_evict(const char *dir, long long max_size) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  CacheEntryInfo *ents = NULL;
+  int len = 0;
+  int cap = 0;
+  long long total = 0;
+
+  for (struct dirent *de; (de = readdir(d));) {
+    // Temp files belong to in-flight stores; never evict those.
+    if (!cache_is_entry_name(de->d_name))
+      continue;
+
+    size_t n = strlen(dir) + 1 + strlen(de->d_name) + 1;
+    char *path = malloc(n);
+    if (!path)
+      die_oom("building cache entry path");
+    snprintf(path, n, "%s/%s", dir, de->d_name);
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+      free(path);
+      continue;
+    }
+
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      ents = realloc(ents, (size_t)cap * sizeof(*ents));
+      if (!ents)
+        die_oom("growing cache entry list");
+    }
+    ents[len++] = (CacheEntryInfo){
+        .path = path, .size = (long long)st.st_size, .mtime = st.st_mtim};
+    total += (long long)st.st_size;
+  }
+  closedir(d);
+
+  if (total > max_size) {
+    qsort(ents, (size_t)len, sizeof(*ents), cache_entry_cmp_mtime);
+    for (int i = 0; i < len && total > max_size; i++) {
+      // Another compiler may have evicted it already; that still frees space.
+      if (unlink(ents[i].path) == 0 || errno == ENOENT)
+        total -= ents[i].size;
+    }
+  }
+
+  for (int i = 0; i < len; i++)
+    free(ents[i].path);
+  free(ents);
+}
+
+// Opens a private temp file in `dir` for a new entry, or returns NULL if the
+// cache directory is unusable (the caller then just skips caching).
+static FILE *cache_store_begin(const char *dir, char **tmp_path_out) {
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+    return NULL;
+
+  size_t n = strlen(dir) + sizeof("/tmp.XXXXXX");
+  char *tmp_path = malloc(n);
+  if (!tmp_path)
+    die_oom("building cache temp path");
+  snprintf(tmp_path, n, "%s/tmp.XXXXXX", dir);
+
+  int fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    free(tmp_path);
+    return NULL;
+  }
+  FILE *fp = fdopen(fd, "w+b");
+  if (!fp) {
+    close(fd);
+    unlink(tmp_path);
+    free(tmp_path);
+    return NULL;
+  }
+  *tmp_path_out = tmp_path;
+  return fp;
+}
+
+// Publishes the temp file as the entry for `key`, then copies the result to
+// `out`. The copy reads through the still-open handle, so a concurrent
+// eviction of the fresh entry cannot lose the output.
+static void cache_store_commit(const char *dir, Hash128 key,
+                               long long max_size, FILE *tmp, char *tmp_path,
+                               FILE *out) {
+  bool ok = fflush(tmp) == 0 && !ferror(tmp);
+  char *path = cache_entry_path(dir, key);
+  if (!ok || rename(tmp_path, path) != 0)
+    unlink(tmp_path);
+
+  rewind(tmp);
+  cache_skip_deps(tmp);
+  cache_copy_stream(tmp, out);
+  fclose(tmp);
+  free(path);
+  free(tmp_path);
+
+  if (ok)
+    cache_evict(dir, max_size);
+}
+
+/* section: arena allocation */
+
+// Bump allocation for data that lives as long as a unit and is freed all at
+// once. Requests too big for a chunk get a chunk of their own, of exactly
+// their size.
+
+#define ARENA_CHUNK_SIZE (64 << 10)
+
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size; // of data[]
+  _Alignas(16) char data[];
+};
+
+typedef struct {
+  ArenaChunk *chunks;
+  char *cur, *end; // free space in chunks (the newest small chunk)
+  MemTag tag;
+} Arena;
+
+static void *arena_alloc(Arena *a, size_t size, size_t align) {
+  char *p = (char *)(((uintptr_t)a->cur + align - 1) & ~(uintptr_t)(align - 1));
+  if (a->cur && p <= a->end && size <= (size_t)(a->end - p)) {
+    a->cur = p + size;
+    return p;
+  }
+
+  bool own = size > ARENA_CHUNK_SIZE / 4;
+  size_t cap = own ? size : ARENA_CHUNK_SIZE;
+  ArenaChunk *c = mem_malloc(a->tag, sizeof(*c) + cap);
+  if (!c)
+    die_oom("growing arena");
+  c->size = cap;
+  if (own && a->chunks) {
+    // Keep allocating from the current chunk.
+    c->next = a->chunks->next;
+    a->chunks->next = c;
+    return c->data;
+  }
+  c->next = a->chunks;
+  a->chunks = c;
+  if (own) {
+    a->cur = a->end = c->data + cap;
+    return c->data;
+  }
+  a->cur = c->data + size;
+  a->end = c->data + cap;
+  return c->data;
+}
+
+static void arena_free(Arena *a) {
+  while (a->chunks) {
+    ArenaChunk *next = a->chunks->next;
+    mem_free(a->tag, a->chunks, sizeof(*a->chunks) + a->chunks->size);
+    a->chunks = next;
+  }
+  a->cur = a->end = NULL;
+}
+
+/* section: lexical analysis */
+
+// Lexer: preprocessed PPTokens -> Tokens (C11 6.4, see
+// docs/lexer_and_parser.md). Every token is classified here once, so the
+// parser never compares spellings: identifiers are looked up in a perfect
+// hash of the keywords, punctuators (digraphs included) map to a Punct, and
+// pp-numbers and character constants are converted to typed values. A Token
+// takes over its PPToken's origin chain, for diagnostics with a macro
+// backtrace. String literals keep their spelling.
+
+typedef enum {
+  TK_IDENT,
+  TK_KEYWORD,
+  TK_PUNCT,
+  TK_NUM, // integer, floating or character constant
+  TK_STR,
+  TK_EOF,
+} TokenKind;
+
+#define KEYWORDS(X)                                                            \
+  X(AUTO, "auto")                                                              \
+  X(BREAK, "break")                                                            \
+  X(CASE, "case")                                                              \
+  X(CHAR, "char")                                                              \
+  X(CONST, "const")                                                            \
+  X(CONTINUE, "continue")                                                      \
+  X(DEFAULT, "default")                                                        \
+  X(DO, "do")                                                                  \
+  X(DOUBLE, "double")                                                          \
+  X(ELSE, "else")                                                              \
+  X(ENUM, "enum")                                                              \
+  X(EXTERN, "extern")                                                          \
+  X(FLOAT, "float")                                                            \
+  X(FOR, "for")                                                                \
+  X(GOTO, "goto")                                                              \
+  X(IF, "if")                                                                  \
+  X(INLINE, "inline")                                                          \
+  X(INT, "int")                                                                \
+  X(LONG, "long")                                                              \
+  X(REGISTER, "register")                                                      \
+  X(RESTRICT, "restrict")                                                      \
+  X(RETURN, "return")                                                          \
+  X(SHORT, "short")                                                            \
+  X(SIGNED, "signed")                                                          \
+  X(SIZEOF, "sizeof")                                                          \
+  X(STATIC, "static")                                                          \
+  X(STRUCT, "struct")                                                          \
+  X(SWITCH, "switch")                                                          \
+  X(TYPEDEF, "typedef")                                                        \
+  X(UNION, "union")                                                            \
+  X(UNSIGNED, "unsigned")                                                      \
+  X(VOID, "void")                                                              \
+  X(VOLATILE, "volatile")                                                      \
+  X(WHILE, "while")                                                            \
+  X(ALIGNAS, "_Alignas")                                                       \
+  X(ALIGNOF, "_Alignof")                                                       \
+  X(ATOMIC, "_Atomic")                                                         \
+  X(BOOL, "_Bool")                                                             \
+  X(COMPLEX, "_Complex")                                                       \
+  X(GENERIC, "_Generic")                                                       \
+  X(IMAGINARY, "_Imaginary")                                                   \
+  X(NORETURN, "_Noreturn")                                                     \
+  X(STATIC_ASSERT, "_Static_assert")                                           \
+  X(THREAD_LOCAL, "_Thread_local")
+
+typedef enum {
+#define LEX_KW_ENUM(name, str) KW_##name,
+  KEYWORDS(LEX_KW_ENUM)
+#undef LEX_KW_ENUM
+  KW_COUNT,
+} Keyword;
+
+static const char *const keyword_names[] = {
+#define LEX_KW_NAME(name, str) str,
+    KEYWORDS(LEX_KW_NAME)
+#undef LEX_KW_NAME
+};
+
+#define PUNCTUATORS(X)                                                         \
+  X(LBRACKET, "[")                                                             \
+  X(RBRACKET, "]")                                                             \
+  X(LPAREN, "(")                                                               \
+  X(RPAREN, ")")                                                               \
+  X(LBRACE, "{")                                                               \
+  X(RBRACE, "}")                                                               \
+  X(DOT, ".")                                                                  \
+  X(ARROW, "->")                                                               \
+  X(INC, "++")                                                                 \
+  X(DEC, "--")                                                                 \
+  X(AMP, "&")                                                                  \
+  X(STAR, "*")                                                                 \
+  X(PLUS, "+")                                                                 \
+  X(MINUS, "-")                                                                \
+  X(TILDE, "~")                                                                \
+  X(NOT, "!")                                                                  \
+  X(SLASH, "/")                                                                \
+  X(PERCENT, "%")                                                              \
+  X(SHL, "<<")                                                                 \
+  X(SHR, ">>")                                                                 \
+  X(LT, "<")                                                                   \
+  X(GT, ">")                                                                   \
+  X(LE, "<=")                                                                  \
+  X(GE, ">=")                                                                  \
+  X(EQ, "==")                                                                  \
+  X(NE, "!=")                                                                  \
+  X(XOR, "^")                                                                  \
+  X(OR, "|")                                                                   \
+  X(LOGAND, "&&")                                                              \
+  X(LOGOR, "||")                                                               \
+  X(QUESTION, "?")                                                             \
+  X(COLON, ":")                                                                \
+  X(SEMI, ";")                                                                 \
+  X(ELLIPSIS, "...")                                                           \
+  X(ASSIGN, "=")                                                               \
+  X(MUL_ASSIGN, "*=")                                                          \
+  X(DIV_ASSIGN, "/=")                                                          \
+  X(MOD_ASSIGN, "%=")                                                          \
+  X(ADD_ASSIGN, "+=")                                                          \
+  X(SUB_ASSIGN, "-=")                                                          \
+  X(SHL_ASSIGN, "<<=")                                                         \
+  X(SHR_ASSIGN, ">>=")                                                         \
+  X(AND_ASSIGN, "&=")                                                          \
+  X(XOR_ASSIGN, "^=")                                                          \
+  X(OR_ASSIGN, "|=")                                                           \
+  X(COMMA, ",")                                                                \
+  X(HASH, "#")                                                                 \
+  X(HASHHASH, "##")
+
+typedef enum {
+#define LEX_PUNCT_ENUM(name, str) P_##name,
+  PUNCTUATORS(LEX_PUNCT_ENUM)
+#undef LEX_PUNCT_ENUM
+  P_COUNT,
+} Punct;
+
+static const char *const punct_names[] = {
+#define LEX_PUNCT_NAME(name, str) str,
+    PUNCTUATORS(LEX_PUNCT_NAME)
+#undef LEX_PUNCT_NAME
+};
+
+// Type of a TK_NUM (LP64: long and long long are 64 bits).
+typedef enum {
+  NUM_INT,
+  NUM_UINT,
+  NUM_LONG,
+  NUM_ULONG,
+  NUM_LLONG,
+  NUM_ULLONG,
+  NUM_USHORT, // u'x' (char16_t)
+  NUM_FLOAT,
+  NUM_DOUBLE,
+  NUM_LDOUBLE,
+} NumType;
+
+// Element type of a TK_STR.
+typedef enum {
+  STR_CHAR,  // "..." (char)
+  STR_UTF8,  // u8"..." (char)
+  STR_UTF16, // u"..." (char16_t)
+  STR_UTF32, // U"..." (char32_t)
+  STR_WIDE,  // L"..." (wchar_t, 32 bits)
+} StrEnc;
+
+typedef struct Token Token;
+struct Token {
+  TokenKind kind;
+  union {
+    Keyword kw;       // TK_KEYWORD
+    Punct punct;      // TK_PUNCT
+    NumType num_type; // TK_NUM
+    StrEnc str_enc;   // TK_STR
+  };
+  union {
+    uint64_t ival;    // integer TK_NUM, as the bits of its type
+    long double fval; // floating TK_NUM
+    struct {          // TK_STR, after concatenation (translation phase 6)
+      const char *str; // str_len elements, in host byte order
+      int64_t str_len; // not counting the terminating null, which may be
+                       // missing: an undecoded literal points into its file
+    };
+  };
+  const char *loc; // spelling, as preprocessed
+  int len;
+  bool at_bol;
+  bool has_space;
+  PPSrcLoc spelling;
+  PPOrigin *origin; // macro expansion backtrace (owned)
+  uint32_t src; // its AST location once the parser has recorded one; the AST
+                // then owns `origin`
+  uint32_t ident; // TK_IDENT: its name once the parser has interned it
+  Token *next;
+};
+
+static bool num_is_float(NumType t) { return t >= NUM_FLOAT; }
+
+static const char *num_type_name(NumType t) {
+  switch (t) {
+  case NUM_INT:
+    return "int";
+  case NUM_UINT:
+    return "unsigned int";
+  case NUM_LONG:
+    return "long";
+  case NUM_ULONG:
+    return "unsigned long";
+  case NUM_LLONG:
+    return "long long";
+  case NUM_ULLONG:
+    return "unsigned long long";
+  case NUM_USHORT:
+    return "unsigned short";
+  case NUM_FLOAT:
+    return "float";
+  case NUM_DOUBLE:
+    return "double";
+  case NUM_LDOUBLE:
+    return "long double";
+  }
+  return "unknown";
+}
+
+// Print the expansions from the outermost inwards (the chain links outwards).
+static void lex_fprint_origins(FILE *out, const PPOrigin *o) {
+  if (!o)
+    return;
+  lex_fprint_origins(out, o->parent);
+  fprintf(out, "note: ");
+  pp_fprint_srcloc(out, o->expanded_at);
+  fprintf(out, ": expanded from macro '%s'\n", o->macro_name);
+}
+
+// Report an error at a token spelled at `spelling` through the expansions
+// `origin`: where the user's code has it (the outermost macro call it came
+// from, if any), then the expansions it went through.
+static _Noreturn void verror_at(PPSrcLoc spelling, const PPOrigin *origin,
+                                const char *fmt, va_list ap) {
+  FILE *out = diag_stream();
+  PPSrcLoc at = spelling;
+  for (const PPOrigin *o = origin; o; o = o->parent)
+    at = o->expanded_at;
+  fprintf(out, "error: ");
+  pp_fprint_srcloc(out, at);
+  fprintf(out, ": ");
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+  fprintf(out, "\n");
+  if (origin) {
+    lex_fprint_origins(out, origin);
+    fprintf(out, "note: ");
+    pp_fprint_srcloc(out, spelling);
+    fprintf(out, ": spelled here\n");
+  }
+  fatal_exit();
+}
+
+static _Noreturn void error_tok(const Token *tok, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  verror_at(tok->spelling, tok->origin, fmt, ap);
+}
+
+// Keywords by perfect hash: slot (len * 31 + s[1] * 3 + s[len - 1] * 29 +
+// s[0]) % 128 holds 1 + the only keyword that can hash there. The constants
+// were searched for offline so that C11's keywords never collide.
+static const unsigned char lex_keyword_slots[128] = {
+    [1] = KW_CHAR + 1, [2] = KW_DO + 1, [3] = KW_REGISTER + 1,
+    [4] = KW_ENUM + 1, [11] = KW_UNSIGNED + 1, [16] = KW_DEFAULT + 1,
+    [19] = KW_VOID + 1, [22] = KW_ELSE + 1, [25] = KW_CONTINUE + 1,
+    [33] = KW_ALIGNAS + 1, [37] = KW_IMAGINARY + 1, [40] = KW_ALIGNOF + 1,
+    [42] = KW_THREAD_LOCAL + 1, [44] = KW_VOLATILE + 1, [45] = KW_STRUCT + 1,
+    [46] = KW_STATIC_ASSERT + 1, [50] = KW_ATOMIC + 1, [52] = KW_INT + 1,
+    [56] = KW_COMPLEX + 1, [59] = KW_WHILE + 1, [60] = KW_SIGNED + 1,
+    [61] = KW_RESTRICT + 1, [64] = KW_STATIC + 1, [67] = KW_GOTO + 1,
+    [70] = KW_TYPEDEF + 1, [79] = KW_AUTO + 1, [80] = KW_UNION + 1,
+    [81] = KW_RETURN + 1, [86] = KW_NORETURN + 1, [90] = KW_SWITCH + 1,
+    [92] = KW_DOUBLE + 1, [94] = KW_INLINE + 1, [96] = KW_LONG + 1,
+    [99] = KW_GENERIC + 1, [103] = KW_IF + 1, [105] = KW_FLOAT + 1,
+    [106] = KW_SHORT + 1, [111] = KW_CONST + 1, [114] = KW_BREAK + 1,
+    [115] = KW_CASE + 1, [118] = KW_SIZEOF + 1, [122] = KW_FOR + 1,
+    [124] = KW_BOOL + 1, [125] = KW_EXTERN + 1,
+};
+
+static bool lex_keyword(const char *p, int len, Keyword *kw) {
+  if (len < 2 || len > 14)
+    return false;
+  unsigned h = ((unsigned)len * 31 + (unsigned char)p[1] * 3u +
+                (unsigned char)p[len - 1] * 29u + (unsigned char)p[0]) %
+               128;
+  int slot = lex_keyword_slots[h];
+  if (!slot)
+    return false;
+  const char *name = keyword_names[slot - 1];
+  if (strncmp(name, p, (size_t)len) || name[len])
+    return false;
+  *kw = (Keyword)(slot - 1);
+  return true;
+}
+
+#define LEX_PK(a, b, c, d)                                                     \
+  ((uint32_t)(unsigned char)(a) | (uint32_t)(unsigned char)(b) << 8 |          \
+   (uint32_t)(unsigned char)(c) << 16 | (uint32_t)(unsigned char)(d) << 24)
+
+static bool lex_punct(const char *p, int len, Punct *out) {
+  if (len < 1 || len > 4)
+    return false;
+  uint32_t key = 0;
+  for (int i = 0; i < len; i++)
+    key |= (uint32_t)(unsigned char)p[i] << (8 * i);
+  Punct pu;
+  switch (key) {
+  case LEX_PK('[', 0, 0, 0):
+  case LEX_PK('<', ':', 0, 0):
+    pu = P_LBRACKET;
+    break;
+  case LEX_PK(']', 0, 0, 0):
+  case LEX_PK(':', '>', 0, 0):
+    pu = P_RBRACKET;
+    break;
+  case LEX_PK('(', 0, 0, 0):
+    pu = P_LPAREN;
+    break;
+  case LEX_PK(')', 0, 0, 0):
+    pu = P_RPAREN;
+    break;
+  case LEX_PK('{', 0, 0, 0):
+  case LEX_PK('<', '%', 0, 0):
+    pu = P_LBRACE;
+    break;
+  case LEX_PK('}', 0, 0, 0):
+  case LEX_PK('%', '>', 0, 0):
+    pu = P_RBRACE;
+    break;
+  case LEX_PK('.', 0, 0, 0):
+    pu = P_DOT;
+    break;
+  case LEX_PK('-', '>', 0, 0):
+    pu = P_ARROW;
+    break;
+  case LEX_PK('+', '+', 0, 0):
+    pu = P_INC;
+    break;
+  case LEX_PK('-', '-', 0, 0):
+    pu = P_DEC;
+    break;
+  case LEX_PK('&', 0, 0, 0):
+    pu = P_AMP;
+    break;
+  case LEX_PK('*', 0, 0, 0):
+    pu = P_STAR;
+    break;
+  case LEX_PK('+', 0, 0, 0):
+    pu = P_PLUS;
+    break;
+  case LEX_PK('-', 0, 0, 0):
+    pu = P_MINUS;
+    break;
+  case LEX_PK('~', 0, 0, 0):
+    pu = P_TILDE;
+    break;
+  case LEX_PK('!', 0, 0, 0):
+    pu = P_NOT;
+    break;
+  case LEX_PK('/', 0, 0, 0):
+    pu = P_SLASH;
+    break;
+  case LEX_PK('%', 0, 0, 0):
+    pu = P_PERCENT;
+    break;
+  case LEX_PK('<', '<', 0, 0):
+    pu = P_SHL;
+    break;
+  case LEX_PK('>', '>', 0, 0):
+    pu = P_SHR;
+    break;
+  case LEX_PK('<', 0, 0, 0):
+    pu = P_LT;
+    break;
+  case LEX_PK('>', 0, 0, 0):
+    pu = P_GT;
+    break;
+  case LEX_PK('<', '=', 0, 0):
+    pu = P_LE;
+    break;
+  case LEX_PK('>', '=', 0, 0):
+    pu = P_GE;
+    break;
+  case LEX_PK('=', '=', 0, 0):
+    pu = P_EQ;
+    break;
+  case LEX_PK('!', '=', 0, 0):
+    pu = P_NE;
+    break;
+  case LEX_PK('^', 0, 0, 0):
+    pu = P_XOR;
+    break;
+  case LEX_PK('|', 0, 0, 0):
+    pu = P_OR;
+    break;
+  case LEX_PK('&', '&', 0, 0):
+    pu = P_LOGAND;
+    break;
+  case LEX_PK('|', '|', 0, 0):
+    pu = P_LOGOR;
+    break;
+  case LEX_PK('?', 0, 0, 0):
+    pu = P_QUESTION;
+    break;
+  case LEX_PK(':', 0, 0, 0):
+    pu = P_COLON;
+    break;
+  case LEX_PK(';', 0, 0, 0):
+    pu = P_SEMI;
+    break;
+  case LEX_PK('.', '.', '.', 0):
+    pu = P_ELLIPSIS;
+    break;
+  case LEX_PK('=', 0, 0, 0):
+    pu = P_ASSIGN;
+    break;
+  case LEX_PK('*', '=', 0, 0):
+    pu = P_MUL_ASSIGN;
+    break;
+  case LEX_PK('/', '=', 0, 0):
+    pu = P_DIV_ASSIGN;
+    break;
+  case LEX_PK('%', '=', 0, 0):
+    pu = P_MOD_ASSIGN;
+    break;
+  case LEX_PK('+', '=', 0, 0):
+    pu = P_ADD_ASSIGN;
+    break;
+  case LEX_PK('-', '=', 0, 0):
+    pu = P_SUB_ASSIGN;
+    break;
+  case LEX_PK('<', '<', '=', 0):
+    pu = P_SHL_ASSIGN;
+    break;
+  case LEX_PK('>', '>', '=', 0):
+    pu = P_SHR_ASSIGN;
+    break;
+  case LEX_PK('&', '=', 0, 0):
+    pu = P_AND_ASSIGN;
+    break;
+  case LEX_PK('^', '=', 0, 0):
+    pu = P_XOR_ASSIGN;
+    break;
+  case LEX_PK('|', '=', 0, 0):
+    pu = P_OR_ASSIGN;
+    break;
+  case LEX_PK(',', 0, 0, 0):
+    pu = P_COMMA;
+    break;
+  case LEX_PK('#', 0, 0, 0):
+  case LEX_PK('%', ':', 0, 0):
+    pu = P_HASH;
+    break;
+  case LEX_PK('#', '#', 0, 0):
+  case LEX_PK('%', ':', '%', ':'):
+    pu = P_HASHHASH;
+    break;
+  default:
+    return false;
+  }
+  *out = pu;
+  return true;
+}
+
+// Decimal digits are read eight at a time where the spelling has eight in a
+// row (SWAR, on little-endian hosts): one unaligned load, one check that all
+// eight bytes are '0'..'9', and three multiplies to combine them.
+static bool lex_is_8_digits(uint64_t v) {
+  return ((v & 0xF0F0F0F0F0F0F0F0u) |
+          (((v + 0x0606060606060606u) & 0xF0F0F0F0F0F0F0F0u) >> 4)) ==
+         0x3333333333333333u;
+}
+
+static uint64_t lex_8_digits(uint64_t v) {
+  v = (v & 0x0F0F0F0F0F0F0F0Fu) * 2561 >> 8;
+  v = (v & 0x00FF00FF00FF00FFu) * 6553601 >> 16;
+  return (v & 0x0000FFFF0000FFFFu) * 42949672960001u >> 32;
+}
+
+// Read the decimal digits at the start of p[0, len) into `*val`. Returns how
+// many there were; `*overflow` is set if the value needs more than 64 bits.
+static int lex_decimal_digits(const char *p, int len, uint64_t *val,
+                              bool *overflow) {
+  uint64_t v = 0;
+  int i = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (i + 8 <= len) {
+    uint64_t chunk;
+    memcpy(&chunk, p + i, 8);
+    if (!lex_is_8_digits(chunk))
+      break;
+    uint64_t d = lex_8_digits(chunk);
+    if (v > (UINT64_MAX - d) / 100000000u)
+      *overflow = true;
+    v = v * 100000000u + d;
+    i += 8;
+  }
+#endif
+  for (; i < len && pp_is_digit((unsigned char)p[i]); i++) {
+    unsigned d = (unsigned)(p[i] - '0');
+    if (v > (UINT64_MAX - d) / 10)
+      *overflow = true;
+    v = v * 10 + d;
+  }
+  *val = v;
+  return i;
+}
+
+static int lex_digit_value(int c) {
+  if ((unsigned)(c - '0') < 10)
+    return c - '0';
+  if ((unsigned)((c | 0x20) - 'a') < 6)
+    return (c | 0x20) - 'a' + 10;
+  return 99;
+}
+
+// C11 6.4.4.1: the value and type of an integer constant.
+static void lex_integer(Token *tok, const char *p, int len) {
+  int base = 10, i = 0;
+  if (len > 2 && p[0] == '0' && (p[1] | 0x20) == 'x' &&
+      lex_digit_value((unsigned char)p[2]) < 16) {
+    base = 16;
+    i = 2;
+  } else if (len > 2 && p[0] == '0' && (p[1] | 0x20) == 'b' &&
+             (p[2] == '0' || p[2] == '1')) {
+    base = 2; // GNU extension
+    i = 2;
+  } else if (p[0] == '0') {
+    base = 8;
+  }
+
+  uint64_t val = 0;
+  bool overflow = false;
+  if (base == 10) {
+    i = lex_decimal_digits(p, len, &val, &overflow);
+  } else {
+    for (; i < len; i++) {
+      int d = lex_digit_value((unsigned char)p[i]);
+      if (d >= base)
+        break;
+      if (val > (UINT64_MAX - (unsigned)d) / (unsigned)base)
+        overflow = true;
+      val = val * (unsigned)base + (unsigned)d;
+    }
+  }
+
+  // Suffix: u and l/ll (same case) in either order.
+  bool u = false;
+  int l = 0;
+  for (int n = 0; n < 2 && i < len; n++) {
+    if ((p[i] | 0x20) == 'u' && !u) {
+      u = true;
+      i++;
+    } else if ((p[i] == 'l' || p[i] == 'L') && !l) {
+      l = i + 1 < len && p[i + 1] == p[i] ? 2 : 1;
+      i += l;
+    }
+  }
+  if (i != len)
+    error_tok(tok, "invalid integer constant '%.*s'", len, p);
+  if (overflow)
+    error_tok(tok, "integer constant is too large");
+
+  // The first type in the constant's list (C11 6.4.4.1p5) that can represent
+  // the value; long being 64 bits, long long is only reached with ll. A
+  // decimal constant without u that is too large for every signed type has
+  // no type in its list (6.4.4.1p6) and gets unsigned long long, as in Clang.
+  bool dec = base == 10;
+  NumType t;
+  if (l == 0 && !u && val <= INT32_MAX)
+    t = NUM_INT;
+  else if (l == 0 && (u || !dec) && val <= UINT32_MAX)
+    t = NUM_UINT;
+  else if (l < 2 && !u && val <= INT64_MAX)
+    t = NUM_LONG;
+  else if (l < 2 && (u || !dec))
+    t = NUM_ULONG;
+  else if (l == 2 && !u && val <= INT64_MAX)
+    t = NUM_LLONG;
+  else
+    t = NUM_ULLONG;
+  tok->num_type = t;
+  tok->ival = val;
+}
+
+// C11 6.4.4.2. Plain decimal constants whose digits and exponent fit exactly
+// in their own type are converted with one rounding (Clinger's fast path:
+// up to 2^53 and 10^22 for double, 2^24 and 10^10 for float; going through
+// double would round a float twice). Anything else, and every long double
+// constant, goes through strtod/strtof/strtold, which round correctly.
+static void lex_floating(Token *tok, const char *p, int len) {
+  NumType t = NUM_DOUBLE;
+  int n = len;
+  if ((p[n - 1] | 0x20) == 'f') {
+    t = NUM_FLOAT;
+    n--;
+  } else if ((p[n - 1] | 0x20) == 'l') {
+    t = NUM_LDOUBLE;
+    n--;
+  }
+  tok->num_type = t;
+
+  bool hex = n > 1 && p[0] == '0' && (p[1] | 0x20) == 'x';
+  if (!hex && t != NUM_LDOUBLE) {
+    uint64_t m = 0;
+    int digits = 0, frac = 0, i = 0;
+    bool seen_dot = false, ok = true;
+    for (; i < n; i++) {
+      if (p[i] == '.' && !seen_dot) {
+        seen_dot = true;
+      } else if (pp_is_digit((unsigned char)p[i])) {
+        if (m || p[i] != '0')
+          digits++;
+        if (digits > 19) {
+          ok = false;
+          break;
+        }
+        m = m * 10 + (unsigned)(p[i] - '0');
+        frac += seen_dot;
+      } else {
+        break;
+      }
+    }
+    int exp = 0;
+    if (ok && i < n && (p[i] | 0x20) == 'e') {
+      int sign = 1, j = i + 1;
+      if (j < n && (p[j] == '+' || p[j] == '-'))
+        sign = p[j++] == '-' ? -1 : 1;
+      if (j == n)
+        ok = false;
+      for (; j < n && pp_is_digit((unsigned char)p[j]) && exp < 1000; j++)
+        exp = exp * 10 + (p[j] - '0');
+      exp *= sign;
+      i = j;
+    }
+    exp -= frac;
+    static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                   1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                   1e18, 1e19, 1e20, 1e21, 1e22};
+    static const float pow10f[] = {1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                   1e6f, 1e7f, 1e8f, 1e9f, 1e10f};
+    if (ok && i == n && t == NUM_FLOAT && m <= (1u << 24) && exp >= -10 &&
+        exp <= 10) {
+      float f = (float)m;
+      tok->fval = (float)(exp < 0 ? f / pow10f[-exp] : f * pow10f[exp]);
+      return;
+    }
+    if (ok && i == n && t == NUM_DOUBLE && m <= (1ull << 53) && exp >= -22 &&
+        exp <= 22) {
+      tok->fval = exp < 0 ? (double)m / pow10[-exp] : (double)m * pow10[exp];
+      return;
+    }
+  }
+
+  char small[64];
+  char *buf = n < (int)sizeof(small) ? small : malloc((size_t)n + 1);
+  if (!buf)
+    die_oom("converting floating constant");
+  memcpy(buf, p, (size_t)n);
+  buf[n] = '\0';
+  char *end;
+  if (t == NUM_FLOAT)
+    tok->fval = strtof(buf, &end);
+  else if (t == NUM_DOUBLE)
+    tok->fval = strtod(buf, &end);
+  else
+    tok->fval = strtold(buf, &end);
+  // strto* would also take a hexadecimal constant without its exponent.
+  bool bad = end != buf + n || (hex && !memchr(buf, 'p', (size_t)n) &&
+                                !memchr(buf, 'P', (size_t)n));
+  if (buf != small)
+    free(buf);
+  if (bad)
+    error_tok(tok, "invalid floating constant '%.*s'", len, p);
+}
+
+static void lex_number(Token *tok) {
+  const char *p = tok->loc;
+  int len = tok->len;
+  bool hex = len > 1 && p[0] == '0' && (p[1] | 0x20) == 'x';
+  bool is_float = false;
+  for (int i = 0; i < len && !is_float; i++)
+    is_float = p[i] == '.' || (!hex && (p[i] | 0x20) == 'e') ||
+               (hex && (p[i] | 0x20) == 'p');
+  if (is_float)
+    lex_floating(tok, p, len);
+  else
+    lex_integer(tok, p, len);
+}
+
+// Decode the escape sequence after the backslash at `*p`, leaving `*p` after
+// it (C11 6.4.4.4). `*ucn` (if given) tells a universal character name, which
+// names a character, from a numeric escape, which gives a code unit.
+static uint32_t lex_escape(const Token *tok, const char **p, bool *ucn) {
+  const char *q = *p + 1;
+  uint32_t c = 0;
+  if (ucn)
+    *ucn = *q == 'u' || *q == 'U';
+  if (*q >= '0' && *q <= '7') {
+    for (int n = 0; n < 3 && *q >= '0' && *q <= '7'; n++)
+      c = c * 8 + (uint32_t)(*q++ - '0');
+  } else if (*q == 'x') {
+    q++;
+    if (lex_digit_value((unsigned char)*q) >= 16)
+      error_tok(tok, "\\x used with no following hex digits");
+    for (; lex_digit_value((unsigned char)*q) < 16; q++) {
+      if (c >> 28)
+        error_tok(tok, "hex escape sequence out of range");
+      c = c << 4 | (uint32_t)lex_digit_value((unsigned char)*q);
+    }
+  } else if (*q == 'u' || *q == 'U') {
+    int n = pp_scan_ucn_len(q - 1);
+    if (!n)
+      error_tok(tok, "incomplete universal character name");
+    for (int i = 2; i < n; i++)
+      c = c << 4 | (uint32_t)lex_digit_value((unsigned char)q[i - 1]);
+    if (c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+      error_tok(tok, "\\%.*s is not a valid universal character", n - 1, q);
+    q += n - 1;
+  } else {
+    switch (*q) {
+    case 'a':
+      c = '\a';
+      break;
+    case 'b':
+      c = '\b';
+      break;
+    case 'f':
+      c = '\f';
+      break;
+    case 'n':
+      c = '\n';
+      break;
+    case 'r':
+      c = '\r';
+      break;
+    case 't':
+      c = '\t';
+      break;
+    case 'v':
+      c = '\v';
+      break;
+    case 'e': // GNU extension
+      c = 27;
+      break;
+    case '\'':
+    case '"':
+    case '?':
+    case '\\':
+      c = (unsigned char)*q;
+      break;
+    default:
+      error_tok(tok, "unknown escape sequence '\\%c'", *q);
+    }
+    q++;
+  }
+  *p = q;
+  return c;
+}
+
+// C11 6.4.4.4: a character constant's value and type. A plain one is an int
+// holding its (possibly several, GCC-style) chars; a prefixed one holds one
+// character, decoded from UTF-8 or an escape.
+static void lex_char(Token *tok) {
+  const char *p = tok->loc;
+  const char *end = tok->loc + tok->len - 1; // closing quote
+  char prefix = *p == '\'' ? 0 : *p;
+  bool u8 = p[0] == 'u' && p[1] == '8';
+  p += (prefix != 0) + u8 + 1;
+  if (p == end)
+    error_tok(tok, "empty character constant");
+
+  uint64_t val = 0;
+  if (!prefix || u8) {
+    int n = 0;
+    while (p < end) {
+      uint32_t c = *p == '\\' ? lex_escape(tok, &p, NULL) : (unsigned char)*p++;
+      if (c > 0xFF)
+        error_tok(tok, "escape sequence out of range");
+      val = val << 8 | c;
+      n++;
+    }
+    if (u8 && n > 1)
+      error_tok(tok, "character too large for a u8 character constant");
+    tok->num_type = NUM_INT;
+    // A single char is a (signed) char converted to int.
+    tok->ival = u8 || n > 1 ? (uint64_t)(int32_t)val : (uint64_t)(int8_t)val;
+    return;
+  }
+
+  uint32_t c = 0;
+  while (p < end) { // like GCC, the last character counts
+    if (*p == '\\') {
+      c = lex_escape(tok, &p, NULL);
+      continue;
+    }
+    int n = pp_decode_utf8(p, &c);
+    if (!n)
+      error_tok(tok, "invalid UTF-8 in character constant");
+    p += n;
+  }
+  if (prefix == 'u') {
+    if (c > 0xFFFF)
+      error_tok(tok, "character too large for a u character constant");
+    tok->num_type = NUM_USHORT;
+  } else {
+    tok->num_type = prefix == 'U' ? NUM_UINT : NUM_INT; // L: wchar_t is int
+  }
+  tok->ival = prefix == 'L' ? (uint64_t)(int32_t)c : c;
+}
+
+// Classify `pp` into `tok`, taking over its origin chain.
+static void lex_convert(PPToken *pp, Token *tok) {
+  *tok = (Token){
+      .loc = pp->loc,
+      .len = pp->len,
+      .at_bol = pp->at_bol,
+      .has_space = pp->has_space,
+      .spelling = pp->spelling,
+      .origin = pp->origin,
+  };
+  pp->origin = NULL;
+
+  switch (pp->kind) {
+  case PPTOK_IDENTIFIER:
+    tok->kind = lex_keyword(pp->loc, pp->len, &tok->kw) ? TK_KEYWORD : TK_IDENT;
+    return;
+  case PPTOK_PUNCTUATOR:
+    if (!lex_punct(pp->loc, pp->len, &tok->punct))
+      error_tok(tok, "invalid token '%.*s'", pp->len, pp->loc);
+    tok->kind = TK_PUNCT;
+    return;
+  case PPTOK_PP_NUMBER:
+    tok->kind = TK_NUM;
+    lex_number(tok);
+    return;
+  case PPTOK_CHARACTER_CONSTANT:
+    tok->kind = TK_NUM;
+    lex_char(tok);
+    return;
+  case PPTOK_STRING_LITERAL:
+    tok->kind = TK_STR;
+    return;
+  case PPTOK_EOF:
+    tok->kind = TK_EOF;
+    return;
+  case PPTOK_NEWLINE:
+  case PPTOK_OTHER:
+    break;
+  }
+  if ((unsigned char)pp->loc[0] >= 0x80 || pp->loc[0] == '\\')
+    error_tok(tok, "stray '\\%o' in program", (unsigned char)pp->loc[0]);
+  error_tok(tok, "stray '%.*s' in program", pp->len, pp->loc);
+}
+
+// Pulling lexer. A Lexer converts the tokens of a PPStream (or of a
+// preprocessed list) as they are asked for, into a window of at most
+// LEX_LOOKAHEAD tokens; a token leaving the window is recycled for the next
+// one unless its consumer took it over. Up to the parser, the pipeline thus
+// holds a window of main-file tokens, one expanded line and a few Tokens,
+// whatever the size of the unit; included headers are kept tokenized whole,
+// and the parser keeps the whole AST it builds.
+
+#define LEX_LOOKAHEAD 4 // a power of two
+
+typedef struct {
+  PPStream *pp;       // source of PPTokens, or else
+  PPToken *list;      // the rest of a preprocessed list (a *.pptok input)
+  const Token *saved; // copies of earlier tokens, each owning its origin,
+  int64_t nsaved;     // to read first (the last is an EOF)
+  PPToken *pending;   // pulled past the end of a string literal
+  Token *window[LEX_LOOKAHEAD]; // peek(k) is window[(pos + k) % N]
+  int pos, len;
+  Token *free;   // recycled tokens
+  Arena strings; // decoded string literals, for as long as the Lexer
+  FILE *dump;    // --lex-tokens: where each token goes as it is converted
+} Lexer;
+
+static void lex_init(Lexer *l, PPStream *pp, PPToken *list) {
+  *l = (Lexer){.pp = pp, .list = list, .strings = {.tag = MEM_STRING}};
+}
+
+// The next preprocessed token that is not a NEWLINE, or NULL past EOF.
+static PPToken *lex_next_pp(Lexer *l) {
+  for (;;) {
+    PPToken *pp = l->pending;
+    if (pp) {
+      l->pending = NULL;
+    } else if (l->pp) {
+      pp = pp_stream_next(l->pp);
+    } else if ((pp = l->list)) {
+      l->list = pp->next;
+      pp->next = NULL;
+    }
+    if (!pp || pp->kind != PPTOK_NEWLINE)
+      return pp;
+    pp_free_tok(pp);
+  }
+}
+
+// String literals (C11 6.4.5). Adjacent literals are concatenated
+// (translation phase 6) into one TK_STR whose contents are built in a single
+// pass with a single allocation: the pieces are measured first, then decoded
+// straight into a buffer of the final size in the Lexer's arena. A lone plain
+// or u8 literal without escapes is not copied at all; its contents are the
+// bytes between the quotes in the source. Wide literals are transcoded from
+// UTF-8 eight bytes at a time while the text is ASCII.
+
+static int str_enc_size(StrEnc enc) {
+  return enc <= STR_UTF8 ? 1 : enc == STR_UTF16 ? 2 : 4;
+}
+
+static const char *str_enc_name(StrEnc enc) {
+  switch (enc) {
+  case STR_CHAR:
+    return "char";
+  case STR_UTF8:
+    return "u8 char";
+  case STR_UTF16:
+    return "char16_t";
+  case STR_UTF32:
+    return "char32_t";
+  case STR_WIDE:
+    return "wchar_t";
+  }
+  return "unknown";
+}
+
+// The encoding prefix of the literal spelled at `p`; `*len` is its length.
+static StrEnc lex_str_prefix(const char *p, int *len) {
+  *len = 1;
+  switch (*p) {
+  case 'u':
+    if (p[1] == '8') {
+      *len = 2;
+      return STR_UTF8;
+    }
+    return STR_UTF16;
+  case 'U':
+    return STR_UTF32;
+  case 'L':
+    return STR_WIDE;
+  }
+  *len = 0;
+  return STR_CHAR;
+}
+
+static const uint64_t lex_high_bits = 0x8080808080808080u;
+
+// How many `enc` units the UTF-8 text p[0, n) needs (as long as it is valid;
+// lex_utf8_widen() checks that). Counts lead bytes eight at a time, plus one
+// for each 4-byte sequence in UTF-16, which takes a surrogate pair.
+static int64_t lex_utf8_units(const char *p, int64_t n, StrEnc enc) {
+  int64_t units = 0, i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    if (!(v & lex_high_bits)) {
+      units += 8;
+      continue;
+    }
+    uint64_t cont = v & ~(v << 1) & lex_high_bits; // 10xxxxxx
+    units += 8 - __builtin_popcountll(cont);
+    if (enc == STR_UTF16)
+      units += __builtin_popcountll(v & v << 1 & v << 2 & v << 3 &
+                                    lex_high_bits); // 1111xxxx
+  }
+  for (; i < n; i++) {
+    unsigned char c = (unsigned char)p[i];
+    units += (c & 0xC0) != 0x80;
+    units += enc == STR_UTF16 && c >= 0xF0;
+  }
+  return units;
+}
+
+// Store `c` as `enc` units at `out`; return the end.
+static char *lex_put_unit(char *out, StrEnc enc, uint32_t c) {
+  if (enc == STR_UTF16) {
+    uint16_t u = (uint16_t)c;
+    memcpy(out, &u, 2);
+    return out + 2;
+  }
+  memcpy(out, &c, 4);
+  return out + 4;
+}
+
+static char *lex_put_char(char *out, StrEnc enc, uint32_t c) {
+  if (enc == STR_UTF16 && c > 0xFFFF) {
+    c -= 0x10000;
+    out = lex_put_unit(out, enc, 0xD800 + (c >> 10));
+    return lex_put_unit(out, enc, 0xDC00 + (c & 0x3FF));
+  }
+  return lex_put_unit(out, enc, c);
+}
+
+// Transcode the UTF-8 text p[0, n) to UTF-16 or UTF-32 at `out`; return the
+// end. Runs of ASCII are widened a word at a time (the inner loops
+// vectorize); other characters are decoded one by one.
+static char *lex_utf8_widen(const Token *tok, const char *p, int64_t n,
+                            StrEnc enc, char *out) {
+  int64_t i = 0;
+  while (i < n) {
+    uint64_t v;
+    if (i + 8 <= n && (memcpy(&v, p + i, 8), !(v & lex_high_bits))) {
+      if (enc == STR_UTF16) {
+        uint16_t w[8];
+        for (int k = 0; k < 8; k++)
+          w[k] = (unsigned char)p[i + k];
+        memcpy(out, w, sizeof(w));
+        out += sizeof(w);
+      } else {
+        uint32_t w[8];
+        for (int k = 0; k < 8; k++)
+          w[k] = (unsigned char)p[i + k];
+        memcpy(out, w, sizeof(w));
+        out += sizeof(w);
+      }
+      i += 8;
+      continue;
+    }
+    uint32_t c;
+    int len = pp_decode_utf8(p + i, &c);
+    if (!len || i + len > n)
+      error_tok(tok, "invalid UTF-8 in string literal");
+    out = lex_put_char(out, enc, c);
+    i += len;
+  }
+  return out;
+}
+
+// Encode `c` as UTF-8 at `out`, or just count the bytes when `out` is NULL.
+static int lex_put_utf8(char *out, uint32_t c) {
+  int n = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+  if (!out)
+    return n;
+  if (n == 1) {
+    out[0] = (char)c;
+    return 1;
+  }
+  static const unsigned char lead[] = {0, 0, 0xC0, 0xE0, 0xF0};
+  for (int i = n - 1; i > 0; i--, c >>= 6)
+    out[i] = (char)(0x80 | (c & 0x3F));
+  out[0] = (char)(lead[n] | c);
+  return n;
+}
+
+// Decode the body p[0, n) of a literal as `enc` units into `out`, or only
+// count them when `out` is NULL. Both passes walk escapes the same way, so
+// the count is exact.
+static int64_t lex_str_body(const Token *tok, const char *p, int64_t n,
+                            StrEnc enc, char *out) {
+  int size = str_enc_size(enc);
+  const char *end = p + n;
+  int64_t units = 0;
+  while (p < end) {
+    const char *bs =
+        *p == '\\' ? p : memchr(p, '\\', (size_t)(end - p)); // runs of escapes
+    int64_t run = (bs ? bs : end) - p;
+    if (size == 1) {
+      if (out)
+        memcpy(out + units, p, (size_t)run);
+      units += run;
+    } else if (out) {
+      units = (lex_utf8_widen(tok, p, run, enc, out + units * size) - out) /
+              size;
+    } else {
+      units += lex_utf8_units(p, run, enc);
+    }
+    if (!bs)
+      break;
+
+    p = bs;
+    bool ucn;
+    uint32_t c = lex_escape(tok, &p, &ucn);
+    if (ucn && size == 1) {
+      units += lex_put_utf8(out ? out + units : NULL, c);
+    } else if (ucn && enc == STR_UTF16 && c > 0xFFFF) {
+      if (out)
+        lex_put_char(out + units * size, enc, c);
+      units += 2;
+    } else {
+      if (c > (size == 1 ? 0xFFu : size == 2 ? 0xFFFFu : 0xFFFFFFFFu))
+        error_tok(tok, "escape sequence out of range");
+      if (size == 1) {
+        if (out)
+          out[units] = (char)c;
+      } else if (out) {
+        lex_put_unit(out + units * size, enc, c);
+      }
+      units++;
+    }
+  }
+  return units;
+}
+
+// Fill in the TK_STR `tok` from the string-literal pieces[0, n), which are
+// adjacent in the token stream.
+static void lex_string(Lexer *l, Token *tok, PPToken **pieces, int n) {
+  StrEnc enc = STR_CHAR;
+  bool plain = true;
+  for (int i = 0; i < n; i++) {
+    int plen;
+    StrEnc e = lex_str_prefix(pieces[i]->loc, &plen);
+    if (e != STR_CHAR && enc != STR_CHAR && e != enc)
+      error_tok(tok, "concatenation of string literals with different "
+                     "encoding prefixes");
+    if (e != STR_CHAR)
+      enc = e;
+    plain = plain && !memchr(pieces[i]->loc, '\\', (size_t)pieces[i]->len);
+  }
+  tok->kind = TK_STR;
+  tok->str_enc = enc;
+
+  if (n == 1 && plain && str_enc_size(enc) == 1) {
+    int plen;
+    lex_str_prefix(tok->loc, &plen);
+    tok->str = tok->loc + plen + 1;
+    tok->str_len = tok->len - plen - 2;
+    return;
+  }
+
+  int64_t units = 0;
+  for (int i = 0; i < n; i++) {
+    int plen;
+    lex_str_prefix(pieces[i]->loc, &plen);
+    units += lex_str_body(tok, pieces[i]->loc + plen + 1,
+                          pieces[i]->len - plen - 2, enc, NULL);
+  }
+  int size = str_enc_size(enc);
+  char *buf = arena_alloc(&l->strings, (size_t)(units + 1) * (size_t)size,
+                          (size_t)size);
+  int64_t at = 0;
+  for (int i = 0; i < n; i++) {
+    int plen;
+    lex_str_prefix(pieces[i]->loc, &plen);
+    at += lex_str_body(tok, pieces[i]->loc + plen + 1,
+                       pieces[i]->len - plen - 2, enc, buf + at * size);
+  }
+  memset(buf + units * size, 0, (size_t)size);
+  tok->str = buf;
+  tok->str_len = units;
+  STAT_ADD(STAT_STRING_BYTES, (units + 1) * size);
+}
+
+// Print the `len` elements of a string literal, escaping all but printable
+// ASCII.
+static void dump_str_units(FILE *out, const char *str, int64_t len,
+                           StrEnc enc) {
+  for (int64_t i = 0; i < len; i++) {
+    uint32_t c;
+    if (str_enc_size(enc) == 1) {
+      c = (unsigned char)str[i];
+    } else if (enc == STR_UTF16) {
+      uint16_t u;
+      memcpy(&u, str + i * 2, 2);
+      c = u;
+    } else {
+      memcpy(&c, str + i * 4, 4);
+    }
+    if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+      fputc((int)c, out);
+    else
+      fprintf(out, "\\x%x", c);
+  }
+}
+
+static void dump_lex_token(FILE *err, const Token *tok) {
+  pp_fprint_srcloc(err, tok->spelling);
+  switch (tok->kind) {
+  case TK_IDENT:
+    fprintf(err, ": IDENT: %.*s\n", tok->len, tok->loc);
+    break;
+  case TK_KEYWORD:
+    fprintf(err, ": KEYWORD: %s\n", keyword_names[tok->kw]);
+    break;
+  case TK_PUNCT:
+    fprintf(err, ": PUNCT: %s\n", punct_names[tok->punct]);
+    break;
+  case TK_NUM:
+    fprintf(err, ": NUM(%s): ", num_type_name(tok->num_type));
+    if (num_is_float(tok->num_type))
+      fprintf(err, "%.21Lg\n", tok->fval);
+    else if (tok->num_type == NUM_INT || tok->num_type == NUM_LONG ||
+             tok->num_type == NUM_LLONG)
+      fprintf(err, "%lld\n", (long long)tok->ival);
+    else
+      fprintf(err, "%llu\n", (unsigned long long)tok->ival);
+    break;
+  case TK_STR:
+    fprintf(err, ": STR(%s[%lld]): \"", str_enc_name(tok->str_enc),
+            (long long)tok->str_len + 1);
+    dump_str_units(err, tok->str, tok->str_len, tok->str_enc);
+    fprintf(err, "\"\n");
+    break;
+  case TK_EOF:
+    fprintf(err, ": EOF\n");
+    break;
+  }
+}
+
+// Return a token that is no longer referenced to the Lexer.
+static void lex_release(Lexer *l, Token *tok) {
+  if (!tok->src)
+    pp_origin_free(tok->origin);
+  tok->origin = NULL;
+  tok->next = l->free;
+  l->free = tok;
+}
+
+// A token to fill, which the caller must lex_release() in the end.
+static Token *lex_new_token(Lexer *l) {
+  Token *tok = l->free;
+  if (tok)
+    l->free = tok->next;
+  else if (!(tok = mem_malloc(MEM_LEX_TOKEN, sizeof(*tok))))
+    die_oom("allocating token");
+  return tok;
+}
+
+// Convert the next token, or return NULL past EOF.
+static Token *lex_pull(Lexer *l) {
+  if (l->nsaved) {
+    Token *tok = lex_new_token(l);
+    *tok = *l->saved++;
+    l->nsaved--;
+    return tok;
+  }
+  PPToken *pp = lex_next_pp(l);
+  if (!pp)
+    return NULL;
+  Token *tok = lex_new_token(l);
+  lex_convert(pp, tok);
+  STAT_INC(STAT_LEX_TOKENS);
+  if (pp->kind != PPTOK_STRING_LITERAL) {
+    pp_free_tok(pp);
+    return tok;
+  }
+
+  // Gather the adjacent literals (their PPTokens keep the spellings alive).
+  PPToken *small[8];
+  PPToken **pieces = small;
+  int n = 0, cap = 8;
+  pieces[n++] = pp;
+  PPToken *next;
+  while ((next = lex_next_pp(l)) && next->kind == PPTOK_STRING_LITERAL) {
+    if (n == cap) {
+      cap *= 2;
+      PPToken **grown = malloc((size_t)cap * sizeof(*grown));
+      if (!grown)
+        die_oom("concatenating string literals");
+      memcpy(grown, pieces, (size_t)n * sizeof(*grown));
+      if (pieces != small)
+        free(pieces);
+      pieces = grown;
+    }
+    pieces[n++] = next;
+  }
+  l->pending = next;
+  lex_string(l, tok, pieces, n);
+  for (int i = 0; i < n; i++)
+    pp_free_tok(pieces[i]);
+  if (pieces != small)
+    free(pieces);
+  return tok;
+}
+
+// The k-th token ahead (0 is the current one); EOF repeats at the end.
+static Token *lex_peek(Lexer *l, int k) {
+  if (k >= LEX_LOOKAHEAD)
+    DIE("internal error: lexer lookahead %d is too far", k);
+  while (l->len <= k) {
+    Token *last =
+        l->len ? l->window[(l->pos + l->len - 1) % LEX_LOOKAHEAD] : NULL;
+    if (last && last->kind == TK_EOF)
+      return last;
+    Token *tok = lex_pull(l);
+    if (!tok)
+      DIE("internal error: token stream ended without EOF");
+    if (l->dump)
+      dump_lex_token(l->dump, tok);
+    l->window[(l->pos + l->len++) % LEX_LOOKAHEAD] = tok;
+  }
+  return l->window[(l->pos + k) % LEX_LOOKAHEAD];
+}
+
+// Remove the current token from the window and hand it to the caller, who
+// must lex_release() it.
+static Token *lex_take(Lexer *l) {
+  Token *tok = lex_peek(l, 0);
+  if (tok->kind != TK_EOF) {
+    l->pos = (l->pos + 1) % LEX_LOOKAHEAD;
+    l->len--;
+  }
+  return tok;
+}
+
+// Move past the current token (never past EOF).
+static void lex_advance(Lexer *l) {
+  Token *tok = lex_peek(l, 0);
+  if (tok->kind != TK_EOF)
+    lex_release(l, lex_take(l));
+}
+
+// Drop `n` saved token copies that will not be read.
+static void lex_free_saved(const Token *saved, int64_t n) {
+  for (int64_t i = 0; i < n; i++)
+    if (!saved[i].src)
+      pp_origin_free(saved[i].origin);
+}
+
+static void lex_free(Lexer *l) {
+  for (int i = 0; i < l->len; i++)
+    lex_release(l, l->window[(l->pos + i) % LEX_LOOKAHEAD]);
+  l->len = 0;
+  lex_free_saved(l->saved, l->nsaved);
+  while (l->free) {
+    Token *next = l->free->next;
+    mem_free(MEM_LEX_TOKEN, l->free, sizeof(*l->free));
+    l->free = next;
+  }
+  pp_free_tok(l->pending);
+  free_pptokens(l->list);
+  arena_free(&l->strings);
+}
+
+/* section: abstract syntax tree */
+
+// The AST (docs/lexer_and_parser.md, section 5) is kept in typed pools, one per
+// node category, each filled a block at a time from the unit's arena. Nodes
+// refer to each other by 32-bit pool index, 0 meaning none: an expression
+// node is 32 bytes, and a pass over a pool walks memory in order. Types,
+// members, child lists and initializers come from the same arena, so
+// ast_free() releases a whole unit in a handful of calls.
+
+typedef uint32_t ExprId;
+typedef uint32_t StmtId;
+typedef uint32_t ObjId;
+typedef uint32_t SrcId; // a token's location, see ast_loc()
+typedef uint32_t Ident; // an interned identifier, see ast_intern()
+
+typedef struct Type Type;
+typedef struct Member Member;
+typedef struct Initializer Initializer;
+
+#define EXPR_KINDS(X)                                                          \
+  X(NUM, "num")                                                                \
+  X(FNUM, "fnum")                                                              \
+  X(STR, "str")                                                                \
+  X(VAR, "var")                                                                \
+  X(MEMBER, "member")                                                          \
+  X(ADDR, "addr")                                                              \
+  X(DEREF, "deref")                                                            \
+  X(NEG, "neg")                                                                \
+  X(NOT, "not")                                                                \
+  X(BITNOT, "bitnot")                                                          \
+  X(ADD, "add")                                                                \
+  X(SUB, "sub")                                                                \
+  X(MUL, "mul")                                                                \
+  X(DIV, "div")                                                                \
+  X(MOD, "mod")                                                                \
+  X(BITAND, "bitand")                                                          \
+  X(BITOR, "bitor")                                                            \
+  X(BITXOR, "bitxor")                                                          \
+  X(SHL, "shl")                                                                \
+  X(SHR, "shr")                                                                \
+  X(EQ, "eq")                                                                  \
+  X(NE, "ne")                                                                  \
+  X(LT, "lt")                                                                  \
+  X(LE, "le")                                                                  \
+  X(GT, "gt")                                                                  \
+  X(GE, "ge")                                                                  \
+  X(LOGAND, "logand")                                                          \
+  X(LOGOR, "logor")                                                            \
+  X(ASSIGN, "assign")                                                          \
+  X(POSTINC, "postinc")                                                        \
+  X(POSTDEC, "postdec")                                                        \
+  X(COND, "cond")                                                              \
+  X(COMMA, "comma")                                                            \
+  X(CAST, "cast")                                                              \
+  X(CALL, "call")                                                              \
+  X(STMT_EXPR, "stmt-expr")                                                    \
+  X(MEMZERO, "memzero")
+
+typedef enum {
+#define AST_EX_ENUM(name, str) EX_##name,
+  EXPR_KINDS(AST_EX_ENUM)
+#undef AST_EX_ENUM
+} ExprKind;
+
+static const char *const expr_kind_names[] = {
+#define AST_EX_NAME(name, str) str,
+    EXPR_KINDS(AST_EX_NAME)
+#undef AST_EX_NAME
+};
+
+enum {
+  EXF_LVALUE = 1,   // designates an object (or a function)
+  EXF_BITFIELD = 2, // an EX_MEMBER naming a bit-field
+};
+
+// Operands are lhs (unary operators, casts, the callee and the object of a
+// member access) and rhs. Arithmetic is done in the expression's type, to
+// which the operands have been converted, except that pointer arithmetic is
+// not scaled: the integer operand of a pointer +/- counts elements.
+typedef struct {
+  uint8_t kind;   // ExprKind
+  uint8_t aux;    // EX_ASSIGN: ExprKind of a compound assignment's operator
+  uint16_t flags; // EXF_*
+  SrcId loc;
+  Type *ty;
+  ExprId lhs, rhs; // EX_CALL: rhs counts the arguments
+  union {
+    int64_t ival;   // EX_NUM, in the bits of its type
+    uint32_t fnum;  // EX_FNUM: index into Ast.fnums
+    uint32_t str;   // EX_STR: index into Ast.strs
+    ObjId obj;      // EX_VAR, EX_MEMZERO
+    ExprId cond;    // EX_COND: cond ? lhs : rhs
+    Member *member; // EX_MEMBER
+    ExprId *args;   // EX_CALL
+    StmtId body;    // EX_STMT_EXPR: the block
+  };
+} Expr;
+
+#define STMT_KINDS(X)                                                          \
+  X(EXPR, "expr")                                                              \
+  X(BLOCK, "block")                                                            \
+  X(IF, "if")                                                                  \
+  X(FOR, "for")                                                                \
+  X(WHILE, "while")                                                            \
+  X(DO, "do")                                                                  \
+  X(SWITCH, "switch")                                                          \
+  X(CASE, "case")                                                              \
+  X(DEFAULT, "default")                                                        \
+  X(BREAK, "break")                                                            \
+  X(CONTINUE, "continue")                                                      \
+  X(GOTO, "goto")                                                              \
+  X(LABEL, "label")                                                            \
+  X(RETURN, "return")
+
+typedef enum {
+#define AST_ST_ENUM(name, str) ST_##name,
+  STMT_KINDS(AST_ST_ENUM)
+#undef AST_ST_ENUM
+} StmtKind;
+
+static const char *const stmt_kind_names[] = {
+#define AST_ST_NAME(name, str) str,
+    STMT_KINDS(AST_ST_NAME)
+#undef AST_ST_NAME
+};
+
+typedef struct {
+  uint8_t kind; // StmtKind
+  SrcId loc;
+  ExprId expr; // EXPR, RETURN: the value; IF, loops, SWITCH: the condition
+  ExprId inc;  // FOR
+  StmtId init; // FOR
+  StmtId then; // IF, loops, SWITCH: the body; CASE, DEFAULT, LABEL: the
+               // statement labeled
+  StmtId els;  // IF
+  uint32_t n;  // BLOCK: items; SWITCH: labels
+  union {
+    StmtId *items; // BLOCK: the statements; SWITCH: its CASEs and DEFAULT
+    int64_t val;   // CASE
+    Ident label;   // GOTO, LABEL
+  };
+} Stmt;
+
+enum {
+  OBJ_LOCAL = 1 << 0,
+  OBJ_PARAM = 1 << 1,
+  OBJ_FUNC = 1 << 2,
+  OBJ_DEFINED = 1 << 3, // has a body or an initializer
+  OBJ_STATIC = 1 << 4,
+  OBJ_EXTERN = 1 << 5,
+  OBJ_INLINE = 1 << 6,
+  OBJ_TLS = 1 << 7,
+  OBJ_NORETURN = 1 << 8,
+  OBJ_LAZY = 1 << 9,  // a function whose body is still tokens (LazyBody)
+  OBJ_USED = 1 << 10, // a function some expression refers to
+};
+
+typedef struct LazyBody LazyBody;
+
+// A variable or function.
+typedef struct {
+  Ident name; // 0 for a compound literal
+  SrcId loc;
+  Type *ty;
+  uint16_t flags; // OBJ_*
+  int align;
+  union {
+    struct { // OBJ_FUNC
+      StmtId body;
+      uint32_t nparams, nlocals;
+      ObjId *params;
+      ObjId *locals; // every other local, compound literals included
+      LazyBody *lazy;
+    };
+    Initializer *init; // a variable with static storage, if initialized
+  };
+} Obj;
+
+// Elements [first, first + n) of an array initializer. Those of an array of
+// scalars are kept as the bytes the object holds, 0 for an element whose
+// value is not a constant, which is then in `exprs`; those of an array of
+// aggregates each have their Initializer, NULL where nothing was given.
+typedef struct {
+  int64_t first, n, cap; // cap: of the arrays below
+  uint8_t *data;         // n elements' bytes, for scalars
+  ExprId *exprs;         // NULL until an element is not a constant
+  Initializer **elems;   // for aggregates
+} InitRun;
+
+// The initializer of an object of type `ty`: `expr` for a scalar (or a
+// struct or union initialized from an expression); for a struct or union,
+// one child per member, NULL where nothing was given (zero); for an array,
+// the elements given, as sorted disjoint runs with zeros between them, so
+// that neither a long table nor a few elements of a huge zeroed array cost
+// a node per element.
+struct Initializer {
+  Type *ty;
+  ExprId expr;
+  Initializer **children;
+  int64_t nchildren;  // of children, or an array's length
+  InitRun *runs;      // an array's elements
+  int64_t nruns, cap; // cap: of runs
+  Member *member;     // a union's initialized member
+  bool flexible;      // an array of unknown length, sized by the initializer
+};
+
+typedef struct {
+  PPSrcLoc spelling;
+  PPOrigin *origin; // owned
+} AstLoc;
+
+typedef struct {
+  const char *name; // NUL-terminated
+  int len;
+} AstName;
+
+typedef struct {
+  const char *data; // len elements of str_enc_size(enc) bytes, then a null
+  int64_t len;
+  StrEnc enc;
+} AstStr;
+
+#define POOL_BLOCK_SHIFT 10
+#define POOL_BLOCK_MASK ((1u << POOL_BLOCK_SHIFT) - 1)
+
+// Elements of one size, by index; index 0 is reserved. Blocks never move, so
+// pointers into a pool stay valid while it grows.
+typedef struct {
+  char **blocks;
+  uint32_t nblocks, cap;
+  uint32_t len;
+  uint32_t elem_size;
+} Pool;
+
+typedef struct {
+  Arena arena;
+  Pool exprs, stmts, objs;
+  Pool locs;  // AstLoc, by SrcId
+  Pool names; // AstName, by Ident
+  Pool fnums; // long double, by Expr.fnum
+  Pool strs;  // AstStr, by Expr.str
+  PPHashMap idents; // spelling -> Ident
+  PPHashMap types;  // type_key() -> the canonical Type
+  ObjId *globals;   // file-scope objects, in order of first declaration
+  uint32_t nglobals;
+} Ast;
+
+static void *pool_at(const Pool *p, uint32_t i) {
+  return p->blocks[i >> POOL_BLOCK_SHIFT] +
+         (size_t)(i & POOL_BLOCK_MASK) * p->elem_size;
+}
+
+// Append a zeroed element and return its index.
+static uint32_t pool_push(Arena *a, Pool *p) {
+  uint32_t i = p->len;
+  if (i == UINT32_MAX)
+    DIE("too many AST nodes");
+  if (!(i & POOL_BLOCK_MASK) && i >> POOL_BLOCK_SHIFT == p->nblocks) {
+    if (p->nblocks == p->cap) {
+      uint32_t cap = p->cap ? p->cap * 2 : 16;
+      char **blocks = mem_malloc(MEM_AST, cap * sizeof(*blocks));
+      if (!blocks)
+        die_oom("growing AST pool");
+      if (p->nblocks)
+        memcpy(blocks, p->blocks, p->nblocks * sizeof(*blocks));
+      mem_free(MEM_AST, p->blocks, p->cap * sizeof(*blocks));
+      p->blocks = blocks;
+      p->cap = cap;
+    }
+    p->blocks[p->nblocks++] = arena_alloc(
+        a, (size_t)p->elem_size << POOL_BLOCK_SHIFT, _Alignof(max_align_t));
+  }
+  p->len++;
+  memset(pool_at(p, i), 0, p->elem_size);
+  return i;
+}
+
+// Drop the elements from index `len` on, which nothing refers to any more;
+// the blocks stay for the next ones.
+static void pool_truncate(Pool *p, uint32_t len) { p->len = len; }
+
+static void ast_init(Ast *a) {
+  *a = (Ast){.arena = {.tag = MEM_AST}};
+  Pool *pools[] = {&a->exprs, &a->stmts, &a->objs, &a->locs,
+                   &a->names, &a->fnums, &a->strs};
+  size_t sizes[] = {sizeof(Expr),    sizeof(Stmt),        sizeof(Obj),
+                    sizeof(AstLoc),  sizeof(AstName),     sizeof(long double),
+                    sizeof(AstStr)};
+  for (size_t i = 0; i < sizeof(pools) / sizeof(*pools); i++) {
+    pools[i]->elem_size = (uint32_t)sizes[i];
+    pool_push(&a->arena, pools[i]);
+  }
+}
+
+static void ast_free(Ast *a) {
+  for (uint32_t i = 1; i < a->locs.len; i++)
+    pp_origin_free(((AstLoc *)pool_at(&a->locs, i))->origin);
+  Pool *pools[] = {&a->exprs, &a->stmts, &a->objs, &a->locs,
+                   &a->names, &a->fnums, &a->strs};
+  for (size_t i = 0; i < sizeof(pools) / sizeof(*pools); i++)
+    mem_free(MEM_AST, pools[i]->blocks, pools[i]->cap * sizeof(char *));
+  mem_free(MEM_HASHMAP, a->idents.buckets,
+           (size_t)a->idents.capacity * sizeof(PPHashEntry));
+  mem_free(MEM_HASHMAP, a->types.buckets,
+           (size_t)a->types.capacity * sizeof(PPHashEntry));
+  arena_free(&a->arena);
+  *a = (Ast){};
+}
+
+static void *ast_zalloc(Ast *a, size_t size, size_t align) {
+  void *p = arena_alloc(&a->arena, size, align);
+  memset(p, 0, size);
+  return p;
+}
+
+#define AST_NEW(a, T) ((T *)ast_zalloc((a), sizeof(T), _Alignof(T)))
+
+static Expr *ast_expr(const Ast *a, ExprId id) {
+  return pool_at(&a->exprs, id);
+}
+
+static Stmt *ast_stmt(const Ast *a, StmtId id) {
+  return pool_at(&a->stmts, id);
+}
+
+static Obj *ast_obj(const Ast *a, ObjId id) { return pool_at(&a->objs, id); }
+
+static ExprId ast_new_expr(Ast *a) {
+  STAT_INC(STAT_AST_NODES);
+  return pool_push(&a->arena, &a->exprs);
+}
+
+static StmtId ast_new_stmt(Ast *a) {
+  STAT_INC(STAT_AST_NODES);
+  return pool_push(&a->arena, &a->stmts);
+}
+
+static ObjId ast_new_obj(Ast *a) {
+  STAT_INC(STAT_AST_NODES);
+  return pool_push(&a->arena, &a->objs);
+}
+
+static Ident ast_intern(Ast *a, const char *s, int len) {
+  void *id = pp_hash_get2(&a->idents, (char *)s, len);
+  if (id)
+    return (Ident)(uintptr_t)id;
+  char *name = arena_alloc(&a->arena, (size_t)len + 1, 1);
+  memcpy(name, s, (size_t)len);
+  name[len] = '\0';
+  Ident i = pool_push(&a->arena, &a->names);
+  *(AstName *)pool_at(&a->names, i) = (AstName){name, len};
+  pp_hash_put2(&a->idents, name, len, (void *)(uintptr_t)i);
+  return i;
+}
+
+static const char *ast_name(const Ast *a, Ident id) {
+  return id ? ((AstName *)pool_at(&a->names, id))->name : "";
+}
+
+// The location of `tok`, for nodes made from it. The AST takes over the
+// token's origin chain (it stays readable through the token while the Lexer
+// has it), so each token's is recorded once.
+static SrcId ast_loc(Ast *a, Token *tok) {
+  if (tok->src)
+    return tok->src;
+  SrcId id = pool_push(&a->arena, &a->locs);
+  *(AstLoc *)pool_at(&a->locs, id) = (AstLoc){tok->spelling, tok->origin};
+  tok->src = id;
+  return id;
+}
+
+static _Noreturn void error_at(const Ast *a, SrcId loc, const char *fmt,
+                               ...) {
+  AstLoc *l = pool_at(&a->locs, loc);
+  va_list ap;
+  va_start(ap, fmt);
+  verror_at(l->spelling, l->origin, fmt, ap);
+}
+
+static uint32_t ast_fnum(Ast *a, long double v) {
+  uint32_t i = pool_push(&a->arena, &a->fnums);
+  *(long double *)pool_at(&a->fnums, i) = v;
+  return i;
+}
+
+static long double ast_fnum_value(const Ast *a, uint32_t i) {
+  return *(long double *)pool_at(&a->fnums, i);
+}
+
+// Copy a string literal of `len` elements into the AST.
+static uint32_t ast_str(Ast *a, const char *data, int64_t len, StrEnc enc) {
+  size_t size = (size_t)str_enc_size(enc);
+  char *buf = arena_alloc(&a->arena, ((size_t)len + 1) * size, size);
+  memcpy(buf, data, (size_t)len * size);
+  memset(buf + (size_t)len * size, 0, size);
+  uint32_t i = pool_push(&a->arena, &a->strs);
+  *(AstStr *)pool_at(&a->strs, i) = (AstStr){buf, len, enc};
+  return i;
+}
+
+static const AstStr *ast_str_at(const Ast *a, uint32_t i) {
+  return pool_at(&a->strs, i);
+}
+
+// A growable array of ids.
+typedef struct {
+  uint32_t *data;
+  uint32_t len, cap;
+} IdVec;
+
+static void idvec_push(IdVec *v, uint32_t id) {
+  if (v->len == v->cap) {
+    uint32_t cap = v->cap ? v->cap * 2 : 64;
+    uint32_t *data = mem_malloc(MEM_AST, cap * sizeof(*data));
+    if (!data)
+      die_oom("growing parser stack");
+    if (v->len)
+      memcpy(data, v->data, v->len * sizeof(*data));
+    mem_free(MEM_AST, v->data, v->cap * sizeof(*data));
+    v->data = data;
+    v->cap = cap;
+  }
+  v->data[v->len++] = id;
+}
+
+static void idvec_free(IdVec *v) {
+  mem_free(MEM_AST, v->data, v->cap * sizeof(*v->data));
+  *v = (IdVec){};
+}
+
+// Move the ids pushed on `v` since `base` into the AST.
+static uint32_t *ast_list(Ast *a, IdVec *v, uint32_t base, uint32_t *n) {
+  *n = v->len - base;
+  if (!*n)
+    return NULL;
+  uint32_t *list = arena_alloc(&a->arena, *n * sizeof(*list), sizeof(*list));
+  memcpy(list, v->data + base, *n * sizeof(*list));
+  v->len = base;
+  return list;
+}
+
+/* section: types */
+
+// C types (C11 6.2.5), for LP64. The unqualified arithmetic types are static
+// singletons; every other type is built in the unit's arena, once: types are
+// hash-consed, so two types are the same type exactly when they are the same
+// Type object, and must not be modified once made. A struct, union or enum
+// keeps its tag, members and layout in a TagInfo shared by all its qualified
+// versions, so completing the type completes all of them.
+
+typedef enum {
+  TY_VOID,
+  TY_BOOL,
+  TY_CHAR, // signed, as on x86-64
+  TY_SCHAR,
+  TY_UCHAR,
+  TY_SHORT,
+  TY_USHORT,
+  TY_INT,
+  TY_UINT,
+  TY_LONG,
+  TY_ULONG,
+  TY_LLONG,
+  TY_ULLONG,
+  TY_FLOAT,
+  TY_DOUBLE,
+  TY_LDOUBLE,
+  TY_ENUM, // compatible with int
+  TY_PTR,
+  TY_ARRAY,
+  TY_FUNC,
+  TY_STRUCT,
+  TY_UNION,
+} TypeKind;
+
+enum {
+  TQ_CONST = 1,
+  TQ_VOLATILE = 2,
+  TQ_RESTRICT = 4,
+  TQ_ATOMIC = 8,
+};
+
+struct Member {
+  Member *next;
+  Type *ty;
+  Ident name; // 0 for an anonymous struct or union, or an unnamed bit-field
+  SrcId loc;
+  int idx; // position in the struct
+  int align;
+  int64_t offset;
+  int bit_width; // -1 if not a bit-field
+  int bit_offset;
+};
+
+typedef struct {
+  Ident tag; // 0 if untagged
+  bool complete;
+  bool flexible; // a struct ending in a flexible array member
+  int align;
+  int64_t size;
+  int nmembers;
+  Member *members;
+} TagInfo;
+
+struct Type {
+  TypeKind kind;
+  uint8_t qual;    // TQ_*
+  bool variadic;   // TY_FUNC
+  bool prototyped; // TY_FUNC: false for `()`
+  int align;
+  int64_t size;   // -1 if incomplete; see type_size()
+  Type *base;     // TY_PTR, TY_ARRAY: the element; TY_FUNC: the return type
+  int64_t len;    // TY_ARRAY: elements, -1 for []
+  Type **params;  // TY_FUNC, as adjusted (arrays and functions to pointers)
+  int nparams;
+  TagInfo *tag;   // TY_STRUCT, TY_UNION, TY_ENUM
+};
+
+static Type ty_arith[] = {
+    [TY_VOID] = {.kind = TY_VOID, .size = -1, .align = 1},
+    [TY_BOOL] = {.kind = TY_BOOL, .size = 1, .align = 1},
+    [TY_CHAR] = {.kind = TY_CHAR, .size = 1, .align = 1},
+    [TY_SCHAR] = {.kind = TY_SCHAR, .size = 1, .align = 1},
+    [TY_UCHAR] = {.kind = TY_UCHAR, .size = 1, .align = 1},
+    [TY_SHORT] = {.kind = TY_SHORT, .size = 2, .align = 2},
+    [TY_USHORT] = {.kind = TY_USHORT, .size = 2, .align = 2},
+    [TY_INT] = {.kind = TY_INT, .size = 4, .align = 4},
+    [TY_UINT] = {.kind = TY_UINT, .size = 4, .align = 4},
+    [TY_LONG] = {.kind = TY_LONG, .size = 8, .align = 8},
+    [TY_ULONG] = {.kind = TY_ULONG, .size = 8, .align = 8},
+    [TY_LLONG] = {.kind = TY_LLONG, .size = 8, .align = 8},
+    [TY_ULLONG] = {.kind = TY_ULLONG, .size = 8, .align = 8},
+    [TY_FLOAT] = {.kind = TY_FLOAT, .size = 4, .align = 4},
+    [TY_DOUBLE] = {.kind = TY_DOUBLE, .size = 8, .align = 8},
+    [TY_LDOUBLE] = {.kind = TY_LDOUBLE, .size = 16, .align = 16},
+};
+
+// The unqualified void or arithmetic type of kind `k`.
+static Type *ty_of(TypeKind k) { return &ty_arith[k]; }
+
+static bool ty_is_integer(const Type *ty) {
+  return (ty->kind >= TY_BOOL && ty->kind <= TY_ULLONG) ||
+         ty->kind == TY_ENUM;
+}
+
+static bool ty_is_float(const Type *ty) {
+  return ty->kind >= TY_FLOAT && ty->kind <= TY_LDOUBLE;
+}
+
+static bool ty_is_arith(const Type *ty) {
+  return ty_is_integer(ty) || ty_is_float(ty);
+}
+
+static bool ty_is_scalar(const Type *ty) {
+  return ty_is_arith(ty) || ty->kind == TY_PTR;
+}
+
+static bool ty_is_unsigned(const Type *ty) {
+  switch (ty->kind) {
+  case TY_BOOL:
+  case TY_UCHAR:
+  case TY_USHORT:
+  case TY_UINT:
+  case TY_ULONG:
+  case TY_ULLONG:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool ty_is_record(const Type *ty) {
+  return ty->kind == TY_STRUCT || ty->kind == TY_UNION;
+}
+
+static int64_t type_size(const Type *ty) {
+  if (ty_is_record(ty))
+    return ty->tag->complete ? ty->tag->size : -1;
+  return ty->size;
+}
+
+static int type_align(const Type *ty) {
+  return ty_is_record(ty) ? ty->tag->align : ty->align;
+}
+
+// What identifies `ty` among the unit's types, into `key`, which has room
+// for 4 + ty->nparams words: what it is derived from, which is canonical, so
+// compared by address, and how. Returns the number of words.
+static size_t type_key(const Type *ty, uint64_t *key) {
+  key[0] = (uint64_t)ty->kind | (uint64_t)ty->qual << 8 |
+           (uint64_t)ty->variadic << 16 | (uint64_t)ty->prototyped << 17 |
+           (uint64_t)(uint32_t)ty->nparams << 32;
+  key[1] = (uintptr_t)ty->base;
+  key[2] = (uint64_t)ty->len;
+  key[3] = (uintptr_t)ty->tag;
+  for (int i = 0; i < ty->nparams; i++)
+    key[4 + i] = (uintptr_t)ty->params[i];
+  return 4 + (size_t)ty->nparams;
+}
+
+// The canonical type equal to `proto`, made from it (parameter array and all)
+// the first time. With `fresh`, `proto` is new to the unit and becomes
+// canonical without a lookup.
+static Type *type_intern(Ast *a, const Type *proto, bool fresh) {
+  uint64_t buf[16];
+  size_t n = 4 + (size_t)proto->nparams;
+  uint64_t *key = buf;
+  if (fresh || n > sizeof(buf) / sizeof(*buf))
+    key = arena_alloc(&a->arena, n * sizeof(*key), _Alignof(uint64_t));
+  int keylen = (int)(type_key(proto, key) * sizeof(*key));
+  Type *ty = fresh ? NULL : pp_hash_get2(&a->types, (char *)key, keylen);
+  if (ty)
+    return ty;
+  if (key == buf) {
+    key = arena_alloc(&a->arena, (size_t)keylen, _Alignof(uint64_t));
+    memcpy(key, buf, (size_t)keylen);
+  }
+  ty = AST_NEW(a, Type);
+  *ty = *proto;
+  pp_hash_put2(&a->types, (char *)key, keylen, ty);
+  return ty;
+}
+
+static Type *pointer_to(Ast *a, Type *base) {
+  return type_intern(
+      a, &(Type){.kind = TY_PTR, .size = 8, .align = 8, .base = base}, false);
+}
+
+static Type *array_of(Ast *a, Type *base, int64_t len) {
+  int64_t size = len < 0 ? -1 : type_size(base) * len;
+  return type_intern(a,
+                     &(Type){.kind = TY_ARRAY,
+                             .size = size,
+                             .align = type_align(base),
+                             .base = base,
+                             .len = len},
+                     false);
+}
+
+// `params` must live as long as the unit; it becomes the type's when the
+// type is new.
+static Type *func_type(Ast *a, Type *ret, Type **params, int nparams,
+                       bool variadic, bool prototyped) {
+  return type_intern(a,
+                     &(Type){.kind = TY_FUNC,
+                             .size = -1,
+                             .align = 1,
+                             .base = ret,
+                             .params = params,
+                             .nparams = nparams,
+                             .variadic = variadic,
+                             .prototyped = prototyped},
+                     false);
+}
+
+// A new struct, union or enum type, incomplete until its TagInfo is filled.
+static Type *tagged_type(Ast *a, TypeKind kind, Ident tag) {
+  TagInfo *info = AST_NEW(a, TagInfo);
+  info->tag = tag;
+  info->align = 1;
+  return type_intern(a,
+                     &(Type){.kind = kind,
+                             .size = kind == TY_ENUM ? 4 : -1,
+                             .align = 4,
+                             .tag = info},
+                     true);
+}
+
+// `ty` with exactly the qualifiers `qual`. Qualifying an array qualifies its
+// elements (C11 6.7.3p9).
+static Type *type_with_qual(Ast *a, Type *ty, int qual) {
+  if (ty->kind == TY_ARRAY) {
+    Type *base = type_with_qual(a, ty->base, qual);
+    return base == ty->base ? ty : array_of(a, base, ty->len);
+  }
+  if (ty->qual == qual)
+    return ty;
+  if (!qual && ty->kind <= TY_LDOUBLE)
+    return ty_of(ty->kind);
+  Type q = *ty;
+  q.qual = (uint8_t)qual;
+  return type_intern(a, &q, false);
+}
+
+static Type *qualified(Ast *a, Type *ty, int qual) {
+  if (ty->kind == TY_ARRAY)
+    return type_with_qual(a, ty, qual | ty->base->qual);
+  return type_with_qual(a, ty, qual | ty->qual);
+}
+
+static Type *unqualified(Ast *a, Type *ty) {
+  return ty->kind == TY_ARRAY ? ty : type_with_qual(a, ty, 0);
+}
+
+static int int_rank(const Type *ty) {
+  switch (ty->kind) {
+  case TY_BOOL:
+    return 0;
+  case TY_CHAR:
+  case TY_SCHAR:
+  case TY_UCHAR:
+    return 1;
+  case TY_SHORT:
+  case TY_USHORT:
+    return 2;
+  case TY_INT:
+  case TY_UINT:
+  case TY_ENUM:
+    return 3;
+  case TY_LONG:
+  case TY_ULONG:
+    return 4;
+  default:
+    return 5;
+  }
+}
+
+// Integer promotion (C11 6.3.1.1); other types only lose their qualifiers.
+static Type *type_promote(const Type *ty) {
+  if (ty_is_integer(ty) && int_rank(ty) <= 3 && ty->kind != TY_UINT)
+    return ty_of(TY_INT);
+  return ty->kind <= TY_LDOUBLE ? ty_of(ty->kind) : (Type *)ty;
+}
+
+// The usual arithmetic conversions (C11 6.3.1.8).
+static Type *usual_arith(const Type *t1, const Type *t2) {
+  if (t1->kind == TY_LDOUBLE || t2->kind == TY_LDOUBLE)
+    return ty_of(TY_LDOUBLE);
+  if (t1->kind == TY_DOUBLE || t2->kind == TY_DOUBLE)
+    return ty_of(TY_DOUBLE);
+  if (t1->kind == TY_FLOAT || t2->kind == TY_FLOAT)
+    return ty_of(TY_FLOAT);
+  Type *a = type_promote(t1), *b = type_promote(t2);
+  if (a == b)
+    return a;
+  if (ty_is_unsigned(a) == ty_is_unsigned(b))
+    return int_rank(a) >= int_rank(b) ? a : b;
+  Type *u = ty_is_unsigned(a) ? a : b, *s = ty_is_unsigned(a) ? b : a;
+  if (int_rank(u) >= int_rank(s))
+    return u;
+  if (s->size > u->size)
+    return s;
+  return ty_of(s->kind == TY_LONG ? TY_ULONG : TY_ULLONG);
+}
+
+// C11 6.2.7: compatible types. Struct, union and enum types are compatible
+// only with themselves (one translation unit), and an enum with int. Equal
+// types are one object; only distinct ones need comparing structurally.
+static bool type_compatible(const Type *t1, const Type *t2) {
+  if (t1 == t2)
+    return true;
+  if (t1->qual != t2->qual)
+    return false;
+  if (t1->kind != t2->kind)
+    return (t1->kind == TY_ENUM && t2->kind == TY_INT) ||
+           (t1->kind == TY_INT && t2->kind == TY_ENUM);
+  switch (t1->kind) {
+  case TY_PTR:
+    return type_compatible(t1->base, t2->base);
+  case TY_ARRAY:
+    return type_compatible(t1->base, t2->base) &&
+           (t1->len < 0 || t2->len < 0 || t1->len == t2->len);
+  case TY_FUNC:
+    if (!type_compatible(t1->base, t2->base))
+      return false;
+    if (!t1->prototyped || !t2->prototyped)
+      return true;
+    if (t1->variadic != t2->variadic || t1->nparams != t2->nparams)
+      return false;
+    for (int i = 0; i < t1->nparams; i++) {
+      const Type *p1 = t1->params[i], *p2 = t2->params[i];
+      // Top-level qualifiers of parameters do not count (C11 6.7.6.3p15).
+      if (p1->qual != p2->qual) {
+        Type u1 = *p1, u2 = *p2;
+        u1.qual = u2.qual = 0;
+        if (!type_compatible(&u1, &u2))
+          return false;
+      } else if (!type_compatible(p1, p2)) {
+        return false;
+      }
+    }
+    return true;
+  case TY_STRUCT:
+  case TY_UNION:
+  case TY_ENUM:
+    return t1->tag == t2->tag;
+  default:
+    return true;
+  }
+}
+
+static void type_quals(char *buf, size_t n, int qual, bool trailing_space) {
+  snprintf(buf, n, "%s%s%s%s", qual & TQ_CONST ? "const " : "",
+           qual & TQ_VOLATILE ? "volatile " : "",
+           qual & TQ_RESTRICT ? "restrict " : "",
+           qual & TQ_ATOMIC ? "_Atomic " : "");
+  size_t len = strlen(buf);
+  if (!trailing_space && len)
+    buf[len - 1] = '\0';
+}
+
+// Spell `ty` the way a declaration of `decl` would (`decl` may be empty), in
+// the style of clang's diagnostics: "int *", "char[4]", "int (*)(void)".
+static void type_spell(const Ast *a, const Type *ty, const char *decl,
+                       char *out, size_t n) {
+  char q[48], inner[256];
+  switch (ty->kind) {
+  case TY_PTR: {
+    type_quals(q, sizeof(q), ty->qual, *decl != '\0');
+    bool paren = ty->base->kind == TY_ARRAY || ty->base->kind == TY_FUNC;
+    snprintf(inner, sizeof(inner), paren ? "(*%s%s)" : "*%s%s", q, decl);
+    type_spell(a, ty->base, inner, out, n);
+    return;
+  }
+  case TY_ARRAY:
+    if (ty->len < 0)
+      snprintf(inner, sizeof(inner), "%s[]", decl);
+    else
+      snprintf(inner, sizeof(inner), "%s[%lld]", decl, (long long)ty->len);
+    type_spell(a, ty->base, inner, out, n);
+    return;
+  case TY_FUNC: {
+    size_t at = (size_t)snprintf(inner, sizeof(inner), "%s(", decl);
+    for (int i = 0; i < ty->nparams && at < sizeof(inner); i++) {
+      char param[128];
+      type_spell(a, ty->params[i], "", param, sizeof(param));
+      at += (size_t)snprintf(inner + at, sizeof(inner) - at, "%s%s",
+                             i ? ", " : "", param);
+    }
+    if (at < sizeof(inner))
+      snprintf(inner + at, sizeof(inner) - at, "%s)",
+               ty->variadic       ? (ty->nparams ? ", ..." : "...")
+               : !ty->prototyped || ty->nparams ? ""
+                                                : "void");
+    type_spell(a, ty->base, inner, out, n);
+    return;
+  }
+  default:
+    break;
+  }
+
+  static const char *const names[] = {
+      [TY_VOID] = "void",
+      [TY_BOOL] = "_Bool",
+      [TY_CHAR] = "char",
+      [TY_SCHAR] = "signed char",
+      [TY_UCHAR] = "unsigned char",
+      [TY_SHORT] = "short",
+      [TY_USHORT] = "unsigned short",
+      [TY_INT] = "int",
+      [TY_UINT] = "unsigned int",
+      [TY_LONG] = "long",
+      [TY_ULONG] = "unsigned long",
+      [TY_LLONG] = "long long",
+      [TY_ULLONG] = "unsigned long long",
+      [TY_FLOAT] = "float",
+      [TY_DOUBLE] = "double",
+      [TY_LDOUBLE] = "long double",
+      [TY_ENUM] = "enum",
+      [TY_STRUCT] = "struct",
+      [TY_UNION] = "union",
+  };
+  char name[128];
+  if (ty->tag)
+    snprintf(name, sizeof(name), "%s %s", names[ty->kind],
+             ty->tag->tag ? ast_name(a, ty->tag->tag) : "<anonymous>");
+  else
+    snprintf(name, sizeof(name), "%s", names[ty->kind]);
+  type_quals(q, sizeof(q), ty->qual, true);
+  snprintf(out, n, "%s%s%s%s", q, name,
+           *decl && *decl != '[' ? " " : "", decl);
+}
+
+// type_spell() into one of a few rotating buffers, for diagnostics.
+static const char *type_str(const Ast *a, const Type *ty) {
+  static _Thread_local char bufs[2][256];
+  static _Thread_local int next;
+  char *buf = bufs[next++ % 2];
+  type_spell(a, ty, "", buf, sizeof(bufs[0]));
+  return buf;
+}
+
+/* section: parser */
+
+// Recursive-descent parser: Tokens -> AST (C11 6.5-6.9). It pulls tokens
+// from the Lexer as it goes and looks at most two ahead, so a Token must not
+// be used once the parser has moved past it. Expressions are typed as they
+// are built, with the conversions the language implies (integer promotions,
+// the usual arithmetic conversions, conversion as if by assignment) made
+// explicit as EX_CAST nodes. Every error is fatal and reported at the
+// offending token, with its macro backtrace.
+
+// What a name is bound to in one scope. There are two name spaces: ordinary
+// identifiers (a variable or function, a typedef name or an enumeration
+// constant) and tags.
+typedef enum {
+  BIND_OBJ,
+  BIND_TYPEDEF,
+  BIND_ENUM_CONST,
+  BIND_TAG,
+  BIND_PARAM, // a parameter in scope in its prototype, an Obj once used
+} BindKind;
+
+typedef struct Binding Binding;
+struct Binding {
+  Binding *shadowed; // binding of the same name in an enclosing scope
+  uint32_t depth;    // of its scope; file scope is 0
+  BindKind kind;
+  ObjId obj;        // BIND_OBJ
+  Type *ty;         // the type a typedef name stands for, the enumeration of
+                    // a constant, the type a tag declares, or a parameter's
+  int64_t enum_val; // BIND_ENUM_CONST
+};
+
+// The innermost bindings of a name, one per name space.
+typedef struct {
+  Binding *ord;
+  Binding *tag;
+} BindingHeads;
+
+// Storage-class specifiers and alignment of a declaration.
+typedef struct {
+  bool is_typedef;
+  bool is_static;
+  bool is_extern;
+  bool is_inline;
+  bool is_tls;
+  bool is_noreturn;
+  int align;
+} VarAttr;
+
+// What a declarator declares besides its type.
+typedef struct {
+  Ident name; // 0 for an abstract declarator
+  SrcId loc;  // of the name, or of where it would be
+  bool has_params;
+  int nparams; // of the function it declares, if any
+  Ident *param_names;
+  SrcId *param_locs;
+  Type **param_types; // as declared, qualifiers and all
+} Decl;
+
+typedef struct {
+  Lexer *lex;
+  Ast *a;
+  BindingHeads *binds; // by Ident
+  uint32_t nbinds;
+  IdVec undo;          // 2 * Ident + is_tag of each block-scope binding
+  IdVec scopes;        // length of `undo` on entering each open block scope
+  IdVec file_binds;    // 2 * Ident + is_tag of each file-scope binding
+  Binding **hidden;    // scratch for scope_file_rewind()
+  uint32_t nhidden;    // capacity of `hidden`
+  Binding *free_binds; // bindings of closed scopes, for reuse
+  ObjId fn;          // function being defined, or 0
+  IdVec stack;       // items of the lists being built, innermost last
+  IdVec locals;      // of `fn`
+  IdVec labels;      // LABEL statements of `fn`
+  IdVec gotos;       // GOTO statements of `fn`
+  IdVec cases;       // CASE and DEFAULT statements of the enclosing switches
+  IdVec globals;
+  IdVec lazy;        // used functions whose bodies are still tokens
+  Token *defer;      // scratch for parse_defer_body()
+  uint32_t ndefer;
+  StmtId sw;         // innermost switch, or 0
+  uint32_t sw_cases; // its first entry in `cases`
+  int loops;         // enclosing loops
+  int breakables;    // enclosing loops and switches
+} Parser;
+
+static Expr *ex(Parser *p, ExprId id) { return ast_expr(p->a, id); }
+static Stmt *st(Parser *p, StmtId id) { return ast_stmt(p->a, id); }
+static Obj *obj(Parser *p, ObjId id) { return ast_obj(p->a, id); }
+
+static Token *parse_peek(Parser *p) { return lex_peek(p->lex, 0); }
+static Token *parse_peek2(Parser *p) { return lex_peek(p->lex, 1); }
+
+static bool tok_is(const Token *tok, Punct punct) {
+  return tok->kind == TK_PUNCT && tok->punct == punct;
+}
+
+static bool tok_is_kw(const Token *tok, Keyword kw) {
+  return tok->kind == TK_KEYWORD && tok->kw == kw;
+}
+
+static bool parse_at(Parser *p, Punct punct) {
+  return tok_is(parse_peek(p), punct);
+}
+
+static bool parse_consume(Parser *p, Punct punct) {
+  if (!parse_at(p, punct))
+    return false;
+  lex_advance(p->lex);
+  return true;
+}
+
+static bool parse_consume_kw(Parser *p, Keyword kw) {
+  if (!tok_is_kw(parse_peek(p), kw))
+    return false;
+  lex_advance(p->lex);
+  return true;
+}
+
+static void parse_expect(Parser *p, Punct punct) {
+  if (!parse_consume(p, punct))
+    error_tok(parse_peek(p), "expected '%s'", punct_names[punct]);
+}
+
+// Where the current token is.
+static SrcId parse_loc(Parser *p) { return ast_loc(p->a, parse_peek(p)); }
+
+// The name an identifier token spells, interned once per token.
+static Ident parse_intern(Parser *p, Token *tok) {
+  if (!tok->ident)
+    tok->ident = ast_intern(p->a, tok->loc, tok->len);
+  return tok->ident;
+}
+
+static Ident parse_ident(Parser *p, SrcId *loc) {
+  Token *tok = parse_peek(p);
+  if (tok->kind != TK_IDENT)
+    error_tok(tok, "expected identifier");
+  Ident name = parse_intern(p, tok);
+  if (loc)
+    *loc = ast_loc(p->a, tok);
+  lex_advance(p->lex);
+  return name;
+}
+
+// Scopes keep, for each name, a stack of its bindings, innermost first, so a
+// lookup is an index by Ident. Entering a block scope marks the undo log of
+// the names bound in block scopes; leaving it pops their bindings back to
+// the mark.
+static void scope_enter(Parser *p) { idvec_push(&p->scopes, p->undo.len); }
+
+static void scope_leave(Parser *p) {
+  uint32_t mark = p->scopes.data[--p->scopes.len];
+  while (p->undo.len > mark) {
+    uint32_t u = p->undo.data[--p->undo.len];
+    BindingHeads *h = &p->binds[u >> 1];
+    Binding **head = u & 1 ? &h->tag : &h->ord;
+    Binding *b = *head;
+    *head = b->shadowed;
+    b->shadowed = p->free_binds;
+    p->free_binds = b;
+  }
+}
+
+static Binding *scope_find_var(Parser *p, Ident name) {
+  return name < p->nbinds ? p->binds[name].ord : NULL;
+}
+
+static Binding *scope_find_tag(Parser *p, Ident name) {
+  return name < p->nbinds ? p->binds[name].tag : NULL;
+}
+
+// `b` if it is in the current scope.
+static Binding *scope_here(Parser *p, Binding *b) {
+  return b && b->depth == p->scopes.len ? b : NULL;
+}
+
+static Binding *scope_find_file_var(Parser *p, Ident name) {
+  Binding *b = scope_find_var(p, name);
+  while (b && b->depth)
+    b = b->shadowed;
+  return b;
+}
+
+static Binding *scope_push(Parser *p, Ident name, BindKind kind) {
+  if (name >= p->nbinds) {
+    uint32_t n = p->nbinds ? p->nbinds : 256;
+    while (n <= name)
+      n *= 2;
+    BindingHeads *binds = mem_malloc(MEM_AST, n * sizeof(*binds));
+    if (!binds)
+      die_oom("growing scopes");
+    if (p->nbinds)
+      memcpy(binds, p->binds, p->nbinds * sizeof(*binds));
+    memset(binds + p->nbinds, 0, (n - p->nbinds) * sizeof(*binds));
+    mem_free(MEM_AST, p->binds, p->nbinds * sizeof(*binds));
+    p->binds = binds;
+    p->nbinds = n;
+  }
+
+  Binding *b = p->free_binds;
+  if (b)
+    p->free_binds = b->shadowed;
+  else
+    b = AST_NEW(p->a, Binding);
+  bool is_tag = kind == BIND_TAG;
+  Binding **head = is_tag ? &p->binds[name].tag : &p->binds[name].ord;
+  *b = (Binding){.shadowed = *head, .depth = p->scopes.len, .kind = kind};
+  *head = b;
+  idvec_push(p->scopes.len ? &p->undo : &p->file_binds, name << 1 | is_tag);
+  return b;
+}
+
+// Take the file-scope bindings made since `file_binds` had `mark` entries off
+// their names' stacks, so that what is parsed next sees the file scope as it
+// was then, until scope_file_restore(). Only at file scope.
+static void scope_file_rewind(Parser *p, uint32_t mark) {
+  uint32_t n = p->file_binds.len - mark;
+  if (n > p->nhidden) {
+    Binding **buf = mem_malloc(MEM_AST, n * sizeof(*buf));
+    if (!buf)
+      die_oom("hiding bindings");
+    mem_free(MEM_AST, p->hidden, p->nhidden * sizeof(*buf));
+    p->hidden = buf;
+    p->nhidden = n;
+  }
+  for (uint32_t i = n; i-- > 0;) {
+    uint32_t u = p->file_binds.data[mark + i];
+    BindingHeads *h = &p->binds[u >> 1];
+    Binding **head = u & 1 ? &h->tag : &h->ord;
+    p->hidden[i] = *head;
+    *head = (*head)->shadowed;
+  }
+}
+
+static void scope_file_restore(Parser *p, uint32_t mark) {
+  for (uint32_t i = 0; i < p->file_binds.len - mark; i++) {
+    uint32_t u = p->file_binds.data[mark + i];
+    BindingHeads *h = &p->binds[u >> 1];
+    *(u & 1 ? &h->tag : &h->ord) = p->hidden[i];
+  }
+}
+
+static void scope_push_tag(Parser *p, Ident name, Type *ty) {
+  scope_push(p, name, BIND_TAG)->ty = ty;
+}
+
+// Refuse a second declaration of `name` in the current scope unless both are
+// of objects or functions, whose types the caller checks.
+static void parse_check_redecl(Parser *p, Ident name, SrcId loc, bool is_obj) {
+  Binding *b = scope_here(p, scope_find_var(p, name));
+  if (!b)
+    return;
+  if (!is_obj || b->kind != BIND_OBJ)
+    error_at(p->a, loc, "redefinition of '%s' as different kind of symbol",
+             ast_name(p->a, name));
+}
+
+static bool parse_is_typename(Parser *p, Token *tok) {
+  if (tok->kind == TK_IDENT) {
+    Binding *b = scope_find_var(p, parse_intern(p, tok));
+    return b && b->kind == BIND_TYPEDEF;
+  }
+  if (tok->kind != TK_KEYWORD)
+    return false;
+  switch (tok->kw) {
+  case KW_VOID:
+  case KW_BOOL:
+  case KW_CHAR:
+  case KW_SHORT:
+  case KW_INT:
+  case KW_LONG:
+  case KW_FLOAT:
+  case KW_DOUBLE:
+  case KW_SIGNED:
+  case KW_UNSIGNED:
+  case KW_COMPLEX:
+  case KW_IMAGINARY:
+  case KW_STRUCT:
+  case KW_UNION:
+  case KW_ENUM:
+  case KW_TYPEDEF:
+  case KW_STATIC:
+  case KW_EXTERN:
+  case KW_INLINE:
+  case KW_THREAD_LOCAL:
+  case KW_NORETURN:
+  case KW_AUTO:
+  case KW_REGISTER:
+  case KW_CONST:
+  case KW_VOLATILE:
+  case KW_RESTRICT:
+  case KW_ATOMIC:
+  case KW_ALIGNAS:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* constant folding */
+
+// `v` as a value of the integer type `ty`.
+static int64_t eval_wrap(const Type *ty, uint64_t v) {
+  if (ty->kind == TY_BOOL)
+    return v != 0;
+  switch (ty->kind == TY_PTR ? 8 : ty->size) {
+  case 1:
+    return ty_is_unsigned(ty) ? (int64_t)(uint8_t)v : (int8_t)v;
+  case 2:
+    return ty_is_unsigned(ty) ? (int64_t)(uint16_t)v : (int16_t)v;
+  case 4:
+    return ty_is_unsigned(ty) ? (int64_t)(uint32_t)v : (int32_t)v;
+  default:
+    return (int64_t)v;
+  }
+}
+
+static bool ex_is_const(const Expr *e) {
+  return e->kind == EX_NUM || e->kind == EX_FNUM;
+}
+
+// The value of the constant `e`. A long double holds every value of every
+// arithmetic type exactly.
+static long double fold_value(Parser *p, const Expr *e) {
+  if (e->kind == EX_FNUM)
+    return ast_fnum_value(p->a, e->fnum);
+  return ty_is_unsigned(e->ty) ? (long double)(uint64_t)e->ival
+                               : (long double)e->ival;
+}
+
+static bool fold_truth(Parser *p, const Expr *e) {
+  return e->kind == EX_FNUM ? ast_fnum_value(p->a, e->fnum) != 0
+                            : e->ival != 0;
+}
+
+// `l op r` computed in the floating type `ty`, so that it rounds as the
+// target would: the host's float, double and long double are the target's.
+static long double fold_float(ExprKind op, const Type *ty, long double l,
+                              long double r) {
+#define FOLD_FLOAT(T)                                                          \
+  switch (op) {                                                                \
+  case EX_ADD:                                                                 \
+    return (T)l + (T)r;                                                        \
+  case EX_SUB:                                                                 \
+    return (T)l - (T)r;                                                        \
+  case EX_MUL:                                                                 \
+    return (T)l * (T)r;                                                        \
+  default:                                                                     \
+    return (T)l / (T)r;                                                        \
+  }
+  if (ty->kind == TY_FLOAT)
+    FOLD_FLOAT(float)
+  if (ty->kind == TY_DOUBLE)
+    FOLD_FLOAT(double)
+  FOLD_FLOAT(long double)
+#undef FOLD_FLOAT
+}
+
+// `l op r` for integer operands of type `ty`, or NULL if C gives it no
+// value, in which case what is wrong with it: division by zero, signed
+// overflow, and shifts by a negative count or by at least the width of `ty`.
+static const char *fold_int(ExprKind op, const Type *ty, uint64_t l,
+                            uint64_t r, uint64_t *v) {
+  bool u = ty_is_unsigned(ty);
+  int64_t sv, sl = (int64_t)l, sr = (int64_t)r;
+  bool over = false;
+  switch (op) {
+  case EX_ADD:
+  case EX_SUB:
+  case EX_MUL:
+    if (u) {
+      *v = op == EX_ADD ? l + r : op == EX_SUB ? l - r : l * r;
+      return NULL;
+    }
+    if (op == EX_ADD)
+      over = __builtin_add_overflow(sl, sr, &sv);
+    else if (op == EX_SUB)
+      over = __builtin_sub_overflow(sl, sr, &sv);
+    else
+      over = __builtin_mul_overflow(sl, sr, &sv);
+    if (over || eval_wrap(ty, (uint64_t)sv) != sv)
+      return "integer overflow";
+    *v = (uint64_t)sv;
+    return NULL;
+  case EX_DIV:
+  case EX_MOD:
+    if (r == 0)
+      return "division by zero";
+    if (u) {
+      *v = op == EX_DIV ? l / r : l % r;
+      return NULL;
+    }
+    if (sr == -1) { // only the most negative value has no quotient
+      if (sl != INT64_MIN && eval_wrap(ty, -l) == -sl) {
+        *v = op == EX_DIV ? -l : 0;
+        return NULL;
+      }
+      return "integer overflow";
+    }
+    *v = op == EX_DIV ? (uint64_t)(sl / sr) : (uint64_t)(sl % sr);
+    return NULL;
+  case EX_BITAND:
+    *v = l & r;
+    return NULL;
+  case EX_BITOR:
+    *v = l | r;
+    return NULL;
+  case EX_BITXOR:
+    *v = l ^ r;
+    return NULL;
+  case EX_SHL:
+  case EX_SHR:
+    if (r >= (uint64_t)ty->size * 8)
+      return "shift count out of range";
+    if (op == EX_SHL) {
+      if (!u && (sl < 0 || sl >> (ty->size * 8 - 1 - r) != 0))
+        return "integer overflow";
+      *v = l << r;
+    } else {
+      *v = u ? l >> r : (uint64_t)(sl >> r);
+    }
+    return NULL;
+  case EX_EQ:
+    *v = l == r;
+    return NULL;
+  case EX_NE:
+    *v = l != r;
+    return NULL;
+  case EX_LT:
+    *v = u ? l < r : sl < sr;
+    return NULL;
+  case EX_LE:
+    *v = u ? l <= r : sl <= sr;
+    return NULL;
+  case EX_GT:
+    *v = u ? l > r : sl > sr;
+    return NULL;
+  case EX_GE:
+    *v = u ? l >= r : sl >= sr;
+    return NULL;
+  default:
+    INNER_DIE("fold_int: not an integer operator");
+  }
+}
+
+// The floating value `v` converted to the integer type `ty`, or false if it
+// is out of range, which C leaves undefined (C11 6.3.1.4).
+static bool fold_float_to_int(const Type *ty, long double v, uint64_t *out) {
+  if (ty->kind == TY_BOOL) {
+    *out = v != 0;
+    return true;
+  }
+  long double half = (long double)(UINT64_C(1) << (ty->size * 8 - 1));
+  if (ty_is_unsigned(ty)) {
+    if (!(v > -1 && v < 2 * half))
+      return false;
+    *out = (uint64_t)v;
+  } else {
+    if (!(v > -half - 1 && v < half))
+      return false;
+    *out = (uint64_t)(int64_t)v;
+  }
+  return true;
+}
+
+// Whether `e`, -l or ~l, negates the most negative value of a signed type.
+static bool fold_neg_overflows(const Expr *e, const Expr *l) {
+  return e->kind == EX_NEG && !ty_is_unsigned(e->ty) &&
+         (l->ival == INT64_MIN || eval_wrap(e->ty, -(uint64_t)l->ival) !=
+                                      -l->ival);
+}
+
+static void fold_to_int(Expr *e, uint64_t v) {
+  e->kind = EX_NUM;
+  e->flags = 0;
+  e->lhs = e->rhs = 0;
+  e->ival = eval_wrap(e->ty, v);
+}
+
+static void fold_to_float(Parser *p, Expr *e, long double v) {
+  e->kind = EX_FNUM;
+  e->flags = 0;
+  e->lhs = e->rhs = 0;
+  e->fnum = ast_fnum(p->a, v);
+}
+
+// Reduce the arithmetic expression `id`, just built from its operands, to
+// an EX_NUM or EX_FNUM if they are constants (C11 6.6), so that integer
+// constant expressions and static initializers arrive as a single value.
+// Operations without a value in C stay as they are, for parse_eval() to
+// report where a constant is required.
+static ExprId ex_fold(Parser *p, ExprId id) {
+  Expr *e = ex(p, id);
+  if (!ty_is_arith(e->ty))
+    return id;
+  switch (e->kind) {
+  case EX_CAST: {
+    Expr *l = ex(p, e->lhs);
+    uint64_t v;
+    if (!ex_is_const(l))
+      break;
+    if (ty_is_float(e->ty)) {
+      long double f = fold_value(p, l);
+      fold_to_float(p, e, e->ty->kind == TY_FLOAT    ? (float)f
+                          : e->ty->kind == TY_DOUBLE ? (double)f
+                                                     : f);
+    } else if (l->kind == EX_NUM) {
+      fold_to_int(e, (uint64_t)l->ival);
+    } else if (fold_float_to_int(e->ty, fold_value(p, l), &v)) {
+      fold_to_int(e, v);
+    }
+    break;
+  }
+  case EX_NEG:
+  case EX_BITNOT: {
+    Expr *l = ex(p, e->lhs);
+    if (l->kind == EX_FNUM)
+      fold_to_float(p, e, -ast_fnum_value(p->a, l->fnum));
+    else if (l->kind == EX_NUM && !fold_neg_overflows(e, l))
+      fold_to_int(e, e->kind == EX_NEG ? -(uint64_t)l->ival
+                                       : ~(uint64_t)l->ival);
+    break;
+  }
+  case EX_NOT:
+    if (ex_is_const(ex(p, e->lhs)))
+      fold_to_int(e, !fold_truth(p, ex(p, e->lhs)));
+    break;
+  case EX_LOGAND:
+  case EX_LOGOR: {
+    // The right operand is not evaluated once the left decides.
+    Expr *l = ex(p, e->lhs), *r = ex(p, e->rhs);
+    bool stop = e->kind == EX_LOGOR;
+    if (ex_is_const(l) && fold_truth(p, l) == stop)
+      fold_to_int(e, stop);
+    else if (ex_is_const(l) && ex_is_const(r))
+      fold_to_int(e, fold_truth(p, r));
+    break;
+  }
+  case EX_COND: {
+    Expr *c = ex(p, e->cond);
+    if (!ex_is_const(c))
+      break;
+    Expr *v = ex(p, fold_truth(p, c) ? e->lhs : e->rhs);
+    if (v->kind == EX_NUM)
+      fold_to_int(e, (uint64_t)v->ival);
+    else if (v->kind == EX_FNUM)
+      fold_to_float(p, e, ast_fnum_value(p->a, v->fnum));
+    break;
+  }
+  default: {
+    if (e->kind < EX_ADD || e->kind > EX_GE)
+      break;
+    Expr *l = ex(p, e->lhs), *r = ex(p, e->rhs);
+    uint64_t v;
+    if (!ex_is_const(l) || !ex_is_const(r))
+      break;
+    if (l->kind == EX_NUM && r->kind == EX_NUM) {
+      if (!fold_int((ExprKind)e->kind, l->ty, (uint64_t)l->ival,
+                    (uint64_t)r->ival, &v))
+        fold_to_int(e, v);
+    } else if (e->kind >= EX_EQ) {
+      long double lv = fold_value(p, l), rv = fold_value(p, r);
+      switch (e->kind) {
+      case EX_EQ:
+        fold_to_int(e, lv == rv);
+        break;
+      case EX_NE:
+        fold_to_int(e, lv != rv);
+        break;
+      case EX_LT:
+        fold_to_int(e, lv < rv);
+        break;
+      case EX_LE:
+        fold_to_int(e, lv <= rv);
+        break;
+      case EX_GT:
+        fold_to_int(e, lv > rv);
+        break;
+      default:
+        fold_to_int(e, lv >= rv);
+        break;
+      }
+    } else {
+      fold_to_float(p, e, fold_float((ExprKind)e->kind, e->ty,
+                                     fold_value(p, l), fold_value(p, r)));
+    }
+    break;
+  }
+  }
+  return id;
+}
+
+/* expression nodes */
+
+static ExprId ex_new(Parser *p, ExprKind kind, Type *ty, SrcId loc) {
+  ExprId id = ast_new_expr(p->a);
+  Expr *e = ex(p, id);
+  e->kind = (uint8_t)kind;
+  e->ty = ty;
+  e->loc = loc;
+  return id;
+}
+
+static ExprId ex_unary(Parser *p, ExprKind kind, Type *ty, ExprId lhs,
+                       SrcId loc) {
+  ExprId id = ex_new(p, kind, ty, loc);
+  ex(p, id)->lhs = lhs;
+  return id;
+}
+
+static ExprId ex_binary(Parser *p, ExprKind kind, Type *ty, ExprId lhs,
+                        ExprId rhs, SrcId loc) {
+  ExprId id = ex_new(p, kind, ty, loc);
+  ex(p, id)->lhs = lhs;
+  ex(p, id)->rhs = rhs;
+  return id;
+}
+
+static ExprId ex_num(Parser *p, int64_t val, Type *ty, SrcId loc) {
+  ExprId id = ex_new(p, EX_NUM, ty, loc);
+  ex(p, id)->ival = val;
+  return id;
+}
+
+static ExprId ex_var(Parser *p, ObjId var, SrcId loc) {
+  Obj *o = obj(p, var);
+  if (o->flags & OBJ_FUNC) {
+    if ((o->flags & (OBJ_LAZY | OBJ_USED)) == OBJ_LAZY)
+      idvec_push(&p->lazy, var); // parse_lazy_bodies() will want it
+    o->flags |= OBJ_USED;
+  }
+  ExprId id = ex_new(p, EX_VAR, o->ty, loc);
+  ex(p, id)->obj = var;
+  ex(p, id)->flags = EXF_LVALUE;
+  return id;
+}
+
+// The type of `ty`'s value as an operand: arrays and functions decay to
+// pointers (C11 6.3.2.1), and qualifiers go.
+static Type *value_type(Parser *p, Type *ty) {
+  if (ty->kind == TY_ARRAY)
+    return pointer_to(p->a, ty->base);
+  if (ty->kind == TY_FUNC)
+    return pointer_to(p->a, ty);
+  return unqualified(p->a, ty);
+}
+
+// Convert `id` to `ty`, which the caller has checked it may be.
+static ExprId ex_convert(Parser *p, ExprId id, Type *ty) {
+  Type *from = ex(p, id)->ty;
+  if (from == ty || (from->kind == ty->kind && ty->kind <= TY_LDOUBLE))
+    return id;
+  return ex_fold(p, ex_unary(p, EX_CAST, ty, id, ex(p, id)->loc));
+}
+
+static bool ex_is_null_const(Parser *p, ExprId id) {
+  Expr *e = ex(p, id);
+  while (e->kind == EX_CAST && ty_is_integer(e->ty))
+    e = ex(p, e->lhs);
+  return e->kind == EX_NUM && ty_is_integer(e->ty) && e->ival == 0;
+}
+
+// Convert `id` as if by assignment to an object of type `ty` (C11 6.5.16.1).
+static ExprId ex_assign_conv(Parser *p, ExprId id, Type *ty) {
+  Type *from = value_type(p, ex(p, id)->ty);
+  Type *to = unqualified(p->a, ty);
+  bool ok;
+  if (ty_is_arith(to))
+    ok = ty_is_arith(from) || (from->kind == TY_PTR && to->kind == TY_BOOL);
+  else if (to->kind == TY_PTR)
+    ok = from->kind == TY_PTR || ex_is_null_const(p, id);
+  else if (ty_is_record(to))
+    ok = to == from;
+  else
+    ok = false;
+  if (!ok)
+    error_at(p->a, ex(p, id)->loc,
+             "incompatible type '%s' where '%s' is expected",
+             type_str(p->a, ex(p, id)->ty), type_str(p->a, ty));
+  return ty_is_record(to) ? id : ex_convert(p, id, to);
+}
+
+static void ex_check_scalar(Parser *p, ExprId id) {
+  if (!ty_is_scalar(value_type(p, ex(p, id)->ty)))
+    error_at(p->a, ex(p, id)->loc,
+             "'%s' is not a scalar type where one is required",
+             type_str(p->a, ex(p, id)->ty));
+}
+
+static void ex_check_assignable(Parser *p, ExprId id, SrcId loc) {
+  Expr *e = ex(p, id);
+  if (!(e->flags & EXF_LVALUE) || e->ty->kind == TY_FUNC)
+    error_at(p->a, loc, "expression is not assignable");
+  if (e->ty->kind == TY_ARRAY)
+    error_at(p->a, loc, "array type '%s' is not assignable",
+             type_str(p->a, e->ty));
+  if (e->ty->qual & TQ_CONST)
+    error_at(p->a, loc, "cannot assign to an lvalue of const-qualified type "
+                        "'%s'", type_str(p->a, e->ty));
+}
+
+// `lhs` +/- the integer `rhs` elements, for a pointer `pty`.
+static ExprId ex_ptr_offset(Parser *p, ExprKind kind, Type *pty, ExprId lhs,
+                            ExprId rhs, SrcId loc) {
+  if (type_size(pty->base) < 0)
+    error_at(p->a, loc, "arithmetic on a pointer to an incomplete type '%s'",
+             type_str(p->a, pty->base));
+  return ex_binary(p, kind, pty, ex_convert(p, lhs, pty),
+                   ex_convert(p, rhs, ty_of(TY_LONG)), loc);
+}
+
+// Build `lhs op rhs` for a binary operator other than assignment, comma and
+// ?:, converting the operands as the operator requires.
+static ExprId ex_binop(Parser *p, ExprKind kind, ExprId lhs, ExprId rhs,
+                       SrcId loc) {
+  Type *lt = value_type(p, ex(p, lhs)->ty);
+  Type *rt = value_type(p, ex(p, rhs)->ty);
+  bool arith = ty_is_arith(lt) && ty_is_arith(rt);
+  bool integer = ty_is_integer(lt) && ty_is_integer(rt);
+  switch (kind) {
+  case EX_ADD:
+    if (arith)
+      break;
+    if (lt->kind == TY_PTR && ty_is_integer(rt))
+      return ex_ptr_offset(p, kind, lt, lhs, rhs, loc);
+    if (ty_is_integer(lt) && rt->kind == TY_PTR)
+      return ex_ptr_offset(p, kind, rt, rhs, lhs, loc);
+    goto invalid;
+  case EX_SUB:
+    if (arith)
+      break;
+    if (lt->kind == TY_PTR && ty_is_integer(rt))
+      return ex_ptr_offset(p, kind, lt, lhs, rhs, loc);
+    if (lt->kind == TY_PTR && rt->kind == TY_PTR) {
+      if (!type_compatible(unqualified(p->a, lt->base),
+                           unqualified(p->a, rt->base)))
+        goto invalid;
+      if (type_size(lt->base) < 0)
+        error_at(p->a, loc,
+                 "arithmetic on a pointer to an incomplete type '%s'",
+                 type_str(p->a, lt->base));
+      return ex_binary(p, kind, ty_of(TY_LONG), ex_convert(p, lhs, lt),
+                       ex_convert(p, rhs, rt), loc);
+    }
+    goto invalid;
+  case EX_MUL:
+  case EX_DIV:
+    if (!arith)
+      goto invalid;
+    break;
+  case EX_MOD:
+  case EX_BITAND:
+  case EX_BITOR:
+  case EX_BITXOR:
+    if (!integer)
+      goto invalid;
+    break;
+  case EX_SHL:
+  case EX_SHR:
+    if (!integer)
+      goto invalid;
+    lt = type_promote(lt);
+    return ex_fold(p, ex_binary(p, kind, lt, ex_convert(p, lhs, lt),
+                                ex_convert(p, rhs, type_promote(rt)), loc));
+  case EX_EQ:
+  case EX_NE:
+  case EX_LT:
+  case EX_LE:
+  case EX_GT:
+  case EX_GE: {
+    Type *ct;
+    if (arith)
+      ct = usual_arith(lt, rt);
+    else if (lt->kind == TY_PTR && (rt->kind == TY_PTR || ty_is_integer(rt)))
+      ct = lt;
+    else if (ty_is_integer(lt) && rt->kind == TY_PTR)
+      ct = rt;
+    else
+      goto invalid;
+    return ex_fold(p, ex_binary(p, kind, ty_of(TY_INT),
+                                ex_convert(p, lhs, ct), ex_convert(p, rhs, ct),
+                                loc));
+  }
+  case EX_LOGAND:
+  case EX_LOGOR:
+    if (!ty_is_scalar(lt) || !ty_is_scalar(rt))
+      goto invalid;
+    return ex_fold(p, ex_binary(p, kind, ty_of(TY_INT), lhs, rhs, loc));
+  default:
+    INNER_DIE("ex_binop: not a binary operator");
+  }
+
+  Type *ty = usual_arith(lt, rt);
+  return ex_fold(p, ex_binary(p, kind, ty, ex_convert(p, lhs, ty),
+                              ex_convert(p, rhs, ty), loc));
+
+invalid:
+  error_at(p->a, loc, "invalid operands to binary expression ('%s' and '%s')",
+           type_str(p->a, ex(p, lhs)->ty), type_str(p->a, ex(p, rhs)->ty));
+}
+
+// `lhs = rhs`, or the compound assignment `lhs op= rhs`, whose operation is
+// done in rhs's type (the type `lhs op rhs` would be computed in; for shifts
+// and pointer arithmetic, lhs's).
+static ExprId ex_assign(Parser *p, ExprKind op, ExprId lhs, ExprId rhs,
+                        SrcId loc) {
+  ex_check_assignable(p, lhs, loc);
+  Type *lt = unqualified(p->a, ex(p, lhs)->ty);
+  Type *rt = value_type(p, ex(p, rhs)->ty);
+  if (op == EX_ASSIGN) {
+    rhs = ex_assign_conv(p, rhs, lt);
+  } else if ((op == EX_ADD || op == EX_SUB) && lt->kind == TY_PTR) {
+    if (!ty_is_integer(rt))
+      goto invalid;
+    if (type_size(lt->base) < 0)
+      error_at(p->a, loc, "arithmetic on a pointer to an incomplete type '%s'",
+               type_str(p->a, lt->base));
+    rhs = ex_convert(p, rhs, ty_of(TY_LONG));
+  } else {
+    bool integer_op = op == EX_MOD || op == EX_SHL || op == EX_SHR ||
+                      op == EX_BITAND || op == EX_BITOR || op == EX_BITXOR;
+    if (integer_op ? !ty_is_integer(lt) || !ty_is_integer(rt)
+                   : !ty_is_arith(lt) || !ty_is_arith(rt))
+      goto invalid;
+    if (op == EX_SHL || op == EX_SHR)
+      rhs = ex_convert(p, rhs, type_promote(rt));
+    else
+      rhs = ex_convert(p, rhs, usual_arith(lt, rt));
+  }
+  ExprId id = ex_binary(p, EX_ASSIGN, lt, lhs, rhs, loc);
+  ex(p, id)->aux = (uint8_t)op;
+  return id;
+
+invalid:
+  error_at(p->a, loc, "invalid operands to binary expression ('%s' and '%s')",
+           type_str(p->a, ex(p, lhs)->ty), type_str(p->a, ex(p, rhs)->ty));
+}
+
+static ExprId ex_comma(Parser *p, ExprId lhs, ExprId rhs, SrcId loc) {
+  if (!lhs)
+    return rhs;
+  if (!rhs)
+    return lhs;
+  // Kept even with constant operands: a comma expression is never a
+  // constant expression (C11 6.6p3), nor so a null pointer constant.
+  return ex_binary(p, EX_COMMA, value_type(p, ex(p, rhs)->ty), lhs, rhs, loc);
+}
+
+static ExprId ex_cond(Parser *p, ExprId cond, ExprId then, ExprId els,
+                      SrcId loc) {
+  Type *tt = value_type(p, ex(p, then)->ty);
+  Type *et = value_type(p, ex(p, els)->ty);
+  Type *ty;
+  if (ty_is_arith(tt) && ty_is_arith(et))
+    ty = usual_arith(tt, et);
+  else if (tt->kind == TY_VOID && et->kind == TY_VOID)
+    ty = tt;
+  else if (ty_is_record(tt) && tt == et)
+    ty = tt;
+  else if (tt->kind == TY_PTR && et->kind == TY_PTR)
+    ty = et->base->kind == TY_VOID ? et : tt;
+  else if (tt->kind == TY_PTR && ex_is_null_const(p, els))
+    ty = tt;
+  else if (ex_is_null_const(p, then) && et->kind == TY_PTR)
+    ty = et;
+  else
+    error_at(p->a, loc, "incompatible operand types ('%s' and '%s')",
+             type_str(p->a, ex(p, then)->ty), type_str(p->a, ex(p, els)->ty));
+  if (!ty_is_record(ty) && ty->kind != TY_VOID) {
+    then = ex_convert(p, then, ty);
+    els = ex_convert(p, els, ty);
+  }
+  ExprId id = ex_binary(p, EX_COND, ty, then, els, loc);
+  ex(p, id)->cond = cond;
+  return ex_fold(p, id);
+}
+
+static ExprId ex_deref(Parser *p, ExprId id, SrcId loc) {
+  Type *ty = value_type(p, ex(p, id)->ty);
+  if (ty->kind != TY_PTR)
+    error_at(p->a, loc, "indirection requires pointer operand ('%s' invalid)",
+             type_str(p->a, ex(p, id)->ty));
+  ExprId e = ex_unary(p, EX_DEREF, ty->base, ex_convert(p, id, ty), loc);
+  if (ty->base->kind != TY_VOID)
+    ex(p, e)->flags = EXF_LVALUE;
+  return e;
+}
+
+static ExprId ex_addr(Parser *p, ExprId id, SrcId loc) {
+  Expr *e = ex(p, id);
+  if (e->flags & EXF_BITFIELD)
+    error_at(p->a, loc, "address of bit-field requested");
+  if (!(e->flags & EXF_LVALUE))
+    error_at(p->a, loc, "cannot take the address of an rvalue of type '%s'",
+             type_str(p->a, e->ty));
+  return ex_unary(p, EX_ADDR, pointer_to(p->a, e->ty), id, loc);
+}
+
+static bool type_has_member(Type *ty, Ident name) {
+  for (Member *m = ty->tag->members; m; m = m->next)
+    if (m->name == name ||
+        (!m->name && ty_is_record(m->ty) && type_has_member(m->ty, name)))
+      return true;
+  return false;
+}
+
+static ExprId ex_member_of(Parser *p, ExprId lhs, Member *m, SrcId loc) {
+  Expr *l = ex(p, lhs);
+  Type *ty = l->ty->qual ? qualified(p->a, m->ty, l->ty->qual) : m->ty;
+  uint16_t flags = l->flags & EXF_LVALUE;
+  if (m->bit_width >= 0)
+    flags |= EXF_BITFIELD;
+  ExprId id = ex_unary(p, EX_MEMBER, ty, lhs, loc);
+  ex(p, id)->member = m;
+  ex(p, id)->flags = flags;
+  return id;
+}
+
+// `lhs.name`, through anonymous structs and unions if need be.
+static ExprId ex_member(Parser *p, ExprId lhs, Ident name, SrcId loc) {
+  Type *ty = ex(p, lhs)->ty;
+  if (!ty_is_record(ty))
+    error_at(p->a, loc,
+             "member reference base type '%s' is not a structure or union",
+             type_str(p->a, ty));
+  if (!ty->tag->complete)
+    error_at(p->a, loc, "incomplete definition of type '%s'",
+             type_str(p->a, ty));
+  for (Member *m = ty->tag->members; m; m = m->next) {
+    if (m->name == name)
+      return ex_member_of(p, lhs, m, loc);
+    if (!m->name && ty_is_record(m->ty) && type_has_member(m->ty, name))
+      return ex_member(p, ex_member_of(p, lhs, m, loc), name, loc);
+  }
+  error_at(p->a, loc, "no member named '%s' in '%s'", ast_name(p->a, name),
+           type_str(p->a, ty));
+}
+
+static Type *str_elem_type(StrEnc enc) {
+  switch (enc) {
+  case STR_UTF16:
+    return ty_of(TY_USHORT);
+  case STR_UTF32:
+    return ty_of(TY_UINT);
+  case STR_WIDE:
+    return ty_of(TY_INT);
+  default:
+    return ty_of(TY_CHAR);
+  }
+}
+
+static ExprId ex_string(Parser *p, const char *data, int64_t len, StrEnc enc,
+                        SrcId loc) {
+  Type *ty = array_of(p->a, str_elem_type(enc), len + 1);
+  ExprId id = ex_new(p, EX_STR, ty, loc);
+  ex(p, id)->str = ast_str(p->a, data, len, enc);
+  ex(p, id)->flags = EXF_LVALUE;
+  return id;
+}
+
+/* constant expressions */
+
+// The part of `id`, which did not fold to a constant, that keeps it from
+// being one: the innermost operand that is not constant, or else the
+// operation itself.
+static Expr *ex_nonconst(Parser *p, ExprId id) {
+  Expr *e = ex(p, id);
+  switch (e->kind) {
+  case EX_COND:
+    if (!ex_is_const(ex(p, e->cond)))
+      return ex_nonconst(p, e->cond);
+    return ex_nonconst(p, fold_truth(p, ex(p, e->cond)) ? e->lhs : e->rhs);
+  case EX_CAST:
+  case EX_NEG:
+  case EX_NOT:
+  case EX_BITNOT:
+    if (ty_is_arith(e->ty) && !ex_is_const(ex(p, e->lhs)))
+      return ex_nonconst(p, e->lhs);
+    return e;
+  case EX_COMMA:
+  case EX_LOGAND:
+  case EX_LOGOR:
+    break;
+  default:
+    if (e->kind < EX_ADD || e->kind > EX_GE || !ty_is_arith(e->ty))
+      return e;
+    break;
+  }
+  if (!ex_is_const(ex(p, e->lhs)))
+    return ex_nonconst(p, e->lhs);
+  if (!ex_is_const(ex(p, e->rhs)))
+    return ex_nonconst(p, e->rhs);
+  return e;
+}
+
+// Report the arithmetic expression `id`, which did not fold, where a constant
+// is required: as the operation with no value that it holds, if any, or else
+// with `msg` at the part that is not constant.
+static _Noreturn void error_nonconst(Parser *p, ExprId id, const char *msg) {
+  Expr *e = ex_nonconst(p, id);
+  Expr *l = e->lhs ? ex(p, e->lhs) : NULL;
+  Expr *r = e->rhs ? ex(p, e->rhs) : NULL;
+  const char *why = NULL;
+  uint64_t v;
+  if (e->kind >= EX_ADD && e->kind <= EX_GE && ty_is_integer(e->ty) &&
+      l->kind == EX_NUM && r->kind == EX_NUM)
+    why = fold_int((ExprKind)e->kind, l->ty, (uint64_t)l->ival,
+                   (uint64_t)r->ival, &v);
+  else if (e->kind == EX_NEG && l->kind == EX_NUM && fold_neg_overflows(e, l))
+    why = "integer overflow";
+  else if (e->kind == EX_CAST && ty_is_integer(e->ty) && l->kind == EX_FNUM &&
+           !fold_float_to_int(e->ty, ast_fnum_value(p->a, l->fnum), &v))
+    why = "value out of range"; // undefined (C11 6.3.1.4)
+  if (why)
+    error_at(p->a, e->loc, "%s in a constant expression", why);
+  error_at(p->a, e->loc, "%s", msg);
+}
+
+// Evaluate the integer constant expression `id` (C11 6.6), which ex_fold()
+// has reduced to an EX_NUM if it is one. If it is not, clear *ok, or report
+// it when `ok` is NULL.
+static int64_t parse_eval(Parser *p, ExprId id, bool *ok) {
+  Expr *e = ex(p, id);
+  if (e->kind == EX_NUM && ty_is_integer(e->ty))
+    return e->ival;
+  if (ok) {
+    *ok = false;
+    return 0;
+  }
+  error_nonconst(p, id, "expression is not an integer constant expression");
+}
+
+/* expressions */
+
+static ExprId parse_expr(Parser *p);
+static ExprId parse_assign(Parser *p);
+static ExprId parse_cast(Parser *p);
+static ExprId parse_unary(Parser *p);
+static ExprId parse_postfix_tail(Parser *p, ExprId e);
+static Type *parse_typename(Parser *p);
+static StmtId parse_compound(Parser *p);
+static ExprId parse_compound_literal(Parser *p, Type *ty, SrcId loc);
+static ObjId parse_new_obj(Parser *p, Ident name, SrcId loc, Type *ty,
+                           uint16_t flags, int align);
+
+static int64_t parse_const_expr(Parser *p);
+
+static ExprId parse_number(Parser *p, Token *tok, SrcId loc) {
+  static const TypeKind kinds[] = {
+      [NUM_INT] = TY_INT,       [NUM_UINT] = TY_UINT,
+      [NUM_LONG] = TY_LONG,     [NUM_ULONG] = TY_ULONG,
+      [NUM_LLONG] = TY_LLONG,   [NUM_ULLONG] = TY_ULLONG,
+      [NUM_USHORT] = TY_USHORT, [NUM_FLOAT] = TY_FLOAT,
+      [NUM_DOUBLE] = TY_DOUBLE, [NUM_LDOUBLE] = TY_LDOUBLE,
+  };
+  Type *ty = ty_of(kinds[tok->num_type]);
+  if (!num_is_float(tok->num_type))
+    return ex_num(p, (int64_t)tok->ival, ty, loc);
+  ExprId id = ex_new(p, EX_FNUM, ty, loc);
+  ex(p, id)->fnum = ast_fnum(p->a, tok->fval);
+  return id;
+}
+
+// _Generic ( assignment-expression , generic-assoc-list ) (C11 6.5.1.1)
+static ExprId parse_generic(Parser *p, SrcId loc) {
+  parse_expect(p, P_LPAREN);
+  ExprId ctl = parse_assign(p);
+  Type *ty = value_type(p, ex(p, ctl)->ty);
+  ExprId result = 0, def = 0;
+  while (parse_consume(p, P_COMMA)) {
+    if (tok_is_kw(parse_peek(p), KW_DEFAULT)) {
+      SrcId dloc = parse_loc(p);
+      lex_advance(p->lex);
+      parse_expect(p, P_COLON);
+      if (def)
+        error_at(p->a, dloc, "duplicate default generic association");
+      def = parse_assign(p);
+      continue;
+    }
+    Type *t = parse_typename(p);
+    parse_expect(p, P_COLON);
+    ExprId e = parse_assign(p);
+    if (!result && type_compatible(ty, t))
+      result = e;
+  }
+  parse_expect(p, P_RPAREN);
+  if (!result)
+    result = def;
+  if (!result)
+    error_at(p->a, loc,
+             "controlling expression type '%s' not compatible with any "
+             "generic association type",
+             type_str(p->a, ty));
+  return result;
+}
+
+// ({ ... }), a GNU statement expression: its value is the last statement's.
+static ExprId parse_stmt_expr(Parser *p, SrcId loc) {
+  StmtId body = parse_compound(p);
+  parse_expect(p, P_RPAREN);
+  Stmt *s = st(p, body);
+  Type *ty = ty_of(TY_VOID);
+  if (s->n && st(p, s->items[s->n - 1])->kind == ST_EXPR)
+    ty = value_type(p, ex(p, st(p, s->items[s->n - 1])->expr)->ty);
+  ExprId id = ex_new(p, EX_STMT_EXPR, ty, loc);
+  ex(p, id)->body = body;
+  return id;
+}
+
+static ExprId parse_primary(Parser *p) {
+  Token *tok = parse_peek(p);
+  SrcId loc = ast_loc(p->a, tok);
+
+  if (tok_is(tok, P_LPAREN)) {
+    if (tok_is(parse_peek2(p), P_LBRACE)) {
+      lex_advance(p->lex);
+      return parse_stmt_expr(p, loc);
+    }
+    lex_advance(p->lex);
+    ExprId e = parse_expr(p);
+    parse_expect(p, P_RPAREN);
+    return e;
+  }
+
+  if (tok->kind == TK_NUM) {
+    ExprId e = parse_number(p, tok, loc);
+    lex_advance(p->lex);
+    return e;
+  }
+
+  if (tok->kind == TK_STR) {
+    ExprId e = ex_string(p, tok->str, tok->str_len, tok->str_enc, loc);
+    lex_advance(p->lex);
+    return e;
+  }
+
+  if (tok_is_kw(tok, KW_GENERIC)) {
+    lex_advance(p->lex);
+    return parse_generic(p, loc);
+  }
+
+  if (tok->kind == TK_IDENT) {
+    Ident name = parse_ident(p, NULL);
+    Binding *b = scope_find_var(p, name);
+    if (b && b->kind == BIND_PARAM) { // in a later parameter's declarator
+      b->kind = BIND_OBJ;
+      b->obj = parse_new_obj(p, name, loc, b->ty, OBJ_LOCAL | OBJ_PARAM, 0);
+    }
+    if (b && b->kind == BIND_OBJ)
+      return ex_var(p, b->obj, loc);
+    if (b && b->kind == BIND_ENUM_CONST)
+      return ex_num(p, b->enum_val, ty_of(TY_INT), loc);
+    if (b)
+      error_at(p->a, loc, "unexpected type name '%s': expected expression",
+               ast_name(p->a, name));
+    if (p->fn && !strcmp(ast_name(p->a, name), "__func__")) {
+      Obj *fn = obj(p, p->fn);
+      const char *s = ast_name(p->a, fn->name);
+      return ex_string(p, s, (int64_t)strlen(s), STR_CHAR, loc);
+    }
+    if (parse_at(p, P_LPAREN))
+      error_at(p->a, loc, "implicit declaration of function '%s'",
+               ast_name(p->a, name));
+    error_at(p->a, loc, "use of undeclared identifier '%s'",
+             ast_name(p->a, name));
+  }
+
+  error_tok(tok, "expected expression");
+}
+
+// The default argument promotions (C11 6.5.2.2p6).
+static ExprId ex_promote_arg(Parser *p, ExprId id) {
+  Type *ty = value_type(p, ex(p, id)->ty);
+  if (ty->kind == TY_FLOAT)
+    return ex_convert(p, id, ty_of(TY_DOUBLE));
+  if (ty_is_integer(ty))
+    return ex_convert(p, id, type_promote(ty));
+  return ex_convert(p, id, ty);
+}
+
+static ExprId parse_call(Parser *p, ExprId fn, SrcId loc) {
+  lex_advance(p->lex); // (
+  Type *ft = value_type(p, ex(p, fn)->ty);
+  if (ft->kind != TY_PTR || ft->base->kind != TY_FUNC)
+    error_at(p->a, loc,
+             "called object type '%s' is not a function or function pointer",
+             type_str(p->a, ex(p, fn)->ty));
+  ft = ft->base;
+
+  uint32_t base = p->stack.len;
+  int n = 0;
+  if (!parse_consume(p, P_RPAREN)) {
+    for (;; n++) {
+      ExprId arg = parse_assign(p);
+      if (ft->prototyped && n < ft->nparams)
+        arg = ex_assign_conv(p, arg, ft->params[n]);
+      else if (ft->prototyped && !ft->variadic)
+        error_at(p->a, ex(p, arg)->loc,
+                 "too many arguments to function call, expected %d",
+                 ft->nparams);
+      else
+        arg = ex_promote_arg(p, arg);
+      idvec_push(&p->stack, arg);
+      if (!parse_consume(p, P_COMMA)) {
+        parse_expect(p, P_RPAREN);
+        n++;
+        break;
+      }
+    }
+  }
+  if (ft->prototyped && n < ft->nparams)
+    error_at(p->a, loc, "too few arguments to function call, expected %d, "
+                        "have %d", ft->nparams, n);
+
+  ExprId id = ex_new(p, EX_CALL, ft->base, loc);
+  Expr *e = ex(p, id);
+  e->lhs = fn;
+  e->args = ast_list(p->a, &p->stack, base, &e->rhs);
+  return id;
+}
+
+static bool parse_is_postfix_op(Token *tok) {
+  if (tok->kind != TK_PUNCT)
+    return false;
+  switch (tok->punct) {
+  case P_LPAREN:
+  case P_LBRACKET:
+  case P_DOT:
+  case P_ARROW:
+  case P_INC:
+  case P_DEC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static ExprId parse_postfix_tail(Parser *p, ExprId e) {
+  for (;;) {
+    Token *tok = parse_peek(p);
+    if (!parse_is_postfix_op(tok)) // the "," or ";" ending most operands
+      return e;                    // needs no location
+    SrcId loc = ast_loc(p->a, tok);
+    switch (tok->punct) {
+    case P_LPAREN:
+      e = parse_call(p, e, loc);
+      break;
+    case P_LBRACKET: {
+      lex_advance(p->lex);
+      ExprId idx = parse_expr(p);
+      parse_expect(p, P_RBRACKET);
+      e = ex_deref(p, ex_binop(p, EX_ADD, e, idx, loc), loc);
+      break;
+    }
+    case P_DOT:
+      lex_advance(p->lex);
+      e = ex_member(p, e, parse_ident(p, NULL), loc);
+      break;
+    case P_ARROW:
+      lex_advance(p->lex);
+      e = ex_member(p, ex_deref(p, e, loc), parse_ident(p, NULL), loc);
+      break;
+    case P_INC:
+    case P_DEC: {
+      ExprKind kind = tok->punct == P_INC ? EX_POSTINC : EX_POSTDEC;
+      lex_advance(p->lex);
+      ex_check_assignable(p, e, loc);
+      Type *ty = value_type(p, ex(p, e)->ty);
+      if (!ty_is_scalar(ty))
+        error_at(p->a, loc, "cannot increment value of type '%s'",
+                 type_str(p->a, ty));
+      if (ty->kind == TY_PTR && type_size(ty->base) < 0)
+        error_at(p->a, loc,
+                 "arithmetic on a pointer to an incomplete type '%s'",
+                 type_str(p->a, ty->base));
+      e = ex_unary(p, kind, ty, e, loc);
+      break;
+    }
+    default:
+      return e;
+    }
+  }
+}
+
+// sizeof / _Alignof: of a parenthesized type name, or of an expression.
+static Type *parse_sizeof_operand(Parser *p, bool *is_expr, ExprId *expr) {
+  if (parse_at(p, P_LPAREN) && parse_is_typename(p, parse_peek2(p))) {
+    SrcId loc = parse_loc(p);
+    lex_advance(p->lex);
+    Type *ty = parse_typename(p);
+    parse_expect(p, P_RPAREN);
+    if (!parse_at(p, P_LBRACE)) {
+      *is_expr = false;
+      return ty;
+    }
+    *expr = parse_postfix_tail(p, parse_compound_literal(p, ty, loc));
+  } else {
+    *expr = parse_unary(p);
+  }
+  *is_expr = true;
+  return ex(p, *expr)->ty;
+}
+
+static ExprId parse_unary(Parser *p) {
+  Token *tok = parse_peek(p);
+  SrcId loc = ast_loc(p->a, tok);
+
+  if (tok_is_kw(tok, KW_SIZEOF) || tok_is_kw(tok, KW_ALIGNOF)) {
+    bool is_sizeof = tok_is_kw(tok, KW_SIZEOF), is_expr;
+    const char *what = is_sizeof ? "sizeof" : "_Alignof";
+    lex_advance(p->lex);
+    ExprId e = 0;
+    Type *ty = parse_sizeof_operand(p, &is_expr, &e);
+    if (ty->kind == TY_FUNC)
+      error_at(p->a, loc, "invalid application of '%s' to a function type",
+               what);
+    if (is_expr && (ex(p, e)->flags & EXF_BITFIELD))
+      error_at(p->a, loc, "invalid application of '%s' to bit-field", what);
+    if (type_size(ty) < 0 && (is_sizeof || ty->kind != TY_ARRAY))
+      error_at(p->a, loc, "invalid application of '%s' to an incomplete "
+                          "type '%s'", what, type_str(p->a, ty));
+    return ex_num(p, is_sizeof ? type_size(ty) : type_align(ty),
+                  ty_of(TY_ULONG), loc);
+  }
+
+  if (tok->kind != TK_PUNCT)
+    return parse_postfix_tail(p, parse_primary(p));
+
+  Punct op = tok->punct;
+  switch (op) {
+  case P_PLUS:
+  case P_MINUS:
+  case P_TILDE: {
+    lex_advance(p->lex);
+    ExprId e = parse_cast(p);
+    Type *ty = value_type(p, ex(p, e)->ty);
+    if (op == P_TILDE ? !ty_is_integer(ty) : !ty_is_arith(ty))
+      error_at(p->a, loc, "invalid argument type '%s' to unary expression",
+               type_str(p->a, ex(p, e)->ty));
+    ty = type_promote(ty);
+    e = ex_convert(p, e, ty);
+    if (op == P_PLUS)
+      return ex(p, e)->kind == EX_CAST || ex_is_const(ex(p, e))
+                 ? e
+                 : ex_unary(p, EX_CAST, ty, e, loc);
+    return ex_fold(p,
+                   ex_unary(p, op == P_MINUS ? EX_NEG : EX_BITNOT, ty, e, loc));
+  }
+  case P_NOT: {
+    lex_advance(p->lex);
+    ExprId e = parse_cast(p);
+    ex_check_scalar(p, e);
+    return ex_fold(p, ex_unary(p, EX_NOT, ty_of(TY_INT), e, loc));
+  }
+  case P_AMP:
+    lex_advance(p->lex);
+    return ex_addr(p, parse_cast(p), loc);
+  case P_STAR:
+    lex_advance(p->lex);
+    return ex_deref(p, parse_cast(p), loc);
+  case P_INC:
+  case P_DEC: {
+    lex_advance(p->lex);
+    ExprId e = parse_unary(p);
+    if (!ty_is_scalar(value_type(p, ex(p, e)->ty)))
+      error_at(p->a, loc, "cannot increment value of type '%s'",
+               type_str(p->a, ex(p, e)->ty));
+    return ex_assign(p, op == P_INC ? EX_ADD : EX_SUB, e,
+                     ex_num(p, 1, ty_of(TY_INT), loc), loc);
+  }
+  default:
+    return parse_postfix_tail(p, parse_primary(p));
+  }
+}
+
+static ExprId parse_cast(Parser *p) {
+  if (!parse_at(p, P_LPAREN) || !parse_is_typename(p, parse_peek2(p)))
+    return parse_unary(p);
+
+  SrcId loc = parse_loc(p);
+  lex_advance(p->lex);
+  Type *ty = parse_typename(p);
+  parse_expect(p, P_RPAREN);
+  if (parse_at(p, P_LBRACE))
+    return parse_postfix_tail(p, parse_compound_literal(p, ty, loc));
+
+  ExprId e = parse_cast(p);
+  Type *from = value_type(p, ex(p, e)->ty);
+  if (ty->kind != TY_VOID) {
+    if (!ty_is_scalar(ty))
+      error_at(p->a, loc, "used type '%s' where arithmetic or pointer type "
+                          "is required", type_str(p->a, ty));
+    if (!ty_is_scalar(from) || (ty_is_float(ty) && from->kind == TY_PTR) ||
+        (ty->kind == TY_PTR && ty_is_float(from)))
+      error_at(p->a, loc, "cannot cast from '%s' to '%s'",
+               type_str(p->a, ex(p, e)->ty), type_str(p->a, ty));
+  }
+  return ex_fold(p, ex_unary(p, EX_CAST, unqualified(p->a, ty), e, loc));
+}
+
+// Binding strength of the binary operators, the conditional operator, the
+// assignments and the comma, loosest first; 0 is none.
+enum {
+  PREC_COMMA = 1,
+  PREC_ASSIGN,
+  PREC_COND,
+  PREC_LOGOR,
+  PREC_LOGAND,
+  PREC_BITOR,
+  PREC_BITXOR,
+  PREC_BITAND,
+  PREC_EQUALITY,
+  PREC_RELATIONAL,
+  PREC_SHIFT,
+  PREC_ADD,
+  PREC_MUL,
+};
+
+// Infix operators by punctuator. `kind` is the operation; for compound
+// assignments, the operation they assign the result of.
+static const struct {
+  uint8_t prec;
+  uint8_t kind; // ExprKind
+} binops[P_COUNT] = {
+    [P_COMMA] = {PREC_COMMA, EX_COMMA},
+    [P_ASSIGN] = {PREC_ASSIGN, EX_ASSIGN},
+    [P_MUL_ASSIGN] = {PREC_ASSIGN, EX_MUL},
+    [P_DIV_ASSIGN] = {PREC_ASSIGN, EX_DIV},
+    [P_MOD_ASSIGN] = {PREC_ASSIGN, EX_MOD},
+    [P_ADD_ASSIGN] = {PREC_ASSIGN, EX_ADD},
+    [P_SUB_ASSIGN] = {PREC_ASSIGN, EX_SUB},
+    [P_SHL_ASSIGN] = {PREC_ASSIGN, EX_SHL},
+    [P_SHR_ASSIGN] = {PREC_ASSIGN, EX_SHR},
+    [P_AND_ASSIGN] = {PREC_ASSIGN, EX_BITAND},
+    [P_XOR_ASSIGN] = {PREC_ASSIGN, EX_BITXOR},
+    [P_OR_ASSIGN] = {PREC_ASSIGN, EX_BITOR},
+    [P_QUESTION] = {PREC_COND, EX_COND},
+    [P_LOGOR] = {PREC_LOGOR, EX_LOGOR},
+    [P_LOGAND] = {PREC_LOGAND, EX_LOGAND},
+    [P_OR] = {PREC_BITOR, EX_BITOR},
+    [P_XOR] = {PREC_BITXOR, EX_BITXOR},
+    [P_AMP] = {PREC_BITAND, EX_BITAND},
+    [P_EQ] = {PREC_EQUALITY, EX_EQ},
+    [P_NE] = {PREC_EQUALITY, EX_NE},
+    [P_LT] = {PREC_RELATIONAL, EX_LT},
+    [P_LE] = {PREC_RELATIONAL, EX_LE},
+    [P_GT] = {PREC_RELATIONAL, EX_GT},
+    [P_GE] = {PREC_RELATIONAL, EX_GE},
+    [P_SHL] = {PREC_SHIFT, EX_SHL},
+    [P_SHR] = {PREC_SHIFT, EX_SHR},
+    [P_PLUS] = {PREC_ADD, EX_ADD},
+    [P_MINUS] = {PREC_ADD, EX_SUB},
+    [P_STAR] = {PREC_MUL, EX_MUL},
+    [P_SLASH] = {PREC_MUL, EX_DIV},
+    [P_PERCENT] = {PREC_MUL, EX_MOD},
+};
+
+// An expression of operators binding at least as tightly as `min_prec`
+// (C11 6.5.5-6.5.17), by precedence climbing: a cast expression, then each
+// operator in turn takes as its right operand what binds tighter than it
+// (as tightly, for the right-associative ones). This is the grammar's
+// layering without a call per level for every operand.
+static ExprId parse_binary(Parser *p, int min_prec) {
+  ExprId e = parse_cast(p);
+  for (;;) {
+    Token *tok = parse_peek(p);
+    if (tok->kind != TK_PUNCT || binops[tok->punct].prec < min_prec)
+      return e; // not an operator (prec 0), or one for an enclosing level
+    int prec = binops[tok->punct].prec;
+    ExprKind kind = binops[tok->punct].kind;
+    SrcId loc = ast_loc(p->a, tok);
+    lex_advance(p->lex);
+    switch (prec) {
+    case PREC_COMMA:
+      e = ex_comma(p, e, parse_binary(p, PREC_ASSIGN), loc);
+      break;
+    case PREC_ASSIGN:
+      e = ex_assign(p, kind, e, parse_binary(p, PREC_ASSIGN), loc);
+      break;
+    case PREC_COND: {
+      ex_check_scalar(p, e);
+      ExprId then = parse_binary(p, PREC_COMMA);
+      parse_expect(p, P_COLON);
+      e = ex_cond(p, e, then, parse_binary(p, PREC_COND), loc);
+      break;
+    }
+    default:
+      e = ex_binop(p, kind, e, parse_binary(p, prec + 1), loc);
+    }
+  }
+}
+
+static ExprId parse_conditional(Parser *p) {
+  return parse_binary(p, PREC_COND);
+}
+
+static ExprId parse_assign(Parser *p) { return parse_binary(p, PREC_ASSIGN); }
+
+static ExprId parse_expr(Parser *p) { return parse_binary(p, PREC_COMMA); }
+
+static int64_t parse_const_expr(Parser *p) {
+  return parse_eval(p, parse_conditional(p), NULL);
+}
+
+/* declarations */
+
+static Type *parse_declspec(Parser *p, VarAttr *attr);
+static Type *parse_declarator(Parser *p, Type *ty, Decl *d);
+
+static int64_t align_to(int64_t n, int64_t align) {
+  return (n + align - 1) / align * align;
+}
+
+// _Static_assert ( constant-expression , string-literal ) ;
+static void parse_static_assert(Parser *p) {
+  SrcId loc = parse_loc(p);
+  lex_advance(p->lex);
+  parse_expect(p, P_LPAREN);
+  int64_t val = parse_const_expr(p);
+  parse_expect(p, P_COMMA);
+  Token *msg = parse_peek(p);
+  if (msg->kind != TK_STR || msg->str_enc > STR_UTF8)
+    error_tok(msg, "expected string literal");
+  if (!val)
+    error_at(p->a, loc, "static assertion failed: %.*s", (int)msg->str_len,
+             msg->str);
+  lex_advance(p->lex);
+  parse_expect(p, P_RPAREN);
+  parse_expect(p, P_SEMI);
+}
+
+// Lay out the members of a struct (C11 6.7.2.1, as the x86-64 psABI does).
+static void struct_layout(TagInfo *info) {
+  int64_t bits = 0;
+  for (Member *m = info->members; m; m = m->next) {
+    int64_t size = type_size(m->ty);
+    if (m->bit_width == 0) {
+      // A zero-width bit-field only moves the next one to a new unit.
+      bits = align_to(bits, size * 8);
+      continue;
+    }
+    if (m->bit_width > 0) {
+      if (bits / (size * 8) != (bits + m->bit_width - 1) / (size * 8))
+        bits = align_to(bits, size * 8);
+      m->offset = bits / 8 / size * size;
+      m->bit_offset = (int)(bits - m->offset * 8);
+      bits += m->bit_width;
+    } else {
+      bits = align_to(bits, m->align * 8);
+      m->offset = bits / 8;
+      bits += (size < 0 ? 0 : size) * 8; // a flexible array member is empty
+    }
+    if (info->align < m->align)
+      info->align = m->align;
+  }
+  info->size = align_to(bits, info->align * 8) / 8;
+}
+
+static void union_layout(TagInfo *info) {
+  int64_t size = 0;
+  for (Member *m = info->members; m; m = m->next) {
+    int64_t msize = m->bit_width >= 0 ? (m->bit_width + 7) / 8
+                                      : type_size(m->ty);
+    if (size < msize)
+      size = msize;
+    if (info->align < m->align)
+      info->align = m->align;
+  }
+  info->size = align_to(size, info->align);
+}
+
+// struct-declaration-list, up to and including the closing brace.
+static void parse_members(Parser *p, Type *ty) {
+  TagInfo *info = ty->tag;
+  Member head = {}, *cur = &head;
+  int idx = 0;
+  while (!parse_consume(p, P_RBRACE)) {
+    if (tok_is_kw(parse_peek(p), KW_STATIC_ASSERT)) {
+      parse_static_assert(p);
+      continue;
+    }
+    if (info->flexible)
+      error_tok(parse_peek(p), "flexible array member must be the last "
+                               "member of a struct");
+    SrcId loc = parse_loc(p);
+    VarAttr attr = {};
+    Type *basety = parse_declspec(p, &attr);
+    if (attr.is_typedef || attr.is_static || attr.is_extern ||
+        attr.is_inline || attr.is_tls || attr.is_noreturn)
+      error_at(p->a, loc, "type name does not allow storage class to be "
+                          "specified");
+
+    // An anonymous struct or union member.
+    if (ty_is_record(basety) && parse_consume(p, P_SEMI)) {
+      Member *m = AST_NEW(p->a, Member);
+      m->ty = basety;
+      m->loc = loc;
+      m->idx = idx++;
+      m->align = attr.align ? attr.align : type_align(basety);
+      m->bit_width = -1;
+      cur = cur->next = m;
+      continue;
+    }
+
+    for (bool first = true; !parse_consume(p, P_SEMI); first = false) {
+      if (!first)
+        parse_expect(p, P_COMMA);
+      Member *m = AST_NEW(p->a, Member);
+      Decl d = {};
+      m->ty = parse_at(p, P_COLON) ? basety : parse_declarator(p, basety, &d);
+      m->name = d.name;
+      m->loc = d.name ? d.loc : parse_loc(p);
+      m->idx = idx++;
+      m->align = attr.align ? attr.align : type_align(m->ty);
+      m->bit_width = -1;
+      if (parse_consume(p, P_COLON)) {
+        SrcId wloc = parse_loc(p);
+        int64_t width = parse_const_expr(p);
+        if (!ty_is_integer(m->ty))
+          error_at(p->a, m->loc, "bit-field has non-integral type '%s'",
+                   type_str(p->a, m->ty));
+        if (width < 0 || width > type_size(m->ty) * 8)
+          error_at(p->a, wloc, "invalid width %lld of bit-field",
+                   (long long)width);
+        if (width == 0 && m->name)
+          error_at(p->a, wloc, "named bit-field has zero width");
+        m->bit_width = (int)width;
+      } else if (m->ty->kind == TY_ARRAY && m->ty->len < 0 &&
+                 ty->kind == TY_STRUCT && idx > 1) {
+        info->flexible = true;
+      } else if (m->ty->kind == TY_FUNC) {
+        error_at(p->a, m->loc, "field '%s' declared as a function",
+                 ast_name(p->a, m->name));
+      } else if (type_size(m->ty) < 0) {
+        error_at(p->a, m->loc, "field has incomplete type '%s'",
+                 type_str(p->a, m->ty));
+      }
+      cur = cur->next = m;
+    }
+  }
+  info->members = head.next;
+  info->nmembers = idx;
+  if (ty->kind == TY_STRUCT)
+    struct_layout(info);
+  else
+    union_layout(info);
+  info->complete = true;
+}
+
+// struct-or-union-specifier, after the keyword.
+static Type *parse_struct_union(Parser *p, TypeKind kind) {
+  Ident tag = 0;
+  SrcId loc = parse_loc(p);
+  if (parse_peek(p)->kind == TK_IDENT)
+    tag = parse_ident(p, &loc);
+
+  if (tag && !parse_at(p, P_LBRACE)) {
+    Binding *b = scope_find_tag(p, tag);
+    if (parse_at(p, P_SEMI))
+      b = scope_here(p, b);
+    if (b) {
+      if (b->ty->kind != kind)
+        error_at(p->a, loc, "use of '%s' with tag type that does not match "
+                            "previous declaration", ast_name(p->a, tag));
+      return b->ty;
+    }
+    Type *ty = tagged_type(p->a, kind, tag);
+    scope_push_tag(p, tag, ty);
+    return ty;
+  }
+
+  parse_expect(p, P_LBRACE);
+  Type *ty = NULL;
+  if (tag) {
+    Binding *b = scope_here(p, scope_find_tag(p, tag));
+    if (b && (b->ty->kind != kind || b->ty->tag->complete))
+      error_at(p->a, loc, "redefinition of '%s %s'",
+               kind == TY_STRUCT ? "struct" : "union", ast_name(p->a, tag));
+    if (b)
+      ty = b->ty;
+  }
+  if (!ty) {
+    ty = tagged_type(p->a, kind, tag);
+    if (tag)
+      scope_push_tag(p, tag, ty);
+  }
+  parse_members(p, ty);
+  return ty;
+}
+
+// enum-specifier, after the keyword.
+static Type *parse_enum(Parser *p) {
+  Ident tag = 0;
+  SrcId loc = parse_loc(p);
+  if (parse_peek(p)->kind == TK_IDENT)
+    tag = parse_ident(p, &loc);
+
+  if (tag && !parse_at(p, P_LBRACE)) {
+    Binding *b = scope_find_tag(p, tag);
+    if (!b)
+      error_at(p->a, loc, "use of undeclared enum '%s'", ast_name(p->a, tag));
+    if (b->ty->kind != TY_ENUM)
+      error_at(p->a, loc, "use of '%s' with tag type that does not match "
+                          "previous declaration", ast_name(p->a, tag));
+    return b->ty;
+  }
+
+  parse_expect(p, P_LBRACE);
+  if (tag && scope_here(p, scope_find_tag(p, tag)))
+    error_at(p->a, loc, "redefinition of 'enum %s'", ast_name(p->a, tag));
+  Type *ty = tagged_type(p->a, TY_ENUM, tag);
+  ty->tag->complete = true;
+  if (tag)
+    scope_push_tag(p, tag, ty);
+
+  int64_t val = 0;
+  do {
+    if (parse_at(p, P_RBRACE))
+      break;
+    SrcId nloc;
+    Ident name = parse_ident(p, &nloc);
+    if (parse_consume(p, P_ASSIGN)) {
+      SrcId vloc = parse_loc(p);
+      val = parse_const_expr(p);
+      if (val < INT32_MIN || val > INT32_MAX)
+        error_at(p->a, vloc, "enumerator value %lld is not representable "
+                             "in 'int'", (long long)val);
+    } else if (val > INT32_MAX) {
+      error_at(p->a, nloc, "overflow in enumeration value");
+    }
+    parse_check_redecl(p, name, nloc, false);
+    Binding *b = scope_push(p, name, BIND_ENUM_CONST);
+    b->ty = ty;
+    b->enum_val = val++;
+  } while (parse_consume(p, P_COMMA));
+  parse_expect(p, P_RBRACE);
+  return ty;
+}
+
+// declaration-specifiers (C11 6.7). `attr` is NULL where storage classes are
+// not allowed (type names, parameters take one but ignore it).
+static Type *parse_declspec(Parser *p, VarAttr *attr) {
+  enum {
+    VOID = 1 << 0,
+    BOOL = 1 << 2,
+    CHAR = 1 << 4,
+    SHORT = 1 << 6,
+    INT = 1 << 8,
+    LONG = 1 << 10,
+    FLOAT = 1 << 12,
+    DOUBLE = 1 << 14,
+    OTHER = 1 << 16,
+    SIGNED = 1 << 17,
+    UNSIGNED = 1 << 18,
+  };
+  Type *ty = ty_of(TY_INT);
+  int counter = 0, qual = 0;
+
+  for (Token *tok; parse_is_typename(p, tok = parse_peek(p));) {
+    if (tok->kind == TK_IDENT) {
+      if (counter)
+        break; // the name being declared, shadowing a typedef
+      ty = scope_find_var(p, parse_intern(p, tok))->ty;
+      counter += OTHER;
+      lex_advance(p->lex);
+      continue;
+    }
+
+    switch (tok->kw) {
+    case KW_TYPEDEF:
+    case KW_STATIC:
+    case KW_EXTERN:
+    case KW_INLINE:
+    case KW_THREAD_LOCAL:
+    case KW_NORETURN:
+    case KW_AUTO:
+    case KW_REGISTER:
+      if (!attr)
+        error_tok(tok, "storage class specifier is not allowed in this "
+                       "context");
+      attr->is_typedef |= tok->kw == KW_TYPEDEF;
+      attr->is_static |= tok->kw == KW_STATIC;
+      attr->is_extern |= tok->kw == KW_EXTERN;
+      attr->is_inline |= tok->kw == KW_INLINE;
+      attr->is_tls |= tok->kw == KW_THREAD_LOCAL;
+      attr->is_noreturn |= tok->kw == KW_NORETURN;
+      if (attr->is_typedef + attr->is_static + attr->is_extern > 1 ||
+          (attr->is_typedef && (attr->is_inline || attr->is_tls)))
+        error_tok(tok, "cannot combine with previous declaration specifier");
+      lex_advance(p->lex);
+      continue;
+    case KW_CONST:
+      qual |= TQ_CONST;
+      lex_advance(p->lex);
+      continue;
+    case KW_VOLATILE:
+      qual |= TQ_VOLATILE;
+      lex_advance(p->lex);
+      continue;
+    case KW_RESTRICT:
+      qual |= TQ_RESTRICT;
+      lex_advance(p->lex);
+      continue;
+    case KW_ATOMIC:
+      lex_advance(p->lex);
+      if (parse_consume(p, P_LPAREN)) { // _Atomic ( type-name )
+        if (counter)
+          error_tok(parse_peek(p), "cannot combine with previous type "
+                                   "specifier");
+        ty = parse_typename(p);
+        parse_expect(p, P_RPAREN);
+        counter += OTHER;
+      }
+      qual |= TQ_ATOMIC;
+      continue;
+    case KW_ALIGNAS: {
+      if (!attr)
+        error_tok(tok, "'_Alignas' attribute cannot be applied here");
+      SrcId loc = ast_loc(p->a, tok);
+      lex_advance(p->lex);
+      parse_expect(p, P_LPAREN);
+      int64_t align = parse_is_typename(p, parse_peek(p))
+                          ? type_align(parse_typename(p))
+                          : parse_const_expr(p);
+      parse_expect(p, P_RPAREN);
+      if (align <= 0 || (align & (align - 1)))
+        error_at(p->a, loc, "requested alignment is not a positive power "
+                            "of 2");
+      if (align > attr->align)
+        attr->align = (int)align;
+      continue;
+    }
+    case KW_COMPLEX:
+    case KW_IMAGINARY:
+      error_tok(tok, "'%s' is not supported", keyword_names[tok->kw]);
+    case KW_STRUCT:
+    case KW_UNION:
+    case KW_ENUM: {
+      if (counter)
+        error_tok(tok, "cannot combine with previous type specifier");
+      Keyword kw = tok->kw;
+      lex_advance(p->lex);
+      ty = kw == KW_ENUM ? parse_enum(p)
+                         : parse_struct_union(p, kw == KW_STRUCT ? TY_STRUCT
+                                                                 : TY_UNION);
+      counter += OTHER;
+      continue;
+    }
+    default:
+      break;
+    }
+
+    switch (tok->kw) {
+    case KW_VOID:
+      counter += VOID;
+      break;
+    case KW_BOOL:
+      counter += BOOL;
+      break;
+    case KW_CHAR:
+      counter += CHAR;
+      break;
+    case KW_SHORT:
+      counter += SHORT;
+      break;
+    case KW_INT:
+      counter += INT;
+      break;
+    case KW_LONG:
+      counter += LONG;
+      break;
+    case KW_FLOAT:
+      counter += FLOAT;
+      break;
+    case KW_DOUBLE:
+      counter += DOUBLE;
+      break;
+    case KW_SIGNED:
+      counter |= SIGNED;
+      break;
+    case KW_UNSIGNED:
+      counter |= UNSIGNED;
+      break;
+    default:
+      INNER_DIE("parse_declspec: unhandled keyword");
+    }
+
+    switch (counter) {
+    case VOID:
+      ty = ty_of(TY_VOID);
+      break;
+    case BOOL:
+      ty = ty_of(TY_BOOL);
+      break;
+    case CHAR:
+      ty = ty_of(TY_CHAR);
+      break;
+    case SIGNED + CHAR:
+      ty = ty_of(TY_SCHAR);
+      break;
+    case UNSIGNED + CHAR:
+      ty = ty_of(TY_UCHAR);
+      break;
+    case SHORT:
+    case SHORT + INT:
+    case SIGNED + SHORT:
+    case SIGNED + SHORT + INT:
+      ty = ty_of(TY_SHORT);
+      break;
+    case UNSIGNED + SHORT:
+    case UNSIGNED + SHORT + INT:
+      ty = ty_of(TY_USHORT);
+      break;
+    case INT:
+    case SIGNED:
+    case SIGNED + INT:
+      ty = ty_of(TY_INT);
+      break;
+    case UNSIGNED:
+    case UNSIGNED + INT:
+      ty = ty_of(TY_UINT);
+      break;
+    case LONG:
+    case LONG + INT:
+    case SIGNED + LONG:
+    case SIGNED + LONG + INT:
+      ty = ty_of(TY_LONG);
+      break;
+    case UNSIGNED + LONG:
+    case UNSIGNED + LONG + INT:
+      ty = ty_of(TY_ULONG);
+      break;
+    case LONG + LONG:
+    case LONG + LONG + INT:
+    case SIGNED + LONG + LONG:
+    case SIGNED + LONG + LONG + INT:
+      ty = ty_of(TY_LLONG);
+      break;
+    case UNSIGNED + LONG + LONG:
+    case UNSIGNED + LONG + LONG + INT:
+      ty = ty_of(TY_ULLONG);
+      break;
+    case FLOAT:
+      ty = ty_of(TY_FLOAT);
+      break;
+    case DOUBLE:
+      ty = ty_of(TY_DOUBLE);
+      break;
+    case LONG + DOUBLE:
+      ty = ty_of(TY_LDOUBLE);
+      break;
+    default:
+      error_tok(tok, "cannot combine with previous type specifier");
+    }
+    lex_advance(p->lex);
+  }
+
+  return qual ? qualified(p->a, ty, qual) : ty;
+}
+
+// pointer: ( "*" type-qualifier-list? )*
+static Type *parse_pointers(Parser *p, Type *ty) {
+  while (parse_consume(p, P_STAR)) {
+    ty = pointer_to(p->a, ty);
+    int qual = 0;
+    for (;;) {
+      Token *tok = parse_peek(p);
+      if (tok_is_kw(tok, KW_CONST))
+        qual |= TQ_CONST;
+      else if (tok_is_kw(tok, KW_VOLATILE))
+        qual |= TQ_VOLATILE;
+      else if (tok_is_kw(tok, KW_RESTRICT))
+        qual |= TQ_RESTRICT;
+      else if (tok_is_kw(tok, KW_ATOMIC) && !tok_is(parse_peek2(p), P_LPAREN))
+        qual |= TQ_ATOMIC;
+      else
+        break;
+      lex_advance(p->lex);
+    }
+    if (qual)
+      ty = qualified(p->a, ty, qual);
+  }
+  return ty;
+}
+
+// Parameter names and types are collected on a list before they are counted.
+typedef struct ParamDecl ParamDecl;
+struct ParamDecl {
+  ParamDecl *next;
+  Type *ty;
+  Ident name;
+  SrcId loc;
+};
+
+// ( parameter-type-list? ), returning a function type returning `ret`. The
+// parameters' names go to `d` unless it is NULL. Each is in scope from its
+// declarator to the ')' (C11 6.2.1p4), so that a later one can refer to it.
+static Type *parse_func_params(Parser *p, Type *ret, Decl *d) {
+  SrcId loc = parse_loc(p);
+  lex_advance(p->lex);
+  if (ret->kind == TY_ARRAY)
+    error_at(p->a, loc, "function cannot return array type '%s'",
+             type_str(p->a, ret));
+  if (ret->kind == TY_FUNC)
+    error_at(p->a, loc, "function cannot return function type '%s'",
+             type_str(p->a, ret));
+
+  bool empty = parse_consume(p, P_RPAREN); // no prototype
+  if (empty ||
+      (tok_is_kw(parse_peek(p), KW_VOID) && tok_is(parse_peek2(p), P_RPAREN))) {
+    if (!empty) {
+      lex_advance(p->lex);
+      lex_advance(p->lex);
+    }
+    if (d)
+      d->has_params = true;
+    return func_type(p->a, ret, NULL, 0, false, !empty);
+  }
+
+  ParamDecl head = {}, *cur = &head;
+  int n = 0;
+  bool variadic = false;
+  scope_enter(p);
+  for (;;) {
+    if (parse_consume(p, P_ELLIPSIS)) {
+      variadic = true;
+      parse_expect(p, P_RPAREN);
+      break;
+    }
+    VarAttr attr = {};
+    SrcId ploc = parse_loc(p);
+    Type *ty = parse_declspec(p, &attr);
+    if (attr.is_typedef || attr.is_static || attr.is_extern ||
+        attr.is_inline || attr.is_tls || attr.is_noreturn)
+      error_at(p->a, ploc, "invalid storage class specifier in function "
+                           "declarator");
+    Decl pd = {};
+    ty = parse_declarator(p, ty, &pd);
+    if (ty->kind == TY_VOID)
+      error_at(p->a, pd.loc, "'void' must be the first and only parameter "
+                             "if specified");
+    // Adjust to pointers (C11 6.7.6.3p7-8).
+    if (ty->kind == TY_ARRAY)
+      ty = pointer_to(p->a, ty->base);
+    else if (ty->kind == TY_FUNC)
+      ty = pointer_to(p->a, ty);
+    ParamDecl *pdecl = AST_NEW(p->a, ParamDecl);
+    *pdecl = (ParamDecl){.ty = ty, .name = pd.name, .loc = pd.loc};
+    cur = cur->next = pdecl;
+    n++;
+    if (pd.name)
+      scope_push(p, pd.name, BIND_PARAM)->ty = ty;
+    if (!parse_consume(p, P_COMMA)) {
+      parse_expect(p, P_RPAREN);
+      break;
+    }
+  }
+  scope_leave(p);
+
+  Type **params = arena_alloc(&p->a->arena, (size_t)n * sizeof(*params),
+                              _Alignof(Type *));
+  bool names = d && !d->has_params;
+  if (names) {
+    d->has_params = true;
+    d->nparams = n;
+    d->param_names = arena_alloc(&p->a->arena, (size_t)n * sizeof(Ident),
+                                 _Alignof(Ident));
+    d->param_locs = arena_alloc(&p->a->arena, (size_t)n * sizeof(SrcId),
+                                _Alignof(SrcId));
+    d->param_types = arena_alloc(&p->a->arena, (size_t)n * sizeof(Type *),
+                                 _Alignof(Type *));
+  }
+  // The function type has the parameters' unqualified types (C11 6.7.6.3p15);
+  // only the parameter objects are qualified.
+  int i = 0;
+  for (ParamDecl *pd = head.next; pd; pd = pd->next, i++) {
+    params[i] = unqualified(p->a, pd->ty);
+    if (names) {
+      d->param_names[i] = pd->name;
+      d->param_locs[i] = pd->loc;
+      d->param_types[i] = pd->ty;
+    }
+  }
+  return func_type(p->a, ret, params, n, variadic, true);
+}
+
+static Type *parse_type_suffix(Parser *p, Type *ty, Decl *d);
+
+// [ static? type-qualifier-list? constant-expression? ] and what follows.
+static Type *parse_array_dims(Parser *p, Type *ty) {
+  lex_advance(p->lex);
+  for (Token *tok;
+       (tok = parse_peek(p))->kind == TK_KEYWORD &&
+       (tok->kw == KW_STATIC || tok->kw == KW_CONST ||
+        tok->kw == KW_VOLATILE || tok->kw == KW_RESTRICT);)
+    lex_advance(p->lex);
+
+  int64_t len = -1;
+  if (!parse_consume(p, P_RBRACKET)) {
+    SrcId loc = parse_loc(p);
+    bool ok = true;
+    len = parse_eval(p, parse_assign(p), &ok);
+    if (!ok)
+      error_at(p->a, loc, "variable length arrays are not supported");
+    if (len < 0)
+      error_at(p->a, loc, "array has negative size");
+    parse_expect(p, P_RBRACKET);
+  }
+
+  SrcId loc = parse_loc(p);
+  ty = parse_type_suffix(p, ty, NULL);
+  if (ty->kind == TY_FUNC)
+    error_at(p->a, loc, "array of functions is not allowed");
+  if (type_size(ty) < 0)
+    error_at(p->a, loc, "array has incomplete element type '%s'",
+             type_str(p->a, ty));
+  return array_of(p->a, ty, len);
+}
+
+static Type *parse_type_suffix(Parser *p, Type *ty, Decl *d) {
+  if (parse_at(p, P_LPAREN))
+    return parse_func_params(p, ty, d);
+  if (parse_at(p, P_LBRACKET))
+    return parse_array_dims(p, ty);
+  return ty;
+}
+
+// Rebuild `ty`, made on top of the placeholder `hole`, on top of `repl`. The
+// checks parse_type_suffix could not make on a placeholder are made here.
+static Type *type_fill_hole(Parser *p, Type *ty, Type *hole, Type *repl,
+                            SrcId loc) {
+  if (ty == hole)
+    return repl;
+  Type *base = type_fill_hole(p, ty->base, hole, repl, loc);
+  switch (ty->kind) {
+  case TY_PTR:
+    return qualified(p->a, pointer_to(p->a, base), ty->qual);
+  case TY_ARRAY:
+    if (base->kind == TY_FUNC)
+      error_at(p->a, loc, "array of functions is not allowed");
+    if (type_size(base) < 0)
+      error_at(p->a, loc, "array has incomplete element type '%s'",
+               type_str(p->a, base));
+    return array_of(p->a, base, ty->len);
+  default: // TY_FUNC
+    if (base->kind == TY_ARRAY || base->kind == TY_FUNC)
+      error_at(p->a, loc, "function cannot return %s type '%s'",
+               base->kind == TY_ARRAY ? "array" : "function",
+               type_str(p->a, base));
+    return func_type(p->a, base, ty->params, ty->nparams, ty->variadic,
+                     ty->prototyped);
+  }
+}
+
+// The placeholder a nested declarator is parsed on: complete, so that no
+// check parse_type_suffix makes on it fails.
+static Type ty_hole = {.kind = TY_VOID, .size = 1, .align = 1};
+
+// Does a "(" at the current token start a nested declarator rather than a
+// parameter list?
+static bool parse_nested_declarator(Parser *p) {
+  Token *next = parse_peek2(p);
+  if (tok_is(next, P_STAR) || tok_is(next, P_LPAREN))
+    return true;
+  return next->kind == TK_IDENT && !parse_is_typename(p, next);
+}
+
+// declarator or abstract-declarator (C11 6.7.6, 6.7.7). A nested declarator
+// is parsed first on top of a placeholder type, which the rest of the outer
+// declarator then fills: tokens are never read twice.
+static Type *parse_declarator(Parser *p, Type *ty, Decl *d) {
+  ty = parse_pointers(p, ty);
+  if (parse_at(p, P_LPAREN) && parse_nested_declarator(p)) {
+    SrcId loc = parse_loc(p);
+    lex_advance(p->lex);
+    Type *inner = parse_declarator(p, &ty_hole, d);
+    parse_expect(p, P_RPAREN);
+    ty = parse_type_suffix(p, ty, d->has_params ? NULL : d);
+    return type_fill_hole(p, inner, &ty_hole, ty, loc);
+  }
+  Token *tok = parse_peek(p);
+  d->loc = ast_loc(p->a, tok);
+  if (tok->kind == TK_IDENT)
+    d->name = parse_ident(p, NULL);
+  return parse_type_suffix(p, ty, d);
+}
+
+// type-name (C11 6.7.7)
+static Type *parse_typename(Parser *p) {
+  Type *ty = parse_declspec(p, NULL);
+  Decl d = {};
+  ty = parse_declarator(p, ty, &d);
+  if (d.name)
+    error_at(p->a, d.loc, "unexpected identifier in type name");
+  return ty;
+}
+
+/* initializers */
+
+// An Initializer for an object of type `ty`. A `flexible` one, for an array
+// of unknown length at the top of an initializer, grows as elements are given.
+static Initializer *init_new(Parser *p, Type *ty, bool flexible) {
+  Initializer *init = AST_NEW(p->a, Initializer);
+  init->ty = ty;
+  if (ty->kind == TY_ARRAY && ty->len < 0) {
+    init->flexible = flexible; // else a flexible array member: no elements
+    return init;
+  }
+  if (ty->kind == TY_ARRAY) {
+    init->nchildren = ty->len;
+  } else if (ty_is_record(ty)) {
+    init->nchildren = ty->tag->nmembers;
+    if (init->nchildren)
+      init->children = ast_zalloc(
+          p->a, (size_t)init->nchildren * sizeof(Initializer *),
+          _Alignof(Initializer *));
+  }
+  return init;
+}
+
+// The bytes of an element of the array `init` if they are kept in its runs,
+// that is, if it is an array of scalars; else 0.
+static int64_t init_elem_size(const Initializer *init) {
+  return ty_is_scalar(init->ty->base) ? type_size(init->ty->base) : 0;
+}
+
+// Make room in the run `r` of `init` for `n` elements.
+static void init_run_reserve(Parser *p, Initializer *init, InitRun *r,
+                             int64_t n) {
+  if (n <= r->cap)
+    return;
+  int64_t cap = r->cap ? r->cap * 2 : 8;
+  while (cap < n)
+    cap *= 2;
+  if (!init->flexible && cap > init->nchildren - r->first)
+    cap = init->nchildren - r->first;
+  int64_t size = init_elem_size(init);
+  if (size) {
+    uint8_t *data = ast_zalloc(p->a, (size_t)(cap * size), 16);
+    if (r->n)
+      memcpy(data, r->data, (size_t)(r->n * size));
+    r->data = data;
+    if (r->exprs) {
+      ExprId *exprs = ast_zalloc(p->a, (size_t)cap * sizeof(ExprId),
+                                 _Alignof(ExprId));
+      memcpy(exprs, r->exprs, (size_t)r->n * sizeof(ExprId));
+      r->exprs = exprs;
+    }
+  } else {
+    Initializer **elems = ast_zalloc(p->a, (size_t)cap * sizeof(*elems),
+                                     _Alignof(Initializer *));
+    if (r->n)
+      memcpy(elems, r->elems, (size_t)r->n * sizeof(*elems));
+    r->elems = elems;
+  }
+  r->cap = cap;
+}
+
+// The run of the array `init` that holds element `i`, which the caller has
+// checked it has, made or extended if need be; *k is the element's index in
+// it.
+static InitRun *init_run_at(Parser *p, Initializer *init, int64_t i,
+                            int64_t *k) {
+  if (init->flexible && i >= init->nchildren)
+    init->nchildren = i + 1;
+  int64_t lo = 0, hi = init->nruns; // find the first run past i
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (init->runs[mid].first <= i)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  InitRun *r = lo ? &init->runs[lo - 1] : NULL;
+  if (!r || i > r->first + r->n) {
+    if (init->nruns == init->cap) {
+      int64_t cap = init->cap ? init->cap * 2 : 4;
+      InitRun *runs = ast_zalloc(p->a, (size_t)cap * sizeof(InitRun),
+                                 _Alignof(InitRun));
+      if (init->nruns)
+        memcpy(runs, init->runs, (size_t)init->nruns * sizeof(InitRun));
+      init->runs = runs;
+      init->cap = cap;
+    }
+    memmove(&init->runs[lo + 1], &init->runs[lo],
+            (size_t)(init->nruns - lo) * sizeof(InitRun));
+    init->nruns++;
+    r = &init->runs[lo];
+    *r = (InitRun){.first = i};
+  }
+  *k = i - r->first;
+  if (*k == r->n) {
+    init_run_reserve(p, init, r, r->n + 1);
+    r->n++;
+  }
+  return r;
+}
+
+static bool init_is_zero(const uint8_t *data, int64_t size) {
+  for (int64_t i = 0; i < size; i++)
+    if (data[i])
+      return false;
+  return true;
+}
+
+static void init_store_int(uint8_t *out, int64_t size, uint64_t v) {
+  for (int64_t i = 0; i < size; i++)
+    out[i] = (uint8_t)(v >> (i * 8));
+}
+
+// Store the scalar `id`, already converted to `ty`, to `out` as an object of
+// type `ty` holds it, if it is a constant: a number, or a pointer cast from
+// one, like (void *)0. The host's floating formats are the target's.
+static bool init_const_bytes(Parser *p, ExprId id, const Type *ty,
+                             uint8_t *out) {
+  Expr *e = ex(p, id);
+  while (e->kind == EX_CAST && e->ty->kind == TY_PTR)
+    e = ex(p, e->lhs);
+  if (e->kind == EX_NUM) {
+    init_store_int(out, type_size(ty), (uint64_t)e->ival);
+    return true;
+  }
+  if (e->kind != EX_FNUM)
+    return false;
+  long double v = ast_fnum_value(p->a, e->fnum);
+  if (ty->kind == TY_FLOAT) {
+    float f = (float)v;
+    memcpy(out, &f, sizeof(f));
+  } else if (ty->kind == TY_DOUBLE) {
+    double d = (double)v;
+    memcpy(out, &d, sizeof(d));
+  } else {
+    memset(out, 0, (size_t)type_size(ty));
+    memcpy(out, &v, 10); // x87 extended precision, then padding
+  }
+  return true;
+}
+
+// The constant of type `ty` whose bytes are `data`, as an expression.
+static ExprId init_data_expr(Parser *p, Type *ty, const uint8_t *data,
+                             SrcId loc) {
+  ty = unqualified(p->a, ty);
+  if (ty_is_float(ty)) {
+    long double v = 0;
+    if (ty->kind == TY_FLOAT) {
+      float f;
+      memcpy(&f, data, sizeof(f));
+      v = f;
+    } else if (ty->kind == TY_DOUBLE) {
+      double d;
+      memcpy(&d, data, sizeof(d));
+      v = d;
+    } else {
+      memcpy(&v, data, 10);
+    }
+    ExprId id = ex_new(p, EX_FNUM, ty, loc);
+    ex(p, id)->fnum = ast_fnum(p->a, v);
+    return id;
+  }
+  uint64_t v = 0;
+  for (int64_t i = type_size(ty) - 1; i >= 0; i--)
+    v = v << 8 | data[i];
+  if (ty->kind == TY_PTR)
+    return ex_unary(p, EX_CAST, ty, ex_num(p, (int64_t)v, ty_of(TY_LONG), loc),
+                    loc);
+  return ex_num(p, eval_wrap(ty, v), ty, loc);
+}
+
+// An element of an array initializer, from init_elem() to init_elem_done().
+typedef struct {
+  Initializer *init; // the element's own, or `scalar`
+  Initializer scalar;
+  uint32_t nexprs, nfnums, nobjs, nstmts; // the AST's before it was parsed
+} InitElem;
+
+// The initializer for element `i` of the array `init`, which the caller has
+// checked has one, to parse and then pass to init_elem_done(). A scalar is
+// parsed into `el->scalar`.
+static Initializer *init_elem(Parser *p, Initializer *init, int64_t i,
+                              InitElem *el) {
+  Type *ty = init->ty->base;
+  if (ty_is_scalar(ty)) {
+    Ast *a = p->a;
+    *el = (InitElem){.scalar = {.ty = ty},
+                     .nexprs = a->exprs.len,
+                     .nfnums = a->fnums.len,
+                     .nobjs = a->objs.len,
+                     .nstmts = a->stmts.len};
+    el->init = &el->scalar;
+    return el->init;
+  }
+  int64_t k;
+  InitRun *r = init_run_at(p, init, i, &k);
+  if (!r->elems[k])
+    r->elems[k] = init_new(p, ty, false);
+  el->init = r->elems[k];
+  return el->init;
+}
+
+// Store element `i` of the array `init`, parsed into `el`. A constant scalar
+// goes in as its bytes, and the nodes it was parsed into are dropped unless
+// something else could refer to them: an object or a statement made
+// meanwhile (a compound literal, say, or a statement expression).
+static void init_elem_done(Parser *p, Initializer *init, int64_t i,
+                           InitElem *el) {
+  if (el->init != &el->scalar)
+    return;
+  int64_t k;
+  InitRun *r = init_run_at(p, init, i, &k);
+  int64_t size = init_elem_size(init);
+  Ast *a = p->a;
+  if (init_const_bytes(p, el->scalar.expr, el->scalar.ty, r->data + k * size)) {
+    if (r->exprs)
+      r->exprs[k] = 0;
+    if (a->objs.len == el->nobjs && a->stmts.len == el->nstmts) {
+      pool_truncate(&a->exprs, el->nexprs);
+      pool_truncate(&a->fnums, el->nfnums);
+    }
+    return;
+  }
+  memset(r->data + k * size, 0, (size_t)size);
+  if (!r->exprs)
+    r->exprs = ast_zalloc(a, (size_t)r->cap * sizeof(ExprId),
+                          _Alignof(ExprId));
+  r->exprs[k] = el->scalar.expr;
+}
+
+static Initializer *init_member(Parser *p, Initializer *init, Member *m) {
+  if (!init->children[m->idx])
+    init->children[m->idx] = init_new(p, m->ty, false);
+  return init->children[m->idx];
+}
+
+static bool init_has_elem(const Initializer *init, int64_t i) {
+  return init->flexible || i < init->nchildren;
+}
+
+// Does the current braced list end here: "}" or ", }"?
+static bool init_at_end(Parser *p) {
+  return parse_at(p, P_RBRACE) ||
+         (parse_at(p, P_COMMA) && tok_is(parse_peek2(p), P_RBRACE));
+}
+
+static bool init_consume_end(Parser *p) {
+  if (!init_at_end(p))
+    return false;
+  parse_consume(p, P_COMMA);
+  lex_advance(p->lex);
+  return true;
+}
+
+// Is the current token a "," followed by a designator, which ends a run of
+// brace-elided elements: the list it belongs to handles it?
+static bool init_at_designator(Parser *p) {
+  Token *next = parse_peek2(p);
+  return parse_at(p, P_COMMA) &&
+         (tok_is(next, P_LBRACKET) || tok_is(next, P_DOT));
+}
+
+// An initializer for an element past the end of its array or struct, which
+// is parsed and dropped.
+static void init_skip_excess(Parser *p) {
+  if (!parse_consume(p, P_LBRACE)) {
+    parse_assign(p);
+    return;
+  }
+  while (!init_consume_end(p)) {
+    init_skip_excess(p);
+    if (!parse_at(p, P_RBRACE))
+      parse_expect(p, P_COMMA);
+  }
+}
+
+static bool init_is_string_array(Type *ty) {
+  return ty->kind == TY_ARRAY && ty_is_integer(ty->base);
+}
+
+// The array `init` initialized from the string literal at the current token.
+static void init_string(Parser *p, Initializer *init) {
+  Token *tok = parse_peek(p);
+  Type *elem = init->ty->base;
+  int size = str_enc_size(tok->str_enc);
+  if (type_size(elem) != size)
+    error_tok(tok, "initializing '%s' with an incompatible string literal",
+              type_str(p->a, init->ty));
+  int64_t len = tok->str_len + 1;
+  if (!init->flexible && len > init->nchildren)
+    len = init->nchildren; // C11 6.7.9p14: the null may not fit
+  for (int64_t i = 0; i < len; i++) {
+    int64_t c = 0;
+    if (i < tok->str_len) {
+      const char *at = tok->str + i * size;
+      if (size == 1) {
+        c = (signed char)*at;
+      } else if (size == 2) {
+        uint16_t u;
+        memcpy(&u, at, 2);
+        c = u;
+      } else {
+        uint32_t u;
+        memcpy(&u, at, 4);
+        c = u;
+      }
+    }
+    int64_t k;
+    InitRun *r = init_run_at(p, init, i, &k);
+    init_store_int(r->data + k * size, size,
+                   (uint64_t)eval_wrap(elem, (uint64_t)c));
+    if (r->exprs)
+      r->exprs[k] = 0;
+  }
+  lex_advance(p->lex);
+}
+
+static void parse_initializer2(Parser *p, Initializer *init, ExprId *pending);
+static void init_designation(Parser *p, Initializer *init);
+
+// [ constant-expression ], naming an element of the array `init`.
+static int64_t init_array_designator(Parser *p, Initializer *init) {
+  SrcId loc = parse_loc(p);
+  if (init->ty->kind != TY_ARRAY)
+    error_at(p->a, loc, "array designator cannot initialize non-array type "
+                        "'%s'", type_str(p->a, init->ty));
+  lex_advance(p->lex);
+  int64_t i = parse_const_expr(p);
+  if (parse_at(p, P_ELLIPSIS))
+    error_tok(parse_peek(p), "array designator ranges are not supported");
+  parse_expect(p, P_RBRACKET);
+  if (i < 0)
+    error_at(p->a, loc, "array designator value '%lld' is negative",
+             (long long)i);
+  if (!init_has_elem(init, i))
+    error_at(p->a, loc, "array designator index (%lld) exceeds array bounds "
+                        "(%lld)", (long long)i, (long long)init->nchildren);
+  return i;
+}
+
+// . identifier, naming a member of the struct or union `init`. A member of
+// an anonymous struct or union yields the anonymous member, and the
+// designator is left for its own initializer to resolve.
+static Member *init_struct_designator(Parser *p, Initializer *init) {
+  SrcId loc = parse_loc(p);
+  Type *ty = init->ty;
+  if (!ty_is_record(ty))
+    error_at(p->a, loc, "field designator cannot initialize a non-struct, "
+                        "non-union type '%s'", type_str(p->a, ty));
+  Token *tok = parse_peek2(p);
+  if (tok->kind != TK_IDENT)
+    error_tok(tok, "expected a field designator, such as '.field = 4'");
+  Ident name = ast_intern(p->a, tok->loc, tok->len);
+  for (Member *m = ty->tag->members; m; m = m->next) {
+    if (!m->name && ty_is_record(m->ty) && type_has_member(m->ty, name))
+      return m;
+    if (m->name == name) {
+      lex_advance(p->lex);
+      lex_advance(p->lex);
+      return m;
+    }
+  }
+  error_at(p->a, ast_loc(p->a, tok), "field designator '%s' does not refer "
+                                     "to any field in type '%s'",
+           ast_name(p->a, name), type_str(p->a, ty));
+}
+
+static bool init_skips_member(const Member *m) {
+  return !m->name && m->bit_width >= 0; // unnamed bit-fields take no value
+}
+
+// Elements i, i+1, ... of the array `init`, whose braces were elided: they
+// come from the enclosing list until the array is full, the list ends or a
+// designator starts.
+static void init_array2(Parser *p, Initializer *init, int64_t i,
+                        ExprId *pending) {
+  for (; init_has_elem(init, i); i++) {
+    if (!*pending) {
+      if (init_at_end(p) || (i > 0 && init_at_designator(p)))
+        return;
+      if (i > 0)
+        parse_expect(p, P_COMMA);
+    }
+    InitElem el;
+    parse_initializer2(p, init_elem(p, init, i, &el), pending);
+    init_elem_done(p, init, i, &el);
+  }
+}
+
+// { initializer-list } of an array, after the "{".
+static void init_array1(Parser *p, Initializer *init) {
+  for (int64_t i = 0; !init_consume_end(p); i++) {
+    if (i > 0)
+      parse_expect(p, P_COMMA);
+    InitElem el;
+    if (parse_at(p, P_LBRACKET)) {
+      i = init_array_designator(p, init);
+      init_designation(p, init_elem(p, init, i, &el));
+      init_elem_done(p, init, i, &el);
+      continue;
+    }
+    if (init_has_elem(init, i)) {
+      ExprId pending = 0;
+      parse_initializer2(p, init_elem(p, init, i, &el), &pending);
+      init_elem_done(p, init, i, &el);
+    } else {
+      init_skip_excess(p);
+    }
+  }
+}
+
+// Members m, m->next, ... of the struct `init`, whose braces were elided.
+static void init_struct2(Parser *p, Initializer *init, Member *m,
+                         bool need_comma, ExprId *pending) {
+  for (; m; m = m->next) {
+    if (init_skips_member(m))
+      continue;
+    if (!*pending) {
+      if (init_at_end(p) || (need_comma && init_at_designator(p)))
+        return;
+      if (need_comma)
+        parse_expect(p, P_COMMA);
+    }
+    need_comma = true;
+    parse_initializer2(p, init_member(p, init, m), pending);
+  }
+}
+
+// { initializer-list } of a struct, after the "{".
+static void init_struct1(Parser *p, Initializer *init) {
+  Member *m = init->ty->tag->members;
+  for (bool first = true; !init_consume_end(p); first = false) {
+    if (!first)
+      parse_expect(p, P_COMMA);
+    if (parse_at(p, P_DOT)) {
+      m = init_struct_designator(p, init);
+      init->expr = 0;
+      init_designation(p, init_member(p, init, m));
+      m = m->next;
+      continue;
+    }
+    while (m && init_skips_member(m))
+      m = m->next;
+    if (m) {
+      ExprId pending = 0;
+      parse_initializer2(p, init_member(p, init, m), &pending);
+      m = m->next;
+    } else {
+      init_skip_excess(p);
+    }
+  }
+}
+
+static Member *init_first_member(Initializer *init) {
+  Member *m = init->ty->tag->members;
+  while (m && init_skips_member(m))
+    m = m->next;
+  return m;
+}
+
+// A union without braces of its own initializes its first named member.
+static void init_union2(Parser *p, Initializer *init, ExprId *pending) {
+  Member *m = init_first_member(init);
+  if (!m)
+    return;
+  init->member = m;
+  parse_initializer2(p, init_member(p, init, m), pending);
+}
+
+// { initializer-list } of a union, after the "{".
+static void init_union1(Parser *p, Initializer *init) {
+  if (init_consume_end(p))
+    return;
+  Member *m;
+  if (parse_at(p, P_DOT)) {
+    m = init_struct_designator(p, init);
+    init_designation(p, init_member(p, init, m));
+  } else if ((m = init_first_member(init))) {
+    ExprId pending = 0;
+    parse_initializer2(p, init_member(p, init, m), &pending);
+  } else {
+    init_skip_excess(p);
+  }
+  init->member = m;
+  while (!init_consume_end(p)) {
+    parse_expect(p, P_COMMA);
+    init_skip_excess(p);
+  }
+}
+
+// designation? initializer, with its first designator already consumed by the
+// caller; a designator that is not the last continues brace elision in the
+// object it designates into (C11 6.7.9p17).
+static void init_designation(Parser *p, Initializer *init) {
+  if (parse_at(p, P_LBRACKET)) {
+    int64_t i = init_array_designator(p, init);
+    InitElem el;
+    init_designation(p, init_elem(p, init, i, &el));
+    init_elem_done(p, init, i, &el);
+    ExprId pending = 0;
+    init_array2(p, init, i + 1, &pending);
+    return;
+  }
+  if (parse_at(p, P_DOT)) {
+    Member *m = init_struct_designator(p, init);
+    init->expr = 0;
+    init_designation(p, init_member(p, init, m));
+    ExprId pending = 0;
+    if (init->ty->kind == TY_UNION)
+      init->member = m;
+    else
+      init_struct2(p, init, m->next, true, &pending);
+    return;
+  }
+  parse_expect(p, P_ASSIGN);
+  ExprId pending = 0;
+  parse_initializer2(p, init, &pending);
+}
+
+// An initializer for `init` (C11 6.7.9). The token stream is never rewound:
+// when an expression turns out to start the brace-elided members of a struct
+// rather than to initialize the whole struct, it is handed on as `*pending`,
+// which the first scalar (or struct of its type) in turn consumes.
+static void parse_initializer2(Parser *p, Initializer *init, ExprId *pending) {
+  Type *ty = init->ty;
+  if (ty->kind == TY_ARRAY) {
+    if (!*pending && init_is_string_array(ty)) {
+      if (parse_peek(p)->kind == TK_STR) {
+        init_string(p, init);
+        return;
+      }
+      if (parse_at(p, P_LBRACE) && parse_peek2(p)->kind == TK_STR) {
+        lex_advance(p->lex);
+        init_string(p, init);
+        if (!init_consume_end(p))
+          error_tok(parse_peek(p), "excess elements in char array "
+                                   "initializer");
+        return;
       }
     }
+    if (!*pending && parse_consume(p, P_LBRACE))
+      init_array1(p, init);
+    else
+      init_array2(p, init, 0, pending);
+    return;
+  }
 
-    pp_list_append(&out_cur, tok);
-    tok = next;
+  if (ty_is_record(ty)) {
+    if (!*pending && parse_consume(p, P_LBRACE)) {
+      if (ty->kind == TY_STRUCT)
+        init_struct1(p, init);
+      else
+        init_union1(p, init);
+      return;
+    }
+    ExprId e = *pending ? *pending : parse_assign(p);
+    if (unqualified(p->a, ty) == value_type(p, ex(p, e)->ty)) {
+      *pending = 0;
+      init->expr = e;
+      return;
+    }
+    *pending = e;
+    if (ty->kind == TY_STRUCT)
+      init_struct2(p, init, ty->tag->members, false, pending);
+    else
+      init_union2(p, init, pending);
+    return;
   }
 
-  // Expand recursively until no changes. Since we don't have function-like
-  // macros yet, a few fixed iterations is enough; hideset prevents loops.
-  bool changed;
-  do {
-    changed = false;
-    PPToken out2 = {};
-    PPToken *cur2 = &out2;
+  if (!*pending && parse_consume(p, P_LBRACE)) { // int x = {1};
+    parse_initializer2(p, init, pending);
+    while (!init_consume_end(p)) {
+      parse_expect(p, P_COMMA);
+      init_skip_excess(p);
+    }
+    return;
+  }
+  ExprId e = *pending ? *pending : parse_assign(p);
+  *pending = 0;
+  init->expr = ex_assign_conv(p, e, ty);
+}
 
-    PPToken *p = head.next;
-    head.next = NULL;
-    while (p) {
-      PPToken *pn = p->next;
-      p->next = NULL;
-      if (p->kind == PPTOK_IDENTIFIER) {
-        PPMacro *m = pp_macro_find(ctx, p);
-        if (m && !pp_hideset_contains(p->hideset, p->loc, p->len)) {
-          changed = true;
-          for (PPToken *bp = m->body; bp; bp = bp->next) {
-            PPToken *expanded = pp_clone_tok_for_macro(bp, p, m);
-            expanded->next = NULL;
-            pp_list_append(&cur2, expanded);
-          }
-          pp_free_tok(p);
-          p = pn;
+// The initializer of an object declared as `ty`. An array of unknown length
+// takes its length from it, completing the type stored to *new_ty.
+static Initializer *parse_initializer(Parser *p, Type *ty, Type **new_ty) {
+  SrcId loc = parse_loc(p);
+  if (ty->kind == TY_FUNC)
+    error_at(p->a, loc, "illegal initializer (only variables can be "
+                        "initialized)");
+  if (type_size(ty) < 0 && ty->kind != TY_ARRAY)
+    error_at(p->a, loc, "variable has incomplete type '%s'",
+             type_str(p->a, ty));
+  if (ty->kind == TY_ARRAY && !parse_at(p, P_LBRACE) &&
+      !(init_is_string_array(ty) && parse_peek(p)->kind == TK_STR))
+    error_at(p->a, loc, "array initializer must be an initializer list");
+  Initializer *init = init_new(p, ty, true);
+  ExprId pending = 0;
+  parse_initializer2(p, init, &pending);
+  if (pending)
+    error_at(p->a, loc, "initializer for aggregate with no elements");
+  *new_ty = ty;
+  if (init->flexible) {
+    *new_ty = array_of(p->a, ty->base, init->nchildren);
+    init->ty = *new_ty;
+    init->flexible = false;
+  }
+  return init;
+}
+
+// The lvalue an initializer stores to: a local variable, an element or a
+// member of one.
+typedef struct InitDesg InitDesg;
+struct InitDesg {
+  InitDesg *next; // enclosing object, unless `var`
+  int64_t idx;
+  Member *member;
+  ObjId var;
+};
+
+static ExprId init_desg_expr(Parser *p, InitDesg *desg, SrcId loc) {
+  if (desg->var)
+    return ex_var(p, desg->var, loc);
+  ExprId base = init_desg_expr(p, desg->next, loc);
+  if (desg->member)
+    return ex_member_of(p, base, desg->member, loc);
+  return ex_deref(p, ex_binop(p, EX_ADD, base,
+                              ex_num(p, desg->idx, ty_of(TY_LONG), loc), loc),
+                  loc);
+}
+
+// Assignments storing the values given in `init`, as a comma expression (or
+// 0 when there is none).
+static ExprId init_lower(Parser *p, Initializer *init, InitDesg *desg,
+                         SrcId loc) {
+  if (init->expr) {
+    ExprId lhs = init_desg_expr(p, desg, loc);
+    ExprId id = ex_binary(p, EX_ASSIGN, unqualified(p->a, init->ty), lhs,
+                          init->expr, loc);
+    ex(p, id)->aux = EX_ASSIGN;
+    return id;
+  }
+  ExprId e = 0;
+  if (init->ty->kind == TY_ARRAY) {
+    Type *elem = init->ty->base;
+    int64_t size = init_elem_size(init);
+    for (int64_t j = 0; j < init->nruns; j++) {
+      InitRun *r = &init->runs[j];
+      for (int64_t k = 0; k < r->n; k++) {
+        InitDesg d = {.next = desg, .idx = r->first + k};
+        ExprId val = 0;
+        if (!size) {
+          if (r->elems[k])
+            e = ex_comma(p, e, init_lower(p, r->elems[k], &d, loc), loc);
           continue;
         }
+        if (r->exprs && r->exprs[k])
+          val = r->exprs[k];
+        else if (!init_is_zero(r->data + k * size, size)) // else memzero'd
+          val = init_data_expr(p, elem, r->data + k * size, loc);
+        if (val) {
+          Initializer in = {.ty = elem, .expr = val};
+          e = ex_comma(p, e, init_lower(p, &in, &d, loc), loc);
+        }
       }
-      pp_list_append(&cur2, p);
-      p = pn;
     }
-    head.next = out2.next;
-  } while (changed);
+  } else if (init->ty->kind == TY_STRUCT) {
+    for (Member *m = init->ty->tag->members; m; m = m->next) {
+      if (!init->children[m->idx])
+        continue;
+      InitDesg d = {.next = desg, .member = m};
+      e = ex_comma(p, e, init_lower(p, init->children[m->idx], &d, loc), loc);
+    }
+  } else if (init->ty->kind == TY_UNION && init->member &&
+             init->children[init->member->idx]) {
+    InitDesg d = {.next = desg, .member = init->member};
+    e = init_lower(p, init->children[init->member->idx], &d, loc);
+  }
+  return e;
+}
 
-  return head.next;
+// The local `var` initialized by `init`: zero-filled first unless it is a
+// scalar, then stored to member by member (C11 6.7.9p10, p21).
+static ExprId init_local(Parser *p, ObjId var, Initializer *init, SrcId loc) {
+  InitDesg desg = {.var = var};
+  ExprId zero = 0;
+  if (!ty_is_scalar(init->ty)) {
+    zero = ex_new(p, EX_MEMZERO, ty_of(TY_VOID), loc);
+    ex(p, zero)->obj = var;
+  }
+  return ex_comma(p, zero, init_lower(p, init, &desg, loc), loc);
+}
+
+static bool init_is_addr_const(Parser *p, ExprId id);
+
+// Whether the lvalue `id` designates an object of static storage (or a
+// function), so that its address is a constant.
+static bool init_is_static_lvalue(Parser *p, ExprId id) {
+  Expr *e = ex(p, id);
+  switch (e->kind) {
+  case EX_VAR:
+    return !(obj(p, e->obj)->flags & (OBJ_LOCAL | OBJ_TLS));
+  case EX_STR:
+    return true;
+  case EX_MEMBER:
+    return init_is_static_lvalue(p, e->lhs);
+  case EX_DEREF:
+    return init_is_addr_const(p, e->lhs);
+  default:
+    return false;
+  }
+}
+
+// Whether the pointer `id` is an address constant (C11 6.6p9): a null or
+// integer pointer, or the address of a static object, give or take a
+// constant offset.
+static bool init_is_addr_const(Parser *p, ExprId id) {
+  Expr *e = ex(p, id);
+  switch (e->kind) {
+  case EX_NUM:
+    return true;
+  case EX_ADDR:
+    return init_is_static_lvalue(p, e->lhs);
+  case EX_CAST: {
+    Expr *l = ex(p, e->lhs);
+    if (l->ty->kind == TY_ARRAY || l->ty->kind == TY_FUNC) // decays
+      return init_is_static_lvalue(p, e->lhs);
+    return l->kind == EX_NUM || (l->ty->kind == TY_PTR &&
+                                 init_is_addr_const(p, e->lhs));
+  }
+  case EX_ADD:
+  case EX_SUB:
+    if (ex(p, e->rhs)->kind == EX_NUM)
+      return init_is_addr_const(p, e->lhs);
+    return e->kind == EX_ADD && ex(p, e->lhs)->kind == EX_NUM &&
+           init_is_addr_const(p, e->rhs);
+  case EX_COND:
+    if (ex(p, e->cond)->kind != EX_NUM)
+      return false;
+    return init_is_addr_const(p, ex(p, e->cond)->ival ? e->lhs : e->rhs);
+  default:
+    return false;
+  }
+}
+
+// Report an element of `init`, which initializes an object of static
+// storage, that is neither an arithmetic constant nor an address constant
+// (C11 6.7.9p4): such an object gets its value before the program runs.
+static void init_check_static(Parser *p, Initializer *init) {
+  if (init->expr) {
+    Expr *e = ex(p, init->expr);
+    if (ex_is_const(e))
+      return;
+    // A pointer's address, as an integer of its size (an extension).
+    if (ty_is_integer(e->ty) && e->kind == EX_CAST &&
+        ex(p, e->lhs)->ty->kind == TY_PTR && e->ty->size == 8 &&
+        init_is_addr_const(p, e->lhs))
+      return;
+    if (e->ty->kind == TY_PTR && init_is_addr_const(p, init->expr))
+      return;
+    if (ty_is_arith(e->ty))
+      error_nonconst(p, init->expr,
+                     "initializer element is not a compile-time constant");
+    error_at(p->a, e->loc,
+             "initializer element is not a compile-time constant");
+  }
+  for (int64_t i = 0; init->children && i < init->nchildren; i++)
+    if (init->children[i])
+      init_check_static(p, init->children[i]);
+  for (int64_t j = 0; j < init->nruns; j++) {
+    InitRun *r = &init->runs[j];
+    for (int64_t k = 0; k < r->n; k++) {
+      if (r->elems && r->elems[k]) {
+        init_check_static(p, r->elems[k]);
+      } else if (r->exprs && r->exprs[k]) {
+        Initializer in = {.ty = init->ty->base, .expr = r->exprs[k]};
+        init_check_static(p, &in);
+      }
+    }
+  }
+}
+
+/* declarations and definitions */
+
+static ObjId parse_new_obj(Parser *p, Ident name, SrcId loc, Type *ty,
+                           uint16_t flags, int align) {
+  ObjId id = ast_new_obj(p->a);
+  Obj *o = obj(p, id);
+  o->name = name;
+  o->loc = loc;
+  o->ty = ty;
+  o->flags = flags;
+  o->align = align ? align : type_align(ty);
+  if (!(flags & OBJ_LOCAL))
+    idvec_push(&p->globals, id);
+  else if (!(flags & OBJ_PARAM)) // parameters are listed apart
+    idvec_push(&p->locals, id);
+  return id;
+}
+
+static void parse_bind(Parser *p, Ident name, ObjId id) {
+  scope_push(p, name, BIND_OBJ)->obj = id;
+}
+
+// ( type-name ) { initializer-list } (C11 6.5.2.5), after the type name. It
+// is an lvalue: an unnamed object of static storage at file scope, else a
+// local initialized where the literal appears.
+static ExprId parse_compound_literal(Parser *p, Type *ty, SrcId loc) {
+  if (type_size(ty) < 0 && ty->kind != TY_ARRAY)
+    error_at(p->a, loc, "compound literal has incomplete type '%s'",
+             type_str(p->a, ty));
+  if (!p->fn) {
+    ObjId id = parse_new_obj(p, 0, loc, ty, OBJ_STATIC | OBJ_DEFINED, 0);
+    Initializer *init = parse_initializer(p, ty, &ty);
+    init_check_static(p, init);
+    obj(p, id)->ty = ty;
+    obj(p, id)->init = init;
+    return ex_var(p, id, loc);
+  }
+  ObjId var = parse_new_obj(p, 0, loc, ty, OBJ_LOCAL, 0);
+  Initializer *init = parse_initializer(p, ty, &ty);
+  obj(p, var)->ty = ty;
+  ExprId id = ex_binary(p, EX_COMMA, ty, init_local(p, var, init, loc),
+                        ex_var(p, var, loc), loc);
+  ex(p, id)->flags = EXF_LVALUE;
+  return id;
+}
+
+static void parse_typedef(Parser *p, Decl *d, Type *ty) {
+  Binding *b = scope_here(p, scope_find_var(p, d->name));
+  if (b && b->kind == BIND_TYPEDEF) {
+    if (b->ty == ty) // allowed since C11
+      return;
+    error_at(p->a, d->loc, "typedef redefinition with different types ('%s' "
+                           "vs '%s')", type_str(p->a, ty),
+             type_str(p->a, b->ty));
+  }
+  parse_check_redecl(p, d->name, d->loc, false);
+  scope_push(p, d->name, BIND_TYPEDEF)->ty = ty;
+}
+
+// Declare the object or function `d`, which has linkage, in the current
+// scope: a new one, or the file-scope one it redeclares, whose type becomes
+// the composite of the two.
+static ObjId parse_declare(Parser *p, Decl *d, Type *ty, const VarAttr *attr) {
+  const char *name = ast_name(p->a, d->name);
+  Binding *b = scope_find_file_var(p, d->name);
+  if (!b || b->kind != BIND_OBJ) {
+    parse_check_redecl(p, d->name, d->loc, true);
+    uint16_t flags = ty->kind == TY_FUNC ? OBJ_FUNC : 0;
+    if (attr->is_static)
+      flags |= OBJ_STATIC;
+    if (attr->is_extern)
+      flags |= OBJ_EXTERN;
+    if (attr->is_inline)
+      flags |= OBJ_INLINE;
+    if (attr->is_tls)
+      flags |= OBJ_TLS;
+    if (attr->is_noreturn)
+      flags |= OBJ_NORETURN;
+    ObjId id = parse_new_obj(p, d->name, d->loc, ty, flags, attr->align);
+    parse_bind(p, d->name, id);
+    return id;
+  }
+
+  Obj *o = obj(p, b->obj);
+  if (!type_compatible(o->ty, ty)) {
+    if (ty->kind == TY_FUNC || o->ty->kind == TY_FUNC)
+      error_at(p->a, d->loc, "conflicting types for '%s'", name);
+    error_at(p->a, d->loc, "redefinition of '%s' with a different type: "
+                           "'%s' vs '%s'", name, type_str(p->a, ty),
+             type_str(p->a, o->ty));
+  }
+  if (attr->is_static && !(o->flags & OBJ_STATIC))
+    error_at(p->a, d->loc, "static declaration of '%s' follows non-static "
+                           "declaration", name);
+  if (attr->is_tls != !!(o->flags & OBJ_TLS))
+    error_at(p->a, d->loc, "%s declaration of '%s' follows %s declaration",
+             attr->is_tls ? "thread-local" : "non-thread-local", name,
+             attr->is_tls ? "non-thread-local" : "thread-local");
+  if ((o->ty->kind == TY_ARRAY && o->ty->len < 0) ||
+      (o->ty->kind == TY_FUNC && !o->ty->prototyped))
+    o->ty = ty;
+  if (attr->is_inline)
+    o->flags |= OBJ_INLINE;
+  if (attr->is_noreturn)
+    o->flags |= OBJ_NORETURN;
+  if (!attr->is_extern)
+    o->flags &= (uint16_t)~OBJ_EXTERN;
+  if (attr->align > o->align)
+    o->align = attr->align;
+  if (p->scopes.len)
+    parse_bind(p, d->name, b->obj);
+  return b->obj;
+}
+
+static StmtId parse_block_items(Parser *p);
+
+// A function body set aside by parse_defer_body(): copies of its tokens,
+// '{' to '}' and then an EOF, and what parse_function_body() needs besides.
+struct LazyBody {
+  Token *toks;
+  int64_t ntoks;
+  Decl decl;
+  Type *ty;
+  uint32_t nfile_binds; // file-scope bindings made before the body
+};
+
+// The body of the function `fn`, declared by `d` as `ty`.
+static void parse_function_body(Parser *p, ObjId fn, Decl *d, Type *ty) {
+  Obj *f = obj(p, fn);
+  p->fn = fn;
+
+  scope_enter(p);
+  f->nparams = (uint32_t)ty->nparams;
+  f->params = ast_zalloc(p->a, f->nparams * sizeof(ObjId), _Alignof(ObjId));
+  for (int i = 0; i < ty->nparams; i++) {
+    Ident name = d->param_names[i];
+    SrcId loc = d->param_locs[i];
+    if (!name)
+      error_at(p->a, loc, "parameter name omitted");
+    if (scope_here(p, scope_find_var(p, name)))
+      error_at(p->a, loc, "redefinition of parameter '%s'",
+               ast_name(p->a, name));
+    Type *pty = d->param_types[i];
+    if (type_size(pty) < 0)
+      error_at(p->a, loc, "variable has incomplete type '%s'",
+               type_str(p->a, pty));
+    ObjId v = parse_new_obj(p, name, loc, pty, OBJ_LOCAL | OBJ_PARAM, 0);
+    f->params[i] = v;
+    parse_bind(p, name, v);
+  }
+  f->body = parse_block_items(p);
+  scope_leave(p);
+
+  for (uint32_t i = 0; i < p->gotos.len; i++) {
+    Stmt *g = st(p, p->gotos.data[i]);
+    uint32_t j = 0;
+    while (j < p->labels.len && st(p, p->labels.data[j])->label != g->label)
+      j++;
+    if (j == p->labels.len)
+      error_at(p->a, g->loc, "use of undeclared label '%s'",
+               ast_name(p->a, g->label));
+  }
+  f->locals = ast_list(p->a, &p->locals, 0, &f->nlocals);
+  p->labels.len = p->gotos.len = 0;
+  p->fn = 0;
+}
+
+// Set the body of `fn` aside, from its '{' to the matching '}', for
+// parse_lazy_bodies() to parse if the function is ever used. Only braces are
+// looked at until then.
+static void parse_defer_body(Parser *p, ObjId fn, Decl *d, Type *ty) {
+  uint32_t n = 0;
+  for (int depth = 0; !n || depth;) {
+    Token *tok = parse_peek(p);
+    if (tok->kind == TK_EOF)
+      error_tok(tok, "expected '}'");
+    depth += tok_is(tok, P_LBRACE) - tok_is(tok, P_RBRACE);
+    if (n + 1 >= p->ndefer) { // room for the EOF too
+      uint32_t cap = p->ndefer ? p->ndefer * 2 : 256;
+      Token *buf = mem_malloc(MEM_AST, cap * sizeof(*buf));
+      if (!buf)
+        die_oom("setting a function body aside");
+      if (n)
+        memcpy(buf, p->defer, n * sizeof(*buf));
+      mem_free(MEM_AST, p->defer, p->ndefer * sizeof(*buf));
+      p->defer = buf;
+      p->ndefer = cap;
+    }
+    p->defer[n++] = *tok;
+    tok->origin = NULL; // now the copy's
+    lex_advance(p->lex);
+  }
+  Token *last = &p->defer[n - 1];
+  p->defer[n++] = (Token){.kind = TK_EOF, .loc = last->loc + last->len,
+                          .spelling = last->spelling};
+
+  LazyBody *lb = AST_NEW(p->a, LazyBody);
+  lb->toks = arena_alloc(&p->a->arena, n * sizeof(Token), _Alignof(Token));
+  memcpy(lb->toks, p->defer, n * sizeof(Token));
+  lb->ntoks = n;
+  lb->decl = *d;
+  lb->ty = ty;
+  lb->nfile_binds = p->file_binds.len;
+  obj(p, fn)->lazy = lb;
+  obj(p, fn)->flags |= OBJ_LAZY;
+}
+
+// The definition of the function `fn`, declared by `d` as `ty`. The body of
+// a static inline function not used yet is only set aside: headers define
+// many such functions, and a unit uses few of them.
+static void parse_function(Parser *p, ObjId fn, Decl *d, Type *ty) {
+  Obj *f = obj(p, fn);
+  if (f->flags & OBJ_DEFINED)
+    error_at(p->a, d->loc, "redefinition of '%s'", ast_name(p->a, d->name));
+  if (!d->has_params)
+    error_at(p->a, d->loc, "function definition declared by a typedef of "
+                           "function type");
+  if (ty->base->kind != TY_VOID && type_size(ty->base) < 0)
+    error_at(p->a, d->loc, "incomplete result type '%s' in function "
+                           "definition", type_str(p->a, ty->base));
+  f->flags |= OBJ_DEFINED;
+  if ((f->flags & (OBJ_STATIC | OBJ_INLINE | OBJ_USED)) ==
+          (OBJ_STATIC | OBJ_INLINE) &&
+      !opt.eager_inline)
+    parse_defer_body(p, fn, d, ty);
+  else
+    parse_function_body(p, fn, d, ty);
+}
+
+// Parse the set-aside bodies of the functions used so far, once back at file
+// scope, from a Lexer reading their tokens again. The file-scope bindings
+// made after a body are hidden meanwhile: it sees the names declared up to
+// itself, as it would have then.
+static void parse_lazy_bodies(Parser *p) {
+  while (p->lazy.len) {
+    ObjId fn = p->lazy.data[--p->lazy.len];
+    Obj *f = obj(p, fn);
+    LazyBody *lb = f->lazy;
+    f->flags &= (uint16_t)~OBJ_LAZY;
+    f->lazy = NULL;
+    Lexer replay, *lex = p->lex;
+    lex_init(&replay, NULL, NULL);
+    replay.saved = lb->toks;
+    replay.nsaved = lb->ntoks;
+    p->lex = &replay;
+    scope_file_rewind(p, lb->nfile_binds);
+    parse_function_body(p, fn, &lb->decl, lb->ty);
+    scope_file_restore(p, lb->nfile_binds);
+    p->lex = lex;
+    lex_free(&replay);
+  }
+}
+
+// A declaration in a block (C11 6.7, 6.8.2), as the statement initializing
+// its variables, or 0 when it has none.
+static StmtId parse_local_decl(Parser *p) {
+  SrcId loc = parse_loc(p);
+  VarAttr attr = {};
+  Type *basety = parse_declspec(p, &attr);
+  ExprId init = 0;
+  for (bool first = true; !parse_consume(p, P_SEMI); first = false) {
+    if (!first)
+      parse_expect(p, P_COMMA);
+    Decl d = {};
+    Type *ty = parse_declarator(p, basety, &d);
+    if (!d.name)
+      error_at(p->a, d.loc, "expected identifier or '('");
+    if (attr.is_typedef) {
+      parse_typedef(p, &d, ty);
+      continue;
+    }
+
+    if (ty->kind == TY_FUNC || attr.is_extern) {
+      if (ty->kind == TY_FUNC && attr.is_static)
+        error_at(p->a, d.loc, "function declared in block scope cannot "
+                              "have 'static' storage class");
+      if (parse_at(p, P_ASSIGN))
+        error_at(p->a, d.loc, "declaration of block scope identifier with "
+                              "linkage cannot have an initializer");
+      parse_declare(p, &d, ty, &attr);
+      continue;
+    }
+
+    Binding *prev = scope_here(p, scope_find_var(p, d.name));
+    if (prev && prev->kind == BIND_OBJ)
+      error_at(p->a, d.loc, "redefinition of '%s'", ast_name(p->a, d.name));
+    parse_check_redecl(p, d.name, d.loc, false);
+    if (ty->kind == TY_VOID)
+      error_at(p->a, d.loc, "variable has incomplete type 'void'");
+    if (attr.is_static) { // static storage, but no linkage
+      uint16_t flags = OBJ_STATIC | (attr.is_tls ? OBJ_TLS : 0);
+      ObjId v = parse_new_obj(p, d.name, d.loc, ty, flags, attr.align);
+      parse_bind(p, d.name, v);
+      if (parse_consume(p, P_ASSIGN)) {
+        Initializer *in = parse_initializer(p, ty, &ty);
+        init_check_static(p, in);
+        obj(p, v)->init = in;
+        obj(p, v)->ty = ty;
+        obj(p, v)->flags |= OBJ_DEFINED;
+      }
+      if (type_size(ty) < 0)
+        error_at(p->a, d.loc, "variable has incomplete type '%s'",
+                 type_str(p->a, ty));
+      continue;
+    }
+    if (attr.is_tls)
+      error_at(p->a, d.loc, "'_Thread_local' variable must have global "
+                            "storage");
+
+    ObjId v = parse_new_obj(p, d.name, d.loc, ty, OBJ_LOCAL, attr.align);
+    parse_bind(p, d.name, v);
+    if (parse_consume(p, P_ASSIGN)) {
+      Initializer *in = parse_initializer(p, ty, &ty);
+      obj(p, v)->ty = ty;
+      init = ex_comma(p, init, init_local(p, v, in, d.loc), d.loc);
+    }
+    if (type_size(ty) < 0)
+      error_at(p->a, d.loc, "variable has incomplete type '%s'",
+               type_str(p->a, ty));
+  }
+  if (!init)
+    return 0;
+  StmtId s = ast_new_stmt(p->a);
+  st(p, s)->kind = ST_EXPR;
+  st(p, s)->loc = loc;
+  st(p, s)->expr = init;
+  return s;
+}
+
+// A declaration or function definition at file scope (C11 6.9).
+static void parse_global_decl(Parser *p) {
+  VarAttr attr = {};
+  Type *basety = parse_declspec(p, &attr);
+  for (bool first = true; !parse_consume(p, P_SEMI); first = false) {
+    if (!first)
+      parse_expect(p, P_COMMA);
+    Decl d = {};
+    Type *ty = parse_declarator(p, basety, &d);
+    if (!d.name)
+      error_at(p->a, d.loc, "expected identifier or '('");
+    if (attr.is_typedef) {
+      parse_typedef(p, &d, ty);
+      continue;
+    }
+    ObjId id = parse_declare(p, &d, ty, &attr);
+    if (ty->kind == TY_FUNC) {
+      if (first && parse_at(p, P_LBRACE)) {
+        parse_function(p, id, &d, ty);
+        return;
+      }
+      continue;
+    }
+    if (parse_consume(p, P_ASSIGN)) {
+      Obj *o = obj(p, id);
+      if (o->flags & OBJ_DEFINED)
+        error_at(p->a, d.loc, "redefinition of '%s'", ast_name(p->a, d.name));
+      Initializer *init = parse_initializer(p, o->ty, &o->ty);
+      init_check_static(p, init);
+      o->init = init;
+      o->flags = (uint16_t)((o->flags | OBJ_DEFINED) & ~OBJ_EXTERN);
+    }
+  }
+}
+
+/* statements */
+
+static StmtId parse_stmt(Parser *p);
+
+static StmtId st_new(Parser *p, StmtKind kind, SrcId loc) {
+  StmtId id = ast_new_stmt(p->a);
+  st(p, id)->kind = (uint8_t)kind;
+  st(p, id)->loc = loc;
+  return id;
+}
+
+// ( expression ), the controlling expression of if, while or do.
+static ExprId parse_cond(Parser *p) {
+  parse_expect(p, P_LPAREN);
+  ExprId e = parse_expr(p);
+  parse_expect(p, P_RPAREN);
+  ex_check_scalar(p, e);
+  return e;
+}
+
+// The body of a loop, or of a switch when `loop` is false.
+static StmtId parse_body(Parser *p, bool loop) {
+  p->loops += loop;
+  p->breakables++;
+  StmtId s = parse_stmt(p);
+  p->loops -= loop;
+  p->breakables--;
+  return s;
+}
+
+static StmtId parse_return(Parser *p, SrcId loc) {
+  StmtId s = st_new(p, ST_RETURN, loc);
+  Obj *fn = obj(p, p->fn);
+  Type *ret = fn->ty->base;
+  if (parse_consume(p, P_SEMI)) {
+    if (ret->kind != TY_VOID)
+      error_at(p->a, loc, "non-void function '%s' should return a value",
+               ast_name(p->a, fn->name));
+    return s;
+  }
+  ExprId e = parse_expr(p);
+  parse_expect(p, P_SEMI);
+  if (ret->kind == TY_VOID) {
+    if (ex(p, e)->ty->kind != TY_VOID)
+      error_at(p->a, loc, "void function '%s' should not return a value",
+               ast_name(p->a, fn->name));
+  } else {
+    e = ex_assign_conv(p, e, ret);
+  }
+  st(p, s)->expr = e;
+  return s;
+}
+
+static StmtId parse_switch(Parser *p, SrcId loc) {
+  parse_expect(p, P_LPAREN);
+  ExprId e = parse_expr(p);
+  parse_expect(p, P_RPAREN);
+  Type *ty = value_type(p, ex(p, e)->ty);
+  if (!ty_is_integer(ty))
+    error_at(p->a, ex(p, e)->loc, "statement requires expression of integer "
+                                  "type ('%s' invalid)",
+             type_str(p->a, ex(p, e)->ty));
+  StmtId s = st_new(p, ST_SWITCH, loc);
+  st(p, s)->expr = ex_convert(p, e, type_promote(ty));
+
+  StmtId sw = p->sw;
+  uint32_t sw_cases = p->sw_cases;
+  p->sw = s;
+  p->sw_cases = p->cases.len;
+  StmtId body = parse_body(p, false);
+  Stmt *sp = st(p, s);
+  sp->then = body;
+  sp->items = ast_list(p->a, &p->cases, p->sw_cases, &sp->n);
+  p->sw = sw;
+  p->sw_cases = sw_cases;
+  return s;
+}
+
+// case constant-expression : statement, or default : statement
+static StmtId parse_case(Parser *p, SrcId loc, bool is_default) {
+  const char *what = is_default ? "default" : "case";
+  if (!p->sw)
+    error_at(p->a, loc, "'%s' statement not in switch statement", what);
+  StmtId s = st_new(p, is_default ? ST_DEFAULT : ST_CASE, loc);
+  if (!is_default) {
+    int64_t val = parse_const_expr(p);
+    if (parse_at(p, P_ELLIPSIS))
+      error_tok(parse_peek(p), "case ranges are not supported");
+    // The value converted to the promoted type of the controlling expression.
+    val = eval_wrap(ex(p, st(p, p->sw)->expr)->ty, (uint64_t)val);
+    st(p, s)->val = val;
+  }
+  parse_expect(p, P_COLON);
+  for (uint32_t i = p->sw_cases; i < p->cases.len; i++) {
+    Stmt *c = st(p, p->cases.data[i]);
+    if (is_default && c->kind == ST_DEFAULT)
+      error_at(p->a, loc, "multiple default labels in one switch");
+    if (!is_default && c->kind == ST_CASE && c->val == st(p, s)->val)
+      error_at(p->a, loc, "duplicate case value '%lld'",
+               (long long)st(p, s)->val);
+  }
+  idvec_push(&p->cases, s);
+  StmtId then = parse_stmt(p);
+  st(p, s)->then = then;
+  return s;
+}
+
+static StmtId parse_local_decl(Parser *p);
+
+static StmtId parse_for(Parser *p, SrcId loc) {
+  StmtId s = st_new(p, ST_FOR, loc);
+  parse_expect(p, P_LPAREN);
+  scope_enter(p);
+  StmtId init = 0;
+  ExprId cond = 0, inc = 0;
+  if (parse_is_typename(p, parse_peek(p))) {
+    init = parse_local_decl(p);
+  } else if (!parse_consume(p, P_SEMI)) {
+    SrcId iloc = parse_loc(p);
+    init = st_new(p, ST_EXPR, iloc);
+    ExprId e = parse_expr(p);
+    st(p, init)->expr = e;
+    parse_expect(p, P_SEMI);
+  }
+  if (!parse_at(p, P_SEMI)) {
+    cond = parse_expr(p);
+    ex_check_scalar(p, cond);
+  }
+  parse_expect(p, P_SEMI);
+  if (!parse_at(p, P_RPAREN))
+    inc = parse_expr(p);
+  parse_expect(p, P_RPAREN);
+  StmtId body = parse_body(p, true);
+  scope_leave(p);
+  Stmt *sp = st(p, s);
+  sp->init = init;
+  sp->expr = cond;
+  sp->inc = inc;
+  sp->then = body;
+  return s;
+}
+
+// identifier : statement
+static StmtId parse_label(Parser *p) {
+  SrcId loc;
+  Ident name = parse_ident(p, &loc);
+  lex_advance(p->lex); // :
+  for (uint32_t i = 0; i < p->labels.len; i++)
+    if (st(p, p->labels.data[i])->label == name)
+      error_at(p->a, loc, "redefinition of label '%s'", ast_name(p->a, name));
+  StmtId s = st_new(p, ST_LABEL, loc);
+  st(p, s)->label = name;
+  idvec_push(&p->labels, s);
+  StmtId then = parse_stmt(p);
+  st(p, s)->then = then;
+  return s;
+}
+
+// statement (C11 6.8), other than a declaration.
+static StmtId parse_stmt(Parser *p) {
+  Token *tok = parse_peek(p);
+  SrcId loc = ast_loc(p->a, tok);
+
+  if (tok->kind == TK_KEYWORD) {
+    Keyword kw = tok->kw;
+    switch (kw) {
+    case KW_RETURN:
+      lex_advance(p->lex);
+      return parse_return(p, loc);
+    case KW_IF: {
+      lex_advance(p->lex);
+      StmtId s = st_new(p, ST_IF, loc);
+      ExprId cond = parse_cond(p);
+      StmtId then = parse_stmt(p);
+      StmtId els = parse_consume_kw(p, KW_ELSE) ? parse_stmt(p) : 0;
+      Stmt *sp = st(p, s);
+      sp->expr = cond;
+      sp->then = then;
+      sp->els = els;
+      return s;
+    }
+    case KW_SWITCH:
+      lex_advance(p->lex);
+      return parse_switch(p, loc);
+    case KW_CASE:
+    case KW_DEFAULT:
+      lex_advance(p->lex);
+      return parse_case(p, loc, kw == KW_DEFAULT);
+    case KW_FOR:
+      lex_advance(p->lex);
+      return parse_for(p, loc);
+    case KW_WHILE: {
+      lex_advance(p->lex);
+      StmtId s = st_new(p, ST_WHILE, loc);
+      ExprId cond = parse_cond(p);
+      StmtId body = parse_body(p, true);
+      st(p, s)->expr = cond;
+      st(p, s)->then = body;
+      return s;
+    }
+    case KW_DO: {
+      lex_advance(p->lex);
+      StmtId s = st_new(p, ST_DO, loc);
+      StmtId body = parse_body(p, true);
+      if (!parse_consume_kw(p, KW_WHILE))
+        error_tok(parse_peek(p), "expected 'while' in do/while loop");
+      ExprId cond = parse_cond(p);
+      parse_expect(p, P_SEMI);
+      st(p, s)->expr = cond;
+      st(p, s)->then = body;
+      return s;
+    }
+    case KW_GOTO: {
+      lex_advance(p->lex);
+      StmtId s = st_new(p, ST_GOTO, loc);
+      Ident label = parse_ident(p, NULL);
+      st(p, s)->label = label;
+      parse_expect(p, P_SEMI);
+      idvec_push(&p->gotos, s);
+      return s;
+    }
+    case KW_BREAK:
+    case KW_CONTINUE:
+      if (kw == KW_BREAK && !p->breakables)
+        error_at(p->a, loc, "'break' statement not in loop or switch "
+                            "statement");
+      if (kw == KW_CONTINUE && !p->loops)
+        error_at(p->a, loc, "'continue' statement not in loop statement");
+      lex_advance(p->lex);
+      parse_expect(p, P_SEMI);
+      return st_new(p, kw == KW_BREAK ? ST_BREAK : ST_CONTINUE, loc);
+    default:
+      break;
+    }
+  }
+
+  if (tok->kind == TK_IDENT && tok_is(parse_peek2(p), P_COLON))
+    return parse_label(p);
+  if (tok_is(tok, P_LBRACE))
+    return parse_compound(p);
+
+  StmtId s = st_new(p, ST_EXPR, loc);
+  if (!parse_consume(p, P_SEMI)) {
+    ExprId e = parse_expr(p);
+    st(p, s)->expr = e;
+    parse_expect(p, P_SEMI);
+  }
+  return s;
+}
+
+// { block-item-list? }, in the current scope.
+static StmtId parse_block_items(Parser *p) {
+  SrcId loc = parse_loc(p);
+  parse_expect(p, P_LBRACE);
+  uint32_t base = p->stack.len;
+  while (!parse_consume(p, P_RBRACE)) {
+    Token *tok = parse_peek(p);
+    if (tok->kind == TK_EOF)
+      error_tok(tok, "expected '}'");
+    if (tok_is_kw(tok, KW_STATIC_ASSERT)) {
+      parse_static_assert(p);
+      continue;
+    }
+    StmtId s;
+    if (parse_is_typename(p, tok) && !tok_is(parse_peek2(p), P_COLON))
+      s = parse_local_decl(p);
+    else
+      s = parse_stmt(p);
+    if (s)
+      idvec_push(&p->stack, s);
+  }
+  StmtId s = st_new(p, ST_BLOCK, loc);
+  Stmt *sp = st(p, s);
+  sp->items = ast_list(p->a, &p->stack, base, &sp->n);
+  return s;
+}
+
+static StmtId parse_compound(Parser *p) {
+  scope_enter(p);
+  StmtId s = parse_block_items(p);
+  scope_leave(p);
+  return s;
+}
+
+/* translation unit */
+
+// Parse the translation unit `l` yields into `a` (C11 6.9).
+static void parse_unit(Lexer *l, Ast *a) {
+  Parser p = {.lex = l, .a = a};
+  for (Token *tok; (tok = parse_peek(&p))->kind != TK_EOF;) {
+    if (tok_is_kw(tok, KW_STATIC_ASSERT))
+      parse_static_assert(&p);
+    else if (tok_is(tok, P_SEMI))
+      lex_advance(l);
+    else
+      parse_global_decl(&p);
+    parse_lazy_bodies(&p);
+  }
+  for (uint32_t i = 0; i < p.globals.len; i++) {
+    Obj *o = obj(&p, p.globals.data[i]);
+    if (!(o->flags & (OBJ_FUNC | OBJ_EXTERN)) && o->ty->kind != TY_ARRAY &&
+        type_size(o->ty) < 0)
+      error_at(a, o->loc, "tentative definition has type '%s' that is never "
+                          "completed", type_str(a, o->ty));
+    if (o->flags & OBJ_LAZY) { // never used: the body is dropped unparsed
+      lex_free_saved(o->lazy->toks, o->lazy->ntoks);
+      o->lazy = NULL;
+    }
+  }
+  a->globals = ast_list(a, &p.globals, 0, &a->nglobals);
+  idvec_free(&p.stack);
+  idvec_free(&p.locals);
+  idvec_free(&p.labels);
+  idvec_free(&p.gotos);
+  idvec_free(&p.cases);
+  idvec_free(&p.globals);
+  idvec_free(&p.lazy);
+  mem_free(MEM_AST, p.defer, p.ndefer * sizeof(*p.defer));
+  idvec_free(&p.undo);
+  idvec_free(&p.scopes);
+  idvec_free(&p.file_binds);
+  mem_free(MEM_AST, p.hidden, p.nhidden * sizeof(*p.hidden));
+  mem_free(MEM_AST, p.binds, p.nbinds * sizeof(*p.binds));
+}
+
+/* dump */
+
+static void dump_expr(FILE *out, const Ast *a, ExprId id, int depth);
+static void dump_stmt(FILE *out, const Ast *a, StmtId id, int depth);
+
+static const char *dump_obj_name(const Ast *a, ObjId id) {
+  const Obj *o = ast_obj(a, id);
+  return o->name ? ast_name(a, o->name) : "<compound literal>";
+}
+
+static void dump_expr(FILE *out, const Ast *a, ExprId id, int depth) {
+  const Expr *e = ast_expr(a, id);
+  fprintf(out, "%*s%s '%s'", depth * 2, "", expr_kind_names[e->kind],
+          type_str(a, e->ty));
+  if (e->flags & EXF_LVALUE)
+    fprintf(out, " lvalue");
+  if (e->flags & EXF_BITFIELD)
+    fprintf(out, " bitfield");
+  switch (e->kind) {
+  case EX_NUM:
+    fprintf(out, ty_is_unsigned(e->ty) ? " %llu" : " %lld",
+            (unsigned long long)e->ival);
+    break;
+  case EX_FNUM:
+    fprintf(out, " %.21Lg", ast_fnum_value(a, e->fnum));
+    break;
+  case EX_STR: {
+    const AstStr *s = ast_str_at(a, e->str);
+    fprintf(out, " %s \"", str_enc_name(s->enc));
+    dump_str_units(out, s->data, s->len, s->enc);
+    fputc('"', out);
+    break;
+  }
+  case EX_VAR:
+  case EX_MEMZERO:
+    fprintf(out, " %s", dump_obj_name(a, e->obj));
+    break;
+  case EX_MEMBER:
+    fprintf(out, " .%s",
+            e->member->name ? ast_name(a, e->member->name) : "<anonymous>");
+    break;
+  case EX_ASSIGN:
+    if (e->aux != EX_ASSIGN)
+      fprintf(out, " %s", expr_kind_names[e->aux]);
+    break;
+  }
+  fputc('\n', out);
+
+  if (e->kind == EX_COND)
+    dump_expr(out, a, e->cond, depth + 1);
+  if (e->lhs)
+    dump_expr(out, a, e->lhs, depth + 1);
+  if (e->kind == EX_CALL) {
+    for (uint32_t i = 0; i < e->rhs; i++)
+      dump_expr(out, a, e->args[i], depth + 1);
+    return;
+  }
+  if (e->rhs)
+    dump_expr(out, a, e->rhs, depth + 1);
+  if (e->kind == EX_STMT_EXPR)
+    dump_stmt(out, a, e->body, depth + 1);
+}
+
+static void dump_stmt(FILE *out, const Ast *a, StmtId id, int depth) {
+  const Stmt *s = ast_stmt(a, id);
+  fprintf(out, "%*s%s", depth * 2, "", stmt_kind_names[s->kind]);
+  if (s->kind == ST_CASE)
+    fprintf(out, " %lld", (long long)s->val);
+  if (s->kind == ST_GOTO || s->kind == ST_LABEL)
+    fprintf(out, " %s", ast_name(a, s->label));
+  fputc('\n', out);
+
+  if (s->kind == ST_FOR) { // absent clauses show as "-"
+    if (s->init)
+      dump_stmt(out, a, s->init, depth + 1);
+    else
+      fprintf(out, "%*s-\n", (depth + 1) * 2, "");
+    ExprId clauses[] = {s->expr, s->inc};
+    for (int i = 0; i < 2; i++) {
+      if (clauses[i])
+        dump_expr(out, a, clauses[i], depth + 1);
+      else
+        fprintf(out, "%*s-\n", (depth + 1) * 2, "");
+    }
+  } else if (s->expr) {
+    dump_expr(out, a, s->expr, depth + 1);
+  }
+  if (s->kind == ST_BLOCK)
+    for (uint32_t i = 0; i < s->n; i++)
+      dump_stmt(out, a, s->items[i], depth + 1);
+  if (s->then)
+    dump_stmt(out, a, s->then, depth + 1);
+  if (s->els)
+    dump_stmt(out, a, s->els, depth + 1);
+}
+
+static void dump_init(FILE *out, const Ast *a, const Initializer *init,
+                      int depth);
+
+// Elements of an array of scalars show as their bytes, 16 to a line, then
+// those that are not constants as expressions.
+static void dump_init_run(FILE *out, const Ast *a, const Initializer *init,
+                          const InitRun *r, int depth) {
+  int64_t size = init_elem_size(init);
+  if (size) {
+    fprintf(out, "%*s[%lld..%lld] bytes\n", depth * 2, "",
+            (long long)r->first, (long long)(r->first + r->n - 1));
+    for (int64_t i = 0; i < r->n * size; i += 16) {
+      fprintf(out, "%*s", (depth + 1) * 2, "");
+      for (int64_t j = i; j < i + 16 && j < r->n * size; j++)
+        fprintf(out, "%s%02x", j > i ? " " : "", r->data[j]);
+      fputc('\n', out);
+    }
+  }
+  for (int64_t k = 0; k < r->n; k++) {
+    if (size ? !r->exprs || !r->exprs[k] : !r->elems[k])
+      continue;
+    fprintf(out, "%*s[%lld]\n", depth * 2, "", (long long)(r->first + k));
+    if (size)
+      dump_expr(out, a, r->exprs[k], depth + 1);
+    else
+      dump_init(out, a, r->elems[k], depth + 1);
+  }
+}
+
+static void dump_init(FILE *out, const Ast *a, const Initializer *init,
+                      int depth) {
+  fprintf(out, "%*sinit '%s'\n", depth * 2, "", type_str(a, init->ty));
+  if (init->expr) {
+    dump_expr(out, a, init->expr, depth + 1);
+    return;
+  }
+  if (init->ty->kind == TY_ARRAY) {
+    for (int64_t j = 0; j < init->nruns; j++)
+      dump_init_run(out, a, init, &init->runs[j], depth + 1);
+    return;
+  }
+  for (Member *m = ty_is_record(init->ty) ? init->ty->tag->members : NULL; m;
+       m = m->next) {
+    if (!init->children[m->idx] ||
+        (init->ty->kind == TY_UNION && m != init->member))
+      continue;
+    fprintf(out, "%*s.%s\n", (depth + 1) * 2, "",
+            m->name ? ast_name(a, m->name) : "<anonymous>");
+    dump_init(out, a, init->children[m->idx], depth + 2);
+  }
+}
+
+static void dump_obj(FILE *out, const Ast *a, ObjId id, const char *what,
+                     int depth) {
+  const Obj *o = ast_obj(a, id);
+  fprintf(out, "%*s%s '%s' %s", depth * 2, "", what, type_str(a, o->ty),
+          dump_obj_name(a, id));
+  static const struct {
+    uint16_t flag;
+    const char *name;
+  } flags[] = {
+      {OBJ_STATIC, "static"},     {OBJ_EXTERN, "extern"},
+      {OBJ_INLINE, "inline"},     {OBJ_TLS, "_Thread_local"},
+      {OBJ_NORETURN, "_Noreturn"}, {OBJ_LAZY, "unparsed"},
+  };
+  for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+    if (o->flags & flags[i].flag)
+      fprintf(out, " %s", flags[i].name);
+  if (o->align != type_align(o->ty))
+    fprintf(out, " align=%d", o->align);
+  fputc('\n', out);
 }
 
-typedef struct {
-  PPContext *ctx;
-  PPToken **out_cur;
-  bool emit_text;
-  bool stop_on_endif_like;
-} PPGroupParser;
+// Write the AST in an indented tree, one node per line, for --dump-ast.
+static void dump_ast(FILE *out, const Ast *a) {
+  for (uint32_t i = 0; i < a->nglobals; i++) {
+    ObjId id = a->globals[i];
+    const Obj *o = ast_obj(a, id);
+    if (!(o->flags & OBJ_FUNC)) {
+      dump_obj(out, a, id, "var", 0);
+      if (o->init)
+        dump_init(out, a, o->init, 1);
+      continue;
+    }
+    dump_obj(out, a, id, "func", 0);
+    if (!(o->flags & OBJ_DEFINED) || (o->flags & OBJ_LAZY))
+      continue;
+    for (uint32_t j = 0; j < o->nparams; j++)
+      dump_obj(out, a, o->params[j], "param", 1);
+    for (uint32_t j = 0; j < o->nlocals; j++)
+      dump_obj(out, a, o->locals[j], "local", 1);
+    dump_stmt(out, a, o->body, 1);
+  }
+}
 
-static PPToken *pp_parse_group(PPGroupParser *p, PPToken *tok);
+/* section: driver */
+
+static void dump_pptokens(FILE *err, PPToken *tok) {
+  for (; tok; tok = tok->next) {
+    pp_fprint_srcloc(err, tok->spelling);
+    fprintf(err, ": %s%s%s", pp_tok_kind_name(tok->kind),
+            tok->at_bol ? "(BOL)" : "",
+            tok->kind == PPTOK_NEWLINE ? "" : ": ");
+    if (tok->kind != PPTOK_NEWLINE)
+      fwrite(tok->loc, 1, (size_t)tok->len, err);
+    fputc('\n', err);
+  }
+}
 
-static PPToken *pp_handle_text_line(PPGroupParser *p, PPToken *tok) {
-  PPToken *line_end = tok;
-  while (line_end && line_end->kind != PPTOK_EOF &&
-         line_end->kind != PPTOK_NEWLINE)
-    line_end = line_end->next;
+// Past -E: parse the unit `l` yields. The AST holds on to macro origins and
+// file names, so it goes before the Lexer and the files do.
+static void compile_tokens(Lexer *l, FILE *err) {
+  if (opt.dump_lex_tokens)
+    l->dump = err;
+  Ast a;
+  ast_init(&a);
+  parse_unit(l, &a);
+  if (opt.dump_ast)
+    dump_ast(err, &a);
+  ast_free(&a);
+}
 
-  if (!p->emit_text)
-    return pp_skip_to_line_end(tok);
+// Parse the preprocessed unit `pp` (consuming it).
+static void compile_lex(PPToken *pp, FILE *err) {
+  PhaseTimer t = phase_begin(PHASE_PARSE);
+  Lexer l;
+  lex_init(&l, NULL, pp);
+  compile_tokens(&l, err);
+  lex_free(&l);
+  phase_end(t);
+}
 
-  // Clone the line into an owned list, expand macros in it, and append to output.
-  PPToken *line = pp_clone_range(tok, line_end);
-  line = pp_expand_list(p->ctx, line);
-  pp_list_append_list(p->out_cur, line);
+// Pull the unit through the fused preprocess -> lex -> parse pipeline. The
+// stages run interleaved, so their time is reported together as "parse".
+// `pp` is the tokenized main file, or NULL to tokenize `file` on the way.
+static void compile_stream(PPToken *pp, PPFile *file, PPFileSet *files,
+                           FILE *err) {
+  PhaseTimer t = phase_begin(PHASE_PARSE);
+  PPStream s;
+  if (pp)
+    pp_stream_init(&s, pp, files);
+  else
+    pp_stream_init_file(&s, file, files);
+  Lexer l;
+  lex_init(&l, &s, NULL);
+  compile_tokens(&l, err);
+  lex_free(&l);
+  pp_stream_free(&s);
+  phase_end(t);
+}
 
-  if (line_end && line_end->kind == PPTOK_NEWLINE) {
-    pp_list_append(p->out_cur, pp_clone_tok(line_end));
-    return line_end->next;
+// A *.pptok input is already preprocessed: load it and go on from there.
+static void compile_pptok_body(const char *path, FILE *out, FILE *err) {
+  PhaseTimer t = phase_begin(PHASE_READ);
+  PPFile f;
+  PPToken *pp = pp_read_pptok(path, &f);
+  phase_end(t);
+
+  if (opt.dump_tokens)
+    dump_pptokens(err, pp);
+  if (opt.opt_E) {
+    t = phase_begin(PHASE_OUTPUT);
+    pp_emit_tokens(out, pp);
+    phase_end(t);
+    free_pptokens(pp);
+  } else {
+    compile_lex(pp, err);
   }
-  return line_end;
+  pp_free_file(&f);
 }
 
-static PPToken *pp_handle_empty_directive(PPToken *tok) {
-  // control-line: "#" new-line
-  PPToken *trail = tok->next;
-  if (trail && trail->kind != PPTOK_NEWLINE && trail->kind != PPTOK_EOF)
-    pp_die_tok(trail, "extra token after #");
-  return pp_skip_to_line_end(tok);
+static void unescape_edit_text(char *s, size_t *len) {
+  size_t w = 0;
+  for (size_t r = 0; s[r]; r++) {
+    if (s[r] != '\\' || !s[r + 1]) {
+      s[w++] = s[r];
+      continue;
+    }
+    char c = s[++r];
+    s[w++] = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+  }
+  s[w] = '\0';
+  *len = w;
 }
 
-static PPToken *pp_handle_include(PPToken *tok) { return pp_skip_to_line_end(tok); }
+// --edit-script: keep the unit in a PPSession and apply each edit line
+//   <path> <offset> <removed> <text>
+// (text may use \n, \t, \r and \\ escapes) as an editor would, bringing the
+// output up to date after every one. The final output is printed.
+static void compile_session_body(const char *path, FILE *out, FILE *err) {
+  FILE *fp = fopen(opt.edit_script, "r");
+  if (!fp)
+    DIE("cannot open edit script: %s", opt.edit_script);
+  PhaseTimer t = phase_begin(PHASE_TOKENIZE);
+  PPSession *s = pp_session_open(path);
+  phase_end(t);
+  // Errors in the session itself are caught by it; this catches the rest,
+  // which must not leave the session's I/O thread running.
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    fclose(fp);
+    pp_session_close(s);
+    fatal_exit();
+  }
+  t = phase_begin(PHASE_PREPROCESS);
+  bool ok = pp_session_output(s);
+  phase_end(t);
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t n;
+  for (int lineno = 1; (n = getline(&line, &cap, fp)) >= 0; lineno++) {
+    if (n > 0 && line[n - 1] == '\n')
+      line[--n] = '\0';
+    if (!line[0] || line[0] == '#')
+      continue;
+    char file[4096];
+    size_t offset, removed;
+    int consumed = 0;
+    if (sscanf(line, "%4095s %zu %zu%n", file, &offset, &removed,
+               &consumed) != 3 ||
+        (line[consumed] && line[consumed] != ' ')) {
+      free(line);
+      DIE("%s:%d: expected <path> <offset> <removed> <text>", opt.edit_script,
+          lineno);
+    }
+    char *text = line + consumed + (line[consumed] == ' ');
+    size_t len;
+    unescape_edit_text(text, &len);
+
+    t = phase_begin(PHASE_TOKENIZE);
+    ok = pp_session_edit(s, file, offset, removed, text, len);
+    phase_end(t);
+    if (!ok)
+      continue;
+    t = phase_begin(PHASE_PREPROCESS);
+    ok = pp_session_output(s);
+    phase_end(t);
+  }
+  free(line);
+  if (!ok)
+    fatal_exit(); // the last edit left an error, already reported
+  fatal_jmp = saved;
+  fclose(fp);
 
-static PPToken *pp_handle_include_next(PPToken *tok) {
-  return pp_skip_to_line_end(tok);
+  if (opt.dump_tokens)
+    dump_pptokens(err, s->main.tokens);
+  if (opt.opt_E) {
+    t = phase_begin(PHASE_OUTPUT);
+    pp_emit_tokens(out, pp_session_output(s));
+    phase_end(t);
+  }
+  pp_session_close(s);
 }
 
-static PPToken *pp_handle_define(PPContext *ctx, PPToken *tok) {
-  // control-line:
-  //   # define identifier replacement-list new-line
-  // For now we only support object-like macros.
-  PPToken *define_tok = tok->next;
-  PPToken *name_tok = define_tok ? define_tok->next : NULL;
-  if (!pp_directive_is(tok, "define") || !pp_is_identifier(name_tok))
-    pp_die_tok(tok, "malformed #define");
+static void compile_tu_body(const char *path, FILE *out, FILE *err) {
+  if (ends_with(path, ".pptok")) {
+    compile_pptok_body(path, out, err);
+    return;
+  }
+  if (opt.edit_script) {
+    compile_session_body(path, out, err);
+    return;
+  }
 
-  char *name = pp_strndup(name_tok->loc, name_tok->len);
+  PhaseTimer t = phase_begin(PHASE_READ);
+  PPFile f = pp_read_file(path);
+  phase_end(t);
+
+  // --tokens wants the tokenizer to actually run, so it bypasses the cache.
+  bool use_cache = opt.cache_dir && opt.opt_E && !opt.dump_tokens;
+  Hash128 key = {0};
+  if (use_cache) {
+    key = cache_key(&opt, &f);
+    t = phase_begin(PHASE_OUTPUT);
+    bool hit = cache_fetch(opt.cache_dir, key, path, out);
+    phase_end(t);
+    if (hit) {
+      pp_free_file(&f);
+      return;
+    }
+  }
 
-  // Replacement-list: tokens up to NEWLINE.
-  PPToken *line_end = name_tok->next;
-  while (line_end && line_end->kind != PPTOK_EOF &&
-         line_end->kind != PPTOK_NEWLINE)
-    line_end = line_end->next;
-  PPToken *body = pp_clone_range(name_tok->next, line_end);
+  // The main file is tokenized as the stream consumes it, unless its tokens
+  // are dumped or it is big enough to be tokenized in parallel.
+  PPToken *pp = NULL;
+  if (opt.dump_tokens || pp_tokenize_in_chunks(&f)) {
+    t = phase_begin(PHASE_TOKENIZE);
+    pp = tokenlize(&f);
+    phase_end(t);
+  }
 
-  pp_macro_define_obj(ctx, name_tok->spelling, name, body);
-  return pp_skip_to_line_end(tok);
+  if (opt.dump_tokens)
+    dump_pptokens(err, pp);
+
+  PPFileSet files;
+  pp_fileset_init(&files);
+  files.record_includes = use_cache;
+  // The I/O thread waits on `files`, which lives in this frame: on a fatal
+  // error, stop it and free the unit before passing the error on.
+  jmp_buf jb;
+  jmp_buf *saved = fatal_jmp;
+  fatal_jmp = &jb;
+  if (setjmp(jb) != 0) {
+    fatal_jmp = saved;
+    pp_fileset_free(&files);
+    free_pptokens(pp);
+    pp_free_file(&f);
+    fatal_exit();
+  }
+  if (opt.opt_E) {
+    t = phase_begin(PHASE_PREPROCESS);
+    PPToken *pp2 = preprocess(pp, &f, &files);
+    phase_end(t);
+
+    t = phase_begin(PHASE_OUTPUT);
+    char *tmp_path = NULL;
+    FILE *tmp = use_cache ? cache_store_begin(opt.cache_dir, &tmp_path) : NULL;
+    if (tmp)
+      cache_write_deps(tmp, &files);
+    pp_emit_tokens(tmp ? tmp : out, pp2);
+    if (tmp)
+      cache_store_commit(opt.cache_dir, key, opt.cache_max_size, tmp,
+                         tmp_path, out);
+    phase_end(t);
+    free_pptokens(pp2);
+  } else {
+    compile_stream(pp, &f, &files, err);
+  }
+  fatal_jmp = saved;
+
+  pp_fileset_free(&files);
+  free_pptokens(pp);
+  pp_free_file(&f);
 }
 
-static PPToken *pp_handle_undef(PPContext *ctx, PPToken *tok) {
-  // control-line:
-  //   # undef identifier new-line
-  PPToken *undef_tok = tok->next;
-  PPToken *name_tok = undef_tok ? undef_tok->next : NULL;
-  if (!pp_directive_is(tok, "undef") || !pp_is_identifier(name_tok))
-    pp_die_tok(tok, "malformed #undef");
-  pp_macro_undef(ctx, (char *)name_tok->loc, name_tok->len);
-  PPToken *trail = name_tok->next;
-  if (trail && trail->kind != PPTOK_NEWLINE && trail->kind != PPTOK_EOF)
-    pp_die_tok(trail, "extra token after #undef");
-  return pp_skip_to_line_end(tok);
+// Compile one translation unit: results (e.g. -E text) go to `out`, token
+// dumps and reports to `err`. Fatal errors leave through fatal_exit().
+static void compile_tu(const char *path, FILE *out, FILE *err) {
+  tu_stats = (Stats){};
+  tu_mem = (MemStats){};
+  mem_untracked = false;
+  CostReport cost = {.files = {.untracked = true},
+                     .macros = {.untracked = true}};
+  tu_cost = opt.cost_report ? &cost : NULL;
+  double start = trace_enabled() ? trace_clock() : 0;
+  compile_tu_body(path, out, err);
+  if (trace_enabled())
+    trace_complete("tu", path, start, trace_clock(), "file", path, NULL,
+                   NULL);
+  if (opt.time_report)
+    print_time_report(err, path);
+  if (opt.stats)
+    print_stats(err, path);
+  if (opt.mem_report)
+    print_mem_report(err, path);
+  if (tu_cost) {
+    print_cost_report(err, path, opt.cost_report);
+    cost_report_free(tu_cost);
+    tu_cost = NULL;
+  }
 }
 
-static PPToken *pp_handle_line(PPToken *tok) { return pp_skip_to_line_end(tok); }
+// Parallel driver (-j N).
+//
+// Inputs are independent translation units. Workers claim them in argv order
+// from an atomic cursor and compile each into private memory streams; every
+// piece of per-TU state (files, token lists, PPContext) is already local to
+// compile_tu(), and `opt` is read-only once argv is parsed. The main thread
+// emits finished units strictly in argv order, so stdout/stderr match a
+// sequential run byte for byte. A fatal error stops workers from claiming
+// further inputs; units before it are still emitted, as they would have been.
 
-static PPToken *pp_handle_error(PPToken *tok) { return pp_skip_to_line_end(tok); }
+typedef struct {
+  char *out;
+  size_t out_len;
+  char *err;
+  size_t err_len;
+  bool failed;
+  bool done; // guarded by TUPool.mu
+} TUResult;
 
-static PPToken *pp_handle_pragma(PPToken *tok) { return pp_skip_to_line_end(tok); }
+typedef struct {
+  TUResult *results;
+  int n;
+  atomic_int next; // next unclaimed input index
+  atomic_bool stop;
+  mtx_t mu;
+  cnd_t done_cv;
+} TUPool;
+
+static void tu_run_buffered(const char *path, TUResult *r) {
+  // Catch errors before anything can fail: exiting from a worker would take
+  // down a compile server along with the unit.
+  jmp_buf jb;
+  fatal_jmp = &jb;
+  FILE *out = open_memstream(&r->out, &r->out_len);
+  FILE *err = open_memstream(&r->err, &r->err_len);
+  if (setjmp(jb) == 0) {
+    if (!out || !err)
+      die_oom("opening per-unit output buffers");
+    diag_out = err;
+    compile_tu(path, out, err);
+  } else {
+    r->failed = true; // compile_tu_body already freed the unit's files
+  }
+  fatal_jmp = NULL;
+  diag_out = NULL;
 
-static PPToken *pp_handle_non_directive(PPToken *tok) { return pp_skip_to_line_end(tok); }
+  if (out)
+    fclose(out);
+  if (err)
+    fclose(err);
+}
 
-static PPToken *pp_handle_control_line(PPGroupParser *p, PPToken *tok) {
-  if (pp_is_empty_directive(tok))
-    return pp_handle_empty_directive(tok);
-  if (pp_directive_is(tok, "include"))
-    return pp_handle_include(tok);
-  if (pp_directive_is(tok, "include_next"))
-    return pp_handle_include_next(tok);
-  if (pp_directive_is(tok, "define"))
-    return pp_handle_define(p->ctx, tok);
-  if (pp_directive_is(tok, "undef"))
-    return pp_handle_undef(p->ctx, tok);
-  if (pp_directive_is(tok, "line"))
-    return pp_handle_line(tok);
-  if (pp_directive_is(tok, "error"))
-    return pp_handle_error(tok);
-  if (pp_directive_is(tok, "pragma"))
-    return pp_handle_pragma(tok);
+static int tu_worker(void *arg) {
+  TUPool *pool = arg;
+  while (!atomic_load(&pool->stop)) {
+    int i = atomic_fetch_add(&pool->next, 1);
+    if (i >= pool->n)
+      break;
 
-  // conditionals are handled elsewhere; unknown directives are non-directive.
-  return pp_handle_non_directive(tok);
+    TUResult *r = &pool->results[i];
+    tu_run_buffered(opt.c_inputs.data[i], r);
+    if (r->failed)
+      atomic_store(&pool->stop, true);
+
+    mtx_lock(&pool->mu);
+    r->done = true;
+    cnd_broadcast(&pool->done_cv);
+    mtx_unlock(&pool->mu);
+  }
+  return 0;
 }
 
-static PPToken *pp_handle_if_section(PPGroupParser *p, PPToken *tok) {
-  // Parse:
-  //   if-group (elif-group)* (else-group)? endif-line
-  // We do not evaluate expressions, so we also do not emit any controlled text.
-  PPSrcLoc started_at = tok->spelling;
+static void compile_parallel(int jobs) {
+  TUPool pool = {.n = opt.c_inputs.len};
+  pool.results = calloc((size_t)pool.n, sizeof(*pool.results));
+  if (!pool.results)
+    die_oom("allocating per-unit results");
+  atomic_init(&pool.next, 0);
+  atomic_init(&pool.stop, false);
+  if (mtx_init(&pool.mu, mtx_plain) != thrd_success ||
+      cnd_init(&pool.done_cv) != thrd_success)
+    DIE("cannot initialize worker pool");
+
+  int nthreads = jobs < pool.n ? jobs : pool.n;
+  tokenize_jobs = jobs / nthreads;
+  thrd_t *threads = calloc((size_t)nthreads, sizeof(*threads));
+  if (!threads)
+    die_oom("allocating worker threads");
+  // Make do with the workers that started: none may outlive this call.
+  for (int t = 0; t < nthreads; t++) {
+    if (thrd_create(&threads[t], tu_worker, &pool) != thrd_success) {
+      nthreads = t;
+      break;
+    }
+  }
+  if (nthreads == 0)
+    DIE("cannot start worker thread");
+
+  // Every unit before the first failed one was claimed before it (claims are
+  // in order), so waiting on `done` in argv order cannot hang.
+  bool failed = false;
+  for (int i = 0; i < pool.n && !failed; i++) {
+    TUResult *r = &pool.results[i];
+    mtx_lock(&pool.mu);
+    while (!r->done)
+      cnd_wait(&pool.done_cv, &pool.mu);
+    mtx_unlock(&pool.mu);
+
+    fwrite(r->err, 1, r->err_len, stderr);
+    fflush(stderr);
+    fwrite(r->out, 1, r->out_len, stdout);
+    fflush(stdout);
+    failed = r->failed;
+  }
 
-  if (!(pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
-        pp_directive_is(tok, "ifndef")))
-    pp_die_tok(tok, "internal error: expected #if/#ifdef/#ifndef");
+  for (int t = 0; t < nthreads; t++)
+    thrd_join(threads[t], NULL);
 
-  // if-line
-  tok = pp_skip_to_line_end(tok);
-  // pp_handle_if_section is syntax-only for now, so we don't expand or emit
-  // anything in controlled regions.
-  PPGroupParser sub = *p;
-  sub.emit_text = false;
-  sub.stop_on_endif_like = true;
-  tok = pp_parse_group(&sub, tok);
+  for (int i = 0; i < pool.n; i++) {
+    free(pool.results[i].out);
+    free(pool.results[i].err);
+  }
+  free(pool.results);
+  free(threads);
+  cnd_destroy(&pool.done_cv);
+  mtx_destroy(&pool.mu);
+  if (failed)
+    fatal_exit(); // its error is printed already
+}
 
-  // elif-groupsopt
-  for (;;) {
-    if (!tok || tok->kind == PPTOK_EOF)
-      break;
-    if (!pp_directive_is(tok, "elif"))
-      break;
-    tok = pp_skip_to_line_end(tok);
-    tok = pp_parse_group(&sub, tok);
+// Everything main() does once argv is in `opt` and the process is set up.
+static void compile_inputs(void) {
+  if (opt.c_inputs.len == 0)
+    DIE_HINT("no .c or .pptok input files");
+
+  if (opt.jobs > 1 && opt.c_inputs.len > 1) {
+    compile_parallel(opt.jobs);
+  } else {
+    tokenize_jobs = opt.jobs;
+    for (int i = 0; i < opt.c_inputs.len; i++)
+      compile_tu(opt.c_inputs.data[i], stdout, stderr);
   }
+}
 
-  // else-groupopt
-  if (tok && pp_directive_is(tok, "else")) {
-    tok = pp_skip_to_line_end(tok);
-    tok = pp_parse_group(&sub, tok);
+/* section: compile server */
+
+// Compile server (--server) and its client (--connect).
+//
+// A server is one long-lived process for a user and a set of header bundles.
+// It keeps what outlives a unit warm across requests: the bundled and
+// --header-bundle headers, and every header it has read (see PPWarmFile).
+// A client connects to it instead of compiling, and sends its argv, working
+// directory and environment along with its stdout and stderr descriptors
+// (SCM_RIGHTS). The server runs each request in a child process of its own,
+// one at a time, with those descriptors as fds 1 and 2, then replies with the
+// exit status. Whatever a request builds, or abandons on a fatal error, goes
+// with its process, so the server only grows by the headers it keeps warm.
+// The child reports the headers it read, and the server reads them into its
+// own cache for the requests after. If no server answers, the client compiles
+// by itself.
+
+#define SERVER_MAGIC 0x66706363u // "fpcc"
+
+typedef struct {
+  uint32_t magic;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t len; // bytes of NUL-terminated strings that follow: cwd, argv, env
+} ServerRequest;
+
+extern char **environ;
+
+static bool server_read_all(int fd, void *buf, size_t len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= (size_t)n;
   }
+  return true;
+}
 
-  // endif-line
-  if (!tok || tok->kind == PPTOK_EOF) {
-    DIE("%s:%d:%d: unterminated #if (missing #endif)", started_at.path,
-        started_at.line_no, started_at.col_no);
+static bool server_write_all(int fd, const void *buf, size_t len) {
+  for (const char *p = buf; len > 0;) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= (size_t)n;
   }
+  return true;
+}
 
-  if (!pp_directive_is(tok, "endif"))
-    pp_die_tok(tok, "expected #endif");
-  tok = pp_skip_to_line_end(tok);
+static void strvec_free(StrVec *v) {
+  for (int i = 0; i < v->len; i++)
+    free(v->data[i]);
+  free(v->data);
+  *v = (StrVec){};
+}
 
-  return tok;
+static bool strvec_equal(const StrVec *a, const StrVec *b) {
+  if (a->len != b->len)
+    return false;
+  for (int i = 0; i < a->len; i++)
+    if (strcmp(a->data[i], b->data[i]))
+      return false;
+  return true;
 }
 
-static PPToken *pp_parse_group(PPGroupParser *p, PPToken *tok) {
-  // Parse groupopt/group: a sequence of group-part.
-  // When stop_on_endif_like is true, we stop before a line that begins with
-  // #elif/#else/#endif (so the enclosing if-section parser can consume it).
-  while (tok && tok->kind != PPTOK_EOF) {
-    if (p->stop_on_endif_like && pp_is_directive_start(tok)) {
-      if (pp_is_endif_like(tok))
-        return tok;
-    }
+static void options_free(Options *o) {
+  StrVec *vecs[] = {&o->include_paths, &o->header_bundles, &o->defines,
+                    &o->inputs,        &o->c_inputs,       &o->asm_inputs,
+                    &o->obj_inputs,    &o->ar_inputs,      &o->so_inputs,
+                    &o->other_inputs,  &o->ld_args};
+  for (size_t i = 0; i < sizeof(vecs) / sizeof(*vecs); i++)
+    strvec_free(vecs[i]);
+}
 
-    if (!pp_is_directive_start(tok)) {
-      tok = pp_handle_text_line(p, tok);
-      continue;
+// Split `n` NUL-terminated strings off the front of [*p, end) into `out`.
+static bool server_take_strings(char **p, char *end, uint32_t n, char **out) {
+  for (uint32_t i = 0; i < n; i++) {
+    char *nul = memchr(*p, '\0', (size_t)(end - *p));
+    if (!nul)
+      return false;
+    out[i] = *p;
+    *p = nul + 1;
+  }
+  return true;
+}
+
+// Run `argv` as if it had been started in `cwd` with `envp`, and return its
+// exit status. `defaults` is `opt` as it was before parsing any argv. Called
+// in the request's process, which ends after it.
+static int server_compile(char *cwd, int argc, char **argv, char **envp,
+                          const Options *defaults, const StrVec *bundles) {
+  int status = 1;
+  jmp_buf jb;
+  fatal_jmp = &jb;
+  if (setjmp(jb) == 0) {
+    if (chdir(cwd) != 0)
+      DIE("server: cannot enter %s", cwd);
+    environ = envp;
+    opt = *defaults;
+    bool help = false;
+    for (int i = 1; i < argc; i++)
+      help |= !strcmp(argv[i], "-h") || !strcmp(argv[i], "--help");
+    if (help) {
+      print_help(stdout);
+    } else {
+      parse_argv(argc, argv);
+      if (opt.server)
+        DIE("server: --server in a request");
+      if (opt.trace_json)
+        DIE("server: --trace-json needs a local compile");
+      if (!strvec_equal(&opt.header_bundles, bundles))
+        DIE("server: started with a different --header-bundle set");
+      if (opt.verbose)
+        dump_options(stdout, &opt);
+      if (opt.inputs.len == 0)
+        DIE_HINT("no input file");
+      validate_options(&opt);
+      compile_inputs();
     }
+    status = 0;
+  }
+  fatal_jmp = NULL;
+  return status;
+}
 
-    if (pp_directive_is(tok, "if") || pp_directive_is(tok, "ifdef") ||
-        pp_directive_is(tok, "ifndef")) {
-      tok = pp_handle_if_section(p, tok);
+// In a request's process: send the paths of the headers it read into the
+// warm cache, each NUL-terminated, to `fd`.
+static void server_report_learned(int fd) {
+  for (int i = 0; i < pp_warm.capacity; i++) {
+    PPHashEntry *ent = &pp_warm.buckets[i];
+    PPWarmFile *wf = ent->key && ent->key != (char *)PP_TOMBSTONE ? ent->val
+                                                                  : NULL;
+    if (wf && wf->learned &&
+        !server_write_all(fd, wf->path, strlen(wf->path) + 1))
+      return;
+  }
+}
+
+// Read into the warm cache the `len` bytes of paths a request reported. A
+// header that has gone or fails to read is left for a later request.
+static void server_learn(char *paths, size_t len) {
+  jmp_buf jb;
+  fatal_jmp = &jb;
+  for (char *p = paths, *end = paths + len; p < end; p += strlen(p) + 1) {
+    struct stat st;
+    if (stat(p, &st) != 0)
       continue;
-    }
+    if (setjmp(jb) == 0)
+      pp_warm_open(p);
+  }
+  fatal_jmp = NULL;
+}
 
-    if (pp_is_endif_like(tok)) {
-      // These should have been caught by stop_on_endif_like.
-      pp_die_tok(tok, "stray conditional directive");
-    }
+// Run a request in a child process and return its exit status, learning the
+// headers it read.
+static int32_t server_fork(int fds[2], char *cwd, int argc, char **argv,
+                           char **envp, const Options *defaults,
+                           const StrVec *bundles) {
+  int report[2];
+  if (pipe(report) != 0) {
+    dprintf(fds[1], "error: server: cannot create pipe: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(report[0]);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    pp_warm_in_request = true;
+    int status = server_compile(cwd, argc, argv, envp, defaults, bundles);
+    fflush(stdout);
+    fflush(stderr);
+    server_report_learned(report[1]);
+    _exit(status);
+  }
+  close(report[1]);
+  if (pid < 0) {
+    close(report[0]);
+    dprintf(fds[1], "error: server: cannot fork: %s\n", strerror(errno));
+    return 1;
+  }
 
-    tok = pp_handle_control_line(p, tok);
+  // Drain the report before waiting, so that a child with much to report
+  // does not block on a full pipe.
+  char *paths = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&paths, &len);
+  if (!mem)
+    die_oom("reading a request's headers");
+  char buf[4096];
+  for (ssize_t n; (n = read(report[0], buf, sizeof(buf))) != 0;) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      break;
+    fwrite(buf, 1, (size_t)n, mem);
   }
-  return tok;
+  fclose(mem);
+  close(report[0]);
+  int ws;
+  pid_t done;
+  while ((done = waitpid(pid, &ws, 0)) < 0 && errno == EINTR)
+    ;
+  int32_t status = done == pid && WIFEXITED(ws) ? WEXITSTATUS(ws) : 1;
+  server_learn(paths, len);
+  free(paths);
+  return status;
 }
 
-static PPToken *preprocess(PPToken *in) {
-  PPToken head = {};
-  PPToken *out_cur = &head;
+// Read one request from `conn`, run it and send back its exit status.
+static void server_handle(int conn, const Options *defaults,
+                          const StrVec *bundles) {
+  ServerRequest req;
+  int fds[2];
+  char ctrl[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl,
+                       .msg_controllen = sizeof(ctrl)};
+  ssize_t n;
+  do
+    n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  while (n < 0 && errno == EINTR);
+  struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+  if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+      cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+    return; // not a client
+  memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+  char *buf = NULL;
+  char **strs = NULL;
+  if ((size_t)n != sizeof(req) || req.magic != SERVER_MAGIC ||
+      req.len > (1u << 30) || req.argc == 0 || req.argc > req.len ||
+      req.envc > req.len)
+    goto out;
+  buf = malloc((size_t)req.len + 1);
+  strs = calloc((size_t)req.argc + req.envc + 3, sizeof(*strs));
+  if (!buf || !strs || !server_read_all(conn, buf, req.len))
+    goto out;
+  char *p = buf, *end = buf + req.len;
+  char **argv = strs + 1;
+  char **envp = argv + req.argc + 1; // argv and envp are NULL-terminated
+  if (!server_take_strings(&p, end, 1, strs) ||
+      !server_take_strings(&p, end, req.argc, argv) ||
+      !server_take_strings(&p, end, req.envc, envp))
+    goto out;
+
+  int32_t status = server_fork(fds, strs[0], (int)req.argc, argv, envp,
+                               defaults, bundles);
+  pp_warm_sweep();
+  server_write_all(conn, &status, sizeof(status));
+
+out:
+  free(strs);
+  free(buf);
+  close(fds[0]);
+  close(fds[1]);
+}
 
-  PPContext ctx = {};
-  PPGroupParser p = {
-      .ctx = &ctx,
-      .out_cur = &out_cur,
-      .emit_text = true,
-      .stop_on_endif_like = false,
-  };
-  PPToken *tok = pp_parse_group(&p, in);
+static bool server_address(const char *path, struct sockaddr_un *addr) {
+  *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path);
+  return true;
+}
 
-  if (!tok || tok->kind != PPTOK_EOF)
-    pp_die_tok(tok, "internal error: expected EOF after preprocessing-file");
+static _Noreturn void serve(const char *path, const Options *defaults) {
+  struct sockaddr_un addr;
+  if (!server_address(path, &addr))
+    DIE("socket path too long: %s", path);
+  if (mtx_init(&pp_warm_mu, mtx_plain) != thrd_success)
+    DIE("cannot initialize warm header cache");
+  pp_warm_enabled = true;
+  pp_vfs_open_all(); // built once, not in every request's process
+  // Requests may not change the VFS that was built from these.
+  StrVec bundles = opt.header_bundles;
+  opt.header_bundles = (StrVec){};
+  options_free(&opt);
+  signal(SIGPIPE, SIG_IGN); // a client that goes away only fails its writes
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    DIE("cannot create socket: %s", strerror(errno));
+  unlink(path);
+  mode_t mask = umask(077); // only this user may connect
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (rc != 0 || listen(fd, 64) != 0)
+    DIE("cannot listen on %s: %s", path, strerror(errno));
 
-  out_cur->next = pp_clone_tok(tok);
-  out_cur = out_cur->next;
-  return head.next;
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      DIE("accept failed: %s", strerror(errno));
+    }
+    server_handle(conn, defaults, &bundles);
+    close(conn);
+  }
 }
 
-/* section: lexical analysis */
+// Forward this command to the server at `path` and return the exit status it
+// reports, or -1 if no server took the request.
+static int client_run(const char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  if (!server_address(path, &addr))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  char *cwd = getcwd(NULL, 0);
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *mem = open_memstream(&buf, &len);
+  if (!cwd || !mem)
+    die_oom("building server request");
+  ServerRequest req = {.magic = SERVER_MAGIC, .argc = (uint32_t)argc};
+  fwrite(cwd, 1, strlen(cwd) + 1, mem);
+  for (int i = 0; i < argc; i++)
+    fwrite(argv[i], 1, strlen(argv[i]) + 1, mem);
+  for (char **e = environ; *e; e++, req.envc++)
+    fwrite(*e, 1, strlen(*e) + 1, mem);
+  fclose(mem);
+  free(cwd);
+  req.len = (uint32_t)len;
+
+  fflush(stdout);
+  fflush(stderr);
+  int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  char ctrl[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctrl,
+                       .msg_controllen = sizeof(ctrl)};
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+  bool sent = sendmsg(fd, &msg, 0) == (ssize_t)sizeof(req) &&
+              server_write_all(fd, buf, len);
+  free(buf);
+
+  int32_t status;
+  bool done = sent && server_read_all(fd, &status, sizeof(status));
+  close(fd);
+  if (!sent)
+    return -1; // nothing ran
+  if (!done)
+    DIE("lost connection to the server at %s", path);
+  return status;
+}
 
 /* section: main function */
 int main(int argc, char **argv) {
+  Options defaults = opt;
   parse_argv(argc, argv);
-  if (opt.verbose)
+  if (opt.verbose && !opt.connect)
     dump_options(stdout, &opt);
 
+  if (opt.server) {
+    validate_options(&opt);
+    if (opt.inputs.len != 0)
+      DIE_HINT("--server takes no input files");
+    pp_init_bundled_include_dir(argv[0]);
+    pp_vfs_init(&opt.header_bundles);
+    serve(opt.server, &defaults);
+  }
+  if (opt.connect && !opt.trace_json) {
+    int status = client_run(opt.connect, argc, argv);
+    if (status >= 0)
+      return status;
+    if (opt.verbose)
+      dump_options(stdout, &opt); // compiling here after all
+  }
+
   if (opt.inputs.len == 0) {
     DIE_HINT("no input file");
   }
   validate_options(&opt);
+  pp_init_bundled_include_dir(argv[0]);
+  pp_vfs_init(&opt.header_bundles);
+  if (opt.trace_json)
+    trace_init(opt.trace_json, opt.trace_granularity);
 
   // Preprocessing-token tokenizer demo:
   //   - `-E`: print tokens (not a full preprocessor; just token stream)
   //   - `--tokens`: dump tokens to stderr
-  if (opt.c_inputs.len == 0)
-    DIE_HINT("no .c input files");
-
-  if (opt.opt_E || opt.dump_tokens) {
-    for (int i = 0; i < opt.c_inputs.len; i++) {
-      const char *path = opt.c_inputs.data[i];
-      PPFile f = pp_read_file(path);
-
-      PPToken *pp = tokenlize(&f);
-      PPToken *pp2 = NULL;
-
-      if (opt.dump_tokens) {
-        for (PPToken *tok = pp; tok; tok = tok->next) {
-          pp_fprint_srcloc(stderr, tok->spelling);
-          fprintf(stderr, ": %s%s%s", pp_tok_kind_name(tok->kind),
-                  tok->at_bol ? "(BOL)" : "",
-                  tok->kind == PPTOK_NEWLINE ? "" : ": ");
-          if (tok->kind != PPTOK_NEWLINE)
-            fwrite(tok->loc, 1, (size_t)tok->len, stderr);
-          fputc('\n', stderr);
-        }
-      }
-
-      if (opt.opt_E) {
-        pp2 = preprocess(pp);
-        for (PPToken *tok = pp2; tok; tok = tok->next) {
-          if (tok->kind == PPTOK_NEWLINE) {
-            fputc('\n', stdout);
-          } else {
-            if (tok->has_space)
-              fputc(' ', stdout);
-            fwrite(tok->loc, 1, (size_t)tok->len, stdout);
-          }
-        }
-      }
-
-      free_pptokens(pp2);
-      free_pptokens(pp);
-      pp_free_file(&f);
-    }
+  if (!opt.trace_json) {
+    compile_inputs();
+    return 0;
   }
-
-  return 0;
+  // A fatal error comes back here once the unit's threads are joined (see
+  // compile_tu_body, compile_parallel), so the trace is complete either way.
+  jmp_buf jb;
+  int status = 0;
+  fatal_jmp = &jb;
+  if (setjmp(jb) == 0)
+    compile_inputs();
+  else
+    status = 1;
+  fatal_jmp = NULL;
+  trace_flush();
+  return status;
 }
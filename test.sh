@@ -1,2 +1,226 @@
-gcc -std=c11 -g -fno-common -Wall -Wno-switch -o feipiaocc feipiaocc.c
-./feipiaocc feipiaocc.c --tokens --no-codegen > token.txt
\ No newline at end of file
+#!/bin/sh
+# Build feipiaocc and run its regression checks: each check compares what the
+# compiler prints against an expected output under test/.
+
+set -e
+
+root=$(cd "$(dirname "$0")" && pwd)
+cd "$root"
+gcc -std=c11 -g -fno-common -Wall -Wno-switch -pthread -o feipiaocc feipiaocc.c
+
+cc=$root/feipiaocc
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# The compiler tokenizes its own source.
+"$cc" feipiaocc.c --tokens -E > /dev/null 2> "$work/tokens.txt"
+
+# check <name> <expected-file> <command...>: the command must succeed and
+# print (stdout and stderr) exactly the expected file.
+check() {
+  name=$1 expected=$2
+  shift 2
+  status=0
+  "$@" > "$work/out" 2>&1 || status=$?
+  if [ "$status" -ne 0 ]; then
+    echo "FAIL $name: exit status $status"
+    cat "$work/out"
+    failed=1
+  elif ! diff -u "$expected" "$work/out"; then
+    echo "FAIL $name"
+    failed=1
+  fi
+}
+
+# check_error <name> <message> <command...>: the command must fail and print
+# the message.
+check_error() {
+  name=$1 message=$2
+  shift 2
+  if "$@" > "$work/out" 2>&1; then
+    echo "FAIL $name: succeeded"
+    failed=1
+  elif ! grep -qF -- "$message" "$work/out"; then
+    echo "FAIL $name: expected '$message'"
+    cat "$work/out"
+    failed=1
+  fi
+}
+
+# error_case <name> <message> <source>: compiling the source must fail with
+# the message.
+error_case() {
+  printf '%s\n' "$3" > "$work/$1.c"
+  check_error "$1" "$2" "$cc" "$work/$1.c" --no-codegen
+}
+
+# ok_case <name> <source>: the source must compile without a word.
+ok_case() {
+  printf '%s\n' "$2" > "$work/$1.c"
+  check "$1" /dev/null "$cc" "$work/$1.c" --no-codegen
+}
+
+# The embedded headers are those under include/, and building from another
+# directory embeds them too.
+./embed_headers.sh "$work/headers.inc"
+if ! cmp -s "$work/headers.inc" feipiaocc_headers.inc; then
+  echo "FAIL embed: feipiaocc_headers.inc is stale; run ./embed_headers.sh"
+  failed=1
+fi
+(cd "$work" && gcc -std=c11 -fno-common -pthread -o elsewhere \
+  "$root/feipiaocc.c")
+printf '#include <stdbool.h>\nbool b = true;\n' > "$work/bool.c"
+"$cc" "$work/bool.c" -E > "$work/bool.expected"
+check embed "$work/bool.expected" "$work/elsewhere" "$work/bool.c" -E
+
+check ast test/ast.expected "$cc" test/ast.c --dump-ast --no-codegen
+check fold test/fold.expected "$cc" test/fold.c --dump-ast --no-codegen
+
+# Constant expressions are checked as C11 6.6 says.
+error_case overflow "integer overflow in a constant expression" \
+  'enum { E = 2147483647 + 1 };'
+error_case neg-overflow "integer overflow in a constant expression" \
+  'enum { E = -(-2147483647 - 1) };'
+error_case comma-ice "not an integer constant expression" \
+  'enum { E = (1, 2) };'
+error_case comma-null "incompatible type" 'void *p = (0, 0);'
+error_case static-var "initializer element is not a compile-time constant" \
+  'int x; int y = x;'
+error_case static-local "initializer element is not a compile-time constant" \
+  'int f(void) { int x; static int *p = &x; return 0; }'
+error_case static-div "division by zero in a constant expression" \
+  'int a = 1 / 0;'
+error_case float-range "value out of range in a constant expression" \
+  'int r = (int)1e10;'
+
+# An integer constant takes the first type in its list that fits (C11
+# 6.4.4.1p5); a decimal one too large for them all is unsigned long long.
+ok_case int-types \
+  '_Static_assert(_Generic(18446744073709551615, unsigned long long: 1), "");
+_Static_assert(_Generic(9223372036854775808l, unsigned long long: 1), "");
+_Static_assert(_Generic(0xffffffffffffffff, unsigned long: 1), "");
+_Static_assert(_Generic(0xffffffffffffffffl, unsigned long: 1), "");
+_Static_assert(_Generic(4294967296, long: 1), "");
+_Static_assert(_Generic(1ll, long long: 1), "");
+_Static_assert(_Generic(0xffffffffffffffffll, unsigned long long: 1), "");'
+
+# A UCN in an identifier must name a character Annex D allows there.
+error_case ucn-initial "\\u0300 is not allowed at the start of an identifier" \
+  'int \u0300x;'
+error_case ucn-basic "\\u0041 names a basic or control character" \
+  'int \u0041b;'
+error_case ucn-control "\\u0009 names a basic or control character" \
+  'int a\u0009;'
+ok_case ucn-ok 'int x\u0300 = 1, \u00e9 = 2;'
+
+# A parameter is in scope in the declarators of those after it.
+error_case vla-param "variable length arrays are not supported" \
+  'int h(int n, int a[n]);'
+
+# A parameter's qualifiers are not part of its function's type, only of the
+# parameter itself (C11 6.7.6.3p15).
+ok_case param-qual 'typedef int F(int);
+typedef int F(const int);
+int g(const int x);
+int g(int x) { return x; }'
+error_case param-const "cannot assign to an lvalue of const-qualified type" \
+  'int h(const int x) { x = 1; return x; }'
+
+# A static inline body parsed at first use sees only what precedes it.
+error_case lazy-later "use of undeclared identifier 'later'" \
+  'static inline int f(void) { return later; }
+int later;
+int g(void) { return f(); }'
+error_case lazy-typedef "use of undeclared identifier 'T'" \
+  'static inline int f(void) { T * y; return 0; }
+typedef int T;
+int g(void) { return f(); }'
+
+# Float constants are rounded once, as strtof does, fast path or not.
+gcc -std=c11 -o "$work/strtof" test/strtof.c
+"$work/strtof" < test/floats.txt > "$work/floats.expected"
+{ printf 'float v[] = {\n'; sed 's/$/,/' test/floats.txt; printf '};\n'; } \
+  > "$work/floats.c"
+check floats "$work/floats.expected" sh -c \
+  '"$1" "$2" --lex-tokens --no-codegen 2>&1 | sed -n "s/.*NUM(float): //p"' \
+  sh "$cc" "$work/floats.c"
+
+# The main file is tokenized as the parser pulls it: preprocessing tokens in
+# memory stay bounded however long the unit is.
+awk 'BEGIN {
+  for (i = 0; i < 50000; i++)
+    printf "int v%d = %d + 2 * (3 - 0x%x);\n", i, i, i
+}' > "$work/long.c"
+peak=$("$cc" "$work/long.c" --no-codegen --mem-report 2>&1 |
+  awk '$1 == "tokens" { print $3 }')
+if [ "${peak:-0}" -eq 0 ] || [ "$peak" -gt 1000000 ]; then
+  echo "FAIL stream-memory: peak token bytes ${peak:-unknown}"
+  failed=1
+fi
+
+# Macro memos stay valid across unrelated #defines, and a memo hit counts the
+# expansions it stands for.
+check memo test/memo.expected "$cc" test/memo.c -E
+counts=$("$cc" test/memo.c -E --stats 2>&1 >/dev/null |
+  awk '/macro expansions/ { e = $NF } /macro memo hits/ { h = $NF }
+       END { print e, h }')
+if [ "$counts" != "9 1" ]; then
+  echo "FAIL memo-stats: expansions and memo hits are $counts, not 9 1"
+  failed=1
+fi
+
+# --cost-report keeps its own bookkeeping out of --stats.
+"$cc" test/memo.c -E --stats > /dev/null 2> "$work/stats.expected"
+check cost-stats "$work/stats.expected" sh -c \
+  '"$1" test/memo.c -E --stats --cost-report 2>&1 >/dev/null |
+   sed "/^cost report/,\$d"' sh "$cc"
+
+# An #undef leaves the macro name that origins of its expansions refer to.
+printf '#define STRAY_MACRO @\nint x = STRAY_MACRO;\n#undef STRAY_MACRO\n' \
+  > "$work/undef.c"
+"$cc" "$work/undef.c" -E --emit-pptok=origins > "$work/undef.pptok"
+check_error undef-origin "expanded from macro 'STRAY_MACRO'" \
+  "$cc" "$work/undef.pptok" --no-codegen
+
+# A failed compile still writes the whole --trace-json timeline, after its
+# workers are done with it.
+printf 'int a = 1;\n' > "$work/ok.c"
+printf 'int b = ;\n' > "$work/bad.c"
+if "$cc" "$work/ok.c" "$work/bad.c" "$work/ok.c" -j4 --no-codegen \
+  --trace-json "$work/trace.json" > /dev/null 2>&1 ||
+  ! tail -n 1 "$work/trace.json" | grep -qF '],"displayTimeUnit":"ms"}'; then
+  echo "FAIL trace-json: no complete timeline after a failed compile"
+  failed=1
+fi
+
+# --edit-script must leave the same output as preprocessing the edited files.
+(cd test/edit/final && "$cc" main.c -E) > "$work/edit.expected"
+check edit-script "$work/edit.expected" \
+  sh -c 'cd test/edit && "$1" main.c -E --edit-script edits' sh "$cc"
+
+# A cached -E result must not outlive a change to a header it included.
+mkdir -p "$work/cache/src"
+printf '#include "h.h"\nint x = H;\n' > "$work/cache/src/main.c"
+printf '#define H 1\n' > "$work/cache/src/h.h"
+cache="$cc main.c -E --cache-dir $work/cache/dir"
+(cd "$work/cache/src" && $cache) > /dev/null
+printf '#define H 2\n' > "$work/cache/src/h.h"
+(cd "$work/cache/src" && "$cc" main.c -E) > "$work/cache.expected"
+check include-cache "$work/cache.expected" sh -c "cd $work/cache/src && $cache"
+
+# ... nor a new header that shadows one it included from a later -I directory.
+mkdir -p "$work/cache/src/inc1" "$work/cache/src/inc2"
+printf '#include <s.h>\n' > "$work/cache/src/shadow.c"
+printf 'int from_inc2;\n' > "$work/cache/src/inc2/s.h"
+shadow="$cc shadow.c -E -I inc1 -I inc2 --cache-dir $work/cache/dir"
+(cd "$work/cache/src" && $shadow) > /dev/null
+printf 'int from_inc1;\n' > "$work/cache/src/inc1/s.h"
+printf 'int from_inc1;\n' > "$work/shadow.expected"
+check include-shadow "$work/shadow.expected" sh -c "cd $work/cache/src && $shadow"
+
+if [ "$failed" -ne 0 ]; then
+  echo "some checks failed"
+  exit 1
+fi
+echo "all checks passed"
@@ -0,0 +1,20 @@
+// Parser features: scopes, precedence, hash-consed types, lazy static inline
+// bodies and sparse static initializers.
+typedef int T;
+typedef T *TP;
+enum { A = 1 << 4, B = A * 3 + 1 };
+static int tab[B] = {[3] = 7, [40] = 1};
+static char zeros[1000000] = {[999999] = 2};
+static inline int unused(int x) { return x + 1; }
+static inline int used(int x) { return x * 2; }
+int f(int a, int b) {
+  T t = a + b * 3 - (4 << 2);
+  TP p = &t;
+  int *q = p;
+  {
+    int a = t;
+    t = a;
+  }
+  return used(*q) + sizeof(int[A]) + tab[3] + a < b == b || a & b ^ a | b;
+}
+int sz(int n, char a[sizeof n]) { return sizeof a + n; }
@@ -0,0 +1,2 @@
+#define G 1
+#define H 20 + 1
@@ -0,0 +1,6 @@
+int z;
+#include "h.h"
+#define N 4
+int x = N;
+int y = H;
+int w = N * H;
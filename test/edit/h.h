@@ -0,0 +1 @@
+#define H 10
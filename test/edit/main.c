@@ -0,0 +1,4 @@
+#include "h.h"
+#define N 3
+int x = N;
+int y = H;
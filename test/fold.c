@@ -0,0 +1,18 @@
+// Integer constant expressions and static initializers fold to constants.
+enum { A = -7 / 2, B = -7 % 2, C = 1u - 2 > 0, D = (char)300, E = sizeof(long) * 2 };
+int a[A + 10];
+int b[B + 10];
+int c[C];
+int d[D];
+int e[E];
+unsigned long m = ~0ul >> 60;
+int s = (3 > 2) ? 10 / 3 : 1 / 0;
+int u = 1 || 1 / 0;
+double g = 1.5 * 4;
+int h = (int)2.75 + 'a';
+_Static_assert((1 << 10) == 1024, "shift");
+int f(int x) { return x * (2 + 3) + 0 * x; }
+unsigned w = 4294967295u + 1;
+int *p = &a[2] + 1;
+const char *q[] = {"x", 0, (char *)16};
+int (*fp)(int) = f;
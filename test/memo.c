@@ -0,0 +1,13 @@
+// Memoized object-like macro expansions: an unrelated #define keeps a memo,
+// a change to a macro it looked up rebuilds it.
+#define A B
+#define B 1
+A
+#define C 2
+A
+#define B 3
+A
+#define D E
+D
+#define E 4
+D
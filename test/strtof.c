@@ -0,0 +1,11 @@
+// Print each floating constant read from stdin (one per line, with its f
+// suffix) the way --lex-tokens prints it, as converted by strtof.
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void) {
+  char line[256];
+  while (fgets(line, sizeof(line), stdin))
+    printf("%.21Lg\n", (long double)strtof(line, NULL));
+  return 0;
+}